@@ -0,0 +1,144 @@
+/*
+ * Copyright 2013-16 Board of Trustees of Stanford University
+ * Copyright 2013-16 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * echoserver_coro.cc - the echoserver written against ixev_coro.h
+ *
+ * Takes the same arguments as echoserver, so the two can be compared with
+ * echoclient.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <ixev_coro.h>
+
+static size_t msg_size;
+
+static struct mempool_datastore pp_msg_datastore;
+static __thread struct mempool pp_msg_pool;
+
+static ixev::task pp_serve(ixev::conn &c)
+{
+	char *msg = (char *) mempool_alloc(&pp_msg_pool);
+
+	if (!msg) {
+		c.close();
+		co_return;
+	}
+
+	while (co_await c.recv(msg, msg_size) > 0) {
+		if (co_await c.send(msg, msg_size) < 0)
+			break;
+	}
+
+	mempool_free(&pp_msg_pool, msg);
+	c.close();
+}
+
+static ixev::task pp_listen(void)
+{
+	while (true)
+		pp_serve(co_await ixev::accept());
+}
+
+static void *pp_main(void *arg)
+{
+	int ret;
+
+	ret = ixev::init_thread();
+	if (ret) {
+		fprintf(stderr, "unable to init IXEV\n");
+		return NULL;
+	};
+
+	ret = mempool_create(&pp_msg_pool, &pp_msg_datastore);
+	if (ret) {
+		fprintf(stderr, "unable to create mempool\n");
+		return NULL;
+	}
+
+	pp_listen();
+
+	while (1) {
+		ixev_wait();
+	}
+
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	int i, nr_cpu;
+	pthread_t tid;
+	int ret;
+	unsigned int pp_conn_pool_entries;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s MSG_SIZE [MAX_CONNECTIONS]\n", argv[0]);
+		return -1;
+	}
+
+	msg_size = atol(argv[1]);
+
+	if (argc >= 3)
+		pp_conn_pool_entries = atoi(argv[2]);
+	else
+		pp_conn_pool_entries = 16 * 4096;
+
+	/* one frame per connection plus the listener */
+	ret = ixev::init(pp_conn_pool_entries, pp_conn_pool_entries + 1);
+	if (ret) {
+		fprintf(stderr, "failed to initialize ixev\n");
+		return ret;
+	}
+
+	ret = mempool_create_datastore(&pp_msg_datastore,
+				       ixev::detail::round_up(pp_conn_pool_entries),
+				       msg_size, 0, MEMPOOL_DEFAULT_CHUNKSIZE,
+				       "pp_msg");
+	if (ret) {
+		fprintf(stderr, "unable to create mempool\n");
+		return ret;
+	}
+
+	nr_cpu = sys_nrcpus();
+	if (nr_cpu < 1) {
+		fprintf(stderr, "got invalid cpu count %d\n", nr_cpu);
+		exit(-1);
+	}
+	nr_cpu--; /* don't count the main thread */
+
+	sys_spawnmode(true);
+
+	for (i = 0; i < nr_cpu; i++) {
+		if (pthread_create(&tid, NULL, pp_main, NULL)) {
+			fprintf(stderr, "failed to spawn thread %d\n", i);
+			exit(-1);
+		}
+	}
+
+	pp_main(NULL);
+	return 0;
+}
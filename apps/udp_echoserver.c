@@ -0,0 +1,126 @@
+/*
+ * Copyright 2013-16 Board of Trustees of Stanford University
+ * Copyright 2013-16 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * udp_echoserver.c - echoes every UDP datagram back to its sender
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <ixev.h>
+#include <ixev_udp.h>
+
+static uint16_t port;
+
+static __thread struct ixev_udp echo_sock;
+
+static void echo_recv(struct ixev_udp *u, struct ixev_udp_msg *msgs,
+		      unsigned int nr)
+{
+	unsigned int i;
+
+	/* a reply that can't be queued is dropped, as the network could */
+	for (i = 0; i < nr; i++)
+		ixev_udp_sendto(u, msgs[i].addr, msgs[i].len,
+				msgs[i].id->src_ip, msgs[i].id->src_port);
+}
+
+static struct ixev_ctx *echo_accept(struct ip_tuple *id)
+{
+	/* TCP connections are not served */
+	return NULL;
+}
+
+static void echo_release(struct ixev_ctx *ctx)
+{
+}
+
+static struct ixev_conn_ops echo_conn_ops = {
+	.accept		= &echo_accept,
+	.release	= &echo_release,
+};
+
+static void *echo_main(void *arg)
+{
+	int ret;
+
+	ret = ixev_init_thread();
+	if (ret) {
+		fprintf(stderr, "unable to init IXEV\n");
+		return NULL;
+	};
+
+	ret = ixev_udp_bind(&echo_sock, port, &echo_recv);
+	if (ret) {
+		fprintf(stderr, "unable to bind UDP port %d\n", port);
+		return NULL;
+	}
+
+	while (1) {
+		ixev_wait();
+	}
+
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	int i, nr_cpu;
+	pthread_t tid;
+	int ret;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s PORT\n", argv[0]);
+		return -1;
+	}
+
+	port = atoi(argv[1]);
+
+	ret = ixev_init(&echo_conn_ops);
+	if (ret) {
+		fprintf(stderr, "failed to initialize ixev\n");
+		return ret;
+	}
+
+	nr_cpu = sys_nrcpus();
+	if (nr_cpu < 1) {
+		fprintf(stderr, "got invalid cpu count %d\n", nr_cpu);
+		exit(-1);
+	}
+	nr_cpu--; /* don't count the main thread */
+
+	sys_spawnmode(true);
+
+	for (i = 0; i < nr_cpu; i++) {
+		if (pthread_create(&tid, NULL, echo_main, NULL)) {
+			fprintf(stderr, "failed to spawn thread %d\n", i);
+			exit(-1);
+		}
+	}
+
+	echo_main(NULL);
+	return 0;
+}
@@ -48,7 +48,8 @@ class CpuMetrics(ctypes.Structure):
     ('queue_size', ctypes.c_double * 3),
     ('loop_duration', ctypes.c_long),
     ('idle', ctypes.c_double * 3),
-    ('padding', ctypes.c_byte * 56),
+    ('batch_limit', ctypes.c_uint),
+    ('padding', ctypes.c_byte * 52),
   ]
 
 class FlowGroupMetrics(ctypes.Structure):
@@ -470,7 +471,7 @@ def main():
     wake_up(shmem, args.wake_up)
   elif args.show_metrics:
     for cpu in xrange(shmem.nr_cpus):
-      print 'CPU %d: queuing delay: %d us, batch size: %d pkts' % (cpu, shmem.cpu_metrics[cpu].queuing_delay, shmem.cpu_metrics[cpu].batch_size)
+      print 'CPU %d: queuing delay: %d us, batch size: %d pkts, batch limit: %d pkts' % (cpu, shmem.cpu_metrics[cpu].queuing_delay, shmem.cpu_metrics[cpu].batch_size, shmem.cpu_metrics[cpu].batch_limit)
   elif args.control is not None:
     if args.control == 'eff':
       mode = STEPS_MODE_ENERGY_EFFICIENCY
@@ -54,17 +54,26 @@ struct cfg_parameters CFG;
 
 extern int net_cfg(void);
 extern int arp_insert(struct ip_addr *addr, struct eth_addr *mac);
+extern unsigned int tcp_syn_cookie_threshold;
+struct tcp_cc_ops;
+extern const struct tcp_cc_ops *tcp_cc_find(const char *name);
+extern int tcp_ack_policy_find(const char *name);
 
 static config_t cfg;
 static char config_file[256];
 
 static int parse_host_addr(void);
 static int parse_port(void);
+static int parse_tcp_cc(void);
+static int parse_tcp_ack(void);
 static int parse_gateway_addr(void);
 static int parse_arp(void);
 static int parse_devices(void);
 static int parse_cpu(void);
 static int parse_batch(void);
+static int parse_batch_target_delay(void);
+static int parse_tx_flush_delay(void);
+static int parse_syn_cookies(void);
 static int parse_loader_path(void);
 
 struct config_vector_t {
@@ -75,11 +84,16 @@ struct config_vector_t {
 static struct config_vector_t config_tbl[] = {
 	{ "host_addr",    parse_host_addr},
 	{ "port",         parse_port},
+	{ "tcp_cc",       parse_tcp_cc},
+	{ "tcp_ack",      parse_tcp_ack},
 	{ "gateway_addr", parse_gateway_addr},
 	{ "arp",          parse_arp},
 	{ "devices",      parse_devices},
 	{ "cpu",          parse_cpu},
 	{ "batch",        parse_batch},
+	{ "batch_target_delay", parse_batch_target_delay},
+	{ "tx_flush_delay", parse_tx_flush_delay},
+	{ "syn_cookies",  parse_syn_cookies},
 	{ "loader_path",  parse_loader_path},
 	{ NULL,           NULL}
 };
@@ -196,6 +210,80 @@ static int parse_port(void)
 	return 0;
 }
 
+static int find_port(int port)
+{
+	int i;
+
+	for (i = 0; i < CFG.num_ports; i++) {
+		if (CFG.ports[i] == port)
+			return i;
+	}
+
+	log_err("cfg: port %d is not listened on\n", port);
+	return -EINVAL;
+}
+
+static int parse_tcp_cc(void)
+{
+	const config_setting_t *tcp_cc = NULL, *entry = NULL;
+	int i, j, port;
+
+	tcp_cc = config_lookup(&cfg, "tcp_cc");
+	if (!tcp_cc)
+		return 0;
+	for (i = 0; i < config_setting_length(tcp_cc); ++i) {
+		const char *name = NULL;
+		port = 0;
+		entry = config_setting_get_elem(tcp_cc, i);
+		config_setting_lookup_int(entry, "port", &port);
+		config_setting_lookup_string(entry, "cc", &name);
+		if (!port || !name)
+			return -EINVAL;
+		if (!tcp_cc_find(name)) {
+			log_err("cfg: unknown congestion control '%s'\n", name);
+			return -EINVAL;
+		}
+		j = find_port(port);
+		if (j < 0)
+			return j;
+		strncpy(CFG.port_cc[j], name, CFG_CC_NAME_LEN);
+		CFG.port_cc[j][CFG_CC_NAME_LEN - 1] = '\0';
+	}
+	return 0;
+}
+
+static int parse_tcp_ack(void)
+{
+	const config_setting_t *tcp_ack = NULL, *entry = NULL;
+	int i, j, port, policy, delay;
+
+	tcp_ack = config_lookup(&cfg, "tcp_ack");
+	if (!tcp_ack)
+		return 0;
+	for (i = 0; i < config_setting_length(tcp_ack); ++i) {
+		const char *name = NULL;
+		port = 0;
+		delay = 0;
+		entry = config_setting_get_elem(tcp_ack, i);
+		config_setting_lookup_int(entry, "port", &port);
+		config_setting_lookup_string(entry, "policy", &name);
+		config_setting_lookup_int(entry, "delay", &delay);
+		if (!port || !name || delay < 0)
+			return -EINVAL;
+		policy = tcp_ack_policy_find(name);
+		if (policy < 0) {
+			log_err("cfg: unknown ACK policy '%s'\n", name);
+			return -EINVAL;
+		}
+		j = find_port(port);
+		if (j < 0)
+			return j;
+		CFG.port_ack_policy[j] = policy;
+		CFG.port_ack_delay[j] = delay;
+	}
+	return 0;
+}
+
 static int parse_host_addr(void)
 {
 	char *parsed = NULL, *ip = NULL, *bitmask = NULL;
@@ -314,6 +402,42 @@ static int parse_batch(void)
 	return 0;
 }
 
+static int parse_batch_target_delay(void)
+{
+	int delay = 0;
+
+	if (!config_lookup_int(&cfg, "batch_target_delay", &delay))
+		return 0;
+	if (delay < 0)
+		return -EINVAL;
+	eth_rx_target_delay = delay;
+	return 0;
+}
+
+static int parse_tx_flush_delay(void)
+{
+	int delay = 0;
+
+	if (!config_lookup_int(&cfg, "tx_flush_delay", &delay))
+		return 0;
+	if (delay < 0)
+		return -EINVAL;
+	eth_tx_flush_delay = delay;
+	return 0;
+}
+
+static int parse_syn_cookies(void)
+{
+	int threshold = 0;
+
+	if (!config_lookup_int(&cfg, "syn_cookies", &threshold))
+		return 0;
+	if (threshold < 0 || threshold > 100)
+		return -EINVAL;
+	tcp_syn_cookie_threshold = threshold;
+	return 0;
+}
+
 static int parse_loader_path(void)
 {
 	char *parsed = NULL;
@@ -0,0 +1,286 @@
+/*
+ * Copyright 2013-16 Board of Trustees of Stanford University
+ * Copyright 2013-16 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * chksum.c - internet checksum kernels with runtime CPU dispatch
+ *
+ * The vector kernels widen each 32-bit word of the buffer into a 64-bit
+ * lane and add it without carry handling; a 64-bit lane cannot overflow
+ * for any buffer we checksum. Since 2^16 == 1 modulo 0xffff, the folded
+ * sum of 32-bit words equals the RFC 1071 sum of 16-bit words.
+ */
+
+#include <string.h>
+#include <immintrin.h>
+
+#include <ix/stddef.h>
+#include <ix/log.h>
+
+#include <asm/cpu.h>
+#include <asm/chksum.h>
+
+#define CPUID_1_ECX_SSE42	(1 << 20)
+#define CPUID_1_ECX_AVX		(1 << 28)
+#define CPUID_7_EBX_AVX2	(1 << 5)
+#define XCR0_SSE_AVX		(XCR0_SSE | XCR0_AVX)
+
+static inline uint16_t chksum_fold(uint64_t sum)
+{
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return (uint16_t) sum;
+}
+
+static inline uint64_t chksum_tail(const unsigned char *p, int len,
+				   uint64_t sum)
+{
+	uint32_t v;
+	uint16_t w;
+
+	while (len >= 4) {
+		memcpy(&v, p, 4);
+		sum += v;
+		p += 4;
+		len -= 4;
+	}
+
+	if (len >= 2) {
+		memcpy(&w, p, 2);
+		sum += w;
+		p += 2;
+		len -= 2;
+	}
+
+	/* a trailing byte is the first byte of a zero-padded word */
+	if (len)
+		sum += *p;
+
+	return sum;
+}
+
+static inline uint64_t chksum_copy_tail(unsigned char *dst,
+					const unsigned char *src, int len,
+					uint64_t sum)
+{
+	memcpy(dst, src, len);
+	return chksum_tail(dst, len, sum);
+}
+
+static uint16_t chksum_partial_generic(const void *buf, int len)
+{
+	return chksum_fold(chksum_tail(buf, len, 0));
+}
+
+static uint16_t chksum_copy_partial_generic(void *dst, const void *src,
+					    int len)
+{
+	return chksum_fold(chksum_copy_tail(dst, src, len, 0));
+}
+
+__attribute__((target("sse4.2")))
+static inline __m128i chksum_add_sse(__m128i acc, __m128i v)
+{
+	__m128i zero = _mm_setzero_si128();
+
+	acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, zero));
+	return _mm_add_epi64(acc, _mm_unpackhi_epi32(v, zero));
+}
+
+__attribute__((target("sse4.2")))
+static inline uint64_t chksum_reduce_sse(__m128i acc)
+{
+	return (uint64_t) _mm_cvtsi128_si64(acc) +
+	       (uint64_t) _mm_extract_epi64(acc, 1);
+}
+
+__attribute__((target("sse4.2")))
+static uint16_t chksum_partial_sse42(const void *buf, int len)
+{
+	const unsigned char *p = buf;
+	__m128i acc0 = _mm_setzero_si128();
+	__m128i acc1 = _mm_setzero_si128();
+
+	while (len >= 32) {
+		acc0 = chksum_add_sse(acc0, _mm_loadu_si128((const __m128i *) p));
+		acc1 = chksum_add_sse(acc1, _mm_loadu_si128((const __m128i *) (p + 16)));
+		p += 32;
+		len -= 32;
+	}
+
+	return chksum_fold(chksum_tail(p, len,
+			   chksum_reduce_sse(_mm_add_epi64(acc0, acc1))));
+}
+
+__attribute__((target("sse4.2")))
+static uint16_t chksum_copy_partial_sse42(void *dst, const void *src, int len)
+{
+	const unsigned char *s = src;
+	unsigned char *d = dst;
+	__m128i acc0 = _mm_setzero_si128();
+	__m128i acc1 = _mm_setzero_si128();
+	__m128i v0, v1;
+
+	while (len >= 32) {
+		v0 = _mm_loadu_si128((const __m128i *) s);
+		v1 = _mm_loadu_si128((const __m128i *) (s + 16));
+		_mm_storeu_si128((__m128i *) d, v0);
+		_mm_storeu_si128((__m128i *) (d + 16), v1);
+		acc0 = chksum_add_sse(acc0, v0);
+		acc1 = chksum_add_sse(acc1, v1);
+		s += 32;
+		d += 32;
+		len -= 32;
+	}
+
+	return chksum_fold(chksum_copy_tail(d, s, len,
+			   chksum_reduce_sse(_mm_add_epi64(acc0, acc1))));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i chksum_add_avx2(__m256i acc, __m256i v)
+{
+	__m256i zero = _mm256_setzero_si256();
+
+	acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(v, zero));
+	return _mm256_add_epi64(acc, _mm256_unpackhi_epi32(v, zero));
+}
+
+__attribute__((target("avx2")))
+static inline uint64_t chksum_reduce_avx2(__m256i acc)
+{
+	__m128i v = _mm_add_epi64(_mm256_castsi256_si128(acc),
+				  _mm256_extracti128_si256(acc, 1));
+
+	return (uint64_t) _mm_cvtsi128_si64(v) +
+	       (uint64_t) _mm_extract_epi64(v, 1);
+}
+
+__attribute__((target("avx2")))
+static uint16_t chksum_partial_avx2(const void *buf, int len)
+{
+	const unsigned char *p = buf;
+	__m256i acc0 = _mm256_setzero_si256();
+	__m256i acc1 = _mm256_setzero_si256();
+
+	while (len >= 64) {
+		acc0 = chksum_add_avx2(acc0, _mm256_loadu_si256((const __m256i *) p));
+		acc1 = chksum_add_avx2(acc1, _mm256_loadu_si256((const __m256i *) (p + 32)));
+		p += 64;
+		len -= 64;
+	}
+
+	if (len >= 32) {
+		acc0 = chksum_add_avx2(acc0, _mm256_loadu_si256((const __m256i *) p));
+		p += 32;
+		len -= 32;
+	}
+
+	return chksum_fold(chksum_tail(p, len,
+			   chksum_reduce_avx2(_mm256_add_epi64(acc0, acc1))));
+}
+
+__attribute__((target("avx2")))
+static uint16_t chksum_copy_partial_avx2(void *dst, const void *src, int len)
+{
+	const unsigned char *s = src;
+	unsigned char *d = dst;
+	__m256i acc0 = _mm256_setzero_si256();
+	__m256i acc1 = _mm256_setzero_si256();
+	__m256i v0, v1;
+
+	while (len >= 64) {
+		v0 = _mm256_loadu_si256((const __m256i *) s);
+		v1 = _mm256_loadu_si256((const __m256i *) (s + 32));
+		_mm256_storeu_si256((__m256i *) d, v0);
+		_mm256_storeu_si256((__m256i *) (d + 32), v1);
+		acc0 = chksum_add_avx2(acc0, v0);
+		acc1 = chksum_add_avx2(acc1, v1);
+		s += 64;
+		d += 64;
+		len -= 64;
+	}
+
+	if (len >= 32) {
+		v0 = _mm256_loadu_si256((const __m256i *) s);
+		_mm256_storeu_si256((__m256i *) d, v0);
+		acc0 = chksum_add_avx2(acc0, v0);
+		s += 32;
+		d += 32;
+		len -= 32;
+	}
+
+	return chksum_fold(chksum_copy_tail(d, s, len,
+			   chksum_reduce_avx2(_mm256_add_epi64(acc0, acc1))));
+}
+
+uint16_t (*chksum_partial)(const void *buf, int len) = chksum_partial_generic;
+uint16_t (*chksum_copy_partial)(void *dst, const void *src, int len) =
+	chksum_copy_partial_generic;
+
+static bool chksum_has_avx2(unsigned int ecx1)
+{
+	unsigned int a, b, c, d;
+
+	if ((ecx1 & (CPUID_1_ECX_OSXSAVE | CPUID_1_ECX_AVX)) !=
+	    (CPUID_1_ECX_OSXSAVE | CPUID_1_ECX_AVX))
+		return false;
+	/* the OS must save the YMM state on context switches */
+	if ((xgetbv(0) & XCR0_SSE_AVX) != XCR0_SSE_AVX)
+		return false;
+
+	cpuid(0, 0, &a, &b, &c, &d);
+	if (a < 7)
+		return false;
+
+	cpuid(7, 0, &a, &b, &c, &d);
+	return b & CPUID_7_EBX_AVX2;
+}
+
+/**
+ * chksum_init - selects the checksum kernels for this CPU
+ *
+ * Returns 0 (the generic kernels always work).
+ */
+int chksum_init(void)
+{
+	unsigned int a, b, c, d;
+	const char *name = "generic";
+
+	cpuid(1, 0, &a, &b, &c, &d);
+
+	if (chksum_has_avx2(c)) {
+		chksum_partial = chksum_partial_avx2;
+		chksum_copy_partial = chksum_copy_partial_avx2;
+		name = "avx2";
+	} else if (c & CPUID_1_ECX_SSE42) {
+		chksum_partial = chksum_partial_sse42;
+		chksum_copy_partial = chksum_copy_partial_sse42;
+		name = "sse4.2";
+	}
+
+	log_info("chksum: using %s kernels\n", name);
+	return 0;
+}
@@ -85,20 +85,15 @@ int init_migration_cpu(void)
  */
 void eth_fg_init(struct eth_fg *fg, unsigned int idx)
 {
-	int i;
-
 	fg->perfg = NULL;
 	fg->idx = idx;
 	fg->cur_cpu = -1;
 	fg->in_transition = false;
-	hlist_init_head(&fg->active_buckets);
+	hlist_init_head(&fg->active_pcbs);
 	hlist_init_head(&fg->tw_pcbs);
 	hlist_init_head(&fg->bound_pcbs);
-	for (i = 0; i < TCP_ACTIVE_PCBS_MAX_BUCKETS; i++) {
-		hlist_init_head(&fg->active_tbl[i].pcbs);
-		fg->active_tbl[i].hash_link.prev = NULL;
-		fg->active_tbl[i].hash_link.next = NULL;
-	}
+	memset(&fg->active_tbl, 0, sizeof(fg->active_tbl));
+	memset(&fg->tw_tbl, 0, sizeof(fg->tw_tbl));
 	spin_lock_init(&fg->lock);
 }
 
@@ -112,6 +107,15 @@ int eth_fg_init_cpu(struct eth_fg *fg)
 {
 	size_t len = __perfg_end - __perfg_start;
 	char *addr;
+	int ret;
+
+	ret = tcp_active_tbl_init(&fg->active_tbl);
+	if (ret)
+		return ret;
+
+	ret = tcp_tw_tbl_init(&fg->tw_tbl);
+	if (ret)
+		return ret;
 
 	addr = mem_alloc_pages_onnode(div_up(len, PGSIZE_2MB),
 				      PGSIZE_2MB, percpu_get(cpu_numa_node),
@@ -135,6 +139,8 @@ void eth_fg_free(struct eth_fg *fg)
 
 	if (fg->perfg)
 		mem_free_pages(fg->perfg, div_up(len, PGSIZE_2MB), PGSIZE_2MB);
+	tcp_active_tbl_free(&fg->active_tbl);
+	tcp_tw_tbl_free(&fg->tw_tbl);
 }
 
 static int eth_fg_assign_single_to_cpu(int fg_id, int cpu, struct rte_eth_rss_reta *rss_reta, struct ix_rte_eth_dev **eth)
@@ -175,9 +181,8 @@ static void migrate_fdir(struct ix_rte_eth_dev *dev, struct eth_fg *cur_fg,
 			 int cpu)
 {
 	int ret;
-	int idx;
-	struct tcp_hash_entry *he;
-	struct hlist_node *cur, *n, *tmp;
+	u32_t hash;
+	struct hlist_node *n, *tmp;
 	struct tcp_pcb *pcb;
 	struct rte_fdir_filter fdir_ftr;
 
@@ -190,26 +195,23 @@ static void migrate_fdir(struct ix_rte_eth_dev *dev, struct eth_fg *cur_fg,
 	fdir_ftr.iptype = RTE_FDIR_IPTYPE_IPV4;
 	fdir_ftr.l4type = RTE_FDIR_L4TYPE_TCP;
 
-	hlist_for_each(&cur_fg->active_buckets, cur) {
-		he = hlist_entry(cur, struct tcp_hash_entry, hash_link);
-		hlist_for_each_safe(&he->pcbs, n, tmp) {
-			pcb = hlist_entry(n, struct tcp_pcb, link);
+	hlist_for_each_safe(&cur_fg->active_pcbs, n, tmp) {
+		pcb = hlist_entry(n, struct tcp_pcb, link);
 
-			fdir_ftr.ip_src.ipv4_addr = ntoh32(pcb->remote_ip.addr);
-			fdir_ftr.ip_dst.ipv4_addr = ntoh32(pcb->local_ip.addr);
-			fdir_ftr.port_src = pcb->remote_port;
-			fdir_ftr.port_dst = pcb->local_port;
+		fdir_ftr.ip_src.ipv4_addr = ntoh32(pcb->remote_ip.addr);
+		fdir_ftr.ip_dst.ipv4_addr = ntoh32(pcb->local_ip.addr);
+		fdir_ftr.port_src = pcb->remote_port;
+		fdir_ftr.port_dst = pcb->local_port;
 
-			ret = dev->dev_ops->fdir_remove_perfect_filter(dev, &fdir_ftr, 0);
-			assert(ret >= 0);
+		ret = dev->dev_ops->fdir_remove_perfect_filter(dev, &fdir_ftr, 0);
+		assert(ret >= 0);
 
-			ret = dev->dev_ops->fdir_add_perfect_filter(dev, &fdir_ftr, 0, cpu, 0);
-			assert(ret >= 0);
+		ret = dev->dev_ops->fdir_add_perfect_filter(dev, &fdir_ftr, 0, cpu, 0);
+		assert(ret >= 0);
 
-			idx = tcp_to_idx(&pcb->local_ip, &pcb->remote_ip, pcb->local_port, pcb->remote_port);
-			TCP_RMV_ACTIVE(pcb);
-			TCP_REG_ACTIVE(pcb, idx, outbound_fg_remote(cur_fg->target_cpu));
-		}
+		hash = tcp_conn_hash(&pcb->local_ip, &pcb->remote_ip, pcb->local_port, pcb->remote_port);
+		TCP_RMV_ACTIVE(pcb);
+		TCP_REG_ACTIVE(pcb, hash, outbound_fg_remote(cur_fg->target_cpu));
 	}
 
 	cur_fg->cur_cpu = CFG.cpu[cpu];
@@ -411,6 +413,9 @@ static void transition_handler_target(void *info_)
 	q->head = NULL;
 	q->tail = NULL;
 
+	tcp_gro_flush();
+	tcp_ack_flush();
+
 	SCRATCHPAD->local_queue_pkts = count;
 
 	SCRATCHPAD->ts_after_backlog = rdtsc();
@@ -44,6 +44,7 @@
 #define EMA_SMOOTH_FACTOR EMA_SMOOTH_FACTOR_0
 
 DEFINE_PERCPU(int, eth_num_queues);
+DEFINE_PERCPU(unsigned int, eth_rx_batch);
 DEFINE_PERCPU(struct eth_rx_queue *, eth_rxqs[NETHDEV]);
 DEFINE_PERCPU(struct eth_tx_queue *, eth_txqs[NETHDEV]);
 
@@ -71,6 +72,34 @@ static struct power_accumulator power_acc;
 
 unsigned int eth_rx_max_batch = 64;
 
+/* target queuing delay (in us), 0 disables adaptive batching */
+unsigned int eth_rx_target_delay;
+
+/* maximum time (in us) a packet waits for its doorbell, 0 disables coalescing */
+unsigned int eth_tx_flush_delay;
+
+/**
+ * eth_rx_adapt_batch - adjusts the RX batch limit of the local CPU
+ * @queuing_delay: the average queuing delay of the last period (in us)
+ * @queue_size: the average number of pending packets per iteration
+ *
+ * The limit grows multiplicatively while the delay is above target and the
+ * limit is what keeps packets waiting, and shrinks additively once the delay
+ * is well below target. It always stays within [ETH_RX_MIN_BATCH,
+ * eth_rx_max_batch].
+ */
+static void eth_rx_adapt_batch(double queuing_delay, double queue_size)
+{
+	unsigned int batch = percpu_get(eth_rx_batch);
+
+	if (queuing_delay > eth_rx_target_delay && queue_size > batch)
+		batch = min(batch * 2, eth_rx_max_batch);
+	else if (queuing_delay * 2 < eth_rx_target_delay)
+		batch = max(batch, ETH_RX_MIN_BATCH + ETH_RX_BATCH_STEP) - ETH_RX_BATCH_STEP;
+
+	percpu_get(eth_rx_batch) = min(batch, eth_rx_max_batch);
+}
+
 /**
  * eth_process_poll - polls HW for new packets
  *
@@ -123,6 +152,7 @@ int eth_process_recv(void)
 	unsigned long timestamp;
 	int value;
 	struct metrics_accumulator *this_metrics_acc = &percpu_get(metrics_acc);
+	unsigned int batch = percpu_get(eth_rx_batch);
 	int backlog;
 	double idle;
 	unsigned int energy;
@@ -147,7 +177,12 @@ int eth_process_recv(void)
 				empty = false;
 			}
 		}
-	} while (!empty && count < eth_rx_max_batch);
+	} while (!empty && count < batch);
+
+	/* hand coalesced TCP segments to the stack before the batch ends,
+	 * then send one ACK per connection that still owes one */
+	tcp_gro_flush();
+	tcp_ack_flush();
 
 	backlog = 0;
 	for (i = 0; i < percpu_get(eth_num_queues); i++)
@@ -175,6 +210,8 @@ int eth_process_recv(void)
 			EMA_UPDATE(cp_shmem->cpu_metrics[percpu_get(cpu_nr)].queue_size[1], (double) this_metrics_acc->queue_size / this_metrics_acc->count, EMA_SMOOTH_FACTOR_1);
 			EMA_UPDATE(cp_shmem->cpu_metrics[percpu_get(cpu_nr)].queue_size[2], (double) this_metrics_acc->queue_size / this_metrics_acc->count, EMA_SMOOTH_FACTOR_2);
 			EMA_UPDATE(cp_shmem->cpu_metrics[percpu_get(cpu_nr)].loop_duration, (double) this_metrics_acc->loop_duration / this_metrics_acc->count, EMA_SMOOTH_FACTOR_0);
+			if (eth_rx_target_delay)
+				eth_rx_adapt_batch((double) this_metrics_acc->queuing_delay / this_metrics_acc->count, (double) this_metrics_acc->queue_size / this_metrics_acc->count);
 		} else {
 			EMA_UPDATE(cp_shmem->cpu_metrics[percpu_get(cpu_nr)].queuing_delay, 0, EMA_SMOOTH_FACTOR);
 			EMA_UPDATE(cp_shmem->cpu_metrics[percpu_get(cpu_nr)].batch_size, 0, EMA_SMOOTH_FACTOR);
@@ -183,6 +220,7 @@ int eth_process_recv(void)
 			EMA_UPDATE(cp_shmem->cpu_metrics[percpu_get(cpu_nr)].queue_size[2], 0, EMA_SMOOTH_FACTOR_2);
 			EMA_UPDATE(cp_shmem->cpu_metrics[percpu_get(cpu_nr)].loop_duration, 0, EMA_SMOOTH_FACTOR_0);
 		}
+		cp_shmem->cpu_metrics[percpu_get(cpu_nr)].batch_limit = percpu_get(eth_rx_batch);
 		this_metrics_acc->timestamp = timestamp;
 		percpu_get(idle_cycles) = 0;
 		this_metrics_acc->count = 0;
@@ -209,7 +247,7 @@ int eth_process_recv(void)
 	KSTATS_PACKETS_INC(count);
 	KSTATS_BATCH_INC(count);
 #ifdef ENABLE_KSTATS
-	backlog = div_up(backlog, eth_rx_max_batch);
+	backlog = div_up(backlog, batch);
 	KSTATS_BACKLOG_INC(backlog);
 #endif
 
@@ -219,25 +257,69 @@ int eth_process_recv(void)
 	return empty;
 }
 
+static void eth_tx_flush(struct eth_tx_queue *txq)
+{
+	int nr;
+
+	stats_histogram_xmit_batch(txq->len);
+
+	nr = eth_tx_xmit(txq, txq->len, txq->bufs);
+	if (unlikely(nr != txq->len))
+		panic("transmit buffer size mismatch\n");
+
+	txq->len = 0;
+	txq->bytes = 0;
+}
+
 /**
  * eth_process_send - processes packets pending to be sent
+ *
+ * Rings the doorbell of every TX queue that has pending packets. Must be
+ * called before returning to userspace or idling.
  */
 void eth_process_send(void)
 {
-	int i, nr;
+	int i;
 	struct eth_tx_queue *txq;
 
 	for (i = 0; i < percpu_get(eth_num_queues); i++) {
 		txq = percpu_get(eth_txqs[i]);
 
 		if (txq->len)
-			stats_histogram_xmit_batch(txq->len);
+			eth_tx_flush(txq);
+	}
+}
 
-		nr = eth_tx_xmit(txq, txq->len, txq->bufs);
-		if (unlikely(nr != txq->len))
-			panic("transmit buffer size mismatch\n");
+/**
+ * eth_process_send_coalesced - processes packets pending to be sent, lazily
+ *
+ * Like eth_process_send(), but a queue is only flushed once it holds
+ * ETH_TX_FLUSH_PKTS packets or ETH_TX_FLUSH_BYTES bytes, or once its oldest
+ * packet has waited eth_tx_flush_delay us. Saves tail register writes when
+ * the dataplane loops without returning to userspace.
+ */
+void eth_process_send_coalesced(void)
+{
+	int i;
+	unsigned long now;
+	struct eth_tx_queue *txq;
 
-		txq->len = 0;
+	if (!eth_tx_flush_delay) {
+		eth_process_send();
+		return;
+	}
+
+	now = rdtsc();
+	for (i = 0; i < percpu_get(eth_num_queues); i++) {
+		txq = percpu_get(eth_txqs[i]);
+
+		if (!txq->len)
+			continue;
+
+		if (txq->len >= ETH_TX_FLUSH_PKTS ||
+		    txq->bytes >= ETH_TX_FLUSH_BYTES ||
+		    now - txq->first_tsc >= (unsigned long) eth_tx_flush_delay * cycles_per_us)
+			eth_tx_flush(txq);
 	}
 }
 
@@ -255,6 +337,34 @@ void eth_process_reclaim(void)
 	}
 }
 
+/**
+ * eth_process_reclaim_lazy - processs completed packets on nearly full queues
+ *
+ * Only reclaims the TX queues whose free capacity dropped below their
+ * watermark, so that a few packets per system call don't cost a walk of the
+ * descriptor ring each time. Completing a packet that references user
+ * buffers releases those buffers and raises the application's sent event,
+ * so queues that got such packets are reclaimed right away. Any other
+ * queue is reclaimed at least every ETH_TX_RECLAIM_MAX_DELAY us, which
+ * also bounds how long earlier user buffers stay in flight on a core that
+ * never idles.
+ */
+void eth_process_reclaim_lazy(void)
+{
+	int i;
+	struct eth_tx_queue *txq;
+	unsigned long now = rdtsc();
+	unsigned long max_delay =
+		(unsigned long) ETH_TX_RECLAIM_MAX_DELAY * cycles_per_us;
+
+	for (i = 0; i < percpu_get(eth_num_queues); i++) {
+		txq = percpu_get(eth_txqs[i]);
+		if (txq->cap < txq->reclaim_thresh || txq->user_sent ||
+		    now - txq->reclaim_tsc >= max_delay)
+			txq->cap = eth_tx_reclaim(txq);
+	}
+}
+
 bool eth_rx_idle_wait(uint64_t usecs)
 {
 	int i;
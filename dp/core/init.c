@@ -49,6 +49,8 @@
 
 #include <net/ip.h>
 
+#include <asm/chksum.h>
+
 #include <dune.h>
 
 #include <lwip/memp.h>
@@ -88,6 +90,7 @@ struct init_vector_t {
 static struct init_vector_t init_tbl[] = {
 	{ "Dune",    init_dune,    NULL, NULL},
 	{ "CPU",     cpu_init,     NULL, NULL},
+	{ "chksum",  chksum_init,  NULL, NULL},
 	{ "timer",   timer_init,   timer_init_cpu, NULL},
 	{ "net",     net_init,     NULL, NULL},
 	{ "cfg",     init_cfg,     NULL, NULL},              // after net
@@ -232,6 +235,7 @@ static int init_network_cpu(void)
 	spin_unlock(&assign_lock);
 
 	percpu_get(eth_num_queues) = eth_dev_count;
+	percpu_get(eth_rx_batch) = eth_rx_max_batch;
 
 
 #if 0	/* initialize perqueue data structures */
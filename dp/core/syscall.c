@@ -30,6 +30,7 @@
  */
 
 #include <ix/stddef.h>
+#include <ix/atomic.h>
 #include <ix/syscall.h>
 #include <ix/errno.h>
 #include <ix/uaccess.h>
@@ -67,6 +68,34 @@ static const int usys_nr = div_up(sizeof(struct bsys_arr) +
 				  UARR_MIN_CAPACITY * sizeof(struct bsys_desc),
 				  PGSIZE_2MB);
 
+/*
+ * The pages behind a ring pair. Each part starts on its own page so that
+ * the submission ring is mapped read-write, the completion ring read-only
+ * and the copy of the posted events not at all.
+ */
+struct bsys_ring_pages {
+	struct bsys_rings rings __aligned(PGSIZE_2MB);
+	struct bsys_cring cq __aligned(PGSIZE_2MB);
+	struct bsys_desc posted[BSYS_RING_SIZE] __aligned(PGSIZE_2MB);
+};
+
+static const int rings_nr = sizeof(struct bsys_ring_pages) / PGSIZE_2MB;
+static const int rings_sq_nr = div_up(sizeof(struct bsys_rings), PGSIZE_2MB);
+static const int rings_cq_nr = div_up(sizeof(struct bsys_cring), PGSIZE_2MB);
+
+static DEFINE_PERCPU(struct bsys_ring_pages *, bsys_rings);
+static DEFINE_PERCPU(void *, bsys_rings_iomap);
+static DEFINE_PERCPU(void *, bsys_cq_iomap);
+
+/*
+ * Kernel-private copies of the ring indices. The shared copies are only
+ * ever written, so a misbehaving application cannot make us re-dispatch
+ * or re-finish descriptors.
+ */
+static DEFINE_PERCPU(uint32_t, bsys_sq_head);
+static DEFINE_PERCPU(uint32_t, bsys_cq_done);
+static DEFINE_PERCPU(uint32_t, bsys_cq_tail);
+
 static void bsys_nop(void)
 {
 }
@@ -138,6 +167,121 @@ static int bsys_dispatch(struct bsys_desc __user *d, unsigned int nr)
 
 static DEFINE_PERCPU(struct bsys_arr *, ksys_local);
 
+/**
+ * bsys_ring_reap - releases the events the application has consumed
+ * @rp: the ring pages
+ *
+ * The events are released from the kernel's copy of what was posted, so
+ * only cq_head is taken from the application.
+ */
+static void bsys_ring_reap(struct bsys_ring_pages *rp)
+{
+	uint32_t done = percpu_get(bsys_cq_done);
+	uint32_t head = rp->rings.cq_head;
+
+	if (unlikely(head - done > percpu_get(bsys_cq_tail) - done))
+		return;
+
+	for (; done != head; done++)
+		tcp_finish_usys_one(&rp->posted[done & BSYS_RING_MASK]);
+
+	percpu_get(bsys_cq_done) = done;
+}
+
+/**
+ * bsys_ring_submit - dispatches the descriptors posted to the submission ring
+ * @rp: the ring pages
+ *
+ * There is no syscall to return a dispatch failure from, so it is
+ * reported with a USYS_KSYS_RET event.
+ */
+static void bsys_ring_submit(struct bsys_ring_pages *rp)
+{
+	struct bsys_rings *rings = &rp->rings;
+	uint32_t head = percpu_get(bsys_sq_head);
+	uint32_t tail = rings->sq.tail;
+	struct bsys_desc *d;
+	unsigned int i, nr;
+	int ret;
+
+	if (head == tail)
+		return;
+	if (unlikely(tail - head > BSYS_RING_SIZE))
+		tail = head + BSYS_RING_SIZE;
+
+	/* don't read descriptors before the tail that published them */
+	rmb();
+
+	while (head != tail) {
+		d = &rings->sq.descs[head & BSYS_RING_MASK];
+		nr = min(tail - head, BSYS_RING_SIZE - (head & BSYS_RING_MASK));
+
+		tcp_route_ksys(d, nr);
+		for (i = 0; i < nr; i++) {
+			ret = __bsys_dispatch(&d[i], 1);
+			if (unlikely(ret))
+				usys_ksys_ret(d[i].sysnr, ret, 0);
+		}
+		head += nr;
+	}
+
+	percpu_get(bsys_sq_head) = head;
+	rings->sq.head = head;
+}
+
+/**
+ * bsys_ring_post - moves pending events to the completion ring
+ * @rp: the ring pages
+ *
+ * Events that don't fit stay in the usys array and are posted the next
+ * time the kernel runs.
+ */
+static void bsys_ring_post(struct bsys_ring_pages *rp)
+{
+	struct bsys_arr *arr = percpu_get(usys_arr);
+	uint32_t tail = percpu_get(bsys_cq_tail);
+	unsigned long i, nr;
+
+	nr = min(arr->len, (unsigned long) BSYS_RING_SIZE -
+			   (tail - percpu_get(bsys_cq_done)));
+	if (!nr)
+		return;
+
+	for (i = 0; i < nr; i++) {
+		rp->posted[(tail + i) & BSYS_RING_MASK] = arr->descs[i];
+		rp->cq.descs[(tail + i) & BSYS_RING_MASK] = arr->descs[i];
+	}
+
+	/* publish the descriptors before the tail */
+	wmb();
+	tail += nr;
+	percpu_get(bsys_cq_tail) = tail;
+	rp->cq.tail = tail;
+
+	arr->len -= nr;
+	if (arr->len)
+		memmove(arr->descs, &arr->descs[nr],
+			sizeof(struct bsys_desc) * arr->len);
+}
+
+/**
+ * bsys_ring_poll - services the shared-memory rings, if set up
+ *
+ * Called whenever the kernel gets control of the core, so the application
+ * can submit work and harvest events without trapping.
+ */
+void bsys_ring_poll(void)
+{
+	struct bsys_ring_pages *rp = percpu_get(bsys_rings);
+
+	if (!rp)
+		return;
+
+	bsys_ring_reap(rp);
+	bsys_ring_submit(rp);
+	bsys_ring_post(rp);
+}
+
 void bsys_dispatch_remote(void)
 {
 	unsigned int remote_nr;
@@ -155,12 +299,15 @@ void bsys_dispatch_remote(void)
  * sys_bpoll - performs I/O processing and issues a batch of system calls
  * @d: the batched system call descriptor array
  * @nr: the number of batched system calls
+ * @flags: BPOLL_NONBLOCK to return even if no event is pending
  *
  * Returns 0 if successful, otherwise failure.
  */
-static int sys_bpoll(struct bsys_desc __user *d, unsigned int nr)
+static int sys_bpoll(struct bsys_desc __user *d, unsigned int nr,
+		     unsigned int flags)
 {
 	int ret = 0, empty;
+	struct bsys_ring_pages *rings = percpu_get(bsys_rings);
 
 	percpu_get(in_kernel) = true;
 
@@ -172,7 +319,7 @@ static int sys_bpoll(struct bsys_desc __user *d, unsigned int nr)
 		log_desc("from userspace", i, true, true, &percpu_get(usys_arr)->descs[i]);
 
 	KSTATS_PUSH(tx_reclaim, NULL);
-	eth_process_reclaim();
+	eth_process_reclaim_lazy();
 	KSTATS_POP(NULL);
 
 	KSTATS_PUSH(tcp_route_ksys, NULL);
@@ -183,11 +330,22 @@ static int sys_bpoll(struct bsys_desc __user *d, unsigned int nr)
 	ret = bsys_dispatch(d, nr);
 	KSTATS_POP(NULL);
 
-	KSTATS_PUSH(tcp_finish_usys, NULL);
-	tcp_finish_usys();
-	KSTATS_POP(NULL);
+	if (rings) {
+		/* in ring mode the usys array only holds unposted events */
+		KSTATS_PUSH(tcp_finish_usys, NULL);
+		bsys_ring_reap(rings);
+		KSTATS_POP(NULL);
 
-	usys_reset();
+		KSTATS_PUSH(bsys, NULL);
+		bsys_ring_submit(rings);
+		KSTATS_POP(NULL);
+	} else {
+		KSTATS_PUSH(tcp_finish_usys, NULL);
+		tcp_finish_usys();
+		KSTATS_POP(NULL);
+
+		usys_reset();
+	}
 
 	if (ret)
 		goto out;
@@ -237,7 +395,7 @@ again:
 	KSTATS_POP(NULL);
 
 	KSTATS_PUSH(tx_send, NULL);
-	eth_process_send();
+	eth_process_send_coalesced();
 	KSTATS_POP(NULL);
 
 	KSTATS_PUSH(tcp_generate_usys, NULL);
@@ -245,28 +403,45 @@ again:
 	KSTATS_POP(NULL);
 
 	if (!percpu_get(ksys_local)->len && !percpu_get(usys_arr)->len) {
+		if (flags & BPOLL_NONBLOCK)
+			goto out;
+
 		/* Do not idle if control plane sets the no_idle flag. */
 		if (empty && !percpu_get(cp_cmd)->no_idle) {
 			uint64_t deadline = timer_deadline(10 * ONE_MS);
 			if (deadline > 0) {
 				unsigned long start;
+
+				KSTATS_PUSH(tx_send, NULL);
+				eth_process_send();
+				KSTATS_POP(NULL);
+
 				KSTATS_PUSH(idle, NULL);
 
 				start = rdtsc();
 				tcp_steal_idle_wait(deadline);
 				percpu_get(idle_cycles) += rdtsc() - start;
 				KSTATS_POP(NULL);
+
+				/* after idling, completions are worth reaping regardless of the watermark */
+				KSTATS_PUSH(tx_reclaim, NULL);
+				eth_process_reclaim();
+				KSTATS_POP(NULL);
 			}
 		}
 
 		KSTATS_PUSH(tx_reclaim, NULL);
-		eth_process_reclaim();
+		eth_process_reclaim_lazy();
 		KSTATS_POP(NULL);
 
 		goto again;
 	}
 
 out:
+	KSTATS_PUSH(tx_send, NULL);
+	eth_process_send();
+	KSTATS_POP(NULL);
+
 	for (int i = 0; i < percpu_get(ksys_local)->len; i++)
 		log_desc("to userspace", i, false, true, &d[i]);
 	for (int i = 0; i < percpu_get(usys_arr)->len; i++)
@@ -274,6 +449,9 @@ out:
 
 	stats_counter_events(percpu_get(usys_arr)->len);
 
+	if (rings)
+		bsys_ring_post(rings);
+
 	percpu_get(in_kernel) = false;
 	return ret;
 }
@@ -290,11 +468,12 @@ static int sys_bcall(struct bsys_desc __user *d, unsigned int nr)
 	int ret;
 
 	KSTATS_PUSH(tx_reclaim, NULL);
-	eth_process_reclaim();
+	eth_process_reclaim_lazy();
 	KSTATS_POP(NULL);
 
 	KSTATS_PUSH(bsys, NULL);
 	ret = bsys_dispatch(d, nr);
+	bsys_ring_poll();
 	KSTATS_POP(NULL);
 
 	KSTATS_PUSH(tx_send, NULL);
@@ -430,6 +609,60 @@ static int sys_timer_ctl(int timer_id, uint64_t delay)
 	return utimer_arm(percpu_get_addr(utimers), timer_id, delay);
 }
 
+/**
+ * sys_ring_setup - maps the shared-memory submission and completion rings
+ *
+ * Events handed out through the batched syscall array before this call are
+ * considered consumed; afterwards events are delivered only through the
+ * completion ring. Calling it again returns the existing rings.
+ *
+ * Returns an IOMAP pointer to a struct bsys_rings, or NULL on failure.
+ */
+static void *sys_ring_setup(void)
+{
+	struct bsys_ring_pages *rp;
+	void *iomap, *cq_iomap;
+
+	if (percpu_get(bsys_rings))
+		return percpu_get(bsys_rings_iomap);
+
+	rp = (struct bsys_ring_pages *) page_alloc_contig(rings_nr);
+	if (!rp)
+		return NULL;
+
+	memset(&rp->rings, 0, sizeof(rp->rings));
+	memset(&rp->cq, 0, sizeof(rp->cq));
+
+	iomap = vm_map_to_user((void *) &rp->rings, rings_sq_nr, PGSIZE_2MB,
+			       VM_PERM_R | VM_PERM_W);
+	if (!iomap)
+		goto fail;
+
+	cq_iomap = vm_map_to_user((void *) &rp->cq, rings_cq_nr, PGSIZE_2MB,
+				  VM_PERM_R);
+	if (!cq_iomap) {
+		vm_unmap(iomap, rings_sq_nr, PGSIZE_2MB);
+		goto fail;
+	}
+	rp->rings.cq = cq_iomap;
+
+	tcp_finish_usys();
+	usys_reset();
+
+	percpu_get(bsys_sq_head) = 0;
+	percpu_get(bsys_cq_done) = 0;
+	percpu_get(bsys_cq_tail) = 0;
+	percpu_get(bsys_rings) = rp;
+	percpu_get(bsys_rings_iomap) = iomap;
+	percpu_get(bsys_cq_iomap) = cq_iomap;
+
+	return iomap;
+
+fail:
+	page_free_contig((void *) rp, rings_nr);
+	return NULL;
+}
+
 typedef uint64_t (*sysfn_t)(uint64_t, uint64_t, uint64_t,
 			    uint64_t, uint64_t, uint64_t);
 
@@ -443,6 +676,7 @@ static sysfn_t sys_tbl[] = {
 	(sysfn_t) sys_nrcpus,
 	(sysfn_t) sys_timer_init,
 	(sysfn_t) sys_timer_ctl,
+	(sysfn_t) sys_ring_setup,
 };
 
 /**
@@ -502,6 +736,15 @@ int syscall_init_cpu(void)
  */
 void syscall_exit_cpu(void)
 {
+	if (percpu_get(bsys_rings)) {
+		vm_unmap(percpu_get(bsys_rings_iomap), rings_sq_nr, PGSIZE_2MB);
+		vm_unmap(percpu_get(bsys_cq_iomap), rings_cq_nr, PGSIZE_2MB);
+		page_free_contig((void *) percpu_get(bsys_rings), rings_nr);
+		percpu_get(bsys_rings) = NULL;
+		percpu_get(bsys_rings_iomap) = NULL;
+		percpu_get(bsys_cq_iomap) = NULL;
+	}
+
 	vm_unmap(percpu_get(usys_iomap), usys_nr, PGSIZE_2MB);
 	page_free_contig((void *) percpu_get(usys_arr), usys_nr);
 	percpu_get(usys_arr) = NULL;
@@ -35,6 +35,7 @@
 #define DEBUG_TIMER
 
 #include <ix/timer.h>
+#include <ix/bitmap.h>
 #include <ix/errno.h>
 #include <ix/log.h>
 #include <ix/cpu.h>
@@ -76,11 +77,17 @@
 
 
 
+/*
+ * Each wheel keeps a bitmap of its possibly non-empty buckets, so the next
+ * armed bucket is found with a bit scan instead of walking the hlists.
+ * timer_del() unlinks a timer without knowing its bucket, so a bit may be
+ * stale; it is cleared the first time a scan finds the bucket empty.
+ */
 struct timerwheel {
 	uint64_t now_us;
 	uint64_t timer_pos;
 	struct hlist_head wheels[WHEEL_COUNT][WHEEL_SIZE];
-
+	DEFINE_BITMAP(occupied[WHEEL_COUNT], WHEEL_SIZE);
 };
 
 
@@ -131,9 +138,18 @@ static void timer_insert(struct eth_fg *cur_fg, struct timerwheel *tw, struct ti
 	 */
 	index = ((63 - clz64(delay_us) - MIN_DELAY_SHIFT)
 		 >> WHEEL_SHIFT_LOG2);
+
+	/*
+	 * The rounding above (or a stale now_us) can push the longest
+	 * delays past the last wheel. Such a timer is reached early in
+	 * the last wheel and simply reinserted by timer_collapse().
+	 */
+	if (unlikely(index >= WHEEL_COUNT))
+		index = WHEEL_COUNT - 1;
 	offset = WHEEL_OFFSET(expire_us, index);
 
 	hlist_add_head(&tw->wheels[index][offset], &t->link);
+	bitmap_set(tw->occupied[index], offset);
 
 	if (cur_fg)
 		t->fg_id = cur_fg->fg_id;
@@ -210,24 +226,26 @@ void timer_add_for_next_tick(struct timer *t, struct eth_fg *cur_fg)
 }
 
 
-static void timer_run_bucket(struct timerwheel *tw, struct hlist_head *h)
+/**
+ * timer_next_bucket - finds the next non-empty bucket of a wheel
+ * @tw: the timer wheel
+ * @wheel: the wheel index
+ * @off: the first bucket offset to consider
+ *
+ * Returns the offset of the first non-empty bucket at or after @off, or
+ * WHEEL_SIZE if there is none.
+ */
+static int timer_next_bucket(struct timerwheel *tw, int wheel, int off)
 {
-	struct hlist_node *n, *tmp;
-	struct timer *t;
-#ifdef ENABLE_KSTATS
-	kstats_accumulate save;
-#endif
-
-	hlist_for_each_safe(h, n, tmp) {
-		t = hlist_entry(n, struct timer, link);
-		__timer_del(t);
-		KSTATS_PUSH(timer_handler, &save);
-		if (t->fg_id >= 0)
-			eth_fg_set_current(fgs[t->fg_id]);
-		t->handler(t, fgs[t->fg_id]);
-		KSTATS_POP(&save);
+	while ((off = bitmap_find_next_set(tw->occupied[wheel], WHEEL_SIZE,
+					   off)) < WHEEL_SIZE) {
+		if (!hlist_empty(&tw->wheels[wheel][off]))
+			break;
+		bitmap_clear(tw->occupied[wheel], off);
+		off++;
 	}
-	h->head = NULL;
+
+	return off;
 }
 
 static int timer_reinsert_bucket(struct timerwheel *tw, struct hlist_head *h, uint64_t now_us)
@@ -247,7 +265,7 @@ static int timer_reinsert_bucket(struct timerwheel *tw, struct hlist_head *h, ui
 			KSTATS_PUSH(timer_handler, &save);
 			if (t->fg_id >= 0)
 				eth_fg_set_current(fgs[t->fg_id]);
-			t->handler(t, fgs[t->fg_id]);
+			t->handler(t, get_ethfg_from_id(t->fg_id));
 			KSTATS_POP(&save);
 			continue;
 		}
@@ -273,6 +291,7 @@ static int timer_collapse(uint64_t pos)
 		int off = WHEEL_OFFSET(pos, wheel);
 
 		tw = &percpu_get(timer_wheel_cpu);
+		bitmap_clear(tw->occupied[wheel], off);
 		count = timer_reinsert_bucket(tw, &tw->wheels[wheel][off], pos);
 
 		// only need to go to the next wheel if offset is zero
@@ -294,15 +313,32 @@ void timer_run(void)
 
 	struct timerwheel *tw = &percpu_get(timer_wheel_cpu);
 	uint64_t pos = tw->timer_pos;
+	uint64_t skip;
+	int high_off;
 	tw->now_us = rdtsc() / cycles_per_us;
 
-	for (; pos <= tw->now_us; pos += MIN_DELAY_US) {
-		int high_off = WHEEL_OFFSET(pos, 0);
+	while (pos <= tw->now_us) {
+		high_off = WHEEL_OFFSET(pos, 0);
 
 		if (!high_off)
 			timer_collapse(pos);
 
-		timer_run_bucket(tw, &tw->wheels[0][high_off]);
+		/*
+		 * When catching up, timers (re)inserted relative to now_us
+		 * may sit in a bucket this loop reaches before they are due,
+		 * so only the expired ones fire and the rest are placed again.
+		 */
+		bitmap_clear(tw->occupied[0], high_off);
+		timer_reinsert_bucket(tw, &tw->wheels[0][high_off], pos);
+
+		/*
+		 * Jump over the empty buckets, but stop at the end of the
+		 * wheel (the next collapse) and just past now_us.
+		 */
+		skip = timer_next_bucket(tw, 0, high_off + 1) - high_off;
+		if (pos + skip * MIN_DELAY_US > tw->now_us)
+			skip = (tw->now_us - pos) / MIN_DELAY_US + 1;
+		pos += skip * MIN_DELAY_US;
 	}
 	tw->timer_pos = pos;
 	unset_current_fg();
@@ -313,48 +349,53 @@ void timer_run(void)
  * timer_deadline - determine the time remaining until the next deadline
  * @max_deadline_us: the maximum amount of time to look into the future
  *
- * NOTE: A short @max_deadline_us will reduce the overhead of calling
- * this function. However, even very large values will yield acceptable
- * performance.
- *
- * NOTE: If a timer is about to be cascaded, this function could
- * underestimate the next deadline.
+ * NOTE: A timer in a higher wheel is accounted at the time its bucket is
+ * cascaded, so this function can underestimate the next deadline, but it
+ * never overestimates it.
  *
  * Returns time in microseconds until the next timer expires or
  * @max_deadline_us, whichever is smaller.
  */
-
-
 uint64_t
 timer_deadline(uint64_t max_deadline_us)
 {
 	struct timerwheel *tw = &percpu_get(timer_wheel_cpu);
-	uint64_t now_us = tw->now_us;
-	uint64_t future_us = now_us + max_deadline_us;
-	int idx;
+	uint64_t pos = tw->timer_pos; /* the next pass of timer_run() */
+	uint64_t tsc_us = rdtsc() / cycles_per_us;
+	uint64_t next_us = tsc_us + max_deadline_us;
+	uint64_t run_us, block;
+	int idx, cur, off;
 
 	for (idx = 0; idx < WHEEL_COUNT; idx++) {
-		uint64_t start = (now_us >> WHEEL_IDX_TO_SHIFT(idx));
-		uint64_t end = (future_us >> WHEEL_IDX_TO_SHIFT(idx));
-
-		if (start == end)
-			break;
+		/*
+		 * Higher wheels cascade a bucket when the passes reach its
+		 * start, so their current bucket only holds timers of the
+		 * next rotation unless pos is at that start.
+		 */
+		cur = WHEEL_OFFSET(pos, idx);
+		off = cur;
+		if (idx && (pos & ((1ul << WHEEL_IDX_TO_SHIFT(idx)) - 1)))
+			off++;
+
+		/* the first non-empty bucket from there on, wrapping around */
+		off = timer_next_bucket(tw, idx, off);
+		if (off == WHEEL_SIZE)
+			off = timer_next_bucket(tw, idx, 0) + WHEEL_SIZE;
+		if (off >= WHEEL_SIZE * 2)
+			continue;
 
-		end = min(end, start + WHEEL_SIZE);
-		for (start++; start <= end; start++) {
-			if (!hlist_empty(&tw->wheels[idx][start & WHEEL_MASK])) {
-				uint64_t deadline_us = (start << WHEEL_IDX_TO_SHIFT(idx));
-				uint64_t tsc_us = rdtsc() / cycles_per_us;
-				if (deadline_us <= tsc_us)
-					return 0;
-				else
-					return deadline_us - tsc_us;
-			}
+		/* the first wheel runs a bucket in the pass that reaches it */
+		if (!idx) {
+			run_us = pos + (uint64_t) (off - cur) * MIN_DELAY_US;
+		} else {
+			block = (pos >> WHEEL_IDX_TO_SHIFT(idx)) + off - cur;
+			run_us = max(pos, block << WHEEL_IDX_TO_SHIFT(idx));
 		}
-	}
 
-	return max_deadline_us;
+		next_us = min(next_us, run_us);
+	}
 
+	return next_us > tsc_us ? next_us - tsc_us : 0;
 }
 
 /**
@@ -376,7 +417,8 @@ timer_collect_fgs(uint8_t *fg_vector, struct hlist_head *list, uint64_t *timer_p
 	*timer_pos = tw->timer_pos;
 
 	for (wheel = 0; wheel < WHEEL_COUNT; wheel++)
-		for (pos = 0; pos < WHEEL_SIZE; pos++)
+		for (pos = timer_next_bucket(tw, wheel, 0); pos < WHEEL_SIZE;
+		     pos = timer_next_bucket(tw, wheel, pos + 1))
 			hlist_for_each_safe(&tw->wheels[wheel][pos], x, tmp) {
 			t = hlist_entry(x, struct timer, link);
 			if (t->fg_id >= 0 && fg_vector[t->fg_id]) {
@@ -464,7 +506,8 @@ int timer_init_cpu(void)
 {
 	struct timerwheel *tw = &percpu_get(timer_wheel_cpu);
 	tw->now_us = rdtsc() / cycles_per_us;
-	tw->timer_pos = tw->now_us;
+	/* passes start at bucket boundaries, so a bucket never runs early */
+	tw->timer_pos = tw->now_us & ~(uint64_t) MIN_DELAY_MASK;
 	return 0;
 }
 /**
@@ -1,5 +1,6 @@
 #include <ix/syscall.h>
 #include <ix/timer.h>
+#include <ix/errno.h>
 
 /* max number of supported user level timers */
 #define UTIMER_COUNT 32
@@ -10,6 +11,7 @@ struct utimer {
 };
 
 struct utimer_list {
+	int next;
 	struct utimer arr[UTIMER_COUNT];
 };
 
@@ -24,12 +26,10 @@ void generic_handler(struct timer *t, struct eth_fg *unused)
 
 static int find_available(struct utimer_list *tl)
 {
-	static int next;
-
-	if (next >= UTIMER_COUNT)
+	if (tl->next >= UTIMER_COUNT)
 		return -1;
 
-	return next++;
+	return tl->next++;
 }
 
 int utimer_init(struct utimer_list *tl, void *udata)
@@ -51,6 +51,9 @@ int utimer_init(struct utimer_list *tl, void *udata)
 int utimer_arm(struct utimer_list *tl, int timer_id, uint64_t delay)
 {
 	struct timer *t;
+	if (timer_id < 0 || timer_id >= tl->next)
+		return -EINVAL;
+
 	t = &tl->arr[timer_id].t;
-	return timer_add(t, NULL, delay);
+	return timer_mod(t, NULL, delay);
 }
@@ -533,9 +533,10 @@ static inline uint64_t i40e_build_ctob(uint32_t td_cmd, uint32_t td_offset, unsi
 static int i40e_tx_reclaim(struct eth_tx_queue *tx)
 {
 	struct tx_queue *txq = eth_tx_queue_to_drv(tx);
+	struct mbuf *done[ETH_TX_FREE_BULK];
 	struct tx_entry *txe;
 	volatile struct i40e_tx_desc *txdp;
-	int idx = 0, nb_desc = 0;
+	int idx = 0, nb_desc = 0, nr_done = 0;
 
 	while ((uint16_t)(txq->head + idx) != txq->tail) {
 		txe = &txq->ring_entries[(txq->head + idx) & (txq->len - 1)];
@@ -551,12 +552,18 @@ static int i40e_tx_reclaim(struct eth_tx_queue *tx)
 				rte_cpu_to_le_64(I40E_TX_DESC_DTYPE_DESC_DONE))
 			break;
 
-		mbuf_xmit_done(txe->mbuf);
+		done[nr_done++] = txe->mbuf;
 		txe->mbuf = NULL;
+		if (nr_done == ETH_TX_FREE_BULK) {
+			mbuf_xmit_done_bulk(done, nr_done);
+			nr_done = 0;
+		}
 		idx++;
 		nb_desc = idx;
 	}
 
+	mbuf_xmit_done_bulk(done, nr_done);
+
 	txq->head += nb_desc;
 	return (uint16_t)(txq->len + txq->head - txq->tail);
 }
@@ -711,6 +718,7 @@ static int tx_queue_setup(struct ix_rte_eth_dev *dev, int queue_idx, int numa_no
 	txq->reg_idx = dtxq->reg_idx;
 	txq->tdt_reg_addr = (uint32_t *)dtxq->qtx_tail; */
 
+	txq->etxq.reclaim_thresh = ETH_TX_RECLAIM_WATERMARK(nb_desc);
 	txq->etxq.reclaim = i40e_tx_reclaim;
 	txq->etxq.xmit = i40e_tx_xmit;
 	i40_reset_tx_queue(txq);
@@ -129,6 +129,12 @@ struct tx_queue {
 
 	uint16_t		ctx_curr;
 	struct ixgbe_advctx_info ctx_cache[IXGBE_CTX_NUM];
+	uint16_t		tso_mss;	/* MSS loaded in the TSO context */
+	uint16_t		tso_l4_len;	/* L4 length loaded in the TSO context */
+
+	/* written by the NIC with the index of the next descriptor to process */
+	volatile uint32_t	head_wb __aligned(16);
+	machaddr_t		head_wb_physaddr;
 };
 
 #define eth_tx_queue_to_drv(txq) container_of(txq, struct tx_queue, etxq)
@@ -137,7 +143,8 @@ static int ixgbe_alloc_rx_mbufs(struct rx_queue *rxq);
 static int ixgbe_rx_poll(struct eth_rx_queue *rx);
 static int ixgbe_tx_reclaim(struct eth_tx_queue *tx);
 static int ixgbe_tx_xmit(struct eth_tx_queue *tx, int nr, struct mbuf **mbufs);
-static int ixgbe_tx_xmit_ctx(struct tx_queue *txq, int ol_flags, int ctx_idx);
+static int ixgbe_tx_xmit_ctx(struct tx_queue *txq, int ol_flags, int ctx_idx,
+			     uint16_t mss, uint16_t l4_len);
 
 extern int optind;
 
@@ -176,8 +183,14 @@ static int dev_start(struct ix_rte_eth_dev *dev)
 		IXGBE_WRITE_REG(hw, IXGBE_TDBAH(txq->reg_idx), (uint32_t)(txq->ring_physaddr >> 32));
 		IXGBE_WRITE_REG(hw, IXGBE_TDLEN(txq->reg_idx), txq->len * sizeof(union ixgbe_adv_tx_desc));
 
+		/* enable head write-back, so reclaim need not poll descriptors */
+		IXGBE_WRITE_REG(hw, IXGBE_TDWBAL(txq->reg_idx), (uint32_t)(txq->head_wb_physaddr & 0x00000000ffffffffULL) | IXGBE_TDWBAL_HEAD_WB_ENABLE);
+		IXGBE_WRITE_REG(hw, IXGBE_TDWBAH(txq->reg_idx), (uint32_t)(txq->head_wb_physaddr >> 32));
+
 		/* setup context descriptor 0 for IP/TCP checksums */
-		ixgbe_tx_xmit_ctx(txq, PKT_TX_IP_CKSUM | PKT_TX_TCP_CKSUM, 0);
+		ixgbe_tx_xmit_ctx(txq, PKT_TX_IP_CKSUM | PKT_TX_TCP_CKSUM, 0, 0, 0);
+		IXGBE_PCI_REG_WRITE(txq->tdt_reg_addr,
+				    (txq->tail & (txq->len - 1)));
 	}
 
 	return 0;
@@ -216,8 +229,14 @@ static int dev_start_vf(struct ix_rte_eth_dev *dev)
 		IXGBE_WRITE_REG(hw, IXGBE_VFTDBAH(i), (uint32_t)(txq->ring_physaddr >> 32));
 		IXGBE_WRITE_REG(hw, IXGBE_VFTDLEN(i), txq->len * sizeof(union ixgbe_adv_tx_desc));
 
+		/* enable head write-back, so reclaim need not poll descriptors */
+		IXGBE_WRITE_REG(hw, IXGBE_VFTDWBAL(i), (uint32_t)(txq->head_wb_physaddr & 0x00000000ffffffffULL) | IXGBE_TDWBAL_HEAD_WB_ENABLE);
+		IXGBE_WRITE_REG(hw, IXGBE_VFTDWBAH(i), (uint32_t)(txq->head_wb_physaddr >> 32));
+
 		/* setup context descriptor 0 for IP/TCP checksums */
-		ixgbe_tx_xmit_ctx(txq, PKT_TX_IP_CKSUM | PKT_TX_TCP_CKSUM, 0);
+		ixgbe_tx_xmit_ctx(txq, PKT_TX_IP_CKSUM | PKT_TX_TCP_CKSUM, 0, 0, 0);
+		IXGBE_PCI_REG_WRITE(txq->tdt_reg_addr,
+				    (txq->tail & (txq->len - 1)));
 	}
 
 	return 0;
@@ -474,38 +493,48 @@ err:
 static int ixgbe_tx_reclaim(struct eth_tx_queue *tx)
 {
 	struct tx_queue *txq = eth_tx_queue_to_drv(tx);
+	struct mbuf *done[ETH_TX_FREE_BULK];
 	struct tx_entry *txe;
-	volatile union ixgbe_adv_tx_desc *txdp;
-	int idx = 0, nb_desc = 0;
+	uint16_t hw_head;
+	int idx, nb_desc, nr_done = 0;
 
-	while ((uint16_t)(txq->head + idx) != txq->tail) {
-		txe = &txq->ring_entries[(txq->head + idx) & (txq->len - 1)];
+	/*
+	 * With head write-back, every descriptor before the written back
+	 * index has completed. Since at most len - 1 descriptors are ever
+	 * outstanding, the distance to it is unambiguous.
+	 */
+	hw_head = le32_to_cpu(txq->head_wb);
+	nb_desc = (uint16_t)(hw_head - txq->head) & (txq->len - 1);
 
-		if (!txe->mbuf) {
-			idx++;
+	for (idx = 0; idx < nb_desc; idx++) {
+		txe = &txq->ring_entries[(txq->head + idx) & (txq->len - 1)];
+		if (!txe->mbuf)
 			continue;
-		}
-
-		txdp = &txq->ring[(txq->head + idx) & (txq->len - 1)];
-		if (!(le32_to_cpu(txdp->wb.status) & IXGBE_TXD_STAT_DD))
-			break;
 
-		mbuf_xmit_done(txe->mbuf);
+		done[nr_done++] = txe->mbuf;
 		txe->mbuf = NULL;
-		idx++;
-		nb_desc = idx;
+		if (nr_done == ETH_TX_FREE_BULK) {
+			mbuf_xmit_done_bulk(done, nr_done);
+			nr_done = 0;
+		}
 	}
 
+	mbuf_xmit_done_bulk(done, nr_done);
+
 	txq->head += nb_desc;
 	return (uint16_t)(txq->len + txq->head - txq->tail);
 }
 
 #define IP_HDR_LEN	20
+#define IXGBE_TSO_CTX_IDX	1	/* context 0 is reserved for checksums */
+
 /* ixgbe_tx_xmit_ctx - "transmit" context descriptor
  * 			tells NIC to load a new ctx into its memory
- * Currently assuming no no LSO.
+ * @mss and @l4_len are only used if @ol_flags has PKT_TX_TCP_SEG.
+ * NOTE: the caller is responsible for advancing the hardware tail.
  */
-static int ixgbe_tx_xmit_ctx(struct tx_queue *txq, int ol_flags, int ctx_idx)
+static int ixgbe_tx_xmit_ctx(struct tx_queue *txq, int ol_flags, int ctx_idx,
+			     uint16_t mss, uint16_t l4_len)
 {
 	volatile struct ixgbe_adv_tx_context_desc *txctxd;
 	uint32_t type_tucmd_mlhl, mss_l4len_idx, vlan_macip_lens;
@@ -532,6 +561,11 @@ static int ixgbe_tx_xmit_ctx(struct tx_queue *txq, int ol_flags, int ctx_idx)
 	/* Set context idx. MSS and L4LEN ignored if no LSO */
 	mss_l4len_idx = ctx_idx << IXGBE_ADVTXD_IDX_SHIFT;
 
+	if (ol_flags & PKT_TX_TCP_SEG) {
+		mss_l4len_idx |= (uint32_t) mss << IXGBE_ADVTXD_MSS_SHIFT;
+		mss_l4len_idx |= (uint32_t) l4_len << IXGBE_ADVTXD_L4LEN_SHIFT;
+	}
+
 	vlan_macip_lens = (ETH_HDR_LEN << IXGBE_ADVTXD_MACLEN_SHIFT) | IP_HDR_LEN;
 
 	/* Put context desc on the desc ring */
@@ -547,11 +581,13 @@ static int ixgbe_tx_xmit_ctx(struct tx_queue *txq, int ol_flags, int ctx_idx)
 
 	/* Used up a descriptor, advance tail */
 	txq->tail++;
-	IXGBE_PCI_REG_WRITE(txq->tdt_reg_addr,
-			    (txq->tail & (txq->len - 1)));
 
 	/* Update flag info in software ctx_cache */
 	txq->ctx_cache[ctx_idx].flags = ol_flags;
+	if (ol_flags & PKT_TX_TCP_SEG) {
+		txq->tso_mss = mss;
+		txq->tso_l4_len = l4_len;
+	}
 
 	return 0;
 }
@@ -563,17 +599,43 @@ static int ixgbe_tx_xmit_one(struct tx_queue *txq, struct mbuf *mbuf)
 	int i, nr_iov = mbuf->nr_iov;
 	uint32_t type_len, pay_len = mbuf->len;
 	uint32_t  olinfo_status = 0;
+	uint32_t cmd_tse = 0;
+	int nr_ctx = 0;
 
 	/*
-	 * Make sure enough space is available in the descriptor ring
+	 * With TSO the NIC replicates the headers held in the mbuf for
+	 * every segment, and PAYLEN only counts the bytes after them. The
+	 * MSS and header length live in a context, so load a new one when
+	 * they differ from the last TSO packet.
+	 */
+	if ((mbuf->ol_flags & PKT_TX_TCP_SEG) &&
+	    (txq->ctx_cache[IXGBE_TSO_CTX_IDX].flags != mbuf->ol_flags ||
+	     txq->tso_mss != mbuf->tso_mss ||
+	     txq->tso_l4_len != mbuf->tso_l4_len))
+		nr_ctx = 1;
+
+	/*
+	 * Make sure enough space is available in the descriptor ring,
+	 * including the context, so that a context is never loaded for
+	 * a packet that doesn't fit.
 	 * NOTE: This should work correctly even with overflow...
 	 */
-	if (unlikely((uint16_t)(txq->tail + nr_iov + 1 - txq->head) >= txq->len)) {
+	if (unlikely((uint16_t)(txq->tail + nr_ctx + nr_iov + 1 - txq->head) >= txq->len)) {
 		ixgbe_tx_reclaim(&txq->etxq);
-		if ((uint16_t)(txq->tail + nr_iov + 1 - txq->head) >= txq->len)
+		if ((uint16_t)(txq->tail + nr_ctx + nr_iov + 1 - txq->head) >= txq->len)
 			return -EAGAIN;
 	}
 
+	if (nr_ctx && ixgbe_tx_xmit_ctx(txq, mbuf->ol_flags, IXGBE_TSO_CTX_IDX,
+					mbuf->tso_mss, mbuf->tso_l4_len))
+		return -EAGAIN;
+
+	if (mbuf->ol_flags & PKT_TX_TCP_SEG) {
+		cmd_tse = IXGBE_ADVTXD_DCMD_TSE;
+		olinfo_status |= IXGBE_TSO_CTX_IDX << IXGBE_ADVTXD_IDX_SHIFT;
+		pay_len = 0;
+	}
+
 	/*
 	 * Check mbuf's offload flags
 	 * If flags match context 0 on NIC (IP and TCP chksum), use context
@@ -593,7 +655,7 @@ static int ixgbe_tx_xmit_one(struct tx_queue *txq, struct mbuf *mbuf)
 		txdp->read.buffer_addr = cpu_to_le64((uintptr_t) iov.maddr);
 		type_len = (IXGBE_ADVTXD_DTYP_DATA |
 			    IXGBE_ADVTXD_DCMD_IFCS |
-			    IXGBE_ADVTXD_DCMD_DEXT);
+			    IXGBE_ADVTXD_DCMD_DEXT | cmd_tse);
 		type_len |= iov.len;
 		if (i == nr_iov - 1) {
 			type_len |= (IXGBE_ADVTXD_DCMD_EOP |
@@ -613,7 +675,7 @@ static int ixgbe_tx_xmit_one(struct tx_queue *txq, struct mbuf *mbuf)
 
 	type_len = (IXGBE_ADVTXD_DTYP_DATA |
 		    IXGBE_ADVTXD_DCMD_IFCS |
-		    IXGBE_ADVTXD_DCMD_DEXT);
+		    IXGBE_ADVTXD_DCMD_DEXT | cmd_tse);
 	type_len |= mbuf->len;
 	if (!nr_iov) {
 		type_len |= (IXGBE_ADVTXD_DCMD_EOP |
@@ -658,7 +720,8 @@ static void ixgbe_reset_tx_queue(struct tx_queue *txq)
 
 	txq->head = 0;
 	txq->tail = 0;
-
+	txq->head_wb = 0;
+	txq->ctx_cache[IXGBE_TSO_CTX_IDX].flags = 0;
 }
 
 static int tx_queue_setup(struct ix_rte_eth_dev *dev, int queue_idx,
@@ -722,10 +785,13 @@ static int tx_queue_setup(struct ix_rte_eth_dev *dev, int queue_idx,
 		goto err;
 	txq->ring_physaddr = page_phys +
 			     align_up(sizeof(struct tx_queue), IXGBE_ALIGN);
+	txq->head_wb_physaddr = page_phys + offsetof(struct tx_queue, head_wb);
 
 	txq->reg_idx = dtxq->reg_idx;
 
 	txq->tdt_reg_addr = dtxq->tdt_reg_addr;
+	txq->etxq.reclaim_thresh = ETH_TX_RECLAIM_WATERMARK(nb_desc);
+	txq->etxq.tx_offload_capa = DEV_TX_OFFLOAD_TCP_TSO;
 	txq->etxq.reclaim = ixgbe_tx_reclaim;
 	txq->etxq.xmit = ixgbe_tx_xmit;
 	ixgbe_reset_tx_queue(txq);
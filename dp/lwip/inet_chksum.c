@@ -358,6 +358,23 @@ inet_chksum_pseudo(struct pbuf *p, u8_t proto, u16_t proto_len,
 	return in_pseudo(ip4_addr_get_u32(src), ip4_addr_get_u32(dest), hton32(proto + p->tot_len));
 
 }
+
+/* inet_chksum_pseudo_tso:
+ *
+ * Like inet_chksum_pseudo(), but leaves the length out of the pseudo-header
+ * as required for TCP segmentation offload, since the NIC adds the length
+ * of every segment it generates.
+ *
+ * @param src source ip address (used for checksum of pseudo header)
+ * @param dst destination ip address (used for checksum of pseudo header)
+ * @param proto ip protocol (used for checksum of pseudo header)
+ * @return checksum (as u16_t) to be saved directly in the protocol header
+ */
+u16_t
+inet_chksum_pseudo_tso(u8_t proto, ip_addr_t *src, ip_addr_t *dest)
+{
+	return in_pseudo(ip4_addr_get_u32(src), ip4_addr_get_u32(dest), hton32(proto));
+}
 #if LWIP_IPV6
 /**
  * Calculates the checksum with IPv6 pseudo header used by TCP and UDP for a pbuf chain.
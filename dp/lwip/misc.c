@@ -61,6 +61,8 @@ void tcp_input_tmp(struct eth_fg *cur_fg, struct mbuf *pkt, struct ip_hdr *iphdr
 	pbuf = pbuf_alloc(PBUF_RAW, ntoh16(iphdr->len) - iphdr->header_len * 4, PBUF_ROM);
 	pbuf->payload = tcphdr;
 	pbuf->mbuf = pkt;
+	if ((iphdr->tos & IPTOS_ECN_MASK) == IPTOS_ECN_CE)
+		pbuf->flags |= PBUF_FLAG_CE;
 //	percpu_get(ip_data).current_iphdr_dest.addr = iphdr->dst_addr.addr;
 //	percpu_get(ip_data).current_iphdr_src.addr = iphdr->src_addr.addr;
 	tcp_input(cur_fg,pbuf, &iphdr->src_addr,&iphdr->dst_addr);
@@ -71,12 +73,14 @@ static struct mempool_datastore  pbuf_ds;
 static struct mempool_datastore  pbuf_with_payload_ds;
 static struct mempool_datastore  tcp_pcb_ds;
 static struct mempool_datastore  tcp_seg_ds;
+static struct mempool_datastore  tcp_tw_ds;
 
 DEFINE_PERCPU(struct mempool, pbuf_mempool __attribute__ ((aligned (64))));
 DEFINE_PERCPU(struct mempool, pbuf_with_payload_mempool __attribute__ ((aligned (64))));
 DEFINE_PERCPU(struct mempool, tcp_pcb_mempool __attribute__ ((aligned (64))));
 DEFINE_PERCPU(struct mempool, tcp_pcb_listen_mempool __attribute__ ((aligned (64))));
 DEFINE_PERCPU(struct mempool, tcp_seg_mempool __attribute__ ((aligned (64))));
+DEFINE_PERCPU(struct mempool, tcp_tw_mempool __attribute__ ((aligned (64))));
 
 #define MEMP_SIZE (256*1024)
 #define PBUF_CAPACITY (768*1024)
@@ -101,6 +105,9 @@ int memp_init(void)
 
 	if (init_mempool(&tcp_seg_ds, MEMP_SIZE, memp_sizes[MEMP_TCP_SEG],"tcp_seg"))
 		return 1;
+
+	if (init_mempool(&tcp_tw_ds, MEMP_SIZE, memp_sizes[MEMP_TCP_TW],"tcp_tw"))
+		return 1;
 	return 0;
 }
 
@@ -120,9 +127,22 @@ int memp_init_cpu(void)
 	if (mempool_create(&percpu_get(tcp_seg_mempool), &tcp_seg_ds, MEMPOOL_SANITY_PERCPU, cpu))
 		return 1;
 
+	if (mempool_create(&percpu_get(tcp_tw_mempool), &tcp_tw_ds, MEMPOOL_SANITY_PERCPU, cpu))
+		return 1;
+
 	return 0;
 }
 
+/**
+ * memp_tcp_pcb_usage - estimates the share of tcp_pcbs in use
+ *
+ * Returns a percentage of the tcp_pcb pool, see mempool_datastore_usage().
+ */
+unsigned int memp_tcp_pcb_usage(void)
+{
+	return mempool_datastore_usage(&tcp_pcb_ds);
+}
+
 void *mem_malloc(size_t size)
 {
 	LWIP_ASSERT("mem_malloc", size <= PBUF_WITH_PAYLOAD_SIZE);
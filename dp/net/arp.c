@@ -163,7 +163,7 @@ static void send_pending_pkt(void *data)
 
 	ret = ip_send_one(pkt->fg, &pkt->dst_addr, pkt->mbuf, pkt->len);
 	if (unlikely(ret))
-		mbuf_free(pkt->mbuf);
+		mbuf_xmit_done(pkt->mbuf);
 	
 	spin_lock(&pending_pkt_lock);
 	hlist_del(&pkt->link);
@@ -437,7 +437,7 @@ static void arp_timer_handler(struct timer *t, struct eth_fg *cur_fg)
 		spin_lock(&pending_pkt_lock);
 		hlist_for_each_safe(&e->pending_pkts, n, tmp) {
 			pkt = hlist_entry(n, struct pending_pkt, link);
-			mbuf_free(pkt->mbuf);
+			mbuf_xmit_done(pkt->mbuf);
 			hlist_del(&pkt->link);
 			mempool_free(&pending_pkt_mempool, pkt);
 		}
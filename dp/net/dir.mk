@@ -22,6 +22,7 @@
 # Makefile for network module
 
 SRC = arp.c dump.c icmp.c ip.c net.c tcp.c tcp_in.c tcp_out.c \
-      tcp_api.c udp.c
+      tcp_ack.c tcp_api.c tcp_cc.c tcp_gro.c tcp_hash.c tcp_syncookie.c \
+      tcp_tw.c udp.c
 $(eval $(call register_dir, net, $(SRC)))
 
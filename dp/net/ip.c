@@ -91,8 +91,7 @@ static void ip_input(struct eth_fg *cur_fg, struct mbuf *pkt, struct ip_hdr *hdr
 
 	switch (hdr->proto) {
 	case IPPROTO_TCP:
-		/* FIXME: change when we integrate better with LWIP */
-		tcp_input_tmp(cur_fg, pkt, hdr, mbuf_nextd_off(hdr, void *, hdrlen));
+		tcp_gro_input(cur_fg, pkt, hdr, mbuf_nextd_off(hdr, void *, hdrlen));
 		break;
 	case IPPROTO_UDP:
 		udp_input(pkt, hdr,
@@ -211,7 +210,9 @@ int ip_send_one(struct eth_fg *cur_fg, struct ip_addr *dst_addr, struct mbuf *pk
 
 	txq = percpu_get(eth_txqs)[cur_fg->dev_idx];
 
-	ret = eth_send_one(txq, pkt, len);
+	/* keep any scatter-gather vectors attached by the caller */
+	pkt->len = len;
+	ret = eth_send(txq, pkt);
 	if (unlikely(ret))
 		return -EIO;
 
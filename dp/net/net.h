@@ -51,6 +51,7 @@ extern void udp_input(struct mbuf *pkt, struct ip_hdr *iphdr,
 /* Transmission Control Protocol (TCP) definitions */
 /* FIXME: change when we integrate better with LWIP */
 extern void tcp_input_tmp(struct eth_fg *, struct mbuf *pkt, struct ip_hdr *iphdr, void *tcphdr);
+extern void tcp_gro_input(struct eth_fg *, struct mbuf *pkt, struct ip_hdr *iphdr, void *tcphdr);
 extern int tcp_api_init(void);
 extern int tcp_api_init_fg(void);
 
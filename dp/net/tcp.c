@@ -85,12 +85,8 @@
 #include <string.h>
 
 static void             tcp_tmr     (struct eth_fg *);  /* Must be called every
-                                         TCP_TMR_INTERVAL
-                                         ms. (Typically 250 ms). */
-/* It is also possible to call these two functions at the right
-   intervals (instead of calling tcp_tmr()). */
-static void             tcp_slowtmr (struct eth_fg *);
-static void             tcp_fasttmr (struct eth_fg *);
+                                         TCP_SLOW_INTERVAL
+                                         ms. (Typically 500 ms). */
 
 
 #ifndef TCP_LOCAL_PORT_RANGE_START
@@ -164,22 +160,14 @@ tcp_init(struct eth_fg *cur_fg)
 }
 
 /**
- * Called periodically to dispatch TCP timers.
+ * Called every TCP_SLOW_INTERVAL to advance the coarse TCP clock. The
+ * per-connection timeouts run from each pcb's unified timer, so the cost
+ * of a tick does not depend on the number of connections.
  */
 void
 tcp_tmr(struct eth_fg *cur_fg)
 {
-  /* Call tcp_fasttmr() every 250 ms */
-
-  KSTATS_VECTOR(timer_tcp_fasttmr);
-  tcp_fasttmr(cur_fg);
-
-  if (++cur_fg->tcp_timer & 1) {
-    /* Call tcp_tmr() every 500 ms, i.e., every other timer
-       tcp_tmr() is called. */
-    KSTATS_VECTOR(timer_tcp_slowtmr);
-    tcp_slowtmr(cur_fg);
-  }
+  ++cur_fg->tcp_ticks;
 }
 
 void tcp_close_with_reset(struct eth_fg *cur_fg,struct tcp_pcb *pcb)
@@ -200,7 +188,7 @@ void tcp_close_with_reset(struct eth_fg *cur_fg,struct tcp_pcb *pcb)
  * Connection pcbs are freed if not yet connected and may not be referenced
  * any more. If a connection is established (at least SYN received or in
  * a closing state), the connection is closed, and put in a closing state.
- * The pcb is then automatically freed in tcp_slowtmr(). It is therefore
+ * The pcb is then automatically freed by its slow timer. It is therefore
  * unsafe to reference it.
  *
  * @param pcb the tcp_pcb to close
@@ -230,6 +218,9 @@ tcp_close_shutdown(struct eth_fg *cur_fg,struct tcp_pcb *pcb, u8_t rst_on_unacke
         /* move to TIME_WAIT since we close actively */
         pcb->state = TIME_WAIT;
         TCP_REG(&cur_fg->tw_pcbs, pcb, cur_fg);
+        /* tcp_input() converts the pcb it is processing itself */
+        if (percpu_get(tcp_input_pcb) != pcb)
+          tcp_tw_enter(cur_fg, pcb);
       } else {
         /* CLOSE_WAIT: deallocate the pcb since we already sent a RST for it */
         memp_free(MEMP_TCP_PCB, pcb);
@@ -291,6 +282,8 @@ tcp_close_shutdown(struct eth_fg *cur_fg,struct tcp_pcb *pcb, u8_t rst_on_unacke
   default:
     /* Has already been closed, do nothing. */
     err = ERR_OK;
+    /* but TF_RXCLOSED may start the FIN-WAIT-2 timeout */
+    tcp_slow_timer_update(cur_fg, pcb);
     pcb = NULL;
     break;
   }
@@ -305,6 +298,7 @@ tcp_close_shutdown(struct eth_fg *cur_fg,struct tcp_pcb *pcb, u8_t rst_on_unacke
        If SOF_LINGER is set, the data should be sent and acked before close returns.
        This can only be valid for sequential APIs, not for the raw API. */
 	  tcp_output(cur_fg,pcb);
+	  tcp_slow_timer_update(cur_fg,pcb);
   }
   return err;
 }
@@ -316,7 +310,7 @@ tcp_close_shutdown(struct eth_fg *cur_fg,struct tcp_pcb *pcb, u8_t rst_on_unacke
  * Connection pcbs are freed if not yet connected and may not be referenced
  * any more. If a connection is established (at least SYN received or in
  * a closing state), the connection is closed, and put in a closing state.
- * The pcb is then automatically freed in tcp_slowtmr(). It is therefore
+ * The pcb is then automatically freed by its slow timer. It is therefore
  * unsafe to reference it (unless an error is returned).
  *
  * @param pcb the tcp_pcb to close
@@ -511,7 +505,6 @@ tcp_bind_checklist(struct hlist_head *list, struct tcp_pcb *pcb, ip_addr_t *ipad
 err_t
 tcp_bind(struct eth_fg *cur_fg, struct tcp_pcb *pcb, ip_addr_t *ipaddr, u16_t port)
 {
-  struct hlist_node *cur;
 
   /* called only to initiate connection, on a per-fg basis; listening scoket bypass this */
   assert(cur_fg);
@@ -541,11 +534,8 @@ tcp_bind(struct eth_fg *cur_fg, struct tcp_pcb *pcb, ip_addr_t *ipaddr, u16_t po
   /* Check if the address already is in use (on all lists) */
   err_t err = 0;
 
-  hlist_for_each(&cur_fg->active_buckets,cur) {
-	  struct tcp_hash_entry *hash_head = hlist_entry(cur,struct tcp_hash_entry,hash_link);
-	  err = tcp_bind_checklist(&hash_head->pcbs,pcb,ipaddr,port);
-	  if (err) return err;
-  }
+  err = tcp_bind_checklist(&cur_fg->active_pcbs,pcb,ipaddr,port);
+  if (err) return err;
 
 #ifdef LATER_EDB_LAZY
   /* assume that the local ephemeral range does not overlap with listenign ports */
@@ -556,9 +546,6 @@ tcp_bind(struct eth_fg *cur_fg, struct tcp_pcb *pcb, ip_addr_t *ipaddr, u16_t po
   err = tcp_bind_checklist(&cur_fg->bound_pcbs,pcb,ipaddr,port);
   if (err) return err;
 
-  err = tcp_bind_checklist(&cur_fg->tw_pcbs,pcb,ipaddr,port);
-  if (err) return err;
-
 
   if (!ipX_addr_isany(PCB_ISIPV6(pcb), ip_2_ipX(ipaddr))) {
     ipX_addr_set(PCB_ISIPV6(pcb), &pcb->local_ip, ip_2_ipX(ipaddr));
@@ -619,6 +606,9 @@ tcp_listen_with_backlog(struct tcp_pcb_listen *lpcb, u8_t backlog, ip_addr_t *ad
 //  lpcb->callback_arg = pcb->callback_arg;
   lpcb->local_port = port;
   lpcb->state = LISTEN;
+  lpcb->cc = &tcp_cc_reno;
+  lpcb->ack_policy = TCP_ACK_DELAYED;
+  lpcb->ack_delay = TCP_ACK_DELAY;
 //  lpcb->prio = pcb->prio;
   // lpcb->so_options = pcb->so_options;
   ip_set_option(lpcb, SOF_ACCEPTCONN);
@@ -795,6 +785,7 @@ tcp_connect(struct eth_fg *cur_fg,struct tcp_pcb *pcb, ip_addr_t *ipaddr, u16_t
 
   err_t ret;
   u32_t iss;
+  u32_t hash;
   u16_t old_local_port;
 
 	MEMPOOL_SANITY_ACCESS(pcb);
@@ -831,6 +822,13 @@ tcp_connect(struct eth_fg *cur_fg,struct tcp_pcb *pcb, ip_addr_t *ipaddr, u16_t
       return ERR_BUF;
     }
   }
+  /* TIME-WAIT only reserves the exact 4-tuple, not the local port */
+  hash = tcp_conn_hash(&pcb->local_ip, &pcb->remote_ip, pcb->local_port, pcb->remote_port);
+  if (tcp_tw_lookup(cur_fg, hash, &pcb->local_ip, &pcb->remote_ip,
+                    pcb->local_port, pcb->remote_port)) {
+    pcb->local_port = old_local_port;
+    return ERR_USE;
+  }
 #if SO_REUSE
   if (ip_get_option(pcb, SOF_REUSEADDR)) {
     /* Since SOF_REUSEADDR allows reusing a local address, we have to make sure
@@ -875,16 +873,28 @@ tcp_connect(struct eth_fg *cur_fg,struct tcp_pcb *pcb, ip_addr_t *ipaddr, u16_t
   LWIP_UNUSED_ARG(connected);
 #endif /* LWIP_CALLBACK_API */
 
-  /* Send a SYN together with the MSS option. */
-  ret = tcp_enqueue_flags(pcb, TCP_SYN);
+  /* restart congestion control for the new sequence space */
+  tcp_cc_set(pcb, pcb->cc);
+
+  /* Send a SYN together with the MSS option, asking for ECN if the
+     congestion control uses it. */
+  ret = tcp_enqueue_flags(pcb, TCP_SYN |
+                          (pcb->cc->ecn ? (TCP_ECE | TCP_CWR) : 0));
   if (ret == ERR_OK) {
     /* SYN segment was enqueued, changed the pcbs state now */
-    pcb->state = SYN_SENT;
     if (old_local_port != 0) {
       TCP_RMV(&cur_fg->tcp_bound_pcbs, pcb);
     }
-    int idx = tcp_to_idx(&pcb->local_ip, &pcb->remote_ip, pcb->local_port, pcb->remote_port);
-    TCP_REG_ACTIVE(pcb,idx,cur_fg);
+    if (TCP_REG_ACTIVE(pcb,hash,cur_fg)) {
+      /* the connection table is full: leave the pcb bound and drop the
+         SYN again, the caller aborts it */
+      TCP_REG(&cur_fg->bound_pcbs, pcb, cur_fg);
+      tcp_segs_free(pcb->unsent);
+      pcb->unsent = NULL;
+      return ERR_MEM;
+    }
+    pcb->state = SYN_SENT;
+    tcp_slow_timer_update(cur_fg,pcb);
     snmp_inc_tcpactiveopens();
 
     tcp_output(cur_fg,pcb);
@@ -898,7 +908,11 @@ pcb_remove_called_from_timer(struct eth_fg *cur_fg,struct tcp_pcb *pcb, int pcb_
 
 	MEMPOOL_SANITY_ACCESS(pcb);
       tcp_pcb_purge(pcb);
-      /* Remove PCB from tcp_fg_lists.active_pcbs list. */
+      if (pcb->flags & TF_ACK_BATCH)
+        tcp_ack_unqueue(pcb);
+      /* Remove PCB from tcp_fg_lists.active_pcbs list and its lookup table. */
+      if (pcb->hashed)
+        tcp_active_remove(cur_fg, pcb);
       hlist_del(&pcb->link);
 
 
@@ -911,181 +925,201 @@ pcb_remove_called_from_timer(struct eth_fg *cur_fg,struct tcp_pcb *pcb, int pcb_
 }
 
 /**
- * Called every 500 ms and implements the retransmission timer and the timer that
- * removes PCBs that have been in TIME-WAIT for enough time. It also increments
- * various timers such as the inactivity timer in each PCB.
+ * Returns the number of coarse (TCP_SLOW_INTERVAL) ticks until the pcb's
+ * next slow timeout must be checked, or 0 if no slow timeout applies in the
+ * pcb's current state. The checks themselves are made in tcp_pcb_slowtmr().
+ */
+static u32_t
+tcp_slow_ticks(struct eth_fg *cur_fg, struct tcp_pcb *pcb)
+{
+	u32_t deadline = 0;
+	s32_t ticks;
+
+#define TCP_SLOW_DEADLINE(t) \
+	do { if (!deadline || (s32_t)((t) - deadline) < 0) deadline = (t); } while (0)
+
+	if (pcb->state == FIN_WAIT_2 && (pcb->flags & TF_RXCLOSED))
+		TCP_SLOW_DEADLINE(pcb->tmr + TCP_FIN_WAIT_TIMEOUT / TCP_SLOW_INTERVAL + 1);
+	if (pcb->state == SYN_RCVD)
+		TCP_SLOW_DEADLINE(pcb->tmr + TCP_SYN_RCVD_TIMEOUT / TCP_SLOW_INTERVAL + 1);
+	if (pcb->state == LAST_ACK)
+		TCP_SLOW_DEADLINE(pcb->tmr + 2 * TCP_MSL / TCP_SLOW_INTERVAL + 1);
+	if (ip_get_option(pcb, SOF_KEEPALIVE) &&
+	    (pcb->state == ESTABLISHED || pcb->state == CLOSE_WAIT))
+		TCP_SLOW_DEADLINE(pcb->tmr + (pcb->keep_idle + pcb->keep_cnt_sent *
+			TCP_KEEP_INTVL(pcb)) / TCP_SLOW_INTERVAL + 1);
+#if TCP_QUEUE_OOSEQ
+	if (pcb->ooseq != NULL)
+		TCP_SLOW_DEADLINE(pcb->tmr + pcb->rto * TCP_OOSEQ_TIMEOUT);
+#endif /* TCP_QUEUE_OOSEQ */
+#if LWIP_CALLBACK_API
+	/* the poll callback counts every coarse tick */
+	if (pcb->poll != NULL)
+		TCP_SLOW_DEADLINE(cur_fg->tcp_ticks + 1);
+#endif /* LWIP_CALLBACK_API */
+
+#undef TCP_SLOW_DEADLINE
+	if (!deadline)
+		return 0;
+	ticks = (s32_t)(deadline - cur_fg->tcp_ticks);
+	return ticks > 0 ? ticks : 1;
+}
+
+/**
+ * Arms the slow part of the pcb's unified timer: the FIN-WAIT-2, SYN-RCVD
+ * and LAST-ACK timeouts, keep-alive, out-of-sequence data expiry,
+ * polling and the retry of data refused by the application.
  *
- * Automatically called from tcp_tmr().
+ * Called when the pcb changes state rather than from a periodic scan. The
+ * timeouts are measured from pcb->tmr, which moves on every segment, so an
+ * early expiry simply re-checks and re-arms.
  */
-static void
-tcp_slowtmr(struct eth_fg *cur_fg)
+void
+tcp_slow_timer_update(struct eth_fg *cur_fg, struct tcp_pcb *pcb)
 {
-	struct tcp_pcb *pcb;
-	u8_t pcb_remove;      /* flag if a PCB should be removed */
-	u8_t pcb_reset;       /* flag if a RST should be sent when removing */
-	err_t err;
-	struct hlist_node *cur;
-	struct tcp_hash_entry *hash_head = NULL;
-	struct hlist_node *n,*tmp;
+	u32_t ticks = tcp_slow_ticks(cur_fg, pcb);
+	uint64_t now_us = timer_now();
+	uint64_t expires = 0;
 
-	err = ERR_OK;
+	if (ticks)
+		expires = now_us + (uint64_t)ticks * TCP_SLOW_INTERVAL * ONE_MS;
+	if (pcb->refused_data != NULL &&
+	    (!expires || expires > now_us + TCP_FAST_INTERVAL * ONE_MS))
+		expires = now_us + TCP_FAST_INTERVAL * ONE_MS;
 
-	++cur_fg->tcp_ticks;
-	++cur_fg->tcp_timer_ctr;
+	pcb->timer_slow_expires = expires;
+	tcp_recompute_timers(cur_fg, pcb);
+}
 
-tcp_slowtmr_start:
-	/* Steps through all of the active PCBs. */
+/**
+ * Runs the coarse timeouts of a single pcb when its slow timer expires:
+ * retries data refused by the application, removes PCBs that stayed too
+ * long in FIN-WAIT-2, SYN-RCVD or LAST-ACK, sends keep-alives,
+ * drops stale out-of-sequence data and polls the application.
+ *
+ * @return 1 if the pcb has been deallocated, 0 otherwise
+ */
+static int
+tcp_pcb_slowtmr(struct eth_fg *cur_fg, struct tcp_pcb *pcb)
+{
+	u8_t pcb_remove = 0;  /* flag if a PCB should be removed */
+	u8_t pcb_reset = 0;   /* flag if a RST should be sent when removing */
+	err_t err = ERR_OK;
 
-	if (hash_head == NULL) {
-		LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: no active pcbs\n"));
-	}
+	MEMPOOL_SANITY_ACCESS(pcb);
 
+	LWIP_ASSERT("tcp_slowtmr: active pcb->state != CLOSED\n", pcb->state != CLOSED);
+	LWIP_ASSERT("tcp_slowtmr: active pcb->state != LISTEN\n", pcb->state != LISTEN);
 
-	hlist_for_each(&cur_fg->active_buckets,cur) {
-		hash_head = hlist_entry(cur,struct tcp_hash_entry,hash_link);
-		hlist_for_each_safe(&hash_head->pcbs,n,tmp) {
-			pcb = hlist_entry(n,struct tcp_pcb,link);
-			MEMPOOL_SANITY_ACCESS(pcb);
+	/* If there is data which was previously "refused" by upper layer */
+	if (pcb->refused_data != NULL) {
+		KSTATS_VECTOR(timer_tcp_fasttmr);
+		if (tcp_process_refused_data(cur_fg, pcb) == ERR_ABRT)
+			return 1;
+	}
 
-			LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: processing active pcb\n"));
-			LWIP_ASSERT("tcp_slowtmr: active pcb->state != CLOSED\n", pcb->state != CLOSED);
-			LWIP_ASSERT("tcp_slowtmr: active pcb->state != LISTEN\n", pcb->state != LISTEN);
-			LWIP_ASSERT("tcp_slowtmr: active pcb->state != TIME-WAIT\n", pcb->state != TIME_WAIT);
-			if (pcb->last_timer == cur_fg->tcp_timer_ctr) {
-				/* skip this pcb, we have already processed it */
-				continue;
-			}
-			pcb->last_timer = cur_fg->tcp_timer_ctr;
-
-			pcb_remove = 0;
-			pcb_reset = 0;
-
-			/* Check if this PCB has stayed too long in FIN-WAIT-2 */
-			if (pcb->state == FIN_WAIT_2) {
-				/* If this PCB is in FIN_WAIT_2 because of SHUT_WR don't let it time out. */
-				if (pcb->flags & TF_RXCLOSED) {
-					/* PCB was fully closed (either through close() or SHUT_RDWR):
-					   normal FIN-WAIT timeout handling. */
-					if ((u32_t)(cur_fg->tcp_ticks - pcb->tmr) >
-					    TCP_FIN_WAIT_TIMEOUT / TCP_SLOW_INTERVAL) {
-						++pcb_remove;
-						LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: removing pcb stuck in FIN-WAIT-2\n"));
-					}
-				}
+	/* the remaining checks run at most once per coarse tick */
+	if (pcb->last_timer == (u8_t)cur_fg->tcp_ticks)
+		goto out;
+	pcb->last_timer = (u8_t)cur_fg->tcp_ticks;
+	KSTATS_VECTOR(timer_tcp_slowtmr);
+
+	/* Check if this PCB has stayed too long in FIN-WAIT-2 */
+	if (pcb->state == FIN_WAIT_2) {
+		/* If this PCB is in FIN_WAIT_2 because of SHUT_WR don't let it time out. */
+		if (pcb->flags & TF_RXCLOSED) {
+			/* PCB was fully closed (either through close() or SHUT_RDWR):
+			   normal FIN-WAIT timeout handling. */
+			if ((u32_t)(cur_fg->tcp_ticks - pcb->tmr) >
+			    TCP_FIN_WAIT_TIMEOUT / TCP_SLOW_INTERVAL) {
+				++pcb_remove;
+				LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: removing pcb stuck in FIN-WAIT-2\n"));
 			}
+		}
+	}
 
-			/* Check if KEEPALIVE should be sent */
-			if(ip_get_option(pcb, SOF_KEEPALIVE) &&
-			   ((pcb->state == ESTABLISHED) ||
-			    (pcb->state == CLOSE_WAIT))) {
-				if((u32_t)(cur_fg->tcp_ticks - pcb->tmr) >
-				   (pcb->keep_idle + TCP_KEEP_DUR(pcb)) / TCP_SLOW_INTERVAL)
-				{
-					LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: KEEPALIVE timeout. Aborting connection to "));
-					ipX_addr_debug_print(PCB_ISIPV6(pcb), TCP_DEBUG, &pcb->remote_ip);
-					LWIP_DEBUGF(TCP_DEBUG, ("\n"));
-
-					++pcb_remove;
-					++pcb_reset;
-				}
-				else if((u32_t)(cur_fg->tcp_ticks - pcb->tmr) >
-					(pcb->keep_idle + pcb->keep_cnt_sent * TCP_KEEP_INTVL(pcb))
-					/ TCP_SLOW_INTERVAL)
-				{
-					tcp_keepalive(cur_fg,pcb);
-					pcb->keep_cnt_sent++;
-				}
-			}
+	/* Check if KEEPALIVE should be sent */
+	if(ip_get_option(pcb, SOF_KEEPALIVE) &&
+	   ((pcb->state == ESTABLISHED) ||
+	    (pcb->state == CLOSE_WAIT))) {
+		if((u32_t)(cur_fg->tcp_ticks - pcb->tmr) >
+		   (pcb->keep_idle + TCP_KEEP_DUR(pcb)) / TCP_SLOW_INTERVAL)
+		{
+			LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: KEEPALIVE timeout. Aborting connection to "));
+			ipX_addr_debug_print(PCB_ISIPV6(pcb), TCP_DEBUG, &pcb->remote_ip);
+			LWIP_DEBUGF(TCP_DEBUG, ("\n"));
+
+			++pcb_remove;
+			++pcb_reset;
+		}
+		else if((u32_t)(cur_fg->tcp_ticks - pcb->tmr) >
+			(pcb->keep_idle + pcb->keep_cnt_sent * TCP_KEEP_INTVL(pcb))
+			/ TCP_SLOW_INTERVAL)
+		{
+			tcp_keepalive(cur_fg,pcb);
+			pcb->keep_cnt_sent++;
+		}
+	}
 
-			/* If this PCB has queued out of sequence data, but has been
-			   inactive for too long, will drop the data (it will eventually
-			   be retransmitted). */
+	/* If this PCB has queued out of sequence data, but has been
+	   inactive for too long, will drop the data (it will eventually
+	   be retransmitted). */
 #if TCP_QUEUE_OOSEQ
-			if (pcb->ooseq != NULL &&
-			    (u32_t)cur_fg->tcp_ticks - pcb->tmr >= pcb->rto * TCP_OOSEQ_TIMEOUT) {
-				tcp_segs_free(pcb->ooseq);
-				pcb->ooseq = NULL;
-				LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_slowtmr: dropping OOSEQ queued data\n"));
-			}
+	if (pcb->ooseq != NULL &&
+	    (u32_t)cur_fg->tcp_ticks - pcb->tmr >= pcb->rto * TCP_OOSEQ_TIMEOUT) {
+		tcp_segs_free(pcb->ooseq);
+		pcb->ooseq = NULL;
+		LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_slowtmr: dropping OOSEQ queued data\n"));
+	}
 #endif /* TCP_QUEUE_OOSEQ */
 
-			/* Check if this PCB has stayed too long in SYN-RCVD */
-			if (pcb->state == SYN_RCVD) {
-				if ((u32_t)(cur_fg->tcp_ticks - pcb->tmr) >
-				    TCP_SYN_RCVD_TIMEOUT / TCP_SLOW_INTERVAL) {
-					++pcb_remove;
-					LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: removing pcb stuck in SYN-RCVD\n"));
-				}
-			}
+	/* Check if this PCB has stayed too long in SYN-RCVD */
+	if (pcb->state == SYN_RCVD) {
+		if ((u32_t)(cur_fg->tcp_ticks - pcb->tmr) >
+		    TCP_SYN_RCVD_TIMEOUT / TCP_SLOW_INTERVAL) {
+			++pcb_remove;
+			LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: removing pcb stuck in SYN-RCVD\n"));
+		}
+	}
 
-			/* Check if this PCB has stayed too long in LAST-ACK */
-			if (pcb->state == LAST_ACK) {
-				if ((u32_t)(cur_fg->tcp_ticks - pcb->tmr) > 2 * TCP_MSL / TCP_SLOW_INTERVAL) {
-					++pcb_remove;
-					LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: removing pcb stuck in LAST-ACK\n"));
-				}
-			}
+	/* Check if this PCB has stayed too long in LAST-ACK */
+	if (pcb->state == LAST_ACK) {
+		if ((u32_t)(cur_fg->tcp_ticks - pcb->tmr) > 2 * TCP_MSL / TCP_SLOW_INTERVAL) {
+			++pcb_remove;
+			LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: removing pcb stuck in LAST-ACK\n"));
+		}
+	}
 
-			/* If the PCB should be removed, do it. */
-			if (pcb_remove) {
+	/* If the PCB should be removed, do it. */
+	if (pcb_remove) {
 #ifdef LWIP_CALLBACK_API
-				tcp_err_fn err_fn;
-				err_fn = pcb->errf;
+		tcp_err_fn err_fn;
+		err_fn = pcb->errf;
 #endif
-				void *err_arg;
-				err_arg = pcb->callback_arg;
-
-				hlist_del(&pcb->link);
-				pcb_remove_called_from_timer(cur_fg,pcb, pcb_reset);
+		void *err_arg;
+		err_arg = pcb->callback_arg;
 
-				cur_fg->tcp_active_pcb_changed = 0;
-				TCP_EVENT_ERR(err_fn, err_arg, ERR_ABRT);
-				if (cur_fg->tcp_active_pcb_changed) {
-					goto tcp_slowtmr_start;
-				}
-			} else {
-				/* We check if we should poll the connection. */
-				++pcb->polltmr;
-				if (pcb->polltmr >= pcb->pollinterval) {
-					pcb->polltmr = 0;
-					LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: polling application\n"));
-					cur_fg->tcp_active_pcb_changed = 0;
-					TCP_EVENT_POLL(pcb, err);
-					if (cur_fg->tcp_active_pcb_changed) {
-						goto tcp_slowtmr_start;
-					}
-					/* if err == ERR_ABRT, 'pcb' is already deallocated */
-					if (err == ERR_OK) {
-						tcp_output(cur_fg,pcb);
-					}
-				}
-			}
-		}
-
-
-		/* Steps through all of the TIME-WAIT PCBs. */
-		hlist_for_each_safe(&cur_fg->tw_pcbs,n,tmp) {
-			pcb = hlist_entry(n,struct tcp_pcb,link);
-
-			LWIP_ASSERT("tcp_slowtmr: TIME-WAIT pcb->state == TIME-WAIT", pcb->state == TIME_WAIT);
-			pcb_remove = 0;
-
-			/* Check if this PCB has stayed long enough in TIME-WAIT */
-			if ((u32_t)(cur_fg->tcp_ticks - pcb->tmr) > 2 * TCP_MSL / TCP_SLOW_INTERVAL) {
-				++pcb_remove;
-			}
-
-
-
-			/* If the PCB should be removed, do it. */
-			if (pcb_remove) {
-				tcp_pcb_purge(pcb);
-				hlist_del(&pcb->link);
-				memp_free(MEMP_TCP_PCB, pcb);
-			}
+		pcb_remove_called_from_timer(cur_fg,pcb, pcb_reset);
+		TCP_EVENT_ERR(err_fn, err_arg, ERR_ABRT);
+		return 1;
+	}
 
-		}
+	/* We check if we should poll the connection. */
+	++pcb->polltmr;
+	if (pcb->polltmr >= pcb->pollinterval) {
+		pcb->polltmr = 0;
+		LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: polling application\n"));
+		TCP_EVENT_POLL(pcb, err);
+		/* if err == ERR_ABRT, 'pcb' is already deallocated */
+		if (err == ERR_ABRT)
+			return 1;
+		if (err == ERR_OK)
+			tcp_output(cur_fg,pcb);
 	}
+
+out:
+	tcp_slow_timer_update(cur_fg, pcb);
+	return 0;
 }
 
 void tcp_unified_timer_handler(struct timer *t, struct eth_fg *cur_fg)
@@ -1097,6 +1131,12 @@ void tcp_unified_timer_handler(struct timer *t, struct eth_fg *cur_fg)
 
 	//percpu_get(current_perqueue) = pcb->perqueue;
 
+	if (pcb->timer_slow_expires && pcb->timer_slow_expires <= now_us) {
+		pcb->timer_slow_expires = 0;
+		if (tcp_pcb_slowtmr(cur_fg, pcb))
+			return;
+	}
+
 	if (pcb->timer_delayedack_expires && pcb->timer_delayedack_expires <=now_us) {
 		KSTATS_VECTOR(timer_tcp_send_delayed_ack);
 		tcp_ack_now(pcb);
@@ -1106,7 +1146,6 @@ void tcp_unified_timer_handler(struct timer *t, struct eth_fg *cur_fg)
 	}
 	if (pcb->timer_retransmit_expires && pcb->timer_retransmit_expires <= now_us) {
 		int pcb_remove;
-		tcpwnd_size_t eff_wnd;
 
 		KSTATS_VECTOR(timer_tcp_retransmit);
 		pcb->timer_retransmit_expires = 0;
@@ -1140,11 +1179,7 @@ void tcp_unified_timer_handler(struct timer *t, struct eth_fg *cur_fg)
 		}
 
 		/* Reduce congestion window and ssthresh. */
-		eff_wnd = LWIP_MIN(pcb->cwnd, pcb->snd_wnd);
-		pcb->ssthresh = eff_wnd >> 1;
-		if (pcb->ssthresh < (tcpwnd_size_t)(pcb->mss << 1)) {
-			pcb->ssthresh = (pcb->mss << 1);
-		}
+		pcb->ssthresh = pcb->cc->ssthresh(pcb);
 		pcb->cwnd = pcb->mss;
 
 		/* The following needs to be called AFTER cwnd is set to one
@@ -1169,46 +1204,6 @@ next:
 
 }
 
-/**
- * Is called every TCP_FAST_INTERVAL (250 ms) and process data previously
- * "refused" by upper layer (application) and sends delayed ACKs.
- *
- * Automatically called from tcp_tmr().
- */
-static void
-tcp_fasttmr(struct eth_fg *cur_fg)
-{
-	struct tcp_pcb *pcb;
-	struct hlist_node *n,*tmp;
-	struct hlist_node *cur;
-	++cur_fg->tcp_timer_ctr;
-
-
-tcp_fasttmr_start:
-
-	hlist_for_each(&cur_fg->active_buckets,cur) {
-		struct tcp_hash_entry *he = hlist_entry(cur,struct tcp_hash_entry,hash_link);
-		hlist_for_each_safe(&he->pcbs,n,tmp) {
-			pcb = hlist_entry(n,struct tcp_pcb,link);
-
-			if (pcb->last_timer != cur_fg->tcp_timer_ctr) {
-				pcb->last_timer = cur_fg->tcp_timer_ctr;
-
-				/* If there is data which was previously "refused" by upper layer */
-				if (pcb->refused_data != NULL) {
-					cur_fg->tcp_active_pcb_changed = 0;
-					tcp_process_refused_data(cur_fg,pcb);
-					if (cur_fg->tcp_active_pcb_changed) {
-						/* application callback has changed the pcb list: restart the loop */
-						goto tcp_fasttmr_start;
-					}
-				}
-
-			}
-		}
-	}
-}
-
 /** Pass pcb->refused_data to the recv callback */
 err_t
 tcp_process_refused_data(struct eth_fg *cur_fg,struct tcp_pcb *pcb)
@@ -1372,8 +1367,6 @@ tcp_kill_prio(struct eth_fg *cur_fg,u8_t prio)
 	u32_t inactivity;
 	u8_t mprio;
 
-	struct hlist_node *cur;
-	struct tcp_hash_entry *hash_head = NULL;
 	struct hlist_node *n;
 
 
@@ -1383,18 +1376,15 @@ tcp_kill_prio(struct eth_fg *cur_fg,u8_t prio)
 	inactivity = 0;
 	inactive = NULL;
 
-	hlist_for_each(&cur_fg->active_buckets,cur) {
-		hash_head = hlist_entry(cur,struct tcp_hash_entry,hash_link);
-		hlist_for_each(&hash_head->pcbs,n) {
-			pcb = hlist_entry(n,struct tcp_pcb,link);
-
-			if (pcb->prio <= prio &&
-			    pcb->prio <= mprio &&
-			    (u32_t)(cur_fg->tcp_ticks - pcb->tmr) >= inactivity) {
-				inactivity = cur_fg->tcp_ticks - pcb->tmr;
-				inactive = pcb;
-				mprio = pcb->prio;
-			}
+	hlist_for_each(&cur_fg->active_pcbs,n) {
+		pcb = hlist_entry(n,struct tcp_pcb,link);
+
+		if (pcb->prio <= prio &&
+		    pcb->prio <= mprio &&
+		    (u32_t)(cur_fg->tcp_ticks - pcb->tmr) >= inactivity) {
+			inactivity = cur_fg->tcp_ticks - pcb->tmr;
+			inactive = pcb;
+			mprio = pcb->prio;
 		}
 	}
 	if (inactive != NULL) {
@@ -1405,31 +1395,63 @@ tcp_kill_prio(struct eth_fg *cur_fg,u8_t prio)
 }
 
 /**
- * Kills the oldest connection that is in TIME_WAIT state.
- * Called from tcp_alloc() if no more connections are available.
+ * Initialize a freshly allocated tcp_pcb structure.
+ *
+ * @param pcb the tcp_pcb to initialize
+ * @param prio priority for the pcb
  */
-static void
-tcp_kill_timewait(struct eth_fg *cur_fg)
+void
+tcp_pcb_init(struct eth_fg *cur_fg, struct tcp_pcb *pcb, u8_t prio)
 {
-	struct tcp_pcb *pcb, *inactive;
-	struct hlist_node *n;
-	u32_t inactivity;
+  u32_t iss;
 
-	inactivity = 0;
-	inactive = NULL;
-	/* Go through the list of TIME_WAIT pcbs and get the oldest pcb. */
-	hlist_for_each(&cur_fg->tw_pcbs,n) {
-		pcb = hlist_entry(n,struct tcp_pcb,link);
-		if ((u32_t)(cur_fg->tcp_ticks - pcb->tmr) >= inactivity) {
-			inactivity = cur_fg->tcp_ticks - pcb->tmr;
-			inactive = pcb;
-		}
-	}
-	if (inactive != NULL) {
-		LWIP_DEBUGF(TCP_DEBUG, ("tcp_kill_timewait: killing oldest TIME-WAIT PCB %p (%"S32_F")\n",
-					(void *)inactive, inactivity));
-		tcp_abort(cur_fg,inactive);
-	}
+  MEMPOOL_SANITY_ACCESS(pcb);
+  memset(pcb, 0, sizeof(struct tcp_pcb));
+  pcb->prio = prio;
+  pcb->snd_buf = TCP_SND_BUF;
+  pcb->snd_queuelen = 0;
+  pcb->rcv_wnd = TCP_WND;
+  pcb->rcv_ann_wnd = TCP_WND;
+#if LWIP_WND_SCALE
+  /* snd_scale and rcv_scale are zero unless both sides agree to use scaling */
+  pcb->snd_scale = 0;
+  pcb->rcv_scale = 0;
+#endif
+  pcb->tos = 0;
+  pcb->ttl = TCP_TTL;
+  /* As initial send MSS, we use TCP_MSS but limit it to 536.
+     The send MSS is updated when an MSS option is received. */
+  pcb->mss = (TCP_MSS > 536) ? 536 : TCP_MSS;
+  pcb->rto = 3000 / TCP_SLOW_INTERVAL;
+  pcb->sa = 0;
+  pcb->sv = 3000 / TCP_SLOW_INTERVAL;
+  pcb->cwnd = 1;
+  iss = tcp_next_iss(cur_fg);
+  pcb->snd_wl2 = iss;
+  pcb->snd_nxt = iss;
+  pcb->lastack = iss;
+  pcb->snd_lbb = iss;
+  tcp_cc_set(pcb, &tcp_cc_reno);
+  pcb->ack_policy = TCP_ACK_DELAYED;
+  pcb->ack_delay = TCP_ACK_DELAY;
+  pcb->tmr = cur_fg->tcp_ticks;
+  pcb->last_timer = (u8_t)cur_fg->tcp_ticks;
+
+  pcb->polltmr = 0;
+
+#if LWIP_CALLBACK_API
+  pcb->recv = tcp_recv_null;
+#endif /* LWIP_CALLBACK_API */
+
+  /* Init KEEPALIVE timer */
+  pcb->keep_idle  = TCP_KEEPIDLE_DEFAULT;
+
+#if LWIP_TCP_KEEPALIVE
+  pcb->keep_intvl = TCP_KEEPINTVL_DEFAULT;
+  pcb->keep_cnt   = TCP_KEEPCNT_DEFAULT;
+#endif /* LWIP_TCP_KEEPALIVE */
+
+  pcb->keep_cnt_sent = 0;
 }
 
 /**
@@ -1442,78 +1464,24 @@ struct tcp_pcb *
 tcp_alloc(struct eth_fg *cur_fg,u8_t prio)
 {
   struct tcp_pcb *pcb;
-  u32_t iss;
 
   pcb = (struct tcp_pcb *)memp_malloc(MEMP_TCP_PCB);
   if (pcb == NULL) {
 
 	  panic("tcp_alloc oom\n");
-    /* Try killing oldest connection in TIME-WAIT. */
-    LWIP_DEBUGF(TCP_DEBUG, ("tcp_alloc: killing off oldest TIME-WAIT connection\n"));
-    tcp_kill_timewait(cur_fg);
+    /* TIME-WAIT connections hold no pcb, so only active connections
+       with lower priority than the new one can make room. */
+    LWIP_DEBUGF(TCP_DEBUG, ("tcp_alloc: killing connection with prio lower than %d\n", prio));
+    tcp_kill_prio(cur_fg,prio);
     /* Try to allocate a tcp_pcb again. */
     pcb = (struct tcp_pcb *)memp_malloc(MEMP_TCP_PCB);
-    if (pcb == NULL) {
-      /* Try killing active connections with lower priority than the new one. */
-      LWIP_DEBUGF(TCP_DEBUG, ("tcp_alloc: killing connection with prio lower than %d\n", prio));
-      tcp_kill_prio(cur_fg,prio);
-      /* Try to allocate a tcp_pcb again. */
-      pcb = (struct tcp_pcb *)memp_malloc(MEMP_TCP_PCB);
-      if (pcb != NULL) {
-        /* adjust err stats: memp_malloc failed twice before */
-        MEMP_STATS_DEC(err, MEMP_TCP_PCB);
-      }
-    }
     if (pcb != NULL) {
-      /* adjust err stats: timewait PCB was freed above */
+      /* adjust err stats: memp_malloc failed before */
       MEMP_STATS_DEC(err, MEMP_TCP_PCB);
     }
   }
   if (pcb != NULL) {
-    MEMPOOL_SANITY_ACCESS(pcb);
-    memset(pcb, 0, sizeof(struct tcp_pcb));
-    pcb->prio = prio;
-    pcb->snd_buf = TCP_SND_BUF;
-    pcb->snd_queuelen = 0;
-    pcb->rcv_wnd = TCP_WND;
-    pcb->rcv_ann_wnd = TCP_WND;
-#if LWIP_WND_SCALE
-    /* snd_scale and rcv_scale are zero unless both sides agree to use scaling */
-    pcb->snd_scale = 0;
-    pcb->rcv_scale = 0;
-#endif
-    pcb->tos = 0;
-    pcb->ttl = TCP_TTL;
-    /* As initial send MSS, we use TCP_MSS but limit it to 536.
-       The send MSS is updated when an MSS option is received. */
-    pcb->mss = (TCP_MSS > 536) ? 536 : TCP_MSS;
-    pcb->rto = 3000 / TCP_SLOW_INTERVAL;
-    pcb->sa = 0;
-    pcb->sv = 3000 / TCP_SLOW_INTERVAL;
-    pcb->cwnd = 1;
-    iss = tcp_next_iss(cur_fg);
-    pcb->snd_wl2 = iss;
-    pcb->snd_nxt = iss;
-    pcb->lastack = iss;
-    pcb->snd_lbb = iss;
-    pcb->tmr = cur_fg->tcp_ticks;
-    pcb->last_timer = cur_fg->tcp_timer_ctr;
-
-    pcb->polltmr = 0;
-
-#if LWIP_CALLBACK_API
-    pcb->recv = tcp_recv_null;
-#endif /* LWIP_CALLBACK_API */
-
-    /* Init KEEPALIVE timer */
-    pcb->keep_idle  = TCP_KEEPIDLE_DEFAULT;
-
-#if LWIP_TCP_KEEPALIVE
-    pcb->keep_intvl = TCP_KEEPINTVL_DEFAULT;
-    pcb->keep_cnt   = TCP_KEEPCNT_DEFAULT;
-#endif /* LWIP_TCP_KEEPALIVE */
-
-    pcb->keep_cnt_sent = 0;
+    tcp_pcb_init(cur_fg, pcb, prio);
   }
   return pcb;
 }
@@ -1742,7 +1710,7 @@ tcp_pcb_remove(struct eth_fg *cur_fg,struct tcp_pcb *pcb)
   /* if there is an outstanding delayed ACKs, send it */
   if (pcb->state != TIME_WAIT &&
      pcb->state != LISTEN &&
-      pcb->timer_delayedack_expires>0) {
+      (pcb->timer_delayedack_expires>0 || (pcb->flags & TF_ACK_DUE))) {
     pcb->flags |= TF_ACK_NOW;
     tcp_output(cur_fg,pcb);
   }
@@ -1783,10 +1751,9 @@ static void tcpip_tcp_timer(struct timer *t, struct eth_fg *cur_fg)
 	tcp_tmr(cur_fg);
 
 	/* timer still needed? */
-	if (!hlist_empty(&cur_fg->active_buckets) ||
-	    !hlist_empty(&cur_fg->tw_pcbs))
+	if (!hlist_empty(&cur_fg->active_pcbs))
 		/* restart timer */
-		timer_add(t,cur_fg, TCP_TMR_INTERVAL * ONE_MS);
+		timer_add(t,cur_fg, TCP_SLOW_INTERVAL * ONE_MS);
 }
 
 
@@ -0,0 +1,154 @@
+/*
+ * Copyright 2013-16 Board of Trustees of Stanford University
+ * Copyright 2013-16 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * tcp_ack.c - ACKs deferred to the end of the RX batch
+ *
+ * tcp_ack() decides when received data is acknowledged, following the
+ * ACK policy of the pcb. An ACK that is due is not sent from the middle
+ * of tcp_input(): the pcb is queued here and acknowledged once, by
+ * tcp_ack_flush() at the end of eth_process_recv(). A connection that
+ * received several segments in a batch sends a single ACK for them, and
+ * none at all if it sent data, which carries the ACK, in the meantime.
+ */
+
+#include <string.h>
+
+#include <ix/stddef.h>
+#include <ix/errno.h>
+#include <ix/cpu.h>
+#include <ix/ethfg.h>
+
+#include <lwip/tcp.h>
+#include <lwip/tcp_impl.h>
+
+#define TCP_ACK_MAX_PENDING	64
+
+struct tcp_ack_pending {
+	struct eth_fg *fg;
+	struct tcp_pcb *pcb;
+};
+
+struct tcp_ack_table {
+	int nr;
+	struct tcp_ack_pending pending[TCP_ACK_MAX_PENDING];
+};
+
+static DEFINE_PERCPU(struct tcp_ack_table, tcp_ack_table);
+
+/**
+ * tcp_ack_batch - acknowledges received data at the end of the RX batch
+ * @cur_fg: the flow group of the pcb
+ * @pcb: the pcb
+ *
+ * If too many connections are waiting already, the ACK goes out with
+ * the next tcp_output() instead.
+ */
+void tcp_ack_batch(struct eth_fg *cur_fg, struct tcp_pcb *pcb)
+{
+	struct tcp_ack_table *tbl = &percpu_get(tcp_ack_table);
+
+	pcb->flags |= TF_ACK_DUE;
+	if (pcb->flags & TF_ACK_BATCH)
+		return;
+
+	if (unlikely(tbl->nr == TCP_ACK_MAX_PENDING)) {
+		tcp_ack_now(pcb);
+		return;
+	}
+
+	tbl->pending[tbl->nr].fg = cur_fg;
+	tbl->pending[tbl->nr].pcb = pcb;
+	tbl->nr++;
+	pcb->flags |= TF_ACK_BATCH;
+}
+
+/**
+ * tcp_ack_unqueue - forgets a pcb that is about to be freed
+ * @pcb: the pcb
+ */
+void tcp_ack_unqueue(struct tcp_pcb *pcb)
+{
+	struct tcp_ack_table *tbl = &percpu_get(tcp_ack_table);
+	int i;
+
+	for (i = 0; i < tbl->nr; i++) {
+		if (tbl->pending[i].pcb == pcb)
+			tbl->pending[i].pcb = NULL;
+	}
+
+	pcb->flags &= ~TF_ACK_BATCH;
+}
+
+/**
+ * tcp_ack_flush - sends the ACKs still due at the end of the RX batch
+ */
+void tcp_ack_flush(void)
+{
+	struct tcp_ack_table *tbl = &percpu_get(tcp_ack_table);
+	struct tcp_pcb *pcb;
+	int i;
+
+	for (i = 0; i < tbl->nr; i++) {
+		pcb = tbl->pending[i].pcb;
+		if (!pcb)
+			continue;
+
+		pcb->flags &= ~TF_ACK_BATCH;
+		if (!(pcb->flags & TF_ACK_DUE))
+			continue;
+
+		eth_fg_set_current(tbl->pending[i].fg);
+		tcp_ack_now(pcb);
+		tcp_output(tbl->pending[i].fg, pcb);
+		unset_current_fg();
+	}
+
+	tbl->nr = 0;
+}
+
+static const char *tcp_ack_policy_names[] = {
+	[TCP_ACK_DELAYED]	= "delayed",
+	[TCP_ACK_IMMEDIATE]	= "immediate",
+	[TCP_ACK_PIGGYBACK]	= "piggyback",
+	[TCP_ACK_BATCH]		= "batch",
+};
+
+/**
+ * tcp_ack_policy_find - looks up an ACK policy by name
+ * @name: the name (e.g. "delayed" or "batch")
+ *
+ * Returns the policy, or -EINVAL if there is none with that name.
+ */
+int tcp_ack_policy_find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(tcp_ack_policy_names); i++) {
+		if (!strcmp(tcp_ack_policy_names[i], name))
+			return i;
+	}
+
+	return -EINVAL;
+}
@@ -31,6 +31,7 @@
 #include <ix/syscall.h>
 #include <ix/log.h>
 #include <ix/uaccess.h>
+#include <ix/vm.h>
 #include <ix/ethdev.h>
 #include <ix/kstats.h>
 #include <ix/cfg.h>
@@ -41,6 +42,8 @@
 #include <ix/apic.h>
 
 #include <lwip/tcp.h>
+#include <lwip/tcp_impl.h>
+#include <lwip/inet_chksum.h>
 
 int ip_send_one(struct eth_fg *cur_fg, struct ip_addr *dst_addr, struct mbuf *pkt, size_t len);
 
@@ -74,6 +77,12 @@ static DEFINE_PERCPU(long, last_ipi_time);
 #define PCB_FLAG_READY 1
 #define PCB_FLAG_CLOSED 2
 
+/*
+ * TCP_ZC_MAX_PKTS bounds the number of zero-copy packets a connection may
+ * have in flight; further payloads are copied until the NIC catches up.
+ */
+#define TCP_ZC_MAX_PKTS	32
+
 /*
  * FIXME: LWIP and IX have different lifetime rules so we have to maintain
  * a seperate pcb. Otherwise, we'd be plagued by use-after-free problems.
@@ -91,6 +100,9 @@ struct tcpapi_pcb {
 	bool accepted;
 	int sent_len;
 	int len_xmited;
+	int zc_inflight; /* zero-copy packets not yet completed by the NIC */
+	uint32_t zc_live; /* the zc_seq slots in use */
+	u32_t zc_seq[TCP_ZC_MAX_PKTS]; /* the first seqno of each packet */
 	struct queue pbuf_for_usys;
 	struct queue_node ready_queue;
 	int active_usys_count;
@@ -102,6 +114,15 @@ struct tcpapi_pcb {
 	} lasterr;
 };
 
+/*
+ * Payloads smaller than TCP_ZC_MIN_LEN are cheaper to copy than to
+ * describe with extra TX descriptors. TCP_ZC_MAX_IOV bounds the number
+ * of user buffer fragments that may be attached to a single packet.
+ */
+#define TCP_ZC_MIN_LEN	256
+#define TCP_ZC_MAX_IOV	8
+#define TCP_TSO_MAX_IOV	32	/* within the NIC's per-packet descriptor limit */
+
 #define PCB_UEVENT_KNOCK 1
 #define PCB_UEVENT_CONNECTED 2
 
@@ -187,11 +208,92 @@ static void pcb_ready_enqueue(struct tcpapi_pcb *api)
 	queue_push_back(&percpu_get(pcb_ready_queue).queue, &api->ready_queue);
 }
 
+/**
+ * tcp_zc_track - records a zero-copy packet handed to the NIC
+ * @api: the connection
+ * @seq: the seqno of the first payload byte
+ *
+ * The caller must make sure a slot is free.
+ */
+static void tcp_zc_track(struct tcpapi_pcb *api, u32_t seq)
+{
+	int slot = __builtin_ctz(~api->zc_live);
+
+	api->zc_seq[slot] = seq;
+	api->zc_live |= 1u << slot;
+	api->zc_inflight++;
+}
+
+/**
+ * tcp_zc_untrack - forgets a zero-copy packet the NIC has completed
+ * @api: the connection
+ * @seq: the seqno of the first payload byte
+ *
+ * Retransmissions of the same segment share a seqno, and any one of
+ * their slots may be released.
+ */
+static void tcp_zc_untrack(struct tcpapi_pcb *api, u32_t seq)
+{
+	uint32_t live = api->zc_live;
+	int slot;
+
+	while (live) {
+		slot = __builtin_ctz(live);
+		live &= live - 1;
+		if (api->zc_seq[slot] == seq) {
+			api->zc_live &= ~(1u << slot);
+			api->zc_inflight--;
+			return;
+		}
+	}
+
+	panic("tcpapi: completed an untracked zero-copy packet\n");
+}
+
+/**
+ * tcp_zc_sent_len - determines how many ACKed bytes can be reported sent
+ * @api: the connection
+ *
+ * The user buffer behind a zero-copy packet may still be read by the NIC
+ * after its data was ACKed. ACKed bytes are therefore only released up to
+ * the first byte of the oldest packet the NIC has not completed yet, so a
+ * pipelined sender keeps getting sent events while packets are in flight.
+ *
+ * Returns the number of bytes.
+ */
+static int tcp_zc_sent_len(struct tcpapi_pcb *api)
+{
+	uint32_t live = api->zc_live;
+	u32_t start, limit;
+	int slot;
+
+	if (!api->sent_len || !live)
+		return api->sent_len;
+	if (!api->pcb)
+		return 0;
+
+	/* the first ACKed byte not yet reported */
+	start = api->pcb->lastack - api->sent_len;
+	limit = api->pcb->lastack;
+	while (live) {
+		slot = __builtin_ctz(live);
+		live &= live - 1;
+		if (TCP_SEQ_LT(api->zc_seq[slot], limit))
+			limit = api->zc_seq[slot];
+	}
+
+	if (TCP_SEQ_LEQ(limit, start))
+		return 0;
+
+	return limit - start;
+}
+
 static void __tcp_gen_usys(struct tcpapi_pcb *api)
 {
 	struct mbuf *pkt;
 	struct pbuf *p, *pbufs;
 	void *id;
+	int len;
 
 	assert(!api->flags);
 	assert(!api->active_usys_count);
@@ -220,10 +322,11 @@ static void __tcp_gen_usys(struct tcpapi_pcb *api)
 		api->active_usys_count++;
 	}
 
-	if (api->sent_len) {
-		log_debug("%lx: usys_tcp_sent(%lx, %lx, %d)\n", api, api->handle, api->cookie, api->sent_len);
-		usys_tcp_sent(api->handle, api->cookie, api->sent_len);
-		api->sent_len = 0;
+	len = tcp_zc_sent_len(api);
+	if (len) {
+		log_debug("%lx: usys_tcp_sent(%lx, %lx, %d)\n", api, api->handle, api->cookie, len);
+		usys_tcp_sent(api->handle, api->cookie, len);
+		api->sent_len -= len;
 		api->active_usys_count++;
 	}
 
@@ -324,7 +427,8 @@ static void __tcp_finish_usys(void *_api)
 	spin_lock(&percpu_get(pcb_ready_queue).lock);
 	api->active_usys_count--;
 	if (!api->active_usys_count && api->flags & PCB_FLAG_CLOSED) {
-		mempool_free(&percpu_get(pcb_mempool), api);
+		if (!api->zc_inflight)
+			mempool_free(&percpu_get(pcb_mempool), api);
 	} else if (!api->active_usys_count && api->flags & PCB_FLAG_READY) {
 		api->flags &= ~PCB_FLAG_READY;
 		pcb_ready_enqueue(api);
@@ -332,40 +436,50 @@ static void __tcp_finish_usys(void *_api)
 	spin_unlock(&percpu_get(pcb_ready_queue).lock);
 }
 
-void tcp_finish_usys(void)
+/**
+ * tcp_finish_usys_one - releases a usys event the application has consumed
+ * @d: the event descriptor
+ */
+void tcp_finish_usys_one(struct bsys_desc *d)
 {
-	int i, home, ret;
+	int home, ret;
 	struct tcpapi_pcb *api;
-	struct bsys_desc *descs = percpu_get(usys_arr)->descs;
 #if CONFIG_RUN_TCP_STACK_IPI
 	long now, last;
 #endif
 
-	for (i = 0; i < percpu_get(usys_arr)->len; i++) {
-		if (!usys_is_tcp(&descs[i]))
-			continue;
+	if (!usys_is_tcp(d))
+		return;
 
-		api = __handle_to_tcpapi(descs[i].arga);
+	api = __handle_to_tcpapi(d->arga);
 
-		home = bsys_tcp_home_id(&descs[i]);
-		if (home == percpu_get(cpu_id)) {
-			__tcp_finish_usys(api);
-		} else {
-			ret = cpu_run_on_one(__tcp_finish_usys, api, home);
-			assert(!ret);
+	home = bsys_tcp_home_id(d);
+	if (home == percpu_get(cpu_id)) {
+		__tcp_finish_usys(api);
+	} else {
+		ret = cpu_run_on_one(__tcp_finish_usys, api, home);
+		assert(!ret);
 #if CONFIG_RUN_TCP_STACK_IPI
-			/* Send an IPI in case the home core is in userspace */
-			now = rdtsc();
-			last = percpu_get_remote(last_ipi_time, home);
-			if (!last || now - last >= IPI_TIMEOUT) {
-				percpu_get_remote(last_ipi_time, home) = now;
-				apic_send_ipi(home, RUN_TCP_STACK_IPI_VECTOR);
-			}
-#endif
+		/* Send an IPI in case the home core is in userspace */
+		now = rdtsc();
+		last = percpu_get_remote(last_ipi_time, home);
+		if (!last || now - last >= IPI_TIMEOUT) {
+			percpu_get_remote(last_ipi_time, home) = now;
+			apic_send_ipi(home, RUN_TCP_STACK_IPI_VECTOR);
 		}
+#endif
 	}
 }
 
+void tcp_finish_usys(void)
+{
+	int i;
+	struct bsys_desc *descs = percpu_get(usys_arr)->descs;
+
+	for (i = 0; i < percpu_get(usys_arr)->len; i++)
+		tcp_finish_usys_one(&descs[i]);
+}
+
 void tcp_generate_usys(void)
 {
 	struct pcb_ready_queue *queue;
@@ -386,14 +500,63 @@ void tcp_generate_usys(void)
 
 #if CONFIG_RUN_TCP_STACK_IPI
 
+/*
+ * The IPI interrupts the application, so the handler must preserve any
+ * register state the dataplane may clobber. fxsave only covers x87 and
+ * SSE, but the checksum kernels use AVX2, and VEX-encoded instructions
+ * also clear the upper halves of the ZMM registers. Where the OS has
+ * enabled AVX, those components are saved with xsave instead.
+ */
+#define IPI_XSAVE_AREA_SIZE	4096
+
+struct ipi_fpu_area {
+	char buf[IPI_XSAVE_AREA_SIZE];
+} __aligned(64);
+
+/*
+ * Per-cpu memory starts zeroed, and xsave never writes the reserved
+ * header bytes that xrstor checks.
+ */
+static DEFINE_PERCPU(struct ipi_fpu_area, ipi_fpu_area);
+static unsigned long ipi_xsave_mask;	/* 0 to use fxsave */
+
+static void ipi_fpu_init(void)
+{
+	unsigned int a, b, c, d, i;
+	unsigned long mask;
+
+	cpuid(1, 0, &a, &b, &c, &d);
+	if (!(c & CPUID_1_ECX_OSXSAVE))
+		return;
+
+	mask = xgetbv(0) & (XCR0_X87 | XCR0_SSE | XCR0_AVX | XCR0_ZMM_HI256);
+	if (!(mask & XCR0_AVX))
+		return;
+
+	/* the standard format puts each component at a fixed offset */
+	for (i = 2; i < 64; i++) {
+		if (!(mask & (1UL << i)))
+			continue;
+
+		cpuid(0xd, i, &a, &b, &c, &d);
+		if (a + b > IPI_XSAVE_AREA_SIZE)
+			mask &= ~(1UL << i);
+	}
+
+	ipi_xsave_mask = mask;
+}
+
 static void run_tcp_stack_ipi_handler(struct dune_tf *tf)
 {
-	char fxsave[512];
+	struct ipi_fpu_area *fpu = &percpu_get(ipi_fpu_area);
 
 	if (percpu_get(in_kernel))
 		goto out;
 
-	asm volatile("fxsave %0" : "=m" (fxsave));
+	if (ipi_xsave_mask)
+		xsave(fpu, ipi_xsave_mask);
+	else
+		asm volatile("fxsave %0" : "=m" (*fpu));
 
 	/* Needed so that we process remote ksys */
 	cpu_do_bookkeeping();
@@ -402,9 +565,15 @@ static void run_tcp_stack_ipi_handler(struct dune_tf *tf)
 
 	eth_process_recv();
 
+	/* Serve the shared-memory rings without waiting for a trap */
+	bsys_ring_poll();
+
 	eth_process_send();
 
-	asm volatile("fxrstor %0" : "=m" (fxsave));
+	if (ipi_xsave_mask)
+		xrstor(fpu, ipi_xsave_mask);
+	else
+		asm volatile("fxrstor %0" : : "m" (*fpu));
 
 out:
 	apic_eoi();
@@ -650,10 +819,10 @@ void bsys_tcp_sendv(hid_t handle, struct sg_entry __user *ents,
 			break;
 
 		/*
-		 * FIXME: Unfortunately LWIP's TX path is compeletely
-		 * broken in terms of zero-copy. It's also somewhat
-		 * broken in terms of large write requests. Here's a
-		 * hacky placeholder until we can rewrite this path.
+		 * The data is not copied here: tcp_write() creates
+		 * PBUF_ROM pbufs that reference the user buffer and
+		 * tcp_output_packet() attaches them to the packet as
+		 * scatter-gather when they lie in zero-copy memory.
 		 */
 		err = tcp_write(api->pcb, base, len, 0);
 		if (err != ERR_OK)
@@ -699,7 +868,21 @@ void bsys_tcp_recv_done(hid_t handle, size_t len)
 			break;
 
 		len -= recvd->len;
-		next = recvd->tcp_api_next;
+
+		/*
+		 * Each pbuf of a chain was reported as its own recv event,
+		 * so release a chain one pbuf at a time.
+		 */
+		if (recvd->next) {
+			next = recvd->next;
+			next->tcp_api_next = recvd->tcp_api_next;
+			if (api->recvd_tail == recvd)
+				api->recvd_tail = next;
+			recvd->next = NULL;
+			recvd->tot_len = recvd->len;
+		} else {
+			next = recvd->tcp_api_next;
+		}
 		pbuf_free(recvd);
 		recvd = next;
 	}
@@ -739,7 +922,7 @@ void bsys_tcp_close(hid_t handle)
 		mempool_free(&percpu_get(id_mempool), api->id);
 	}
 
-	if (api->active_usys_count)
+	if (api->active_usys_count || api->zc_inflight)
 		api->flags |= PCB_FLAG_CLOSED;
 	else
 		mempool_free(&percpu_get(pcb_mempool), api);
@@ -890,6 +1073,8 @@ static err_t on_accept(struct eth_fg *cur_fg, void *arg, struct tcp_pcb *pcb, er
 	api->accepted = false;
 	api->sent_len = 0;
 	api->len_xmited = 0;
+	api->zc_inflight = 0;
+	api->zc_live = 0;
 	init_queue(&api->pbuf_for_usys);
 	init_queue_node(&api->ready_queue);
 	api->active_usys_count = 0;
@@ -994,28 +1179,53 @@ lwip_tcp_event(struct eth_fg *cur_fg, void *arg, struct tcp_pcb *pcb,
    -- short version: need to fix this by using flow director for all outbound connections.  (EdB 2014-11-17)
 */
 
-static uint32_t compute_toeplitz_hash(const uint8_t *key, uint32_t src_addr, uint32_t dst_addr, uint16_t src_port, uint16_t dst_port)
+#define TOEPLITZ_INPUT_LEN	12
+
+/*
+ * Toeplitz hash contribution of every byte value at every offset of the
+ * IPv4/TCP hash input, so hashing costs one lookup per input byte.
+ */
+struct toeplitz_tbl {
+	bool ready;
+	uint32_t tbl[TOEPLITZ_INPUT_LEN][256];
+};
+
+static DEFINE_PERCPU(struct toeplitz_tbl, toeplitz_tbl);
+
+static void toeplitz_tbl_build(struct toeplitz_tbl *t, const uint8_t *key)
 {
-	int i, j;
-	uint8_t input[12];
-	uint32_t result = 0;
+	int i, j, b;
+	uint32_t bits[8];
 	uint32_t key_part = htonl(((uint32_t *)key)[0]);
 
-	memcpy(&input[0], &src_addr, 4);
-	memcpy(&input[4], &dst_addr, 4);
-	memcpy(&input[8], &src_port, 2);
-	memcpy(&input[10], &dst_port, 2);
-
-	for (i = 0; i < 12; i++) {
-		for (j = 128; j; j >>= 1) {
-			if (input[i] & j)
-				result ^= key_part;
+	for (i = 0; i < TOEPLITZ_INPUT_LEN; i++) {
+		/* key window used for each bit of byte i, MSB first */
+		for (j = 0; j < 8; j++) {
+			bits[j] = key_part;
 			key_part <<= 1;
-			if (key[i + 4] & j)
+			if (key[i + 4] & (128 >> j))
 				key_part |= 1;
 		}
+
+		for (b = 0; b < 256; b++) {
+			t->tbl[i][b] = 0;
+			for (j = 0; j < 8; j++)
+				if (b & (128 >> j))
+					t->tbl[i][b] ^= bits[j];
+		}
 	}
 
+	t->ready = true;
+}
+
+static inline uint32_t toeplitz_hash(struct toeplitz_tbl *t, const uint8_t *input, int len)
+{
+	int i;
+	uint32_t result = 0;
+
+	for (i = 0; i < len; i++)
+		result ^= t->tbl[i][input[i]];
+
 	return result;
 }
 
@@ -1062,8 +1272,11 @@ static struct eth_fg *get_port_with_fdir(struct ip_tuple *id)
 struct eth_fg *get_local_port_and_set_queue(struct ip_tuple *id)
 {
 	int ret;
-	uint32_t hash;
+	uint32_t hash, base, addr;
+	uint16_t port;
+	uint8_t input[10];
 	uint32_t fg_idx;
+	struct toeplitz_tbl *tbl;
 	struct eth_fg *fg;
 	struct ix_rte_eth_dev *dev;
 	struct ix_rte_eth_rss_conf rss_conf;
@@ -1082,14 +1295,32 @@ struct eth_fg *get_local_port_and_set_queue(struct ip_tuple *id)
 		return fg;
 
 	dev = percpu_get(eth_rxqs[0])->dev;
-	ret = dev->dev_ops->rss_hash_conf_get(dev, &rss_conf);
-	if (ret < 0)
-		return NULL;
+	tbl = &percpu_get(toeplitz_tbl);
+	if (unlikely(!tbl->ready)) {
+		ret = dev->dev_ops->rss_hash_conf_get(dev, &rss_conf);
+		if (ret < 0)
+			return NULL;
+		toeplitz_tbl_build(tbl, rss_conf.rss_key);
+	}
+
+	/*
+	 * RSS hashes the tuple of the replies, so our port comes last.
+	 * Hash everything else once; each candidate port then only costs
+	 * two lookups.
+	 */
+	addr = htonl(id->dst_ip);
+	memcpy(&input[0], &addr, 4);
+	addr = htonl(id->src_ip);
+	memcpy(&input[4], &addr, 4);
+	port = htons(id->dst_port);
+	memcpy(&input[8], &port, 2);
+	base = toeplitz_hash(tbl, input, 10);
 
 	while (1) {
 		if (percpu_get(local_port) >= (percpu_get(cpu_id) + 1) * PORTS_PER_CPU)
 			percpu_get(local_port) = percpu_get(cpu_id) * PORTS_PER_CPU + 1;
-		hash = compute_toeplitz_hash(rss_conf.rss_key, htonl(id->dst_ip), htonl(id->src_ip), htons(id->dst_port), htons(id->src_port));
+		hash = base ^ tbl->tbl[10][id->src_port >> 8] ^
+		       tbl->tbl[11][id->src_port & 0xff];
 		fg_idx = hash & (dev->data->nb_rx_fgs - 1);
 		if (percpu_get(eth_rxqs[0])->dev->data->rx_fgs[fg_idx].cur_cpu == percpu_get(cpu_id)) {
 			//set_current_queue(percpu_get(eth_rxqs)[0]);
@@ -1152,6 +1383,8 @@ void bsys_tcp_connect(struct ip_tuple __user *id, unsigned long cookie)
 	api->accepted = true;
 	api->sent_len = 0;
 	api->len_xmited = 0;
+	api->zc_inflight = 0;
+	api->zc_live = 0;
 	init_queue(&api->pbuf_for_usys);
 	init_queue_node(&api->ready_queue);
 	api->active_usys_count = 0;
@@ -1195,6 +1428,158 @@ pcb_fail:
 /* derived from ip_output_hinted; a mess because of conflicts between LWIP and IX */
 extern int arp_lookup_mac(struct ip_addr *addr, struct eth_addr *mac);
 
+static void __tcp_zc_done(void *_pkt)
+{
+	struct mbuf *pkt = (struct mbuf *) _pkt;
+	struct tcpapi_pcb *api = (struct tcpapi_pcb *) pkt->done_data;
+	struct eth_hdr *ethhdr = mbuf_mtod(pkt, struct eth_hdr *);
+	struct ip_hdr *iphdr = mbuf_nextd(ethhdr, struct ip_hdr *);
+	struct tcp_hdr *tcphdr = mbuf_nextd(iphdr, struct tcp_hdr *);
+	u32_t seq = ntoh32(tcphdr->seqno);
+
+	mbuf_free(pkt);
+
+	spin_lock(&percpu_get(pcb_ready_queue).lock);
+	tcp_zc_untrack(api, seq);
+	if (!api->zc_inflight && api->flags & PCB_FLAG_CLOSED) {
+		if (!api->active_usys_count)
+			mempool_free(&percpu_get(pcb_mempool), api);
+	} else if (!(api->flags & PCB_FLAG_CLOSED) && api->sent_len) {
+		/* the oldest packet may have completed, freeing ACKed bytes */
+		pcb_ready_enqueue(api);
+	}
+	spin_unlock(&percpu_get(pcb_ready_queue).lock);
+}
+
+/**
+ * tcp_zc_mbuf_done - called when the NIC no longer references a
+ * zero-copy TCP packet
+ * @pkt: the packet
+ *
+ * Drops the page references on the user buffers and lets the connection
+ * report the ACKed bytes of the packet as sent. The bookkeeping runs on
+ * the connection's home CPU, which may differ from the CPU that reclaimed
+ * the TX queue, so the packet (which holds the seqno) is freed there.
+ */
+static void tcp_zc_mbuf_done(struct mbuf *pkt)
+{
+	struct tcpapi_pcb *api = (struct tcpapi_pcb *) pkt->done_data;
+	int i, home, ret;
+
+	for (i = 0; i < pkt->nr_iov; i++)
+		mbuf_iov_free(&pkt->iovs[i]);
+
+	home = fgs[handle_to_fg_id(api->handle)]->cur_cpu;
+	if (home == percpu_get(cpu_id)) {
+		__tcp_zc_done(pkt);
+	} else {
+		ret = cpu_run_on_one(__tcp_zc_done, pkt, home);
+		assert(!ret);
+	}
+}
+
+/**
+ * tcp_zc_iov_count - determines if a TCP payload can be sent zero-copy
+ * @p: the first pbuf after the TCP header
+ *
+ * Only payloads that reference user memory in the zero-copy region
+ * (PBUF_ROM pbufs created by tcp_write()) qualify.
+ *
+ * Returns the number of IOVs needed, or 0 if the payload must be copied.
+ */
+static int tcp_zc_iov_count(struct pbuf *p)
+{
+	int nr = 0;
+
+	for (; p; p = p->next) {
+		if (p->type != PBUF_ROM ||
+		    !uaccess_zc_okay(p->payload, p->len))
+			return 0;
+
+		nr += PGOFF_2MB(p->payload) + p->len > PGSIZE_2MB ? 2 : 1;
+	}
+
+	return nr;
+}
+
+/**
+ * tcp_zc_attach - references a TCP payload as mbuf IOVs
+ * @pkt: the packet (IOVs are appended to pkt->iovs)
+ * @p: the first pbuf after the TCP header
+ *
+ * On failure, every IOV of the packet is released.
+ *
+ * Returns 0 if successful, otherwise fail.
+ */
+static int tcp_zc_attach(struct mbuf *pkt, struct pbuf *p)
+{
+	struct sg_entry ent;
+	void *vaddr, *addr;
+	size_t len, left;
+	int i;
+
+	for (; p; p = p->next) {
+		vaddr = p->payload;
+		left = p->len;
+
+		/*
+		 * User pages are not physically contiguous, so a
+		 * crossed page boundary needs a second lookup.
+		 */
+		while (left) {
+			addr = (void *) vm_lookup_phys(vaddr, PGSIZE_2MB);
+			if (unlikely(!addr))
+				goto fail;
+
+			ent.base = (void *)((uintptr_t) addr + PGOFF_2MB(vaddr));
+			ent.len = left;
+			len = mbuf_iov_create(&pkt->iovs[pkt->nr_iov++], &ent);
+			vaddr = (void *)((uintptr_t) vaddr + len);
+			left -= len;
+		}
+	}
+
+	return 0;
+
+fail:
+	for (i = 0; i < pkt->nr_iov; i++)
+		mbuf_iov_free(&pkt->iovs[i]);
+	pkt->nr_iov = 0;
+	return -EFAULT;
+}
+
+/**
+ * tcp_zc_iovs - gets the location of the IOV array of a TCP packet
+ * @pkt: the packet
+ * @hdr_len: the length of the headers (Ethernet, IP and TCP)
+ */
+static inline struct mbuf_iov *tcp_zc_iovs(struct mbuf *pkt, size_t hdr_len)
+{
+	return mbuf_mtod_off(pkt, struct mbuf_iov *,
+			     align_up(hdr_len, sizeof(uint64_t)));
+}
+
+static void tcp_output_ip_hdr(struct ip_hdr *iphdr, struct tcp_pcb *pcb,
+			      size_t l4len)
+{
+	/* setup IP hdr */
+	IPH_VHL_SET(iphdr, 4, sizeof(struct ip_hdr) / 4);
+	//iphdr->header_len = sizeof(struct ip_hdr) / 4;
+	//iphdr->version = 4;
+	iphdr->_len = hton16(sizeof(struct ip_hdr) + l4len);
+	iphdr->_id = 0;
+	iphdr->_offset = 0;
+	iphdr->_proto = IP_PROTO_TCP;
+	iphdr->_chksum = 0;
+	iphdr->_tos = pcb->tos;
+	/* the SYN-ACK of an ECN connection must not be ECN-capable */
+	if ((pcb->flags & TF_ECN) && pcb->state >= ESTABLISHED)
+		iphdr->_tos = (pcb->tos & ~IPH_ECN_MASK) | IPH_ECN_ECT0;
+	iphdr->_ttl = pcb->ttl;
+	iphdr->src.addr = pcb->local_ip.addr;
+	iphdr->dest.addr = pcb->remote_ip.addr;
+}
+
 int tcp_output_packet(struct eth_fg *cur_fg, struct tcp_pcb *pcb, struct pbuf *p)
 {
 	int ret;
@@ -1204,6 +1589,9 @@ int tcp_output_packet(struct eth_fg *cur_fg, struct tcp_pcb *pcb, struct pbuf *p
 	unsigned char *payload;
 	struct pbuf *curp;
 	struct ip_addr dst_addr;
+	struct tcpapi_pcb *api = pcb->callback_arg;
+	size_t len = p->tot_len;
+	int nr_iov = 0;
 
 	pkt = mbuf_alloc_local();
 	if (unlikely(!pkt))
@@ -1215,43 +1603,175 @@ int tcp_output_packet(struct eth_fg *cur_fg, struct tcp_pcb *pcb, struct pbuf *p
 
 	dst_addr.addr = ntoh32(pcb->remote_ip.addr);
 
-	/* setup IP hdr */
-	IPH_VHL_SET(iphdr, 4, sizeof(struct ip_hdr) / 4);
-	//iphdr->header_len = sizeof(struct ip_hdr) / 4;
-	//iphdr->version = 4;
-	iphdr->_len = hton16(sizeof(struct ip_hdr) + p->tot_len);
-	iphdr->_id = 0;
-	iphdr->_offset = 0;
-	iphdr->_proto = IP_PROTO_TCP;
-	iphdr->_chksum = 0;
-	iphdr->_tos = pcb->tos;
-	iphdr->_ttl = pcb->ttl;
-	iphdr->src.addr = pcb->local_ip.addr;
-	iphdr->dest.addr = pcb->remote_ip.addr;
+	tcp_output_ip_hdr(iphdr, pcb, p->tot_len);
+
+	/*
+	 * The first pbuf holds the TCP header (and any copied data). If the
+	 * rest of the chain references user memory, hand it to the NIC as
+	 * scatter-gather instead of copying it.
+	 */
+	BUILD_ASSERT(sizeof(struct eth_hdr) + sizeof(struct ip_hdr) +
+		     60 /* max TCP header */ + TCP_MSS +
+		     TCP_ZC_MAX_IOV * sizeof(struct mbuf_iov) <= MBUF_DATA_LEN);
+	if (api && ~api->zc_live && p->next &&
+	    p->tot_len - p->len >= TCP_ZC_MIN_LEN)
+		nr_iov = tcp_zc_iov_count(p->next);
+
+	if (nr_iov && nr_iov <= TCP_ZC_MAX_IOV) {
+		memcpy(payload, p->payload, p->len);
+		pkt->iovs = tcp_zc_iovs(pkt, sizeof(struct eth_hdr) +
+					sizeof(struct ip_hdr) + p->len);
+		pkt->nr_iov = 0;
+		if (!tcp_zc_attach(pkt, p->next)) {
+			len = p->len;
+			pkt->done = &tcp_zc_mbuf_done;
+			pkt->done_data = (unsigned long) api;
+			tcp_zc_track(api, ntoh32(((struct tcp_hdr *)
+						  p->payload)->seqno));
+			goto send;
+		}
+	}
 
 	for (curp = p; curp; curp = curp->next) {
 		memcpy(payload, curp->payload, curp->len);
 		payload += curp->len;
 	}
 
+send:
 	/* Offload IP and TCP tx checksums */
 	pkt->ol_flags = PKT_TX_IP_CKSUM;
 	pkt->ol_flags |= PKT_TX_TCP_CKSUM;
 
 	ret = ip_send_one(cur_fg, &dst_addr, pkt, sizeof(struct eth_hdr) +
-			  sizeof(struct ip_hdr) + p->tot_len);
+			  sizeof(struct ip_hdr) + len);
 	if (unlikely(ret)) {
-		mbuf_free(pkt);
+		mbuf_xmit_done(pkt);
 		return -EIO;
 	}
 
 	return 0;
 }
 
+/**
+ * tcp_output_packet_tso - sends consecutive TCP segments as one TSO packet
+ * @cur_fg: the current flow group
+ * @pcb: the LWIP pcb
+ * @segs: the pbuf chain of each segment, starting with its TCP header
+ * @nr: the number of segments
+ * @mss: the payload length of every segment but the last
+ *
+ * The header of the first segment is used for the whole packet and the
+ * payloads are attached zero-copy; the NIC then cuts the packet back into
+ * @nr segments. If the TX queue has no TSO support or a payload cannot be
+ * sent zero-copy, the segments are sent one by one instead.
+ *
+ * Returns 0 if successful, otherwise fail.
+ */
+int tcp_output_packet_tso(struct eth_fg *cur_fg, struct tcp_pcb *pcb,
+			  struct pbuf **segs, int nr, u16_t mss)
+{
+	struct eth_tx_queue *txq = percpu_get(eth_txqs)[cur_fg->dev_idx];
+	struct tcpapi_pcb *api = pcb->callback_arg;
+	struct mbuf *pkt;
+	struct eth_hdr *ethhdr;
+	struct ip_hdr *iphdr;
+	struct tcp_hdr *tcphdr, *last;
+	struct ip_addr dst_addr;
+	size_t hdr_len = segs[0]->len, len = 0;
+	int i, n, ret, nr_iov = 0;
+
+	if (!api || !~api->zc_live ||
+	    !(txq->tx_offload_capa & DEV_TX_OFFLOAD_TCP_TSO))
+		goto segment;
+
+	for (i = 0; i < nr; i++) {
+		if (segs[i]->len != hdr_len || !segs[i]->next)
+			goto segment;
+
+		n = tcp_zc_iov_count(segs[i]->next);
+		if (!n)
+			goto segment;
+
+		nr_iov += n;
+		len += segs[i]->tot_len - hdr_len;
+	}
+
+	if (nr_iov > TCP_TSO_MAX_IOV)
+		goto segment;
+
+	pkt = mbuf_alloc_local();
+	if (unlikely(!pkt))
+		return -ENOMEM;
+
+	ethhdr = mbuf_mtod(pkt, struct eth_hdr *);
+	iphdr = mbuf_nextd(ethhdr, struct ip_hdr *);
+	tcphdr = mbuf_nextd(iphdr, struct tcp_hdr *);
+
+	dst_addr.addr = ntoh32(pcb->remote_ip.addr);
+	tcp_output_ip_hdr(iphdr, pcb, hdr_len + len);
+
+	/*
+	 * The NIC clears PSH and FIN on all but the final segment, so take
+	 * them from the last merged segment. The checksum is seeded without
+	 * the length, which differs per generated segment.
+	 */
+	memcpy(tcphdr, segs[0]->payload, hdr_len);
+	last = (struct tcp_hdr *) segs[nr - 1]->payload;
+	TCPH_SET_FLAG(tcphdr, TCPH_FLAGS(last) & (TCP_PSH | TCP_FIN));
+	tcphdr->chksum = inet_chksum_pseudo_tso(IP_PROTO_TCP, &pcb->local_ip,
+						&pcb->remote_ip);
+
+	BUILD_ASSERT(sizeof(struct eth_hdr) + sizeof(struct ip_hdr) +
+		     60 /* max TCP header */ +
+		     TCP_TSO_MAX_IOV * sizeof(struct mbuf_iov) <= MBUF_DATA_LEN);
+	pkt->iovs = tcp_zc_iovs(pkt, sizeof(struct eth_hdr) +
+				sizeof(struct ip_hdr) + hdr_len);
+	pkt->nr_iov = 0;
+	for (i = 0; i < nr; i++) {
+		if (tcp_zc_attach(pkt, segs[i]->next)) {
+			mbuf_free(pkt);
+			goto segment;
+		}
+	}
+
+	pkt->ol_flags = PKT_TX_IP_CKSUM | PKT_TX_TCP_CKSUM | PKT_TX_TCP_SEG;
+	pkt->tso_mss = mss;
+	pkt->tso_l4_len = hdr_len;
+	pkt->done = &tcp_zc_mbuf_done;
+	pkt->done_data = (unsigned long) api;
+	tcp_zc_track(api, ntoh32(tcphdr->seqno));
+
+	ret = ip_send_one(cur_fg, &dst_addr, pkt, sizeof(struct eth_hdr) +
+			  sizeof(struct ip_hdr) + hdr_len);
+	if (unlikely(ret)) {
+		mbuf_xmit_done(pkt);
+		return -EIO;
+	}
+
+	return 0;
+
+segment:
+	/* software fallback: the segments already have complete headers */
+	for (i = 0; i < nr; i++) {
+		ret = tcp_output_packet(cur_fg, pcb, segs[i]);
+		if (unlikely(ret))
+			return ret;
+	}
+
+	return 0;
+}
 
 int tcp_api_init(void)
 {
 	int ret;
+	ret = tcp_syncookie_init();
+	if (ret)
+		return ret;
+
+#if CONFIG_RUN_TCP_STACK_IPI
+	ipi_fpu_init();
+#endif
+
 	ret = mempool_create_datastore(&pcb_datastore, MAX_PCBS,
 				       sizeof(struct tcpapi_pcb), 0, MEMPOOL_DEFAULT_CHUNKSIZE, "pcb");
 	if (ret)
@@ -1288,6 +1808,12 @@ int tcp_api_init_cpu(void)
 			ret = tcp_listen_with_backlog(&percpu_get(listen_ports[i]), TCP_DEFAULT_LISTEN_BACKLOG, IP_ADDR_ANY, CFG.ports[i]);
 			if (ret)
 				return ret;
+			/* validated by cfg, connections accepted on the port inherit it */
+			if (CFG.port_cc[i][0])
+				percpu_get(listen_ports[i]).cc = tcp_cc_find(CFG.port_cc[i]);
+			percpu_get(listen_ports[i]).ack_policy = CFG.port_ack_policy[i];
+			if (CFG.port_ack_delay[i])
+				percpu_get(listen_ports[i]).ack_delay = CFG.port_ack_delay[i];
 		}
 	}
 
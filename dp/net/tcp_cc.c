@@ -0,0 +1,174 @@
+/*
+ * Copyright 2013-16 Board of Trustees of Stanford University
+ * Copyright 2013-16 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * tcp_cc.c - pluggable TCP congestion control
+ *
+ * Every tcp_pcb points at the congestion control algorithm it uses. The
+ * stack calls into it when new data is acknowledged and when it needs a
+ * slow start threshold after a loss; everything else (fast recovery,
+ * retransmission timeouts) stays in the generic code.
+ *
+ * Two algorithms are provided:
+ *  - reno, lwIP's original slow start and congestion avoidance;
+ *  - dctcp (RFC 8257), which negotiates ECN and reduces the window in
+ *    proportion to the fraction of bytes that the fabric marked with CE,
+ *    instead of halving it on every congestion signal.
+ */
+
+#include <string.h>
+
+#include <ix/stddef.h>
+
+#include <lwip/tcp.h>
+#include <lwip/tcp_impl.h>
+
+/* alpha is a fraction of 1 << DCTCP_ALPHA_SHIFT */
+#define DCTCP_ALPHA_SHIFT	10
+/* the estimation gain g is 1 / (1 << DCTCP_G_SHIFT) */
+#define DCTCP_G_SHIFT		4
+
+static void tcp_cc_reno_acked(struct tcp_pcb *pcb, u32_t acked, u8_t ece)
+{
+	tcpwnd_size_t new_cwnd;
+
+	if (pcb->cwnd < pcb->ssthresh) {
+		if ((tcpwnd_size_t)(pcb->cwnd + pcb->mss) > pcb->cwnd)
+			pcb->cwnd += pcb->mss;
+		LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_receive: slow start cwnd %"TCPWNDSIZE_F"\n", pcb->cwnd));
+	} else {
+		new_cwnd = (pcb->cwnd + pcb->mss * pcb->mss / pcb->cwnd);
+		if (new_cwnd > pcb->cwnd)
+			pcb->cwnd = new_cwnd;
+		LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_receive: congestion avoidance cwnd %"TCPWNDSIZE_F"\n", pcb->cwnd));
+	}
+}
+
+/* half of the minimum of the current cwnd and the advertised window,
+   but at least 2 MSS */
+static tcpwnd_size_t tcp_cc_reno_ssthresh(struct tcp_pcb *pcb)
+{
+	tcpwnd_size_t ssthresh = LWIP_MIN(pcb->cwnd, pcb->snd_wnd) / 2;
+
+	if (ssthresh < 2U * pcb->mss)
+		ssthresh = 2U * pcb->mss;
+
+	return ssthresh;
+}
+
+const struct tcp_cc_ops tcp_cc_reno = {
+	.name		= "reno",
+	.ecn		= 0,
+	.acked		= tcp_cc_reno_acked,
+	.ssthresh	= tcp_cc_reno_ssthresh,
+};
+
+static void tcp_cc_dctcp_init(struct tcp_pcb *pcb)
+{
+	/* start conservatively, as if every byte had been marked */
+	pcb->dctcp_alpha = 1 << DCTCP_ALPHA_SHIFT;
+	pcb->dctcp_wnd_end = pcb->snd_nxt;
+	pcb->dctcp_acked = 0;
+	pcb->dctcp_ce_acked = 0;
+	pcb->flags &= ~TF_CC_CWR;
+}
+
+static void tcp_cc_dctcp_update_alpha(struct tcp_pcb *pcb)
+{
+	u32_t f = 0;
+
+	/* alpha = (1 - g) * alpha + g * F, F being the fraction of bytes
+	   acknowledged with ECE over the last window */
+	if (pcb->dctcp_acked)
+		f = (u32_t)(((uint64_t)pcb->dctcp_ce_acked << DCTCP_ALPHA_SHIFT) /
+			    pcb->dctcp_acked);
+	pcb->dctcp_alpha = pcb->dctcp_alpha -
+			   (pcb->dctcp_alpha >> DCTCP_G_SHIFT) +
+			   (f >> DCTCP_G_SHIFT);
+
+	pcb->dctcp_wnd_end = pcb->snd_nxt;
+	pcb->dctcp_acked = 0;
+	pcb->dctcp_ce_acked = 0;
+	pcb->flags &= ~TF_CC_CWR;
+}
+
+static void tcp_cc_dctcp_acked(struct tcp_pcb *pcb, u32_t acked, u8_t ece)
+{
+	tcpwnd_size_t reduction;
+
+	pcb->dctcp_acked += acked;
+	if (ece)
+		pcb->dctcp_ce_acked += acked;
+
+	if (TCP_SEQ_GEQ(pcb->lastack, pcb->dctcp_wnd_end))
+		tcp_cc_dctcp_update_alpha(pcb);
+
+	/* react to congestion at most once per window of data:
+	   cwnd = cwnd * (1 - alpha / 2) */
+	if (ece && !(pcb->flags & TF_CC_CWR)) {
+		reduction = (tcpwnd_size_t)(((uint64_t)pcb->cwnd * pcb->dctcp_alpha) >>
+					    (DCTCP_ALPHA_SHIFT + 1));
+		pcb->cwnd -= reduction;
+		if (pcb->cwnd < 2U * pcb->mss)
+			pcb->cwnd = 2U * pcb->mss;
+		pcb->ssthresh = pcb->cwnd;
+		pcb->flags |= TF_CC_CWR;
+		LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_receive: dctcp alpha %"U16_F" cwnd %"TCPWNDSIZE_F"\n",
+					     pcb->dctcp_alpha, pcb->cwnd));
+		return;
+	}
+
+	tcp_cc_reno_acked(pcb, acked, ece);
+}
+
+const struct tcp_cc_ops tcp_cc_dctcp = {
+	.name		= "dctcp",
+	.ecn		= 1,
+	.init		= tcp_cc_dctcp_init,
+	.acked		= tcp_cc_dctcp_acked,
+	.ssthresh	= tcp_cc_reno_ssthresh,
+};
+
+static const struct tcp_cc_ops *tcp_cc_algos[] = {
+	&tcp_cc_reno,
+	&tcp_cc_dctcp,
+};
+
+/**
+ * tcp_cc_find - looks up a congestion control algorithm by name
+ * @name: the name (e.g. "reno" or "dctcp")
+ *
+ * Returns the algorithm, or NULL if there is none with that name.
+ */
+const struct tcp_cc_ops *tcp_cc_find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(tcp_cc_algos); i++) {
+		if (!strcmp(tcp_cc_algos[i]->name, name))
+			return tcp_cc_algos[i];
+	}
+
+	return NULL;
+}
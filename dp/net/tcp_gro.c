@@ -0,0 +1,229 @@
+/*
+ * Copyright 2013-16 Board of Trustees of Stanford University
+ * Copyright 2013-16 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * tcp_gro.c - receive coalescing of in-order TCP segments
+ *
+ * Segments that arrive back to back for the same connection are chained
+ * into a single pbuf before they reach lwIP, so a large request costs one
+ * pass through tcp_input() and one ACK decision instead of one per MSS.
+ * Held segments never outlive the RX batch that delivered them: the table
+ * is flushed at the end of every eth_process_recv() call.
+ */
+
+#include <ix/stddef.h>
+#include <ix/cpu.h>
+#include <ix/ethfg.h>
+#include <ix/mbuf.h>
+
+#include <lwip/pbuf.h>
+#include <lwip/tcp_impl.h>
+
+#define TCP_GRO_MAX_FLOWS	8
+#define TCP_GRO_MAX_SEGS	16
+
+struct tcp_gro_flow {
+	struct eth_fg *fg;
+	struct ip_hdr *iphdr;
+	struct tcp_hdr *tcphdr;
+	struct pbuf *head;
+	uint32_t next_seq;
+	int nr_segs;
+};
+
+struct tcp_gro_table {
+	int nr_flows;
+	struct tcp_gro_flow flows[TCP_GRO_MAX_FLOWS];
+};
+
+static DEFINE_PERCPU(struct tcp_gro_table, tcp_gro_table);
+
+void tcp_input(struct eth_fg *cur_fg, struct pbuf *p, ip_addr_t *src, ip_addr_t *dest);
+void tcp_input_tmp(struct eth_fg *cur_fg, struct mbuf *pkt, struct ip_hdr *iphdr, void *tcphdr);
+
+static void tcp_gro_deliver(struct tcp_gro_flow *flow)
+{
+	if (flow->nr_segs > 1)
+		flow->head->flags |= PBUF_FLAG_GRO;
+	if (IPH_ECN(flow->iphdr) == IPH_ECN_CE)
+		flow->head->flags |= PBUF_FLAG_CE;
+
+	eth_fg_set_current(flow->fg);
+	tcp_input(flow->fg, flow->head, (ip_addr_t *) &flow->iphdr->src,
+		  (ip_addr_t *) &flow->iphdr->dest);
+	unset_current_fg();
+}
+
+static void tcp_gro_remove(struct tcp_gro_table *tbl, struct tcp_gro_flow *flow)
+{
+	tcp_gro_deliver(flow);
+	*flow = tbl->flows[--tbl->nr_flows];
+}
+
+/**
+ * tcp_gro_flush - passes all held segment chains to the TCP stack
+ */
+void tcp_gro_flush(void)
+{
+	struct tcp_gro_table *tbl = &percpu_get(tcp_gro_table);
+	int i;
+
+	for (i = 0; i < tbl->nr_flows; i++)
+		tcp_gro_deliver(&tbl->flows[i]);
+
+	tbl->nr_flows = 0;
+}
+
+static struct tcp_gro_flow *
+tcp_gro_lookup(struct tcp_gro_table *tbl, struct eth_fg *cur_fg,
+	       struct ip_hdr *iphdr, struct tcp_hdr *tcphdr)
+{
+	struct tcp_gro_flow *flow;
+	int i;
+
+	for (i = 0; i < tbl->nr_flows; i++) {
+		flow = &tbl->flows[i];
+		if (flow->fg == cur_fg &&
+		    flow->tcphdr->src == tcphdr->src &&
+		    flow->tcphdr->dest == tcphdr->dest &&
+		    flow->iphdr->src.addr == iphdr->src.addr &&
+		    flow->iphdr->dest.addr == iphdr->dest.addr)
+			return flow;
+	}
+
+	return NULL;
+}
+
+static bool tcp_gro_can_merge(struct tcp_gro_flow *flow, struct ip_hdr *iphdr,
+			      struct tcp_hdr *tcphdr, int hdrlen, int len)
+{
+	if (flow->nr_segs >= TCP_GRO_MAX_SEGS)
+		return false;
+	if (flow->head->tot_len + len > 0xffff)
+		return false;
+	if (ntohl(tcphdr->seqno) != flow->next_seq)
+		return false;
+	if (tcphdr->ackno != flow->tcphdr->ackno)
+		return false;
+	if (IPH_TOS(iphdr) != IPH_TOS(flow->iphdr))
+		return false;
+	if (TCPH_HDRLEN(tcphdr) != TCPH_HDRLEN(flow->tcphdr))
+		return false;
+	/* ECE/CWR are not covered by TCPH_FLAGS() */
+	if ((tcphdr->_hdrlen_rsvd_flags ^ flow->tcphdr->_hdrlen_rsvd_flags) &
+	    PP_HTONS(TCP_ECE | TCP_CWR))
+		return false;
+
+	/* options (e.g. timestamps) must match exactly */
+	return !memcmp(tcphdr + 1, flow->tcphdr + 1,
+		       hdrlen - sizeof(struct tcp_hdr));
+}
+
+/**
+ * tcp_gro_input - receives a TCP segment, coalescing it when possible
+ * @cur_fg: the flow group of the segment
+ * @pkt: the mbuf containing the segment
+ * @iphdr: the IP header
+ * @tcphdr: the TCP header
+ *
+ * Plain ACK (or ACK+PSH) segments carrying data are held back and chained
+ * to earlier segments of the same connection when they are in sequence.
+ * Anything else first flushes the connection's chain, so the TCP stack
+ * still sees the segments of a connection in arrival order.
+ */
+void tcp_gro_input(struct eth_fg *cur_fg, struct mbuf *pkt,
+		   struct ip_hdr *iphdr, void *tcphdr)
+{
+	struct tcp_gro_table *tbl = &percpu_get(tcp_gro_table);
+	struct tcp_hdr *hdr = tcphdr;
+	struct tcp_gro_flow *flow;
+	struct pbuf *p;
+	int tcplen, hdrlen, len;
+	u8_t flags;
+
+	tcplen = ntohs(IPH_LEN(iphdr)) - IPH_HL(iphdr) * 4;
+	if (unlikely(tcplen < (int) sizeof(struct tcp_hdr)))
+		goto out;
+
+	hdrlen = TCPH_HDRLEN(hdr) * 4;
+	len = tcplen - hdrlen;
+	flags = TCPH_FLAGS(hdr);
+	flow = tcp_gro_lookup(tbl, cur_fg, iphdr, hdr);
+
+	if (hdrlen < (int) sizeof(struct tcp_hdr) || len <= 0 ||
+	    (flags & ~(TCP_ACK | TCP_PSH)) || !(flags & TCP_ACK)) {
+		if (flow)
+			tcp_gro_remove(tbl, flow);
+		goto out;
+	}
+
+	if (flow && tcp_gro_can_merge(flow, iphdr, hdr, hdrlen, len)) {
+		p = pbuf_alloc(PBUF_RAW, len, PBUF_ROM);
+		if (unlikely(!p)) {
+			mbuf_free(pkt);
+			return;
+		}
+		p->payload = (char *) hdr + hdrlen;
+		p->mbuf = pkt;
+		pbuf_cat(flow->head, p);
+
+		/* the latest window and PSH apply to the whole chain */
+		flow->tcphdr->wnd = hdr->wnd;
+		flow->next_seq += len;
+		flow->nr_segs++;
+		if (flags & TCP_PSH) {
+			TCPH_SET_FLAG(flow->tcphdr, TCP_PSH);
+			tcp_gro_remove(tbl, flow);
+		}
+		return;
+	}
+
+	if (flow)
+		tcp_gro_remove(tbl, flow);
+
+	if (flags & TCP_PSH)
+		goto out;
+
+	if (tbl->nr_flows == TCP_GRO_MAX_FLOWS)
+		tcp_gro_remove(tbl, &tbl->flows[0]);
+
+	p = pbuf_alloc(PBUF_RAW, tcplen, PBUF_ROM);
+	if (unlikely(!p)) {
+		mbuf_free(pkt);
+		return;
+	}
+	p->payload = hdr;
+	p->mbuf = pkt;
+
+	flow = &tbl->flows[tbl->nr_flows++];
+	flow->fg = cur_fg;
+	flow->iphdr = iphdr;
+	flow->tcphdr = hdr;
+	flow->head = p;
+	flow->next_seq = ntohl(hdr->seqno) + len;
+	flow->nr_segs = 1;
+	return;
+
+out:
+	tcp_input_tmp(cur_fg, pkt, iphdr, tcphdr);
+}
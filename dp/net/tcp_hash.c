@@ -0,0 +1,342 @@
+/*
+ * Copyright 2013-16 Board of Trustees of Stanford University
+ * Copyright 2013-16 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * tcp_hash.c - per-flow-group table of active TCP connections
+ *
+ * Each bucket is one cache line holding six (tag, pcb) slots. The tag is
+ * the upper half of the connection hash, so a lookup compares the tags
+ * of a bucket with a single SSE2 instruction and dereferences a tcp_pcb
+ * only on a tag hit; the pcb is needed right after the lookup anyway.
+ * Full buckets spill into the following ones (linear probing). Every
+ * bucket counts the entries that probed past it, which bounds lookups
+ * without tombstones.
+ */
+
+#include <string.h>
+#include <emmintrin.h>
+
+#include <ix/stddef.h>
+#include <ix/errno.h>
+#include <ix/log.h>
+#include <ix/mem.h>
+#include <ix/ethfg.h>
+
+#include <lwip/tcp.h>
+#include <lwip/tcp_impl.h>
+
+/* old buckets moved to the new table per insert or remove */
+#define TCP_ACTIVE_TBL_MIGRATE	4
+
+static inline uint16_t tcp_active_tag(u32_t hash)
+{
+	return (hash >> 16) | 1;
+}
+
+static inline unsigned int tcp_active_match_tags(struct tcp_active_bucket *b,
+						 uint16_t tag)
+{
+	__m128i tags = _mm_load_si128((__m128i *) b->tags);
+	__m128i cmp = _mm_cmpeq_epi16(tags, _mm_set1_epi16(tag));
+
+	/* two mask bits per slot, only the first TCP_ACTIVE_TBL_SLOTS */
+	return _mm_movemask_epi8(cmp) & ((1 << (TCP_ACTIVE_TBL_SLOTS * 2)) - 1);
+}
+
+/* small tables take 4KB pages, larger ones huge pages */
+static inline int tcp_active_pgsize(uint32_t nr_buckets)
+{
+	return nr_buckets * sizeof(struct tcp_active_bucket) >= PGSIZE_2MB ?
+	       PGSIZE_2MB : PGSIZE_4KB;
+}
+
+static inline int tcp_active_nr_pages(uint32_t nr_buckets)
+{
+	return div_up(nr_buckets * sizeof(struct tcp_active_bucket),
+		      tcp_active_pgsize(nr_buckets));
+}
+
+/*
+ * Tables are taken from fresh (zeroed) pages on the NUMA node of the
+ * calling CPU, which is the one that serves the flow group.
+ */
+static struct tcp_active_bucket *tcp_active_alloc(uint32_t nr_buckets)
+{
+	void *buckets;
+
+	buckets = mem_alloc_pages(tcp_active_nr_pages(nr_buckets),
+				  tcp_active_pgsize(nr_buckets), NULL,
+				  MPOL_PREFERRED);
+	if (buckets == MAP_FAILED)
+		return NULL;
+
+	return buckets;
+}
+
+static void tcp_active_free(struct tcp_active_bucket *buckets,
+			    uint32_t nr_buckets)
+{
+	if (buckets)
+		mem_free_pages(buckets, tcp_active_nr_pages(nr_buckets),
+			       tcp_active_pgsize(nr_buckets));
+}
+
+/**
+ * tcp_active_tbl_init - allocates the initial connection table
+ * @tbl: the table
+ *
+ * Returns 0 if successful, otherwise -ENOMEM.
+ */
+int tcp_active_tbl_init(struct tcp_active_tbl *tbl)
+{
+	if (tbl->buckets)
+		return 0;
+
+	tbl->buckets = tcp_active_alloc(TCP_ACTIVE_TBL_MIN_BUCKETS);
+	if (!tbl->buckets)
+		return -ENOMEM;
+
+	tbl->mask = TCP_ACTIVE_TBL_MIN_BUCKETS - 1;
+	return 0;
+}
+
+/**
+ * tcp_active_tbl_free - releases the memory of a connection table
+ * @tbl: the table
+ */
+void tcp_active_tbl_free(struct tcp_active_tbl *tbl)
+{
+	tcp_active_free(tbl->buckets, tbl->mask + 1);
+	tcp_active_free(tbl->old_buckets, tbl->old_mask + 1);
+	memset(tbl, 0, sizeof(*tbl));
+}
+
+static struct tcp_pcb *
+tcp_active_find(struct tcp_active_bucket *buckets, uint32_t mask, u32_t hash,
+		ipX_addr_t *local_ip, ipX_addr_t *remote_ip,
+		u16_t local_port, u16_t remote_port)
+{
+	uint16_t tag = tcp_active_tag(hash);
+	struct tcp_active_bucket *b;
+	struct tcp_pcb *pcb;
+	unsigned int hits, slot;
+	uint32_t i = hash;
+
+	do {
+		b = &buckets[i++ & mask];
+		hits = tcp_active_match_tags(b, tag);
+		while (hits) {
+			slot = __builtin_ctz(hits) / 2;
+			hits &= ~(3 << (slot * 2));
+			pcb = b->pcbs[slot];
+			if (pcb->remote_port == remote_port &&
+			    pcb->local_port == local_port &&
+			    ip_addr_cmp(&pcb->remote_ip, remote_ip) &&
+			    ip_addr_cmp(&pcb->local_ip, local_ip))
+				return pcb;
+		}
+	} while (b->overflow);
+
+	return NULL;
+}
+
+/**
+ * tcp_active_lookup - finds the active connection of a 4-tuple
+ * @cur_fg: the flow group
+ * @hash: tcp_conn_hash() of the 4-tuple
+ * @local_ip: the local address
+ * @remote_ip: the remote address
+ * @local_port: the local port (host order)
+ * @remote_port: the remote port (host order)
+ *
+ * Returns the tcp_pcb, or NULL if there is no such connection.
+ */
+struct tcp_pcb *tcp_active_lookup(struct eth_fg *cur_fg, u32_t hash,
+				  ipX_addr_t *local_ip, ipX_addr_t *remote_ip,
+				  u16_t local_port, u16_t remote_port)
+{
+	struct tcp_active_tbl *tbl = &cur_fg->active_tbl;
+	struct tcp_pcb *pcb;
+
+	pcb = tcp_active_find(tbl->buckets, tbl->mask, hash, local_ip,
+			      remote_ip, local_port, remote_port);
+	if (!pcb && unlikely(tbl->old_buckets))
+		pcb = tcp_active_find(tbl->old_buckets, tbl->old_mask, hash,
+				      local_ip, remote_ip, local_port,
+				      remote_port);
+
+	return pcb;
+}
+
+static inline u32_t tcp_pcb_hash(struct tcp_pcb *pcb)
+{
+	return tcp_conn_hash(&pcb->local_ip, &pcb->remote_ip,
+			     pcb->local_port, pcb->remote_port);
+}
+
+static void tcp_active_put(struct tcp_active_bucket *buckets, uint32_t mask,
+			   struct tcp_pcb *pcb, u32_t hash)
+{
+	struct tcp_active_bucket *b;
+	uint32_t i = hash;
+	int slot;
+
+	while (1) {
+		b = &buckets[i++ & mask];
+		for (slot = 0; slot < TCP_ACTIVE_TBL_SLOTS; slot++) {
+			if (!b->tags[slot]) {
+				b->tags[slot] = tcp_active_tag(hash);
+				b->pcbs[slot] = pcb;
+				return;
+			}
+		}
+		b->overflow++;
+	}
+}
+
+static bool tcp_active_del(struct tcp_active_bucket *buckets, uint32_t mask,
+			   struct tcp_pcb *pcb, u32_t hash)
+{
+	uint16_t tag = tcp_active_tag(hash);
+	struct tcp_active_bucket *b;
+	uint32_t i = hash, j;
+	int slot;
+
+	do {
+		b = &buckets[i & mask];
+		for (slot = 0; slot < TCP_ACTIVE_TBL_SLOTS; slot++) {
+			if (b->tags[slot] != tag || b->pcbs[slot] != pcb)
+				continue;
+
+			b->tags[slot] = 0;
+			b->pcbs[slot] = NULL;
+			for (j = hash; j != i; j++)
+				buckets[j & mask].overflow--;
+			return true;
+		}
+		i++;
+	} while (b->overflow);
+
+	return false;
+}
+
+static void tcp_active_migrate(struct tcp_active_tbl *tbl, int nr)
+{
+	struct tcp_active_bucket *b;
+	struct tcp_pcb *pcb;
+	int slot;
+
+	while (nr-- && tbl->old_pos <= tbl->old_mask) {
+		b = &tbl->old_buckets[tbl->old_pos++];
+		for (slot = 0; slot < TCP_ACTIVE_TBL_SLOTS; slot++) {
+			pcb = b->pcbs[slot];
+			if (!pcb)
+				continue;
+			tcp_active_del(tbl->old_buckets, tbl->old_mask, pcb,
+				       tcp_pcb_hash(pcb));
+			tcp_active_put(tbl->buckets, tbl->mask, pcb,
+				       tcp_pcb_hash(pcb));
+		}
+	}
+
+	if (tbl->old_pos > tbl->old_mask) {
+		tcp_active_free(tbl->old_buckets, tbl->old_mask + 1);
+		tbl->old_buckets = NULL;
+	}
+}
+
+static int tcp_active_grow(struct tcp_active_tbl *tbl)
+{
+	struct tcp_active_bucket *buckets;
+
+	/* finish a previous resize first */
+	if (tbl->old_buckets)
+		tcp_active_migrate(tbl, tbl->old_mask + 1);
+
+	buckets = tcp_active_alloc((tbl->mask + 1) * 2);
+	if (!buckets)
+		return -ENOMEM;
+
+	tbl->old_buckets = tbl->buckets;
+	tbl->old_mask = tbl->mask;
+	tbl->old_pos = 0;
+	tbl->buckets = buckets;
+	tbl->mask = tbl->mask * 2 + 1;
+	return 0;
+}
+
+/**
+ * tcp_active_insert - adds a pcb to the active table of its flow group
+ * @cur_fg: the flow group
+ * @pcb: the pcb
+ * @hash: tcp_conn_hash() of the pcb's 4-tuple
+ *
+ * If the table can't grow, it keeps taking connections until it is 7/8
+ * full, after which new connections are refused.
+ *
+ * Returns 0 if successful, otherwise -ENOMEM.
+ */
+int tcp_active_insert(struct eth_fg *cur_fg, struct tcp_pcb *pcb, u32_t hash)
+{
+	struct tcp_active_tbl *tbl = &cur_fg->active_tbl;
+	uint32_t nr_slots;
+
+	if (unlikely(tbl->old_buckets))
+		tcp_active_migrate(tbl, TCP_ACTIVE_TBL_MIGRATE);
+
+	nr_slots = (tbl->mask + 1) * TCP_ACTIVE_TBL_SLOTS;
+	if (tbl->count >= nr_slots * 3 / 4 && tcp_active_grow(tbl)) {
+		log_err("tcp: failed to grow connection table of flow group %d\n",
+			cur_fg->fg_id);
+		if (tbl->count >= nr_slots * 7 / 8)
+			return -ENOMEM;
+	}
+
+	tcp_active_put(tbl->buckets, tbl->mask, pcb, hash);
+	tbl->count++;
+	pcb->hashed = 1;
+	return 0;
+}
+
+/**
+ * tcp_active_remove - removes a pcb from the active table of its flow group
+ * @cur_fg: the flow group
+ * @pcb: the pcb
+ */
+void tcp_active_remove(struct eth_fg *cur_fg, struct tcp_pcb *pcb)
+{
+	struct tcp_active_tbl *tbl = &cur_fg->active_tbl;
+	u32_t hash = tcp_pcb_hash(pcb);
+	bool found;
+
+	found = tcp_active_del(tbl->buckets, tbl->mask, pcb, hash);
+	if (!found && tbl->old_buckets)
+		found = tcp_active_del(tbl->old_buckets, tbl->old_mask, pcb, hash);
+	assert(found);
+
+	tbl->count--;
+	pcb->hashed = 0;
+
+	if (unlikely(tbl->old_buckets))
+		tcp_active_migrate(tbl, TCP_ACTIVE_TBL_MIGRATE);
+}
@@ -98,8 +98,11 @@ struct LWIP_Context {
 	u32_t seqno;
 	u32_t ackno;
 	u8_t flags;
+	u8_t ecn_flags;
 	u16_t tcplen;
 	u8_t recv_flags;
+	u8_t coalesced;
+	u8_t ce;
 	struct pbuf *recv_data;
 	struct eth_fg *cur_fg;
 };
@@ -113,36 +116,14 @@ static err_t tcp_process(struct LWIP_Context *,struct tcp_pcb *pcb,ipX_addr_t *c
 static void tcp_receive(struct LWIP_Context *,struct tcp_pcb *pcb);
 static void tcp_parseopt(struct LWIP_Context *,struct tcp_pcb *pcb);
 
-static err_t tcp_listen_input(struct LWIP_Context *,struct tcp_pcb_listen *pcb, int idx,ipX_addr_t *cur_src_addr,ipX_addr_t *cur_dest_addr);
-static err_t tcp_timewait_input(struct LWIP_Context *,struct tcp_pcb *pcb,ipX_addr_t *cur_src_addr,ipX_addr_t *cur_dest_addr);
+static err_t tcp_listen_input(struct LWIP_Context *,struct tcp_pcb_listen *pcb, u32_t hash,ipX_addr_t *cur_src_addr,ipX_addr_t *cur_dest_addr);
+static err_t tcp_syncookie_accept(struct LWIP_Context *,struct tcp_pcb_listen *lpcb, u32_t hash,ipX_addr_t *cur_src_addr,ipX_addr_t *cur_dest_addr,struct tcp_pcb **pcb);
+static err_t tcp_timewait_input(struct LWIP_Context *,struct tcp_tw *tw,ipX_addr_t *cur_src_addr,ipX_addr_t *cur_dest_addr);
+static void tcp_ecn_input(struct LWIP_Context *lwip_ctxt, struct tcp_pcb *pcb);
 
 extern const u8_t tcp_persist_backoff[];
 
 
-struct tcp_pcb *
-tcp_input_find_list(struct LWIP_Context *lwip_ctxt, struct hlist_head *list, ipX_addr_t *cur_src_addr,ipX_addr_t *cur_dest_addr)
-{
-	struct tcp_pcb *pcb;
-	struct hlist_node *n;
-	hlist_for_each(list,n) {
-		pcb = hlist_entry(n,struct tcp_pcb,link);
-		LWIP_ASSERT("tcp_input: active pcb->state != CLOSED", pcb->state != CLOSED);
-		LWIP_ASSERT("tcp_input: active pcb->state != TIME-WAIT", pcb->state != TIME_WAIT);
-		LWIP_ASSERT("tcp_input: active pcb->state != LISTEN", pcb->state != LISTEN);
-		
-
-		if (pcb->remote_port == lwip_ctxt->tcphdr->src &&
-		    pcb->local_port == lwip_ctxt->tcphdr->dest &&
-		    IP_PCB_IPVER_INPUT_MATCH(pcb) &&
-		    ipX_addr_cmp(ip_current_is_v6(), &pcb->remote_ip, ipX_current_src_addr()) &&
-		    ipX_addr_cmp(ip_current_is_v6(),&pcb->local_ip, ipX_current_dest_addr()))
-			return pcb;
-		
-	}
-	return NULL;
-}
-
-
 /**
  * The initial input processing of TCP. It verifies the TCP header, demultiplexes
  * the segment between the PCBs and passes it on to tcp_process(), which implements
@@ -160,6 +141,7 @@ tcp_input(struct eth_fg *cur_fg, struct pbuf *p, ipX_addr_t *cur_src_addr, ipX_a
 	struct hlist_node *n;
 	
 	struct tcp_pcb *pcb = NULL;
+	struct tcp_tw *tw;
 	struct tcp_pcb_listen *lpcb;
 #if SO_REUSE
 	struct tcp_pcb *lpcb_prev = NULL;
@@ -167,11 +149,15 @@ tcp_input(struct eth_fg *cur_fg, struct pbuf *p, ipX_addr_t *cur_src_addr, ipX_a
 #endif /* SO_REUSE */
 	u8_t hdrlen;
 	err_t err;
+	enum tcp_state prev_state;
+	u8_t prev_ooseq = 0;
 #if CHECKSUM_CHECK_TCP
 	u16_t chksum;
 #endif /* CHECKSUM_CHECK_TCP */
 	
 	lwip_context.cur_fg = cur_fg;
+	lwip_context.coalesced = p->flags & PBUF_FLAG_GRO;
+	lwip_context.ce = p->flags & PBUF_FLAG_CE;
 
 	PERF_START;
 	
@@ -230,7 +216,7 @@ tcp_input(struct eth_fg *cur_fg, struct pbuf *p, ipX_addr_t *cur_src_addr, ipX_a
   lwip_context.tcphdr->src = ntohs(lwip_context.tcphdr->src);
   lwip_context.tcphdr->dest = ntohs(lwip_context.tcphdr->dest);
 
-  int idx = tcp_to_idx(ipX_current_dest_addr(),ipX_current_src_addr(), lwip_context.tcphdr->dest, lwip_context.tcphdr->src);
+  u32_t hash = tcp_conn_hash(ipX_current_dest_addr(),ipX_current_src_addr(), lwip_context.tcphdr->dest, lwip_context.tcphdr->src);
 
 
   lwip_context.seqno = lwip_context.tcphdr->seqno = ntohl(lwip_context.tcphdr->seqno);
@@ -238,6 +224,7 @@ tcp_input(struct eth_fg *cur_fg, struct pbuf *p, ipX_addr_t *cur_src_addr, ipX_a
   lwip_context.tcphdr->wnd = ntohs(lwip_context.tcphdr->wnd);
   
   lwip_context.flags = TCPH_FLAGS(lwip_context.tcphdr);
+  lwip_context.ecn_flags = ntohs(lwip_context.tcphdr->_hdrlen_rsvd_flags) & (TCP_ECE | TCP_CWR);
   lwip_context.tcplen = p->tot_len + ((lwip_context.flags & (TCP_FIN | TCP_SYN)) ? 1 : 0);
   
   /* Demultiplex an incoming segment. First, we check if it is destined
@@ -246,7 +233,8 @@ tcp_input(struct eth_fg *cur_fg, struct pbuf *p, ipX_addr_t *cur_src_addr, ipX_a
   
   
 
-  pcb = tcp_input_find_list(&lwip_context,&cur_fg->active_tbl[idx].pcbs,cur_src_addr,cur_dest_addr);
+  pcb = tcp_active_lookup(cur_fg, hash, ipX_current_dest_addr(), ipX_current_src_addr(),
+                          lwip_context.tcphdr->dest, lwip_context.tcphdr->src);
   if (pcb) {
 	  mem_prefetch(&pcb->tmr);
 	  mem_prefetch(&pcb->rttest);
@@ -257,13 +245,11 @@ tcp_input(struct eth_fg *cur_fg, struct pbuf *p, ipX_addr_t *cur_src_addr, ipX_a
   
   /* If it did not go to an active connection, we check the connections
      in the TIME-WAIT state. */
-  pcb = tcp_input_find_list(&lwip_context,&cur_fg->tw_pcbs,cur_src_addr,cur_dest_addr);
-  if (pcb) {
-	  /* We don't really care enough to move this PCB to the front
-	     of the list since we are not very likely to receive that
-	     many segments for connections in TIME-WAIT. */
+  tw = tcp_tw_lookup(cur_fg, hash, ipX_current_dest_addr(), ipX_current_src_addr(),
+                     lwip_context.tcphdr->dest, lwip_context.tcphdr->src);
+  if (tw) {
 	  LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_input: packed for TIME_WAITing connection.\n"));
-	  tcp_timewait_input(&lwip_context,pcb,cur_src_addr,cur_dest_addr);
+	  tcp_timewait_input(&lwip_context,tw,cur_src_addr,cur_dest_addr);
 	  pbuf_free(p);
 	  return;
   }
@@ -315,9 +301,20 @@ tcp_input(struct eth_fg *cur_fg, struct pbuf *p, ipX_addr_t *cur_src_addr, ipX_a
 #endif /* SO_REUSE */
   
   if (lpcb != NULL) {
+	  /* An ACK completing a SYN-cookie handshake creates its pcb, which
+	     then processes the segment from SYN_RCVD. If there is no room
+	     for the connection, the ACK is dropped. */
+	  if (tcp_syn_cookie_threshold &&
+	      (lwip_context.flags & (TCP_SYN | TCP_RST | TCP_ACK)) == TCP_ACK) {
+		  err_t err = tcp_syncookie_accept(&lwip_context,lpcb,hash,cur_src_addr,cur_dest_addr,&pcb);
+		  if (err == ERR_OK)
+			  goto done_tcp_input;
+		  if (err != ERR_VAL)
+			  goto dropped;
+	  }
 	  
 	  LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_input: packed for LISTENing connection.\n"));
-	  tcp_listen_input(&lwip_context,lpcb,idx,cur_src_addr,cur_dest_addr);
+	  tcp_listen_input(&lwip_context,lpcb,hash,cur_src_addr,cur_dest_addr);
 	  pbuf_free(p);
 	  return;
   }
@@ -362,7 +359,14 @@ done_tcp_input:
         goto aborted;
       }
     }
+    if (pcb->flags & TF_ECN) {
+      tcp_ecn_input(&lwip_context, pcb);
+    }
     percpu_get(tcp_input_pcb) = pcb;
+    prev_state = pcb->state;
+#if TCP_QUEUE_OOSEQ
+    prev_ooseq = pcb->ooseq != NULL;
+#endif /* TCP_QUEUE_OOSEQ */
     err = tcp_process(&lwip_context,pcb,cur_src_addr,cur_dest_addr);
     /* A return value of ERR_ABRT means that tcp_abort() was called
        and that the pcb has been freed. If so, we don't do anything. */
@@ -484,11 +488,25 @@ done_tcp_input:
         percpu_get(tcp_input_pcb) = NULL;
         /* Try to send something out. */
         tcp_output(cur_fg,pcb);
+
 #if TCP_INPUT_DEBUG
 #if TCP_DEBUG
         tcp_debug_print_state(pcb->state);
 #endif /* TCP_DEBUG */
 #endif /* TCP_INPUT_DEBUG */
+        /* The final ACK is out: a connection that reached TIME_WAIT
+           trades its pcb for a compact entry. Otherwise the slow
+           timeouts only need re-arming when the segment changed what
+           they depend on. */
+        if (pcb->state == TIME_WAIT) {
+          tcp_tw_enter(cur_fg,pcb);
+        } else if (pcb->state != prev_state || pcb->refused_data != NULL
+#if TCP_QUEUE_OOSEQ
+            || (pcb->ooseq != NULL && !prev_ooseq)
+#endif /* TCP_QUEUE_OOSEQ */
+            ) {
+          tcp_slow_timer_update(cur_fg,pcb);
+        }
       }
     }
     /* Jump target if pcb has been aborted in a callback (by calling tcp_abort()).
@@ -527,6 +545,178 @@ dropped:
   pbuf_free(p);
     }
 
+/**
+ * Reads the MSS and window scale options of a SYN without a pcb.
+ *
+ * @param mss set to the MSS option, left unchanged if absent
+ * @param wscale set to the window scale option, left unchanged if absent
+ */
+static void
+tcp_parseopt_syn(struct LWIP_Context *lwip_ctxt, u16_t *mss, u8_t *wscale)
+{
+  u16_t c, max_c;
+  u8_t *opts;
+
+  opts = (u8_t *)lwip_ctxt->tcphdr + TCP_HLEN;
+  max_c = (TCPH_HDRLEN(lwip_ctxt->tcphdr) - 5) << 2;
+  for (c = 0; c < max_c; ) {
+    switch (opts[c]) {
+    case 0x00:
+      return;
+    case 0x01:
+      ++c;
+      break;
+    case 0x02:
+      if (opts[c + 1] != 0x04 || c + 0x04 > max_c) {
+        return;
+      }
+      *mss = (opts[c + 2] << 8) | opts[c + 3];
+      if (*mss == 0 || *mss > TCP_MSS) {
+        *mss = TCP_MSS;
+      }
+      c += 0x04;
+      break;
+#if LWIP_WND_SCALE
+    case 0x03:
+      if (opts[c + 1] != 0x03 || c + 0x03 > max_c) {
+        return;
+      }
+      *wscale = LWIP_MIN(opts[c + 2], 14U);
+      c += 0x03;
+      break;
+#endif /* LWIP_WND_SCALE */
+    default:
+      if (c + 1 >= max_c || opts[c + 1] == 0) {
+        return;
+      }
+      c += opts[c + 1];
+    }
+  }
+}
+
+/**
+ * Answers a SYN with a SYN cookie instead of creating a pcb.
+ * Called by tcp_listen_input() when tcp_syncookie_needed().
+ */
+static void
+tcp_syncookie_reply(struct LWIP_Context *lwip_ctxt,ipX_addr_t *cur_src_addr,ipX_addr_t *cur_dest_addr)
+{
+  struct eth_fg *cur_fg = lwip_ctxt->cur_fg;
+  u16_t mss = 536;
+  u8_t wscale = TCP_SYNCOOKIE_NO_WSCALE;
+  u32_t iss;
+
+  tcp_parseopt_syn(lwip_ctxt, &mss, &wscale);
+  iss = tcp_syncookie_make(ipX_current_dest_addr(), ipX_current_src_addr(),
+                           lwip_ctxt->tcphdr->dest, lwip_ctxt->tcphdr->src,
+                           lwip_ctxt->seqno, &mss, wscale);
+  tcp_syncookie_synack(cur_fg, iss, lwip_ctxt->seqno + 1,
+                       ipX_current_dest_addr(), ipX_current_src_addr(),
+                       lwip_ctxt->tcphdr->dest, lwip_ctxt->tcphdr->src, wscale);
+  KSTATS_VECTOR(tcp_input_listen);
+}
+
+/**
+ * Creates the pcb of a connection whose handshake ACK returns a valid
+ * SYN cookie. The pcb is set up in SYN_RCVD as if tcp_listen_input() had
+ * created it and sent the SYN|ACK, so that tcp_process() completes the
+ * handshake with the same segment.
+ *
+ * @param lpcb the listening pcb the ACK is for
+ * @param pcb set to the new pcb on success
+ * @return ERR_OK if the pcb was created,
+ *         ERR_VAL if the ACK does not carry a valid cookie,
+ *         ERR_ABRT if the listen backlog is full,
+ *         ERR_MEM if there is no pcb or connection table entry left
+ */
+static err_t
+tcp_syncookie_accept(struct LWIP_Context *lwip_ctxt, struct tcp_pcb_listen *lpcb, u32_t hash,ipX_addr_t *cur_src_addr,ipX_addr_t *cur_dest_addr,struct tcp_pcb **pcb)
+{
+  struct eth_fg *cur_fg = lwip_ctxt->cur_fg;
+  struct tcp_pcb *npcb;
+  u16_t mss;
+  u8_t wscale;
+
+  if (tcp_syncookie_check(ipX_current_dest_addr(), ipX_current_src_addr(),
+                          lwip_ctxt->tcphdr->dest, lwip_ctxt->tcphdr->src,
+                          lwip_ctxt->seqno - 1, lwip_ctxt->ackno - 1, &mss, &wscale)) {
+    return ERR_VAL;
+  }
+#if TCP_LISTEN_BACKLOG
+  if (lpcb->accepts_pending >= lpcb->backlog) {
+    LWIP_DEBUGF(TCP_DEBUG, ("tcp_syncookie_accept: listen backlog exceeded for port %"U16_F"\n", lwip_ctxt->tcphdr->dest));
+    return ERR_ABRT;
+  }
+#endif /* TCP_LISTEN_BACKLOG */
+
+  /* tcp_alloc() panics on an empty pool, but a flood of cookie ACKs
+     must not take the dataplane down: drop the ACK instead */
+  npcb = (struct tcp_pcb *)memp_malloc(MEMP_TCP_PCB);
+  if (npcb == NULL) {
+    LWIP_DEBUGF(TCP_DEBUG, ("tcp_syncookie_accept: could not allocate PCB\n"));
+    TCP_STATS_INC(tcp.memerr);
+    return ERR_MEM;
+  }
+  tcp_pcb_init(cur_fg, npcb, lpcb->prio);
+#if TCP_LISTEN_BACKLOG
+  lpcb->accepts_pending++;
+#endif /* TCP_LISTEN_BACKLOG */
+#if LWIP_IPV6
+  PCB_ISIPV6(npcb) = ip_current_is_v6();
+#endif /* LWIP_IPV6 */
+  ipX_addr_copy(ip_current_is_v6(), npcb->local_ip, *ipX_current_dest_addr());
+  ipX_addr_copy(ip_current_is_v6(), npcb->remote_ip, *ipX_current_src_addr());
+
+  npcb->local_port = lpcb->local_port;
+  npcb->remote_port = lwip_ctxt->tcphdr->src;
+  npcb->state = SYN_RCVD;
+  npcb->rcv_nxt = lwip_ctxt->seqno;
+  npcb->rcv_ann_right_edge = npcb->rcv_nxt + LWIP_MIN(TCP_WND, 0xFFFF);
+  npcb->snd_wl1 = lwip_ctxt->seqno - 2;/* the SYN's seqno-1, to force window update */
+  /* our SYN is in flight: ISS + 1 is the next sequence number */
+  npcb->snd_nxt = npcb->snd_lbb = lwip_ctxt->ackno;
+  npcb->lastack = npcb->snd_wl2 = lwip_ctxt->ackno - 1;
+  npcb->snd_buf--;
+  npcb->callback_arg = lpcb->callback_arg;
+#if LWIP_CALLBACK_API
+  npcb->accept = lpcb->accept;
+#endif /* LWIP_CALLBACK_API */
+  npcb->so_options = lpcb->so_options & SOF_INHERITED;
+  /* the cookie does not record ECN, so these connections go without */
+  tcp_cc_set(npcb, lpcb->cc);
+  npcb->ack_policy = lpcb->ack_policy;
+  npcb->ack_delay = lpcb->ack_delay;
+
+  npcb->mss = mss;
+#if LWIP_WND_SCALE
+  if (wscale != TCP_SYNCOOKIE_NO_WSCALE) {
+    npcb->snd_scale = wscale;
+    npcb->rcv_scale = TCP_RCV_SCALE;
+    npcb->flags |= TF_WND_SCALE;
+  }
+#endif /* LWIP_WND_SCALE */
+  npcb->snd_wnd = SND_WND_SCALE(npcb, lwip_ctxt->tcphdr->wnd);
+  npcb->snd_wnd_max = npcb->snd_wnd;
+  npcb->ssthresh = npcb->snd_wnd;
+#if TCP_CALCULATE_EFF_SEND_MSS
+  npcb->mss = tcp_eff_send_mss(npcb->mss, &npcb->local_ip,
+    &npcb->remote_ip, PCB_ISIPV6(npcb));
+#endif /* TCP_CALCULATE_EFF_SEND_MSS */
+
+  if (TCP_REG_ACTIVE(npcb,hash,cur_fg)) {
+#if TCP_LISTEN_BACKLOG
+    lpcb->accepts_pending--;
+#endif /* TCP_LISTEN_BACKLOG */
+    memp_free(MEMP_TCP_PCB, npcb);
+    TCP_STATS_INC(tcp.memerr);
+    return ERR_MEM;
+  }
+  tcp_slow_timer_update(cur_fg, npcb);
+  snmp_inc_tcppassiveopens();
+  *pcb = npcb;
+  return ERR_OK;
+}
+
 /**
  * Called by tcp_input() when a segment arrives for a listening
  * connection (from tcp_input()).
@@ -540,7 +730,7 @@ dropped:
  *       involved is passed as a parameter to this function
  */
 static err_t 
-tcp_listen_input(struct LWIP_Context *lwip_ctxt, struct tcp_pcb_listen *pcb, int idx,ipX_addr_t *cur_src_addr,ipX_addr_t *cur_dest_addr )
+tcp_listen_input(struct LWIP_Context *lwip_ctxt, struct tcp_pcb_listen *pcb, u32_t hash,ipX_addr_t *cur_src_addr,ipX_addr_t *cur_dest_addr )
 {
   struct tcp_pcb *npcb;
   err_t rc;
@@ -562,6 +752,10 @@ tcp_listen_input(struct LWIP_Context *lwip_ctxt, struct tcp_pcb_listen *pcb, int
 	  }
   } else if (lwip_ctxt->flags & TCP_SYN) {
     LWIP_DEBUGF(TCP_DEBUG, ("TCP connection request %"U16_F" -> %"U16_F".\n", lwip_ctxt->tcphdr->src, lwip_ctxt->tcphdr->dest));
+    if (tcp_syncookie_needed(pcb)) {
+      tcp_syncookie_reply(lwip_ctxt,cur_src_addr,cur_dest_addr);
+      return ERR_OK;
+    }
 #if TCP_LISTEN_BACKLOG
     if (pcb->accepts_pending >= pcb->backlog) {
       LWIP_DEBUGF(TCP_DEBUG, ("tcp_listen_input: listen backlog exceeded for port %"U16_F"\n", lwip_ctxt->tcphdr->dest));
@@ -604,9 +798,25 @@ tcp_listen_input(struct LWIP_Context *lwip_ctxt, struct tcp_pcb_listen *pcb, int
 #endif /* LWIP_CALLBACK_API */
     /* inherit socket options */
     npcb->so_options = pcb->so_options & SOF_INHERITED;
+    /* inherit the listener's congestion control and ACK policy, and
+       agree on ECN if the SYN asks for it (ECE and CWR set, RFC 3168) */
+    tcp_cc_set(npcb, pcb->cc);
+    npcb->ack_policy = pcb->ack_policy;
+    npcb->ack_delay = pcb->ack_delay;
+    if (pcb->cc->ecn && lwip_ctxt->ecn_flags == (TCP_ECE | TCP_CWR)) {
+      npcb->flags |= TF_ECN;
+    }
     /* Register the new PCB so that we can begin receiving segments
-       for it. */
-    TCP_REG_ACTIVE(npcb,idx,lwip_ctxt->cur_fg);
+       for it. If the connection table is full, drop the SYN. */
+    if (TCP_REG_ACTIVE(npcb,hash,lwip_ctxt->cur_fg)) {
+#if TCP_LISTEN_BACKLOG
+      pcb->accepts_pending--;
+#endif /* TCP_LISTEN_BACKLOG */
+      memp_free(MEMP_TCP_PCB, npcb);
+      TCP_STATS_INC(tcp.memerr);
+      return ERR_MEM;
+    }
+    tcp_slow_timer_update(lwip_ctxt->cur_fg, npcb);
 
     /* Parse any options in the SYN. */
     tcp_parseopt(lwip_ctxt,npcb);
@@ -622,7 +832,8 @@ tcp_listen_input(struct LWIP_Context *lwip_ctxt, struct tcp_pcb_listen *pcb, int
     snmp_inc_tcppassiveopens();
 
     /* Send a SYN|ACK together with the MSS option. */
-    rc = tcp_enqueue_flags(npcb, TCP_SYN | TCP_ACK);
+    rc = tcp_enqueue_flags(npcb, TCP_SYN | TCP_ACK |
+                           ((npcb->flags & TF_ECN) ? TCP_ECE : 0));
     if (rc != ERR_OK) {
 	    tcp_abandon(lwip_ctxt->cur_fg,npcb, 0);
       return rc;
@@ -640,18 +851,39 @@ tcp_listen_input(struct LWIP_Context *lwip_ctxt, struct tcp_pcb_listen *pcb, int
   return ERR_OK;
 }
 
+/**
+ * Called by tcp_input() for every segment of a connection that negotiated
+ * ECN. The ECE flag of our ACKs echoes whether the last segment received
+ * was CE marked. When that changes while an ACK is being delayed, the
+ * delayed ACK goes out first with the old value, so the sender can tell
+ * exactly how many bytes were marked (RFC 8257, section 3.2).
+ *
+ * @param pcb the tcp_pcb for which a segment arrived
+ */
+static void
+tcp_ecn_input(struct LWIP_Context *lwip_ctxt, struct tcp_pcb *pcb)
+{
+  if (!lwip_ctxt->ce == !(pcb->flags & TF_ECN_CE)) {
+    return;
+  }
+  if (pcb->timer_delayedack_expires > 0) {
+    tcp_send_empty_ack(lwip_ctxt->cur_fg, pcb);
+  }
+  pcb->flags ^= TF_ECN_CE;
+}
+
 /**
  * Called by tcp_input() when a segment arrives for a connection in
  * TIME_WAIT.
  *
- * @param pcb the tcp_pcb for which a segment arrived
+ * @param tw the TIME-WAIT entry for which a segment arrived
  *
- * @note the segment which arrived is saved in global variables, therefore only the pcb
- *       involved is passed as a parameter to this function
+ * @note the segment which arrived is saved in the context, therefore only the
+ *       entry involved is passed as a parameter to this function
  */
 
 static err_t
-tcp_timewait_input(struct LWIP_Context *lwip_ctxt, struct tcp_pcb *pcb,ipX_addr_t *cur_src_addr,ipX_addr_t *cur_dest_addr)
+tcp_timewait_input(struct LWIP_Context *lwip_ctxt, struct tcp_tw *tw,ipX_addr_t *cur_src_addr,ipX_addr_t *cur_dest_addr)
 {
 
   /* RFC 1337: in TIME_WAIT, ignore RST and ACK FINs + any 'acceptable' segments */
@@ -666,7 +898,7 @@ tcp_timewait_input(struct LWIP_Context *lwip_ctxt, struct tcp_pcb *pcb,ipX_addr_
   if (lwip_ctxt->flags & TCP_SYN) {
     /* If an incoming segment is not acceptable, an acknowledgment
        should be sent in reply */
-    if (TCP_SEQ_BETWEEN(lwip_ctxt->seqno, pcb->rcv_nxt, pcb->rcv_nxt+pcb->rcv_wnd)) {
+    if (TCP_SEQ_BETWEEN(lwip_ctxt->seqno, tw->rcv_nxt, tw->rcv_nxt+tw->rcv_wnd)) {
       /* If the SYN is in the window it is an error, send a reset */
 	    {
 		    struct eth_fg *cur_fg = lwip_ctxt->cur_fg;
@@ -678,13 +910,12 @@ tcp_timewait_input(struct LWIP_Context *lwip_ctxt, struct tcp_pcb *pcb,ipX_addr_
   } else if (lwip_ctxt->flags & TCP_FIN) {
     /* - eighth, check the FIN bit: Remain in the TIME-WAIT state.
          Restart the 2 MSL time-wait timeout.*/
-    pcb->tmr = lwip_ctxt->cur_fg->tcp_ticks;
+    tcp_tw_restart(lwip_ctxt->cur_fg, tw);
   }
 
   if ((lwip_ctxt->tcplen > 0))  {
     /* Acknowledge data, FIN or out-of-window SYN */
-    pcb->flags |= TF_ACK_NOW;
-    return tcp_output(lwip_ctxt->cur_fg,pcb);
+    tcp_tw_ack(lwip_ctxt->cur_fg, tw);
   }
   return ERR_OK;
 }
@@ -769,6 +1000,10 @@ tcp_process(struct LWIP_Context * lwip_ctxt, struct tcp_pcb *pcb,ipX_addr_t *cur
       pcb->snd_wnd_max = pcb->snd_wnd;
       pcb->snd_wl1 = lwip_ctxt->seqno - 1; /* initialise to seqno - 1 to force window update */
       pcb->state = ESTABLISHED;
+      /* an ECN-setup SYN-ACK has ECE but not CWR set (RFC 3168) */
+      if (pcb->cc->ecn && lwip_ctxt->ecn_flags == TCP_ECE) {
+        pcb->flags |= TF_ECN;
+      }
 
 #if TCP_CALCULATE_EFF_SEND_MSS
       pcb->mss = tcp_eff_send_mss(pcb->mss, &pcb->local_ip, &pcb->remote_ip,
@@ -1121,18 +1356,7 @@ tcp_receive(struct LWIP_Context *lwip_ctxt,struct tcp_pcb *pcb)
       /* Update the congestion control variables (cwnd and
          ssthresh). */
       if (pcb->state >= ESTABLISHED) {
-        if (pcb->cwnd < pcb->ssthresh) {
-          if ((tcpwnd_size_t)(pcb->cwnd + pcb->mss) > pcb->cwnd) {
-            pcb->cwnd += pcb->mss;
-          }
-          LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_receive: slow start cwnd %"TCPWNDSIZE_F"\n", pcb->cwnd));
-        } else {
-          tcpwnd_size_t new_cwnd = (pcb->cwnd + pcb->mss * pcb->mss / pcb->cwnd);
-          if (new_cwnd > pcb->cwnd) {
-            pcb->cwnd = new_cwnd;
-          }
-          LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_receive: congestion avoidance cwnd %"TCPWNDSIZE_F"\n", pcb->cwnd));
-        }
+        pcb->cc->acked(pcb, pcb->acked, lwip_ctxt->ecn_flags & TCP_ECE);
       }
       LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_receive: ACK for %"U32_F", unacked->seqno %"U32_F":%"U32_F"\n",
                                     lwip_ctxt->ackno,
@@ -1511,8 +1735,18 @@ tcp_receive(struct LWIP_Context *lwip_ctxt,struct tcp_pcb *pcb)
 #endif /* TCP_QUEUE_OOSEQ */
 
 
-        /* Acknowledge the segment(s). */
-        tcp_ack(cur_fg,pcb);
+        /* Acknowledge the segment(s). A coalesced chain already holds
+           more segments than we would delay an ACK for, so it is
+           acknowledged at the end of the RX batch. */
+        if (lwip_ctxt->coalesced && pcb->ack_policy != TCP_ACK_IMMEDIATE) {
+          if (pcb->timer_delayedack_expires) {
+            pcb->timer_delayedack_expires = 0;
+            tcp_recompute_timers(cur_fg,pcb);
+          }
+          tcp_ack_batch(cur_fg,pcb);
+        } else {
+          tcp_ack(cur_fg,pcb);
+        }
 
 #if LWIP_IPV6 && LWIP_ND6_TCP_REACHABILITY_HINTS
         if (PCB_ISIPV6(pcb)) {
@@ -86,6 +86,21 @@
 
 // direct into IX (tcp_api)
 extern int tcp_output_packet(struct eth_fg *,struct tcp_pcb *pcb, struct pbuf *p);
+extern int tcp_output_packet_tso(struct eth_fg *,struct tcp_pcb *pcb, struct pbuf **segs, int nr, u16_t mss);
+
+/** Maximum number of consecutive segments merged into one TSO packet */
+#define TCP_TSO_MAX_SEGS  32
+/** Maximum payload of a TSO packet (the IP length field is 16 bits) */
+#define TCP_TSO_MAX_LEN   (0xFFFF - IP_HLEN - TCP_HLEN - 40)
+
+/** Segments built by tcp_output() that have not been handed to IX yet */
+struct tcp_tso_batch {
+  struct pbuf *p[TCP_TSO_MAX_SEGS];
+  struct tcp_seg *last;
+  int nr;
+  u16_t mss;
+  u32_t len;
+};
 
 /* Define some copy-macros for checksum-on-copy so that the code looks
    nicer by preventing too many ifdef's. */
@@ -108,7 +123,8 @@ extern int tcp_output_packet(struct eth_fg *,struct tcp_pcb *pcb, struct pbuf *p
 #endif
 
 /* Forward declarations.*/
-static void tcp_output_segment(struct eth_fg *cur_fg,struct tcp_seg *seg, struct tcp_pcb *pcb);
+static void tcp_output_segment(struct eth_fg *cur_fg,struct tcp_seg *seg, struct tcp_pcb *pcb,
+                               struct tcp_tso_batch *tso);
 
 /** Allocate a pbuf and create a tcphdr at p->payload, used for output
  * functions other than the default tcp_output -> tcp_output_segment
@@ -134,7 +150,8 @@ tcp_output_alloc_header(struct tcp_pcb *pcb, u16_t optlen, u16_t datalen,
     tcphdr->dest = htons(pcb->remote_port);
     tcphdr->seqno = seqno_be;
     tcphdr->ackno = htonl(pcb->rcv_nxt);
-    TCPH_HDRLEN_FLAGS_SET(tcphdr, (5 + optlen / 4), TCP_ACK);
+    TCPH_HDRLEN_FLAGS_SET(tcphdr, (5 + optlen / 4),
+                          TCP_ACK | ((pcb->flags & TF_ECN_CE) ? TCP_ECE : 0));
     tcphdr->wnd = htons(RCV_WND_SCALE(pcb, pcb->rcv_ann_wnd));
     tcphdr->chksum = 0;
     tcphdr->urgp = 0;
@@ -920,7 +937,7 @@ tcp_send_empty_ack(struct eth_fg *cur_fg,struct tcp_pcb *pcb)
   LWIP_DEBUGF(TCP_OUTPUT_DEBUG,
               ("tcp_output: sending ACK for %"U32_F"\n", pcb->rcv_nxt));
   /* remove ACK flags from the PCB, as we send an empty ACK now */
-  pcb->flags &= ~TF_ACK_NOW;
+  pcb->flags &= ~(TF_ACK_NOW | TF_ACK_DUE);
   pcb->timer_delayedack_expires = 0;
   tcp_recompute_timers(cur_fg,pcb);
 
@@ -951,6 +968,58 @@ tcp_send_empty_ack(struct eth_fg *cur_fg,struct tcp_pcb *pcb)
   return ERR_OK;
 }
 
+/**
+ * Send the segments accumulated in a TSO batch, as a single TSO packet
+ * if more than one segment was merged.
+ *
+ * @param pcb the tcp_pcb the segments belong to
+ * @param tso the batch to flush (empty afterwards)
+ */
+static void
+tcp_tso_flush(struct eth_fg *cur_fg, struct tcp_pcb *pcb, struct tcp_tso_batch *tso)
+{
+  if (tso->nr == 1) {
+    tcp_output_packet(cur_fg, pcb, tso->p[0]);
+  } else if (tso->nr > 1) {
+    tcp_output_packet_tso(cur_fg, pcb, tso->p, tso->nr, tso->mss);
+  }
+
+  tso->nr = 0;
+  tso->len = 0;
+}
+
+/**
+ * Queue a segment whose header is complete for output. Consecutive
+ * full-sized segments are merged so that they can be sent as one TSO
+ * packet; anything that cannot be merged flushes the batch first.
+ *
+ * @param pcb the tcp_pcb the segment belongs to
+ * @param tso the current batch
+ * @param seg the segment to queue
+ */
+static void
+tcp_tso_queue(struct eth_fg *cur_fg, struct tcp_pcb *pcb, struct tcp_tso_batch *tso,
+              struct tcp_seg *seg)
+{
+  struct tcp_seg *last = tso->last;
+
+  if (tso->nr == 0 || tso->nr == TCP_TSO_MAX_SEGS ||
+      last->len != tso->mss ||
+      seg->len == 0 || seg->len > tso->mss ||
+      tso->len + seg->len > TCP_TSO_MAX_LEN ||
+      ntohl(seg->tcphdr->seqno) != ntohl(last->tcphdr->seqno) + last->len ||
+      TCPH_HDRLEN(seg->tcphdr) != TCPH_HDRLEN(last->tcphdr) ||
+      (TCPH_FLAGS(last->tcphdr) & (TCP_SYN | TCP_FIN)) ||
+      (TCPH_FLAGS(seg->tcphdr) & (TCP_SYN | TCP_RST))) {
+    tcp_tso_flush(cur_fg, pcb, tso);
+    tso->mss = seg->len;
+  }
+
+  tso->p[tso->nr++] = seg->p;
+  tso->last = seg;
+  tso->len += seg->len;
+}
+
 /**
  * Find out what we can send and send it
  *
@@ -963,6 +1032,7 @@ tcp_output(struct eth_fg *cur_fg,struct tcp_pcb *pcb)
 {
 
   struct tcp_seg *seg, *useg;
+  struct tcp_tso_batch tso;
   u32_t wnd, snd_nxt;
 #if TCP_CWND_DEBUG
   s16_t i = 0;
@@ -1000,6 +1070,9 @@ tcp_output(struct eth_fg *cur_fg,struct tcp_pcb *pcb)
 	  return tcp_send_empty_ack(cur_fg,pcb);
   }
 
+  tso.nr = 0;
+  tso.len = 0;
+
   /* useg should point to last segment on unacked queue */
   useg = pcb->unacked;
   if (useg != NULL) {
@@ -1056,7 +1129,7 @@ tcp_output(struct eth_fg *cur_fg,struct tcp_pcb *pcb)
 
     if (pcb->state != SYN_SENT) {
       TCPH_SET_FLAG(seg->tcphdr, TCP_ACK);
-      pcb->flags &= ~TF_ACK_NOW;
+      pcb->flags &= ~(TF_ACK_NOW | TF_ACK_DUE);
       pcb->timer_delayedack_expires = 0;
       tcp_recompute_timers(cur_fg,pcb);
     }
@@ -1064,7 +1137,7 @@ tcp_output(struct eth_fg *cur_fg,struct tcp_pcb *pcb)
 #if TCP_OVERSIZE_DBGCHECK
     seg->oversize_left = 0;
 #endif /* TCP_OVERSIZE_DBGCHECK */
-    tcp_output_segment(cur_fg,seg, pcb);
+    tcp_output_segment(cur_fg,seg, pcb, &tso);
     snd_nxt = ntohl(seg->tcphdr->seqno) + TCP_TCPLEN(seg);
     if (TCP_SEQ_LT(pcb->snd_nxt, snd_nxt)) {
       pcb->snd_nxt = snd_nxt;
@@ -1098,10 +1171,12 @@ tcp_output(struct eth_fg *cur_fg,struct tcp_pcb *pcb)
       }
     /* do not queue empty segments on the unacked list */
     } else {
+      tcp_tso_flush(cur_fg, pcb, &tso);
       tcp_seg_free(seg);
     }
     seg = pcb->unsent;
   }
+  tcp_tso_flush(cur_fg, pcb, &tso);
 #if TCP_OVERSIZE
   if (pcb->unsent == NULL) {
     /* last unsent has been removed, reset unsent_oversize */
@@ -1118,9 +1193,11 @@ tcp_output(struct eth_fg *cur_fg,struct tcp_pcb *pcb)
  *
  * @param seg the tcp_seg to send
  * @param pcb the tcp_pcb for the TCP connection used to send the segment
+ * @param tso the TSO batch the segment is queued on (see tcp_tso_queue())
  */
 static void
-tcp_output_segment(struct eth_fg *cur_fg,struct tcp_seg *seg, struct tcp_pcb *pcb)
+tcp_output_segment(struct eth_fg *cur_fg,struct tcp_seg *seg, struct tcp_pcb *pcb,
+                   struct tcp_tso_batch *tso)
 {
   u16_t len;
   u32_t *opts;
@@ -1146,6 +1223,16 @@ tcp_output_segment(struct eth_fg *cur_fg,struct tcp_seg *seg, struct tcp_pcb *pc
 
   pcb->rcv_ann_right_edge = pcb->rcv_nxt + pcb->rcv_ann_wnd;
 
+  /* echo the CE state of the last received segment; the ECE of an
+     ECN-setup SYN-ACK is left alone */
+  if ((pcb->flags & TF_ECN) && !(TCPH_FLAGS(seg->tcphdr) & TCP_SYN)) {
+    if (pcb->flags & TF_ECN_CE) {
+      TCPH_SET_FLAG(seg->tcphdr, TCP_ECE);
+    } else {
+      seg->tcphdr->_hdrlen_rsvd_flags &= ~PP_HTONS(TCP_ECE);
+    }
+  }
+
   /* Add any requested options.  NB MSS option is only set on SYN
      packets, so ignore it here */
   opts = (u32_t *)(void *)(seg->tcphdr + 1);
@@ -1249,7 +1336,7 @@ tcp_output_segment(struct eth_fg *cur_fg,struct tcp_seg *seg, struct tcp_pcb *pc
   TCP_STATS_INC(tcp.xmit);
 
 #if LWIP_NETIF_HWADDRHINT
-  tcp_output_packet(cur_fg,pcb,seg->p);
+  tcp_tso_queue(cur_fg, pcb, tso, seg);
 //  ipX_output_hinted(PCB_ISIPV6(pcb), seg->p, &pcb->local_ip, &pcb->remote_ip,
 //    pcb->ttl, pcb->tos, IP_PROTO_TCP, &pcb->dst_eth_addr[0]);
 #else /* LWIP_NETIF_HWADDRHINT*/
@@ -1324,10 +1411,133 @@ tcp_rst_impl(struct eth_fg *cur_fg,u32_t seqno, u32_t ackno,
   LWIP_DEBUGF(TCP_RST_DEBUG, ("tcp_rst: seqno %"U32_F" ackno %"U32_F".\n", seqno, ackno));
 }
 
+/**
+ * Send a SYN|ACK carrying a SYN cookie, without a pcb.
+ *
+ * Called by tcp_listen_input() when tcp_syncookie_needed(). Besides the
+ * MSS option, the window scale option is sent if the SYN offered one:
+ * the cookie remembers the peer's shift, so the connection can still
+ * use a scaled window once its pcb is created.
+ *
+ * @param iss the cookie, used as our initial sequence number
+ * @param ackno the sequence number of the SYN plus one
+ * @param local_ip the local ip address
+ * @param remote_ip the remote ip address
+ * @param local_port the local tcp port
+ * @param remote_port the remote tcp port
+ * @param wscale the window scale offered in the SYN or TCP_SYNCOOKIE_NO_WSCALE
+ */
+void
+tcp_syncookie_synack(struct eth_fg *cur_fg, u32_t iss, u32_t ackno,
+  ipX_addr_t *local_ip, ipX_addr_t *remote_ip,
+  u16_t local_port, u16_t remote_port, u8_t wscale)
+{
+  struct pbuf *p;
+  struct tcp_hdr *tcphdr;
+  u32_t *opts;
+  u16_t optlen = LWIP_TCP_OPT_LEN_MSS;
+  u16_t mss;
+
+#if LWIP_WND_SCALE
+  if (wscale != TCP_SYNCOOKIE_NO_WSCALE) {
+    optlen += LWIP_TCP_OPT_LEN_WS;
+  }
+#else
+  LWIP_UNUSED_ARG(wscale);
+#endif /* LWIP_WND_SCALE */
+
+  p = pbuf_alloc(PBUF_IP, TCP_HLEN + optlen, PBUF_RAM);
+  if (p == NULL) {
+      LWIP_DEBUGF(TCP_DEBUG, ("tcp_syncookie_synack: could not allocate memory for pbuf\n"));
+      return;
+  }
+  LWIP_ASSERT("check that first pbuf can hold struct tcp_hdr",
+              (p->len >= sizeof(struct tcp_hdr) + optlen));
+
+  tcphdr = (struct tcp_hdr *)p->payload;
+  tcphdr->src = htons(local_port);
+  tcphdr->dest = htons(remote_port);
+  tcphdr->seqno = htonl(iss);
+  tcphdr->ackno = htonl(ackno);
+  TCPH_HDRLEN_FLAGS_SET(tcphdr, (TCP_HLEN + optlen)/4, TCP_SYN | TCP_ACK);
+  /* The Window field in a SYN segment is never scaled. */
+  tcphdr->wnd = htons(LWIP_MIN(TCP_WND, 0xFFFF));
+  tcphdr->chksum = 0;
+  tcphdr->urgp = 0;
+
+  opts = (u32_t *)(void *)(tcphdr + 1);
+#if TCP_CALCULATE_EFF_SEND_MSS
+  mss = tcp_eff_send_mss(TCP_MSS, local_ip, remote_ip, 0);
+#else /* TCP_CALCULATE_EFF_SEND_MSS */
+  mss = TCP_MSS;
+#endif /* TCP_CALCULATE_EFF_SEND_MSS */
+  *opts++ = TCP_BUILD_MSS_OPTION(mss);
+#if LWIP_WND_SCALE
+  if (wscale != TCP_SYNCOOKIE_NO_WSCALE) {
+    tcp_build_wnd_scale_option(opts);
+  }
+#endif /* LWIP_WND_SCALE */
+
+  TCP_STATS_INC(tcp.xmit);
+
+#if CHECKSUM_GEN_TCP
+  tcphdr->chksum = ipX_chksum_pseudo(0, p, IP_PROTO_TCP, p->tot_len,
+                                     local_ip, remote_ip);
+#endif
+  ipX_output_hinted(0, p, local_ip, remote_ip, TCP_TTL, 0, IP_PROTO_TCP, NULL);
+  pbuf_free(p);
+  LWIP_DEBUGF(TCP_OUTPUT_DEBUG, ("tcp_syncookie_synack: seqno %"U32_F" ackno %"U32_F".\n",
+                                 iss, ackno));
+}
+
+/**
+ * Send an ACK on behalf of a connection in TIME-WAIT.
+ *
+ * Called by tcp_timewait_input() to re-acknowledge a retransmitted FIN or
+ * any other segment with data.
+ *
+ * @param tw the TIME-WAIT entry of the connection
+ */
+void
+tcp_tw_ack(struct eth_fg *cur_fg, struct tcp_tw *tw)
+{
+  struct pbuf *p;
+  struct tcp_hdr *tcphdr;
+  p = pbuf_alloc(PBUF_IP, TCP_HLEN, PBUF_RAM);
+  if (p == NULL) {
+      LWIP_DEBUGF(TCP_DEBUG, ("tcp_tw_ack: could not allocate memory for pbuf\n"));
+      return;
+  }
+  LWIP_ASSERT("check that first pbuf can hold struct tcp_hdr",
+              (p->len >= sizeof(struct tcp_hdr)));
+
+  tcphdr = (struct tcp_hdr *)p->payload;
+  tcphdr->src = htons(tw->local_port);
+  tcphdr->dest = htons(tw->remote_port);
+  tcphdr->seqno = htonl(tw->snd_nxt);
+  tcphdr->ackno = htonl(tw->rcv_nxt);
+  TCPH_HDRLEN_FLAGS_SET(tcphdr, TCP_HLEN/4, TCP_ACK);
+  tcphdr->wnd = htons(RCV_WND_SCALE(tw, tw->rcv_wnd));
+  tcphdr->chksum = 0;
+  tcphdr->urgp = 0;
+
+  TCP_STATS_INC(tcp.xmit);
+
+#if CHECKSUM_GEN_TCP
+  tcphdr->chksum = ipX_chksum_pseudo(0, p, IP_PROTO_TCP, p->tot_len,
+                                     ip_2_ipX(&tw->local_ip), ip_2_ipX(&tw->remote_ip));
+#endif
+  ipX_output_hinted(0, p, ip_2_ipX(&tw->local_ip), ip_2_ipX(&tw->remote_ip),
+                    tw->ttl, tw->tos, IP_PROTO_TCP, NULL);
+  pbuf_free(p);
+  LWIP_DEBUGF(TCP_OUTPUT_DEBUG, ("tcp_tw_ack: seqno %"U32_F" ackno %"U32_F".\n",
+                                 tw->snd_nxt, tw->rcv_nxt));
+}
+
 /**
  * Requeue all unacked segments for retransmission
  *
- * Called by tcp_slowtmr() for slow retransmission.
+ * Called by tcp_pcb_slowtmr() for slow retransmission.
  *
  * @param pcb the tcp_pcb for which to re-enqueue all unacked segments
  */
@@ -1430,23 +1640,7 @@ tcp_rexmit_fast(struct tcp_pcb *pcb)
                  ntohl(pcb->unacked->tcphdr->seqno)));
     tcp_rexmit(pcb);
 
-    /* Set ssthresh to half of the minimum of the current
-     * cwnd and the advertised window */
-    if (pcb->cwnd > pcb->snd_wnd) {
-      pcb->ssthresh = pcb->snd_wnd / 2;
-    } else {
-      pcb->ssthresh = pcb->cwnd / 2;
-    }
-
-    /* The minimum value for ssthresh should be 2 MSS */
-    if (pcb->ssthresh < (2U * pcb->mss)) {
-      LWIP_DEBUGF(TCP_FR_DEBUG,
-                  ("tcp_receive: The minimum value for ssthresh %"U16_F
-                   " should be min 2 mss %"U16_F"...\n",
-                   pcb->ssthresh, 2*pcb->mss));
-      pcb->ssthresh = 2*pcb->mss;
-    }
-
+    pcb->ssthresh = pcb->cc->ssthresh(pcb);
     pcb->cwnd = pcb->ssthresh + 3 * pcb->mss;
     pcb->flags |= TF_INFR;
   }
@@ -1457,7 +1651,7 @@ tcp_rexmit_fast(struct tcp_pcb *pcb)
  * Send keepalive packets to keep a connection active although
  * no data is sent over it.
  *
- * Called by tcp_slowtmr()
+ * Called by tcp_pcb_slowtmr()
  *
  * @param pcb the tcp_pcb for which to send a keepalive packet
  */
@@ -1512,7 +1706,7 @@ tcp_keepalive(struct eth_fg *cur_fg,struct tcp_pcb *pcb)
  * Send persist timer zero-window probes to keep a connection active
  * when a window update is lost.
  *
- * Called by tcp_slowtmr()
+ * Called by tcp_pcb_slowtmr()
  *
  * @param pcb the tcp_pcb for which to send a zero-window probe packet
  */
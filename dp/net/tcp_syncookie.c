@@ -0,0 +1,197 @@
+/*
+ * Copyright 2013-16 Board of Trustees of Stanford University
+ * Copyright 2013-16 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * tcp_syncookie.c - stateless SYN handling under connection storms
+ *
+ * Once the tcp_pcb pool fills past tcp_syn_cookie_threshold percent (or a
+ * listen backlog is full), SYNs are answered without allocating anything:
+ * the SYN-ACK's sequence number encodes the connection, and the pcb is
+ * only created when the final ACK returns it.
+ *
+ * The cookie follows the classic layout:
+ *
+ *   H1(4-tuple) + client ISN + (count << 24) + ((H2(4-tuple, count) + data) & 0xffffff)
+ *
+ * where count advances every 64 seconds and data holds an index into
+ * syncookie_mss[] and the client's window scale shift. H1 and H2 are
+ * CityHash over the 4-tuple, keyed by a random secret.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <ix/stddef.h>
+#include <ix/errno.h>
+#include <ix/hash.h>
+#include <ix/timer.h>
+
+#include <lwip/memp.h>
+#include <lwip/tcp.h>
+#include <lwip/tcp_impl.h>
+
+#define COOKIE_BITS		24
+#define COOKIE_MASK		((1 << COOKIE_BITS) - 1)
+#define COOKIE_PERIOD_US	(64 * ONE_SECOND)
+#define COOKIE_MAX_AGE		2	/* in periods */
+
+/* data bits: MSS index (2 bits), window scale + 1 or 0 if none (4 bits) */
+#define COOKIE_MSS_BITS		2
+#define COOKIE_DATA_LIMIT	(1 << (COOKIE_MSS_BITS + 4))
+
+/* percentage of tcp_pcbs in use beyond which SYN cookies are sent, 0 = off */
+unsigned int tcp_syn_cookie_threshold;
+
+static uint64_t syncookie_secret[4];
+
+static const u16_t syncookie_mss[1 << COOKIE_MSS_BITS] = {
+	536, 1300, 1440, 1460,
+};
+
+/**
+ * tcp_syncookie_init - draws the secret keying the cookies
+ *
+ * Returns 0 if successful, otherwise -EIO.
+ */
+int tcp_syncookie_init(void)
+{
+	ssize_t ret;
+	int fd;
+
+	fd = open("/dev/urandom", O_RDONLY);
+	if (fd < 0)
+		return -EIO;
+	ret = read(fd, syncookie_secret, sizeof(syncookie_secret));
+	close(fd);
+
+	return ret == sizeof(syncookie_secret) ? 0 : -EIO;
+}
+
+/**
+ * tcp_syncookie_needed - determines whether to answer a SYN statelessly
+ * @lpcb: the listening pcb the SYN is for
+ *
+ * Returns true if SYN cookies are enabled and the pcb pool or the
+ * listen backlog is under pressure.
+ */
+bool tcp_syncookie_needed(struct tcp_pcb_listen *lpcb)
+{
+	if (!tcp_syn_cookie_threshold)
+		return false;
+
+#if TCP_LISTEN_BACKLOG
+	if (lpcb->accepts_pending >= lpcb->backlog)
+		return true;
+#endif /* TCP_LISTEN_BACKLOG */
+
+	return memp_tcp_pcb_usage() >= tcp_syn_cookie_threshold;
+}
+
+static inline u32_t syncookie_hash(ipX_addr_t *local_ip, ipX_addr_t *remote_ip,
+				   u16_t local_port, u16_t remote_port,
+				   u32_t count, int c)
+{
+	uint64_t addrs = ((uint64_t) local_ip->addr << 32) | remote_ip->addr;
+	uint64_t ports = ((uint64_t) count << 32) | ((u32_t) local_port << 16) | remote_port;
+
+	return hash_city_two(addrs ^ syncookie_secret[c],
+			     ports ^ syncookie_secret[c + 1]);
+}
+
+static inline u32_t syncookie_count(void)
+{
+	return timer_now() / COOKIE_PERIOD_US;
+}
+
+/**
+ * tcp_syncookie_make - computes the initial sequence number of a SYN-ACK
+ * @local_ip: the local address
+ * @remote_ip: the remote address
+ * @local_port: the local port (host order)
+ * @remote_port: the remote port (host order)
+ * @isn: the sequence number of the SYN
+ * @mss: the MSS offered in the SYN, rounded down to an encodable MSS
+ * @wscale: the window scale offered in the SYN or TCP_SYNCOOKIE_NO_WSCALE
+ *
+ * Returns the cookie to use as our initial sequence number.
+ */
+u32_t tcp_syncookie_make(ipX_addr_t *local_ip, ipX_addr_t *remote_ip,
+			 u16_t local_port, u16_t remote_port,
+			 u32_t isn, u16_t *mss, u8_t wscale)
+{
+	u32_t count = syncookie_count();
+	u32_t data;
+	int i;
+
+	for (i = ARRAY_SIZE(syncookie_mss) - 1; i > 0; i--)
+		if (*mss >= syncookie_mss[i])
+			break;
+	*mss = syncookie_mss[i];
+
+	data = i;
+	if (wscale != TCP_SYNCOOKIE_NO_WSCALE)
+		data |= (wscale + 1) << COOKIE_MSS_BITS;
+
+	return syncookie_hash(local_ip, remote_ip, local_port, remote_port, 0, 0) +
+	       isn + (count << COOKIE_BITS) +
+	       ((syncookie_hash(local_ip, remote_ip, local_port, remote_port, count, 2) +
+		 data) & COOKIE_MASK);
+}
+
+/**
+ * tcp_syncookie_check - validates the cookie returned by a handshake ACK
+ * @local_ip: the local address
+ * @remote_ip: the remote address
+ * @local_port: the local port (host order)
+ * @remote_port: the remote port (host order)
+ * @isn: the sequence number of the SYN, one less than that of the ACK
+ * @cookie: our initial sequence number, one less than the ACK number
+ * @mss: set to the MSS encoded in the cookie
+ * @wscale: set to the window scale encoded in the cookie
+ *
+ * Returns 0 if the cookie is valid and recent, otherwise -EINVAL.
+ */
+int tcp_syncookie_check(ipX_addr_t *local_ip, ipX_addr_t *remote_ip,
+			u16_t local_port, u16_t remote_port,
+			u32_t isn, u32_t cookie, u16_t *mss, u8_t *wscale)
+{
+	u32_t count = syncookie_count();
+	u32_t diff, data;
+
+	cookie -= syncookie_hash(local_ip, remote_ip, local_port, remote_port, 0, 0) + isn;
+
+	diff = (count - (cookie >> COOKIE_BITS)) & ((u32_t) -1 >> COOKIE_BITS);
+	if (diff >= COOKIE_MAX_AGE)
+		return -EINVAL;
+
+	data = (cookie - syncookie_hash(local_ip, remote_ip, local_port, remote_port,
+					count - diff, 2)) & COOKIE_MASK;
+	if (data >= COOKIE_DATA_LIMIT)
+		return -EINVAL;
+
+	*mss = syncookie_mss[data & ((1 << COOKIE_MSS_BITS) - 1)];
+	data >>= COOKIE_MSS_BITS;
+	*wscale = data ? data - 1 : TCP_SYNCOOKIE_NO_WSCALE;
+	return 0;
+}
@@ -0,0 +1,247 @@
+/*
+ * Copyright 2013-16 Board of Trustees of Stanford University
+ * Copyright 2013-16 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * tcp_tw.c - compact TIME-WAIT state
+ *
+ * A connection entering TIME-WAIT gives its tcp_pcb back to the mempool
+ * right away and leaves behind a struct tcp_tw with just enough state to
+ * answer retransmitted FINs and reject old duplicates for 2MSL. Entries
+ * come from their own mempool, are hashed per flow group by 4-tuple and
+ * expire through the timer wheel, so nothing scans them.
+ */
+
+#include <string.h>
+
+#include <ix/stddef.h>
+#include <ix/errno.h>
+#include <ix/log.h>
+#include <ix/mem.h>
+#include <ix/timer.h>
+#include <ix/ethfg.h>
+
+#include <lwip/memp.h>
+#include <lwip/tcp.h>
+#include <lwip/tcp_impl.h>
+
+#define TCP_TW_TIMEOUT_US	(2 * TCP_MSL * ONE_MS)
+
+/* small tables take 4KB pages, larger ones huge pages */
+static inline int tcp_tw_pgsize(uint32_t nr_buckets)
+{
+	return nr_buckets * sizeof(struct hlist_head) >= PGSIZE_2MB ?
+	       PGSIZE_2MB : PGSIZE_4KB;
+}
+
+static inline int tcp_tw_nr_pages(uint32_t nr_buckets)
+{
+	return div_up(nr_buckets * sizeof(struct hlist_head),
+		      tcp_tw_pgsize(nr_buckets));
+}
+
+/*
+ * Like the connection table, the buckets come from fresh (zeroed) pages
+ * on the NUMA node of the CPU that serves the flow group.
+ */
+static struct hlist_head *tcp_tw_alloc_buckets(uint32_t nr_buckets)
+{
+	void *buckets;
+
+	buckets = mem_alloc_pages(tcp_tw_nr_pages(nr_buckets),
+				  tcp_tw_pgsize(nr_buckets), NULL,
+				  MPOL_PREFERRED);
+	if (buckets == MAP_FAILED)
+		return NULL;
+
+	return buckets;
+}
+
+static void tcp_tw_free_buckets(struct hlist_head *buckets,
+				uint32_t nr_buckets)
+{
+	if (buckets)
+		mem_free_pages(buckets, tcp_tw_nr_pages(nr_buckets),
+			       tcp_tw_pgsize(nr_buckets));
+}
+
+/**
+ * tcp_tw_tbl_init - allocates the initial TIME-WAIT table
+ * @tbl: the table
+ *
+ * Returns 0 if successful, otherwise -ENOMEM.
+ */
+int tcp_tw_tbl_init(struct tcp_tw_tbl *tbl)
+{
+	if (tbl->buckets)
+		return 0;
+
+	tbl->buckets = tcp_tw_alloc_buckets(TCP_TW_TBL_MIN_BUCKETS);
+	if (!tbl->buckets)
+		return -ENOMEM;
+
+	tbl->mask = TCP_TW_TBL_MIN_BUCKETS - 1;
+	return 0;
+}
+
+/**
+ * tcp_tw_tbl_free - releases the memory of a TIME-WAIT table
+ * @tbl: the table
+ */
+void tcp_tw_tbl_free(struct tcp_tw_tbl *tbl)
+{
+	tcp_tw_free_buckets(tbl->buckets, tbl->mask + 1);
+	memset(tbl, 0, sizeof(*tbl));
+}
+
+static inline u32_t tcp_tw_hash(struct tcp_tw *tw)
+{
+	return tcp_conn_hash(ip_2_ipX(&tw->local_ip), ip_2_ipX(&tw->remote_ip),
+			     tw->local_port, tw->remote_port);
+}
+
+/*
+ * Returns 0 if successful, otherwise -ENOMEM, in which case the table
+ * keeps its size and its chains just get longer.
+ */
+static int tcp_tw_grow(struct tcp_tw_tbl *tbl)
+{
+	struct hlist_head *buckets;
+	struct hlist_node *n, *tmp;
+	struct tcp_tw *tw;
+	uint32_t mask = tbl->mask * 2 + 1;
+	uint32_t i;
+
+	buckets = tcp_tw_alloc_buckets(mask + 1);
+	if (!buckets)
+		return -ENOMEM;
+
+	for (i = 0; i <= tbl->mask; i++) {
+		hlist_for_each_safe(&tbl->buckets[i], n, tmp) {
+			tw = hlist_entry(n, struct tcp_tw, link);
+			hlist_add_head(&buckets[tcp_tw_hash(tw) & mask], &tw->link);
+		}
+	}
+
+	tcp_tw_free_buckets(tbl->buckets, tbl->mask + 1);
+	tbl->buckets = buckets;
+	tbl->mask = mask;
+	return 0;
+}
+
+/**
+ * tcp_tw_lookup - finds the TIME-WAIT entry of a 4-tuple
+ * @cur_fg: the flow group
+ * @hash: tcp_conn_hash() of the 4-tuple
+ * @local_ip: the local address
+ * @remote_ip: the remote address
+ * @local_port: the local port (host order)
+ * @remote_port: the remote port (host order)
+ *
+ * Returns the entry, or NULL if the connection is not in TIME-WAIT.
+ */
+struct tcp_tw *tcp_tw_lookup(struct eth_fg *cur_fg, u32_t hash,
+			     ipX_addr_t *local_ip, ipX_addr_t *remote_ip,
+			     u16_t local_port, u16_t remote_port)
+{
+	struct tcp_tw_tbl *tbl = &cur_fg->tw_tbl;
+	struct hlist_node *n;
+	struct tcp_tw *tw;
+
+	hlist_for_each(&tbl->buckets[hash & tbl->mask], n) {
+		tw = hlist_entry(n, struct tcp_tw, link);
+		if (tw->remote_port == remote_port &&
+		    tw->local_port == local_port &&
+		    ip_addr_cmp(&tw->remote_ip, remote_ip) &&
+		    ip_addr_cmp(&tw->local_ip, local_ip))
+			return tw;
+	}
+
+	return NULL;
+}
+
+static void tcp_tw_expire(struct timer *t, struct eth_fg *cur_fg)
+{
+	struct tcp_tw *tw = container_of(t, struct tcp_tw, timer);
+
+	hlist_del(&tw->link);
+	cur_fg->tw_tbl.count--;
+	memp_free(MEMP_TCP_TW, tw);
+}
+
+/**
+ * tcp_tw_restart - restarts the 2MSL timeout of a TIME-WAIT entry
+ * @cur_fg: the flow group
+ * @tw: the entry
+ */
+void tcp_tw_restart(struct eth_fg *cur_fg, struct tcp_tw *tw)
+{
+	timer_mod(&tw->timer, cur_fg, TCP_TW_TIMEOUT_US);
+}
+
+/**
+ * tcp_tw_enter - replaces a pcb that entered TIME-WAIT by a compact entry
+ * @cur_fg: the flow group
+ * @pcb: the pcb, in state TIME_WAIT and on cur_fg->tw_pcbs
+ *
+ * The pcb is freed. If no entry can be allocated, the connection skips
+ * TIME-WAIT rather than holding on to the pcb.
+ */
+void tcp_tw_enter(struct eth_fg *cur_fg, struct tcp_pcb *pcb)
+{
+	struct tcp_tw_tbl *tbl = &cur_fg->tw_tbl;
+	struct tcp_tw *tw;
+
+	LWIP_ASSERT("tcp_tw_enter: pcb->state == TIME_WAIT", pcb->state == TIME_WAIT);
+
+	tw = memp_malloc(MEMP_TCP_TW);
+	if (likely(tw)) {
+		ip_addr_copy(tw->local_ip, pcb->local_ip);
+		ip_addr_copy(tw->remote_ip, pcb->remote_ip);
+		tw->local_port = pcb->local_port;
+		tw->remote_port = pcb->remote_port;
+		tw->snd_nxt = pcb->snd_nxt;
+		tw->rcv_nxt = pcb->rcv_nxt;
+		tw->rcv_wnd = pcb->rcv_ann_wnd;
+		tw->tos = pcb->tos;
+		tw->ttl = pcb->ttl;
+#if LWIP_WND_SCALE
+		tw->rcv_scale = pcb->rcv_scale;
+#endif
+
+		if (tbl->count >= (tbl->mask + 1) * 2 && tcp_tw_grow(tbl))
+			log_warn("tcp: cannot grow the TIME-WAIT table\n");
+		hlist_add_head(&tbl->buckets[tcp_tw_hash(tw) & tbl->mask],
+			       &tw->link);
+		tbl->count++;
+
+		timer_init_entry(&tw->timer, tcp_tw_expire);
+		timer_add(&tw->timer, cur_fg, TCP_TW_TIMEOUT_US);
+	} else {
+		log_warn("tcp: out of TIME-WAIT entries\n");
+	}
+
+	tcp_pcb_purge(pcb);
+	TCP_RMV(&cur_fg->tw_pcbs, pcb);
+	memp_free(MEMP_TCP_PCB, pcb);
+}
@@ -50,6 +50,12 @@
 #define UDP_MAX_LEN \
 	(ETH_MTU - sizeof(struct ip_hdr) - sizeof(struct udp_hdr))
 
+/*
+ * The maximum number of SG entries in a datagram. Each entry can cross
+ * at most one page boundary, so it needs at most two IOVs.
+ */
+#define UDP_MAX_SG		8
+
 void udp_input(struct mbuf *pkt, struct ip_hdr *iphdr, struct udp_hdr *udphdr)
 {
 	void *data = mbuf_nextd(udphdr, void *);
@@ -172,23 +178,23 @@ void bsys_udp_send(void __user *__restrict vaddr, size_t len,
 
 	/* validate user input */
 	if (unlikely(len > UDP_MAX_LEN)) {
-		usys_ksys_ret(KSYS_UDP_SEND, -RET_INVAL, 0);
+		usys_ksys_ret(KSYS_UDP_SEND, -RET_INVAL, cookie);
 		return;
 	}
 
 	if (unlikely(copy_from_user(id, &tmp, sizeof(struct ip_tuple)))) {
-		usys_ksys_ret(KSYS_UDP_SEND, -RET_FAULT, 0);
+		usys_ksys_ret(KSYS_UDP_SEND, -RET_FAULT, cookie);
 		return;
 	}
 
 	if (unlikely(!uaccess_zc_okay(vaddr, len))) {
-		usys_ksys_ret(KSYS_UDP_SEND, -RET_FAULT, 0);
+		usys_ksys_ret(KSYS_UDP_SEND, -RET_FAULT, cookie);
 		return;
 	}
 
 	addr = (void *) vm_lookup_phys(vaddr, PGSIZE_2MB);
 	if (unlikely(!addr)) {
-		usys_ksys_ret(KSYS_UDP_SEND, -RET_FAULT, 0);
+		usys_ksys_ret(KSYS_UDP_SEND, -RET_FAULT, cookie);
 		return;
 	}
 
@@ -196,7 +202,7 @@ void bsys_udp_send(void __user *__restrict vaddr, size_t len,
 
 	pkt = mbuf_alloc_local();
 	if (unlikely(!pkt)) {
-		usys_ksys_ret(KSYS_UDP_SEND, -RET_NOBUFS, 0);
+		usys_ksys_ret(KSYS_UDP_SEND, -RET_NOBUFS, cookie);
 		return;
 	}
 
@@ -230,17 +236,107 @@ void bsys_udp_send(void __user *__restrict vaddr, size_t len,
 		for (i = 0; i < pkt->nr_iov; i++)
 			mbuf_iov_free(&pkt->iovs[i]);
 		mbuf_free(pkt);
-		usys_ksys_ret(KSYS_UDP_SEND, ret, 0);
+		usys_ksys_ret(KSYS_UDP_SEND, ret, cookie);
 		return;
 	}
 }
 
+/**
+ * bsys_udp_sendv - send a UDP packet using scatter-gather data
+ * @ents: the user-level SG entries of the payload
+ * @nrents: the number of SG entries, at most UDP_MAX_SG
+ * @id: the IP destination
+ * @cookie: a user-level tag for the request
+ *
+ * The entries are gathered into a single datagram, without copying.
+ */
 void bsys_udp_sendv(struct sg_entry __user *ents, unsigned int nrents,
 		    struct ip_tuple __user *id, unsigned long cookie)
 {
+	struct ip_tuple tmp;
+	struct mbuf *pkt;
+	struct sg_entry ent;
+	void *vaddr, *addr;
+	size_t len, left, total = 0;
+	int ret;
+	int i;
+
 	KSTATS_VECTOR(bsys_udp_sendv);
 
-	usys_ksys_ret(KSYS_UDP_SENDV, -RET_NOSYS, 0);
+	BUILD_ASSERT(align_up(UDP_PKT_SIZE, sizeof(uint64_t)) +
+		     UDP_MAX_SG * 2 * sizeof(struct mbuf_iov) <= MBUF_DATA_LEN);
+
+	/* validate user input */
+	if (unlikely(!nrents || nrents > UDP_MAX_SG)) {
+		usys_ksys_ret(KSYS_UDP_SENDV, -RET_INVAL, cookie);
+		return;
+	}
+
+	if (unlikely(!uaccess_okay(ents, nrents * sizeof(struct sg_entry)))) {
+		usys_ksys_ret(KSYS_UDP_SENDV, -RET_FAULT, cookie);
+		return;
+	}
+
+	if (unlikely(copy_from_user(id, &tmp, sizeof(struct ip_tuple)))) {
+		usys_ksys_ret(KSYS_UDP_SENDV, -RET_FAULT, cookie);
+		return;
+	}
+
+	pkt = mbuf_alloc_local();
+	if (unlikely(!pkt)) {
+		usys_ksys_ret(KSYS_UDP_SENDV, -RET_NOBUFS, cookie);
+		return;
+	}
+
+	pkt->iovs = mbuf_mtod_off(pkt, struct mbuf_iov *,
+				  align_up(UDP_PKT_SIZE, sizeof(uint64_t)));
+	pkt->nr_iov = 0;
+
+	for (i = 0; i < nrents; i++) {
+		vaddr = (void *) uaccess_peekq((uint64_t *) &ents[i].base);
+		left = uaccess_peekq(&ents[i].len);
+
+		total += left;
+		if (unlikely(total > UDP_MAX_LEN)) {
+			ret = -RET_INVAL;
+			goto fail;
+		}
+
+		if (unlikely(!uaccess_zc_okay(vaddr, left))) {
+			ret = -RET_FAULT;
+			goto fail;
+		}
+
+		/* user pages are not physically contiguous */
+		while (left) {
+			addr = (void *) vm_lookup_phys(vaddr, PGSIZE_2MB);
+			if (unlikely(!addr)) {
+				ret = -RET_FAULT;
+				goto fail;
+			}
+
+			ent.base = (void *)((uintptr_t) addr + PGOFF_2MB(vaddr));
+			ent.len = left;
+			len = mbuf_iov_create(&pkt->iovs[pkt->nr_iov++], &ent);
+			vaddr = (void *)((uintptr_t) vaddr + len);
+			left -= len;
+		}
+	}
+
+	pkt->done = &udp_mbuf_done;
+	pkt->done_data = cookie;
+
+	ret = udp_output(pkt, &tmp, total);
+	if (unlikely(ret))
+		goto fail;
+
+	return;
+
+fail:
+	for (i = 0; i < pkt->nr_iov; i++)
+		mbuf_iov_free(&pkt->iovs[i]);
+	mbuf_free(pkt);
+	usys_ksys_ret(KSYS_UDP_SENDV, ret, cookie);
 }
 
 #define MAX_MBUF_PAGE_OFF	(PGSIZE_2MB - (PGSIZE_2MB % MBUF_LEN))
@@ -27,6 +27,20 @@
 
 #pragma once
 
+/*
+ * Vectorized one's complement sum kernels, selected at boot by
+ * chksum_init() from the CPU features (AVX2, SSE4.2 or plain 64-bit).
+ * Both return the folded but non-inverted 16-bit sum of the buffer
+ * taken as a sequence of 16-bit words in memory order, which is what
+ * lwIP's LWIP_CHKSUM and LWIP_CHKSUM_COPY expect.
+ */
+extern uint16_t (*chksum_partial)(const void *buf, int len);
+extern uint16_t (*chksum_copy_partial)(void *dst, const void *src, int len);
+extern int chksum_init(void);
+
+/* below this length the inline version beats an indirect call */
+#define CHKSUM_VEC_MIN_LEN	128
+
 /**
  * chksum_internet - performs an internet checksum on a buffer
  * @buf: the buffer
@@ -41,6 +55,9 @@ static inline uint16_t chksum_internet(const char *buf, int len)
 {
 	uint64_t sum;
 
+	if (len >= CHKSUM_VEC_MIN_LEN)
+		return ~chksum_partial(buf, len);
+
 	asm volatile("xorq %0, %0\n"
 
 		     /* process 8 byte chunks */
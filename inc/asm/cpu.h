@@ -78,3 +78,54 @@ static inline unsigned long rdmsr(unsigned int msr)
 	asm volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
 	return low | ((unsigned long)high << 32);
 }
+
+static inline void cpuid(unsigned int leaf, unsigned int subleaf,
+			 unsigned int *a, unsigned int *b,
+			 unsigned int *c, unsigned int *d)
+{
+	asm volatile("cpuid"
+		     : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d)
+		     : "a"(leaf), "c"(subleaf));
+}
+
+static inline unsigned long xgetbv(unsigned int index)
+{
+	unsigned int low, high;
+
+	asm volatile("xgetbv" : "=a"(low), "=d"(high) : "c"(index));
+	return low | ((unsigned long)high << 32);
+}
+
+#define CPUID_1_ECX_OSXSAVE	(1 << 27)
+
+/* XCR0 state components */
+#define XCR0_X87		(1 << 0)
+#define XCR0_SSE		(1 << 1)
+#define XCR0_AVX		(1 << 2)
+#define XCR0_ZMM_HI256		(1 << 6)
+
+/**
+ * xsave - saves processor state components
+ * @area: a 64-byte aligned area in the standard format
+ * @mask: the components to save
+ */
+static inline void xsave(void *area, unsigned long mask)
+{
+	asm volatile("xsave (%0)"
+		     : : "r"(area), "a"((unsigned int) mask),
+		     "d"((unsigned int) (mask >> 32))
+		     : "memory");
+}
+
+/**
+ * xrstor - restores processor state components saved by xsave()
+ * @area: the area
+ * @mask: the components to restore
+ */
+static inline void xrstor(const void *area, unsigned long mask)
+{
+	asm volatile("xrstor (%0)"
+		     : : "r"(area), "a"((unsigned int) mask),
+		     "d"((unsigned int) (mask >> 32))
+		     : "memory");
+}
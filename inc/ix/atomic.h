@@ -97,9 +97,9 @@ static inline bool atomic_dec_and_test(atomic_t *a)
 	return (atomic_sub_and_fetch(a, 1) == 0);
 }
 
-static inline bool atomic_cmpxchg(atomic_t *a, int old, int new)
+static inline bool atomic_cmpxchg(atomic_t *a, int old, int val)
 {
-	return __sync_bool_compare_and_swap(&a->cnt, old, new);
+	return __sync_bool_compare_and_swap(&a->cnt, old, val);
 }
 
 static inline long atomic64_read(const atomic64_t *a)
@@ -142,8 +142,8 @@ static inline bool atomic64_dec_and_test(atomic64_t *a)
 	return (atomic64_sub_and_fetch(a, 1) == 0);
 }
 
-static inline bool atomic64_cmpxchg(atomic64_t *a, long old, long new)
+static inline bool atomic64_cmpxchg(atomic64_t *a, long old, long val)
 {
-	return __sync_bool_compare_and_swap(&a->cnt, old, new);
+	return __sync_bool_compare_and_swap(&a->cnt, old, val);
 }
 
@@ -86,3 +86,29 @@ static inline void bitmap_init(unsigned long *bits, int nbits, bool state)
 	memset(bits, state ? 0xff : 0x00, BITMAP_LONG_SIZE(nbits) * sizeof(long));
 }
 
+/**
+ * bitmap_find_next_set - finds the next set bit in the bitmap
+ * @bits: the bitmap
+ * @nbits: the number of total bits
+ * @pos: the first bit number to consider
+ *
+ * Returns the number of the first set bit at or after @pos, or @nbits if
+ * there is none.
+ */
+static inline int bitmap_find_next_set(unsigned long *bits, int nbits, int pos)
+{
+	int idx = BITMAP_POS_IDX(pos);
+	unsigned long word;
+
+	if (pos >= nbits)
+		return nbits;
+
+	word = bits[idx] & (~0ul << BITMAP_POS_SHIFT(pos));
+	while (!word) {
+		if (++idx >= BITMAP_LONG_SIZE(nbits))
+			return nbits;
+		word = bits[idx];
+	}
+
+	return min((int) (idx * BITS_PER_LONG + ctz64(word)), nbits);
+}
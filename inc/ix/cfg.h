@@ -34,6 +34,7 @@
 #define CFG_MAX_PORTS    16
 #define CFG_MAX_CPU     128
 #define CFG_MAX_ETHDEV   16
+#define CFG_CC_NAME_LEN  16
 
 
 struct cfg_ip_addr {
@@ -56,6 +57,11 @@ struct cfg_parameters {
 
 	int num_ports;
 	uint16_t ports[CFG_MAX_PORTS];
+	/* congestion control of each port, empty for the default */
+	char port_cc[CFG_MAX_PORTS][CFG_CC_NAME_LEN];
+	/* ACK policy of each port and its delay in us, 0 for the default */
+	int port_ack_policy[CFG_MAX_PORTS];
+	unsigned int port_ack_delay[CFG_MAX_PORTS];
 
 	char loader_path[256];
 };
@@ -36,6 +36,7 @@ struct cpu_metrics {
 	double queue_size[3];
 	long loop_duration;
 	double idle[3];
+	unsigned int batch_limit;
 } __aligned(64);
 
 struct flow_group_metrics {
@@ -36,7 +36,7 @@ extern int cpus_active; /* the number of in-use CPUs */
 
 /* used to define percpu variables */
 #define DEFINE_PERCPU(type, name) \
-	typeof(type) name __attribute__((section(".percpu,\"\",@nobits#")))
+	__typeof__(type) name __attribute__((section(".percpu,\"\",@nobits#")))
 
 /* used to make percpu variables externally available */
 #define DECLARE_PERCPU(type, name) \
@@ -93,7 +93,7 @@ static inline void *__percpu_get(void *key)
 
 static inline unsigned int __cpu_next_active(unsigned int cpu)
 {
-	while (cpu < cpu_count) {
+	while (cpu < (unsigned int) cpu_count) {
 		cpu++;
 
 		if (cpu_is_active(cpu))
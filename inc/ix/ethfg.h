@@ -39,7 +39,8 @@
 
 #define NETHDEV	16
 #define ETH_MAX_TOTAL_FG (ETH_MAX_NUM_FG * NETHDEV)
-#define TCP_ACTIVE_PCBS_MAX_BUCKETS (512)    // per flow group
+#define TCP_ACTIVE_TBL_MIN_BUCKETS (64)     // per flow group, grows on demand
+#define TCP_ACTIVE_TBL_SLOTS 6
 
 //FIXME - should be a function of max_cpu * NETDEV
 #define NQUEUE 64
@@ -47,9 +48,44 @@
 struct eth_rx_queue;
 
 
-struct tcp_hash_entry {
-	struct hlist_head pcbs;
-	struct hlist_node hash_link;
+struct tcp_pcb;
+
+/*
+ * One cache line of a flow group's connection table. A non-zero 16-bit
+ * tag per slot filters candidates before any tcp_pcb is touched.
+ */
+struct tcp_active_bucket {
+	uint16_t	tags[TCP_ACTIVE_TBL_SLOTS];
+	uint16_t	overflow;	/* entries that probed past this bucket */
+	uint16_t	unused;
+	struct tcp_pcb	*pcbs[TCP_ACTIVE_TBL_SLOTS];
+} __aligned(CACHE_LINE_SIZE);
+
+/*
+ * Open-addressing table of the active connections of a flow group. It
+ * doubles when it gets 3/4 full; entries of the previous table are moved
+ * over a few buckets at a time on later inserts and removals.
+ */
+struct tcp_active_tbl {
+	struct tcp_active_bucket *buckets;
+	uint32_t	mask;
+	uint32_t	count;
+	struct tcp_active_bucket *old_buckets;
+	uint32_t	old_mask;
+	uint32_t	old_pos;
+};
+
+#define TCP_TW_TBL_MIN_BUCKETS	1024
+
+/*
+ * Compact TIME-WAIT entries (struct tcp_tw) of a flow group, chained by
+ * connection hash. The bucket array doubles when the chains get longer
+ * than two entries on average.
+ */
+struct tcp_tw_tbl {
+	struct hlist_head *buckets;
+	uint32_t	mask;
+	uint32_t	count;
 };
 
 struct eth_fg {
@@ -72,15 +108,14 @@ struct eth_fg {
 	// LWIP/TCP globals (per flow)
 	struct timer          tcpip_timer;
 	bool                  tcp_active_pcb_changed;
-	bool                  tcp_timer;
-	bool                  tcp_timer_ctr;
 
 	uint32_t              iss;
 	uint32_t              tcp_ticks;
-	struct hlist_head     active_buckets; // tcp_hash_entry list
-	struct hlist_head     tw_pcbs;        // tcp_pcb
+	struct hlist_head     active_pcbs;    // tcp_pcb
+	struct hlist_head     tw_pcbs;        // tcp_pcb entering TIME-WAIT
 	struct hlist_head     bound_pcbs;     // tcp_pcb
-	struct tcp_hash_entry active_tbl[TCP_ACTIVE_PCBS_MAX_BUCKETS];
+	struct tcp_active_tbl active_tbl;     // lookup index of active_pcbs
+	struct tcp_tw_tbl     tw_tbl;         // compact TIME-WAIT entries
 
 };
 
@@ -126,6 +161,11 @@ static inline void unset_current_fg(void)
 extern void eth_fg_init(struct eth_fg *fg, unsigned int idx);
 extern int eth_fg_init_cpu(struct eth_fg *fg);
 extern void eth_fg_free(struct eth_fg *fg);
+
+extern int tcp_active_tbl_init(struct tcp_active_tbl *tbl);
+extern void tcp_active_tbl_free(struct tcp_active_tbl *tbl);
+extern int tcp_tw_tbl_init(struct tcp_tw_tbl *tbl);
+extern void tcp_tw_tbl_free(struct tcp_tw_tbl *tbl);
 extern void eth_fg_assign_to_cpu(bitmap_ptr fg_bitmap, int cpu);
 
 extern int nr_flow_groups;
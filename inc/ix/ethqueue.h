@@ -37,7 +37,26 @@
 #define ETH_DEV_TX_QUEUE_SZ     4096
 #define ETH_RX_MAX_DEPTH	32768
 
+/* bounds and step of the adaptive RX batch limit */
+#define ETH_RX_MIN_BATCH	4
+#define ETH_RX_BATCH_STEP	4
+
+/* thresholds that force a doorbell when TX coalescing is enabled */
+#define ETH_TX_FLUSH_PKTS	32
+#define ETH_TX_FLUSH_BYTES	(16 * 1024)
+
+/* number of mbufs a driver returns to the pool at once on TX reclaim */
+#define ETH_TX_FREE_BULK	64
+
+/* free descriptor count below which a TX queue is reclaimed */
+#define ETH_TX_RECLAIM_WATERMARK(nb_desc) ((nb_desc) / 2)
+
+/* longest time in us a TX queue goes unreclaimed on a busy core */
+#define ETH_TX_RECLAIM_MAX_DELAY	100
+
 extern unsigned int eth_rx_max_batch;
+extern unsigned int eth_rx_target_delay;
+extern unsigned int eth_tx_flush_delay;
 
 
 /*
@@ -115,6 +134,12 @@ extern bool eth_rx_idle_wait(uint64_t max_usecs);
 struct eth_tx_queue {
 	int cap;	/* number of available buffers left */
 	int len;	/* number of buffers used so far */
+	int reclaim_thresh; /* reclaim lazily only when cap drops below */
+	int user_sent;	/* mbufs with user buffers queued since the last reclaim */
+	unsigned long reclaim_tsc; /* when the queue was last reclaimed */
+	uint32_t tx_offload_capa; /* DEV_TX_OFFLOAD_* supported by the queue */
+	int bytes;	/* number of bytes pending in bufs */
+	unsigned long first_tsc; /* when the oldest pending buffer was queued */
 	struct mbuf *bufs[ETH_DEV_TX_QUEUE_SZ];
 
 	int (*reclaim)(struct eth_tx_queue *tx);
@@ -133,6 +158,8 @@ struct eth_tx_queue {
  */
 static inline int eth_tx_reclaim(struct eth_tx_queue *tx)
 {
+	tx->user_sent = 0;
+	tx->reclaim_tsc = rdtsc();
 	return tx->reclaim(tx);
 }
 
@@ -161,7 +188,12 @@ static inline int eth_tx_xmit(struct eth_tx_queue *tx,
  */
 static inline int eth_send(struct eth_tx_queue *txq, struct mbuf *mbuf)
 {
-	int nr = 1 + mbuf->nr_iov;
+	int i, nr = 1 + mbuf->nr_iov;
+
+	/* a TSO packet may need a context descriptor as well */
+	if (mbuf->ol_flags & PKT_TX_TCP_SEG)
+		nr++;
+
 	if (unlikely(nr > txq->cap)) {
 		log_info("eth_send full. will try to reclaim.\n");
 		txq->cap = eth_tx_reclaim(txq);
@@ -171,8 +203,16 @@ static inline int eth_send(struct eth_tx_queue *txq, struct mbuf *mbuf)
 		}
 	}
 
+	if (eth_tx_flush_delay && !txq->len)
+		txq->first_tsc = rdtsc();
+
 	txq->bufs[txq->len++] = mbuf;
 	txq->cap -= nr;
+	if (mbuf->nr_iov)
+		txq->user_sent++;
+	txq->bytes += mbuf->len;
+	for (i = 0; i < mbuf->nr_iov; i++)
+		txq->bytes += mbuf->iovs[i].len;
 
 	return 0;
 }
@@ -193,11 +233,14 @@ static inline int eth_send_one(struct eth_tx_queue *txq, struct mbuf *mbuf, size
 }
 
 DECLARE_PERCPU(int, eth_num_queues);
+DECLARE_PERCPU(unsigned int, eth_rx_batch);
 DECLARE_PERCPU(struct eth_rx_queue *, eth_rxqs[]);
 DECLARE_PERCPU(struct eth_tx_queue *, eth_txqs[]);
 
 extern int eth_process_poll(void);
 extern int eth_process_recv(void);
 extern void eth_process_send(void);
+extern void eth_process_send_coalesced(void);
 extern void eth_process_reclaim(void);
+extern void eth_process_reclaim_lazy(void);
 
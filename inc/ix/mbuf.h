@@ -83,6 +83,8 @@ struct mbuf {
 	void (*done)(struct mbuf *m);  /* called on free */
 	unsigned long done_data; /* extra data to pass to done() */
 	unsigned long timestamp; /* receive timestamp (in CPU clock ticks) */
+	uint16_t tso_mss;	/* segment payload size (PKT_TX_TCP_SEG only) */
+	uint16_t tso_l4_len;	/* TCP header length (PKT_TX_TCP_SEG only) */
 };
 
 #define MBUF_HEADER_LEN		64	/* one cache line */
@@ -92,6 +94,7 @@ struct mbuf {
 /* Offload flag bits */
 #define PKT_TX_IP_CKSUM      0x1000 /**< IP cksum of TX pkt. computed by NIC. */
 #define PKT_TX_TCP_CKSUM     0x2000 /**< TCP cksum of TX pkt. computed by NIC. */
+#define PKT_TX_TCP_SEG       0x4000 /**< TCP segmentation offload (TSO). */
 
 
 /**
@@ -177,6 +180,7 @@ static inline struct mbuf *mbuf_alloc(struct mempool *pool)
 		return NULL;
 
 	m->next = NULL;
+	m->nr_iov = 0;
 	m->done = &mbuf_default_done;
 
 	return m;
@@ -211,6 +215,28 @@ static inline void mbuf_xmit_done(struct mbuf *m)
 	m->done(m);
 }
 
+/**
+ * mbuf_xmit_done_bulk - called when a TX queue completes several mbufs
+ * @mbufs: the mbufs (the array is reused as scratch space)
+ * @nr: the number of mbufs
+ *
+ * Mbufs with the default completion handler go back to the core-local pool
+ * in bulk, the others have their handler called one by one.
+ */
+static inline void mbuf_xmit_done_bulk(struct mbuf **mbufs, int nr)
+{
+	int i, nr_free = 0;
+
+	for (i = 0; i < nr; i++) {
+		if (mbufs[i]->done == &mbuf_default_done)
+			mbufs[nr_free++] = mbufs[i];
+		else
+			mbuf_xmit_done(mbufs[i]);
+	}
+
+	mempool_free_bulk(&percpu_get(mbuf_mempool), (void **) mbufs, nr_free);
+}
+
 /**
  * mbuf_alloc_local - allocate an mbuf from the core-local mempool
  *
@@ -232,4 +258,6 @@ extern void mbuf_exit_cpu(void);
 struct eth_rx_queue;
 
 extern void eth_input(struct eth_rx_queue *rx_queue, struct mbuf *pkt);
+extern void tcp_gro_flush(void);
+extern void tcp_ack_flush(void);
 
@@ -223,6 +223,50 @@ here:
 		mempool_free_2(m, ptr);
 }
 
+/**
+ * mempool_free_bulk - frees several elements back in to a memory pool
+ * @m: the memory pool
+ * @ptrs: the elements
+ * @nr: the number of elements
+ *
+ * Links as many elements as fit in the private chunk with a single update
+ * of the free list head.
+ *
+ * NOTE: Must be the same memory pool that they were allocated from
+ */
+static inline void mempool_free_bulk(struct mempool *m, void **ptrs, int nr)
+{
+	struct mempool_hdr *elem;
+	int i, n;
+
+#if MEMPOOL_DEBUG
+	for (i = 0; i < nr; i++)
+		mempool_free(m, ptrs[i]);
+	return;
+#endif
+
+	while (nr) {
+		n = min(nr, m->chunk_size - m->num_free);
+		if (!n) {
+			mempool_free_2(m, ptrs[0]);
+			ptrs++;
+			nr--;
+			continue;
+		}
+
+		for (i = 0; i < n; i++) {
+			MEMPOOL_SANITY_ACCESS(ptrs[i]);
+			elem = (struct mempool_hdr *) ptrs[i];
+			elem->next = (i + 1 < n) ? (struct mempool_hdr *) ptrs[i + 1] : m->head;
+		}
+
+		m->head = (struct mempool_hdr *) ptrs[0];
+		m->num_free += n;
+		ptrs += n;
+		nr -= n;
+	}
+}
+
 static inline void *mempool_idx_to_ptr(struct mempool *m, uint32_t idx)
 {
 	void *p;
@@ -241,6 +285,24 @@ static inline uintptr_t mempool_ptr_to_idx(struct mempool *m, void *p)
 	return x;
 }
 
+/**
+ * mempool_datastore_usage - estimates how much of a datastore is in use
+ * @mds: the datastore
+ *
+ * Chunks cached by the per-cpu mempools count as used, so this may exceed
+ * the real usage by up to one chunk per cpu. The read is unlocked.
+ *
+ * Returns the percentage of chunks handed out.
+ */
+static inline unsigned int mempool_datastore_usage(struct mempool_datastore *mds)
+{
+	int free_chunks = *(volatile int *)&mds->free_chunks;
+
+	if (!mds->num_chunks)
+		return 0;
+	return 100 - 100 * free_chunks / mds->num_chunks;
+}
+
 
 extern int mempool_create_datastore(struct mempool_datastore *m, int nr_elems, size_t elem_len, int nostraddle, int chunk_size, const char *prettyname);
 extern int mempool_create(struct mempool *m, struct mempool_datastore *mds, int16_t sanity_type, int16_t sanity_id);
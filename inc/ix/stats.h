@@ -9,7 +9,7 @@
 	COUNTER(steals) \
 	COUNTER(usertime) \
 	HISTOGRAM(batch, 0, 20, 20) \
-	HISTOGRAM(xmit_batch, 0, 20, 20)
+	HISTOGRAM(xmit_batch, 0, 64, 32)
 
 #if CONFIG_STATS
 
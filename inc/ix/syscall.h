@@ -82,9 +82,13 @@ enum {
 	SYS_NRCPUS,
 	SYS_TIMER_INIT,
 	SYS_TIMER_CTL,
+	SYS_RING_SETUP,
 	SYS_NR,
 };
 
+/* SYS_BPOLL flags */
+#define BPOLL_NONBLOCK	0x1	/* return after one pass, even without events */
+
 
 /*
  * Batched system calls
@@ -150,6 +154,48 @@ static inline struct bsys_desc *bsys_arr_next(struct bsys_arr *a)
 }
 
 
+/*
+ * Shared-memory submission and completion rings
+ *
+ * As an alternative to passing arrays through bpoll/bcall, a thread can
+ * set up a ring pair with SYS_RING_SETUP. The application produces
+ * ksys descriptors at sq.tail and the kernel consumes them at sq.head
+ * whenever it runs on that core; the kernel produces usys events at
+ * cq->tail and the application consumes them at cq_head. Each index is
+ * written by exactly one side and is free-running (masked on access).
+ *
+ * The completion ring is mapped read-only in its own mapping, so the only
+ * part of it the application writes, cq_head, lives next to sq.
+ *
+ * An event stays outstanding (e.g., its receive buffer stays pinned)
+ * until the application advances cq_head past it.
+ */
+
+#define BSYS_RING_SIZE	4096
+#define BSYS_RING_MASK	(BSYS_RING_SIZE - 1)
+
+struct bsys_ring {
+	volatile uint32_t head;
+	uint32_t pad0[CACHE_LINE_SIZE / sizeof(uint32_t) - 1];
+	volatile uint32_t tail;
+	uint32_t pad1[CACHE_LINE_SIZE / sizeof(uint32_t) - 1];
+	struct bsys_desc descs[BSYS_RING_SIZE];
+};
+
+struct bsys_cring {
+	volatile uint32_t tail;
+	uint32_t pad0[CACHE_LINE_SIZE / sizeof(uint32_t) - 1];
+	struct bsys_desc descs[BSYS_RING_SIZE];
+};
+
+struct bsys_rings {
+	struct bsys_ring sq;
+	volatile uint32_t cq_head;
+	uint32_t pad0[CACHE_LINE_SIZE / sizeof(uint32_t) - 1];
+	const struct bsys_cring *cq;	/* set by the kernel, read-only */
+};
+
+
 /*
  * Commands that can be sent from the user-level application to the kernel.
  */
@@ -339,6 +385,7 @@ struct locked_bsys_arr {
 DECLARE_PERCPU(bool, in_kernel);
 DECLARE_PERCPU(struct locked_bsys_arr, ksys_remote);
 void bsys_dispatch_remote(void);
+void bsys_ring_poll(void);
 
 /**
  * usys_reset - reset the batched call array
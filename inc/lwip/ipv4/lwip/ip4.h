@@ -124,6 +124,12 @@ PACK_STRUCT_END
 #define IPH_PROTO(hdr) ((hdr)->_proto)
 #define IPH_CHKSUM(hdr) ((hdr)->_chksum)
 
+/* ECN field in the low bits of the TOS byte (RFC 3168) */
+#define IPH_ECN_MASK 0x03U
+#define IPH_ECN_ECT0 0x02U
+#define IPH_ECN_CE   0x03U
+#define IPH_ECN(hdr) ((hdr)->_tos & IPH_ECN_MASK)
+
 #define IPH_VHL_SET(hdr, v, hl) (hdr)->_v_hl = (((v) << 4) | (hl))
 #define IPH_TOS_SET(hdr, tos) (hdr)->_tos = (tos)
 #define IPH_LEN_SET(hdr, len) (hdr)->_len = (len)
@@ -99,6 +99,7 @@ u16_t inet_chksum_pseudo(struct pbuf *p, u8_t proto, u16_t proto_len,
        ip_addr_t *src, ip_addr_t *dest);
 u16_t inet_chksum_pseudo_partial(struct pbuf *p, u8_t proto,
        u16_t proto_len, u16_t chksum_len, ip_addr_t *src, ip_addr_t *dest);
+u16_t inet_chksum_pseudo_tso(u8_t proto, ip_addr_t *src, ip_addr_t *dest);
 #if LWIP_CHKSUM_COPY_ALGORITHM
 u16_t lwip_chksum_copy(void *dst, const void *src, u16_t len);
 #endif /* LWIP_CHKSUM_COPY_ALGORITHM */
@@ -41,12 +41,14 @@ extern const u16_t memp_sizes[MEMP_MAX];
 
 int  memp_init(void);
 int  memp_init_cpu(void);
+unsigned int memp_tcp_pcb_usage(void);
 
 DECLARE_PERCPU(struct mempool, pbuf_mempool);
 DECLARE_PERCPU(struct mempool, pbuf_with_payload_mempool);
 DECLARE_PERCPU(struct mempool, tcp_pcb_mempool);
 DECLARE_PERCPU(struct mempool, tcp_pcb_listen_mempool);
 DECLARE_PERCPU(struct mempool, tcp_seg_mempool);
+DECLARE_PERCPU(struct mempool, tcp_tw_mempool);
 
 static inline void *memp_malloc(memp_t type)
 {
@@ -59,6 +61,8 @@ static inline void *memp_malloc(memp_t type)
 		return mempool_alloc(&percpu_get(tcp_pcb_listen_mempool));
 	case MEMP_TCP_SEG:
 		return mempool_alloc(&percpu_get(tcp_seg_mempool));
+	case MEMP_TCP_TW:
+		return mempool_alloc(&percpu_get(tcp_tw_mempool));
 	case MEMP_SYS_TIMEOUT:
 	case MEMP_PBUF_POOL:
 	case MEMP_MAX:
@@ -83,6 +87,9 @@ static inline void memp_free(memp_t type, void *mem)
 	case MEMP_TCP_SEG:
 		mempool_free(&percpu_get(tcp_seg_mempool), mem);
 		return;
+	case MEMP_TCP_TW:
+		mempool_free(&percpu_get(tcp_tw_mempool), mem);
+		return;
 	case MEMP_SYS_TIMEOUT:
 	case MEMP_PBUF_POOL:
 	case MEMP_MAX:
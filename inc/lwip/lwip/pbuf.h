@@ -108,6 +108,10 @@ typedef enum {
 #define PBUF_FLAG_LLMCAST   0x10U
 /** indicates this pbuf includes a TCP FIN flag */
 #define PBUF_FLAG_TCP_FIN   0x20U
+/** indicates this pbuf chain holds several coalesced TCP segments */
+#define PBUF_FLAG_GRO       0x40U
+/** indicates this pbuf was received with the IP ECN field set to CE */
+#define PBUF_FLAG_CE        0x80U
 
 struct pbuf {
   struct mempool *pool;
@@ -161,7 +161,7 @@ typedef u16_t tcpflags_t;
 #define RCV_WND_SCALE(pcb, wnd) (wnd)
 #define SND_WND_SCALE(pcb, wnd) (wnd)
 typedef u16_t tcpwnd_size_t;
-typedef u8_t tcpflags_t;
+typedef u16_t tcpflags_t;
 #endif
 
 enum tcp_state {
@@ -178,6 +178,14 @@ enum tcp_state {
   TIME_WAIT   = 10
 };
 
+/** When received data is acknowledged (see tcp_ack()) */
+enum tcp_ack_policy {
+  TCP_ACK_DELAYED   = 0, /* every second segment, or after ack_delay */
+  TCP_ACK_IMMEDIATE = 1, /* every segment */
+  TCP_ACK_PIGGYBACK = 2, /* on the next data sent, or after ack_delay */
+  TCP_ACK_BATCH     = 3  /* once per RX batch */
+};
+
 #if LWIP_CALLBACK_API
   /* Function to call when a listener has been connected.
    * @param arg user-supplied argument (tcp_pcb.callback_arg)
@@ -191,6 +199,8 @@ enum tcp_state {
 #define DEF_ACCEPT_CALLBACK
 #endif /* LWIP_CALLBACK_API */
 
+struct tcp_cc_ops;
+
 /**
  * members common to struct tcp_pcb and struct tcp_listen_pcb
   struct timer delayed_ack_timer; \
@@ -208,12 +218,17 @@ enum tcp_state {
   uint64_t timer_delayedack_expires;\
   uint64_t timer_retransmit_expires;\
   uint64_t timer_persist_expires;\
+  uint64_t timer_slow_expires;\
   void *callback_arg;						\
   /* the accept callback for listen- and normal pcbs, if LWIP_CALLBACK_API */ \
   DEF_ACCEPT_CALLBACK \
   u32_t delayed_ack_counter; \
   enum tcp_state state; /* TCP state */ \
   u8_t prio; \
+  u8_t hashed; /* in the flow group's active_tbl */ \
+  const struct tcp_cc_ops *cc; /* congestion control algorithm */ \
+  u8_t ack_policy; /* enum tcp_ack_policy */ \
+  u32_t ack_delay; /* in us, for TCP_ACK_DELAYED and TCP_ACK_PIGGYBACK */ \
   /* ports are in host byte order */ \
   u16_t local_port
 
@@ -239,6 +254,11 @@ struct tcp_pcb {
 #if LWIP_WND_SCALE
 #define TF_WND_SCALE   ((tcpflags_t)0x0100U)   /* Window Scale option enabled */
 #endif
+#define TF_ECN         ((tcpflags_t)0x0200U)   /* ECN negotiated on the connection */
+#define TF_ECN_CE      ((tcpflags_t)0x0400U)   /* last segment received was CE marked */
+#define TF_CC_CWR      ((tcpflags_t)0x0800U)   /* window already reduced for ECE in this window */
+#define TF_ACK_BATCH   ((tcpflags_t)0x1000U)   /* queued for an ACK at the end of the RX batch */
+#define TF_ACK_DUE     ((tcpflags_t)0x2000U)   /* that ACK has not been sent yet */
 
   /* the rest of the fields are in host byte order
      as we have to do some math with them */
@@ -272,6 +292,13 @@ struct tcp_pcb {
   tcpwnd_size_t cwnd;
   tcpwnd_size_t ssthresh;
 
+  /* DCTCP state: fraction of marked bytes (scaled by 1024) and the
+     bytes acknowledged in the current observation window */
+  u16_t dctcp_alpha;
+  u32_t dctcp_wnd_end;
+  u32_t dctcp_acked;
+  u32_t dctcp_ce_acked;
+
   /* sender variables */
   u32_t snd_nxt;   /* next new seqno to be sent */
   u32_t snd_wl1, snd_wl2; /* Sequence and acknowledgement numbers of last
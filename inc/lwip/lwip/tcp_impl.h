@@ -85,6 +85,7 @@ void             tcp_init    (struct eth_fg *);  /* Initialize this module. */
 	void             tcp_input   (struct eth_fg *cur_fg, struct pbuf *p, ipX_addr_t *,ipX_addr_t *);
 /* Used within the TCP code only: */
 struct tcp_pcb * tcp_alloc   (struct eth_fg *,u8_t prio);
+void             tcp_pcb_init(struct eth_fg *, struct tcp_pcb *pcb, u8_t prio);
 void             tcp_abandon (struct eth_fg *,struct tcp_pcb *pcb, int reset);
 err_t            tcp_send_empty_ack(struct eth_fg *,struct tcp_pcb *pcb);
 void             tcp_rexmit  (struct tcp_pcb *pcb);
@@ -378,12 +379,84 @@ struct tcp_global_percpu_lists {
 
 DECLARE_PERCPU(struct tcp_global_percpu_lists,tcp_cpu_lists);
 
-static inline int tcp_to_idx(ipX_addr_t *local_ip, ipX_addr_t *remote_ip, uint16_t local_port, uint16_t remote_port)
+static inline u32_t tcp_conn_hash(ipX_addr_t *local_ip, ipX_addr_t *remote_ip, uint16_t local_port, uint16_t remote_port)
 {
-  int idx = hash_crc32c_two(TCP_ACTIVE_PCBS_HASH_SEED, local_ip->addr, remote_ip->addr);
-  idx = hash_crc32c_one(idx, (local_port << 16) | remote_port);
-  idx &= TCP_ACTIVE_PCBS_MAX_BUCKETS - 1;
-  return idx;
+  u32_t hash = hash_crc32c_two(TCP_ACTIVE_PCBS_HASH_SEED, local_ip->addr, remote_ip->addr);
+  return hash_crc32c_one(hash, (local_port << 16) | remote_port);
+}
+
+struct tcp_pcb *tcp_active_lookup(struct eth_fg *cur_fg, u32_t hash,
+                                  ipX_addr_t *local_ip, ipX_addr_t *remote_ip,
+                                  u16_t local_port, u16_t remote_port);
+int tcp_active_insert(struct eth_fg *cur_fg, struct tcp_pcb *pcb, u32_t hash);
+void tcp_active_remove(struct eth_fg *cur_fg, struct tcp_pcb *pcb);
+
+/** Compact state of a connection in TIME-WAIT. The tcp_pcb is freed as
+    soon as a connection enters TIME-WAIT; this is all that is kept until
+    2MSL expire. */
+struct tcp_tw {
+  struct hlist_node link;     /* in the flow group's tw_tbl */
+  struct timer timer;         /* 2MSL expiry */
+  ip_addr_t local_ip;
+  ip_addr_t remote_ip;
+  u16_t local_port;
+  u16_t remote_port;
+  u32_t snd_nxt;
+  u32_t rcv_nxt;
+  tcpwnd_size_t rcv_wnd;      /* last announced window, unscaled */
+  u8_t tos;
+  u8_t ttl;
+#if LWIP_WND_SCALE
+  u8_t rcv_scale;
+#endif
+};
+
+struct tcp_tw *tcp_tw_lookup(struct eth_fg *cur_fg, u32_t hash,
+                             ipX_addr_t *local_ip, ipX_addr_t *remote_ip,
+                             u16_t local_port, u16_t remote_port);
+void tcp_tw_enter(struct eth_fg *cur_fg, struct tcp_pcb *pcb);
+void tcp_tw_restart(struct eth_fg *cur_fg, struct tcp_tw *tw);
+void tcp_tw_ack(struct eth_fg *cur_fg, struct tcp_tw *tw);
+
+/** SYN cookies (tcp_syncookie.c) */
+#define TCP_SYNCOOKIE_NO_WSCALE 0xFF
+
+extern unsigned int tcp_syn_cookie_threshold;
+
+int tcp_syncookie_init(void);
+bool tcp_syncookie_needed(struct tcp_pcb_listen *lpcb);
+u32_t tcp_syncookie_make(ipX_addr_t *local_ip, ipX_addr_t *remote_ip,
+                         u16_t local_port, u16_t remote_port,
+                         u32_t isn, u16_t *mss, u8_t wscale);
+int tcp_syncookie_check(ipX_addr_t *local_ip, ipX_addr_t *remote_ip,
+                        u16_t local_port, u16_t remote_port,
+                        u32_t isn, u32_t cookie, u16_t *mss, u8_t *wscale);
+void tcp_syncookie_synack(struct eth_fg *cur_fg, u32_t iss, u32_t ackno,
+                          ipX_addr_t *local_ip, ipX_addr_t *remote_ip,
+                          u16_t local_port, u16_t remote_port, u8_t wscale);
+
+/** Congestion control (tcp_cc.c). Every pcb points at one algorithm;
+    new connections inherit the algorithm of their listening pcb. */
+struct tcp_cc_ops {
+  const char *name;
+  u8_t ecn;                   /* negotiate ECN on connections using it */
+  void (*init)(struct tcp_pcb *pcb);
+  /* new data acknowledged; ece is set when the ACK carried ECE */
+  void (*acked)(struct tcp_pcb *pcb, u32_t acked, u8_t ece);
+  /* slow start threshold after a loss */
+  tcpwnd_size_t (*ssthresh)(struct tcp_pcb *pcb);
+};
+
+extern const struct tcp_cc_ops tcp_cc_reno;
+extern const struct tcp_cc_ops tcp_cc_dctcp;
+
+const struct tcp_cc_ops *tcp_cc_find(const char *name);
+
+static inline void tcp_cc_set(struct tcp_pcb *pcb, const struct tcp_cc_ops *cc)
+{
+  pcb->cc = cc;
+  if (cc->init)
+    cc->init(pcb);
 }
 
 
@@ -446,26 +519,21 @@ void tcp_persist_handler(struct timer *t);
     tcp_timer_needed(cur_fg);                            \
   } while (0)
 
+/** ACKs deferred to the end of the RX batch (tcp_ack.c) */
+void tcp_ack_batch(struct eth_fg *cur_fg, struct tcp_pcb *pcb);
+void tcp_ack_unqueue(struct tcp_pcb *pcb);
+int tcp_ack_policy_find(const char *name);
+
 /** 
  * __TCP_RMV -- complement to TCP_REG and TCP_REG_ACTIVE
  */
 
 static inline void __TCP_RMV(struct eth_fg *cur_fg,struct tcp_pcb *pcb)
 {
-	struct tcp_hash_entry *he = &cur_fg->active_tbl[0];
-	struct tcp_hash_entry *he2;
-	/* if you are removing the only entry in the hash list, remove the bucket from the bucket list */
-	if ((uintptr_t) pcb->link.prev >= (uintptr_t)he && 
-	    (uintptr_t) pcb->link.prev < (uintptr_t)&he[TCP_ACTIVE_PCBS_MAX_BUCKETS] &&
-	    pcb->link.next == NULL) {
-		he2 = (struct tcp_hash_entry *) pcb->link.prev;
-		int idx = he2 - he;
-		assert (idx>=0 && idx<TCP_ACTIVE_PCBS_MAX_BUCKETS);
-		assert ((uintptr_t)he + idx * sizeof(struct tcp_hash_entry) == (uintptr_t)he2);
-		
-		hlist_del(&he2->hash_link);
-		he2->hash_link.prev = NULL;
-	}
+	if (pcb->flags & TF_ACK_BATCH)
+		tcp_ack_unqueue(pcb);
+	if (pcb->hashed)
+		tcp_active_remove(cur_fg, pcb);
 	hlist_del(&pcb->link);		
 	pcb->link.prev = NULL;
 //	pcb->perqueue = NULL;
@@ -505,24 +573,22 @@ static inline void tcp_timer_needed(struct eth_fg *cur_fg)
 	/* timer is off but needed again? */
 
 	if (!timer_pending(&cur_fg->tcpip_timer) && 
-	    (!hlist_empty(&cur_fg->active_buckets) ||
-	     !hlist_empty(&cur_fg->tw_pcbs))) {
-		timer_add(&cur_fg->tcpip_timer, cur_fg,TCP_TMR_INTERVAL * ONE_MS);
+	    !hlist_empty(&cur_fg->active_pcbs)) {
+		timer_add(&cur_fg->tcpip_timer, cur_fg,TCP_SLOW_INTERVAL * ONE_MS);
 	}
 }
 
 
-static inline void TCP_REG_ACTIVE(struct tcp_pcb *npcb, int idx, struct eth_fg *cur_fg)
+/* returns 0 if successful, otherwise -ENOMEM and the pcb stays unregistered */
+static inline int TCP_REG_ACTIVE(struct tcp_pcb *npcb, u32_t hash, struct eth_fg *cur_fg)
 {
-	struct tcp_hash_entry *he = &cur_fg->active_tbl[idx];
-	
-	/* going from empty to non-empty list */
-	if (hlist_empty(&he->pcbs))
-		if (he->hash_link.prev == NULL)
-			hlist_add_head(&cur_fg->active_buckets,&he->hash_link);
-	
-	TCP_REG(&he->pcbs, npcb,cur_fg);
-	cur_fg->tcp_active_pcb_changed = 1;					
+	int ret = tcp_active_insert(cur_fg, npcb, hash);
+
+	if (unlikely(ret))
+		return ret;
+	TCP_REG(&cur_fg->active_pcbs, npcb,cur_fg);
+	cur_fg->tcp_active_pcb_changed = 1;
+	return 0;
 }
 
 
@@ -543,6 +609,7 @@ static inline void TCP_REG_ACTIVE(struct tcp_pcb *npcb, int idx, struct eth_fg *
 struct tcp_pcb *tcp_pcb_copy(struct tcp_pcb *pcb);
 void tcp_pcb_purge(struct tcp_pcb *pcb);
 void tcp_pcb_remove(struct eth_fg *cur_fg,struct tcp_pcb *pcb);
+void tcp_slow_timer_update(struct eth_fg *cur_fg,struct tcp_pcb *pcb);
 
 void tcp_segs_free(struct tcp_seg *seg);
 void tcp_seg_free(struct tcp_seg *seg);
@@ -559,6 +626,8 @@ tcp_recompute_timers(struct eth_fg *cur_fg,struct tcp_pcb *pcb)
 		first = pcb->timer_retransmit_expires;
 	if (pcb->timer_persist_expires>0 && pcb->timer_persist_expires<first)
 		first = pcb->timer_persist_expires;
+	if (pcb->timer_slow_expires>0 && pcb->timer_slow_expires<first)
+		first = pcb->timer_slow_expires;
 
 	if (timer_pending(&pcb->unified_timer) && first>=pcb->unified_timer.expires) {
 		;/* nothing */
@@ -572,22 +641,47 @@ tcp_recompute_timers(struct eth_fg *cur_fg,struct tcp_pcb *pcb)
 			
 /* MAX_PACKETS_DELAYED_ACK -- LWIP behavior set to 2 */
 #define MAX_PACKETS_DELAYED_ACK 2 
+
+static inline void tcp_ack_delay(struct eth_fg *cur_fg, struct tcp_pcb *pcb)
+{
+	pcb->timer_delayedack_expires = timer_now() + pcb->ack_delay;
+	tcp_recompute_timers(cur_fg, pcb);
+}
+
+/**
+ * tcp_ack - acknowledges received data according to the pcb's ACK policy
+ *
+ * Except under TCP_ACK_IMMEDIATE, an ACK that is due waits for the end of
+ * the RX batch, so a connection sends at most one per batch, and none if
+ * data carrying the ACK goes out first.
+ */
 static inline void tcp_ack(struct eth_fg *cur_fg,struct tcp_pcb *pcb)
 {
-	if(pcb->timer_delayedack_expires>0) {	
-		pcb->delayed_ack_counter++;
-		if (pcb->delayed_ack_counter>=MAX_PACKETS_DELAYED_ACK) {
-			pcb->timer_delayedack_expires = 0;
-			tcp_recompute_timers(cur_fg,pcb);
-			pcb->flags |= TF_ACK_NOW;
-		}
-	} else if (MAX_PACKETS_DELAYED_ACK == 1) {
+	switch (pcb->ack_policy) {
+	case TCP_ACK_IMMEDIATE:
 		pcb->flags |= TF_ACK_NOW;
-	} else {
-		pcb->delayed_ack_counter = 1;
-		pcb->timer_delayedack_expires = timer_now() + TCP_ACK_DELAY;
-		tcp_recompute_timers(cur_fg,
-pcb);
+		break;
+	case TCP_ACK_BATCH:
+		tcp_ack_batch(cur_fg, pcb);
+		break;
+	case TCP_ACK_PIGGYBACK:
+		if (!pcb->timer_delayedack_expires)
+			tcp_ack_delay(cur_fg, pcb);
+		break;
+	default:
+		if(pcb->timer_delayedack_expires>0) {	
+			pcb->delayed_ack_counter++;
+			if (pcb->delayed_ack_counter>=MAX_PACKETS_DELAYED_ACK) {
+				pcb->timer_delayedack_expires = 0;
+				tcp_recompute_timers(cur_fg,pcb);
+				tcp_ack_batch(cur_fg, pcb);
+			}
+		} else if (MAX_PACKETS_DELAYED_ACK == 1) {
+			tcp_ack_batch(cur_fg, pcb);
+		} else {
+			pcb->delayed_ack_counter = 1;
+			tcp_ack_delay(cur_fg, pcb);
+		}
 	}
 }  
     
@@ -56,6 +56,11 @@
 #define LWIP_PLATFORM_HTONL(x) hton32(x)
 #define LWIP_PLATFORM_NTOHL(x) ntoh32(x)
 
+#include <asm/chksum.h>
+
+#define LWIP_CHKSUM(dataptr, len) chksum_partial(dataptr, len)
+#define LWIP_CHKSUM_COPY(dst, src, len) chksum_copy_partial(dst, src, len)
+
 #define LWIP_WND_SCALE 1
 #define TCP_RCV_SCALE 7
 #define TCP_SND_BUF 65536
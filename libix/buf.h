@@ -41,6 +41,7 @@ extern __thread struct mempool ixev_buf_pool;
 struct ixev_buf {
 	uint32_t len;
 	uint32_t pad;
+	struct mempool *pool;	/* the pool of the allocating thread */
 	struct ixev_ref ref;
 	char payload[BUF_SIZE];
 };
@@ -48,7 +49,11 @@ struct ixev_buf {
 static inline void ixev_buf_release(struct ixev_ref *ref)
 {
 	struct ixev_buf *buf = container_of(ref, struct ixev_buf, ref);
-	mempool_free(&ixev_buf_pool, buf);
+
+	if (likely(buf->pool == &ixev_buf_pool))
+		mempool_free(&ixev_buf_pool, buf);
+	else
+		mempool_free_remote(buf->pool, buf);
 }
 
 /**
@@ -66,6 +71,7 @@ static inline struct ixev_buf *ixev_buf_alloc(void)
 		return NULL;
 
 	buf->len = 0;
+	buf->pool = &ixev_buf_pool;
 	buf->ref.cb = &ixev_buf_release;
 
 	return buf;
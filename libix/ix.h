@@ -27,6 +27,8 @@
 
 #pragma once
 
+#include <ix/atomic.h>
+
 #include "syscall.h"
 
 struct ix_ops {
@@ -47,6 +49,36 @@ struct ix_ops {
 
 extern void ix_flush(void);
 extern __thread struct bsys_arr *karr;
+extern __thread uint64_t ix_flush_count;
+extern __thread struct bsys_rings *ix_rings;
+
+/**
+ * ix_ring_next - get the next free submission ring descriptor
+ *
+ * Fill the descriptor with one of the ksys_*() helpers, then publish it
+ * with ix_ring_commit(). The kernel picks it up the next time it runs on
+ * this core, without the application having to trap.
+ *
+ * Returns a descriptor, or NULL if the ring is full.
+ */
+static inline struct bsys_desc *ix_ring_next(void)
+{
+	struct bsys_ring *sq = &ix_rings->sq;
+
+	if (sq->tail - sq->head >= BSYS_RING_SIZE)
+		return NULL;
+
+	return &sq->descs[sq->tail & BSYS_RING_MASK];
+}
+
+/**
+ * ix_ring_commit - publish the descriptor returned by ix_ring_next()
+ */
+static inline void ix_ring_commit(void)
+{
+	wmb();
+	ix_rings->sq.tail = ix_rings->sq.tail + 1;
+}
 
 static inline int ix_bsys_idx(void)
 {
@@ -141,5 +173,8 @@ extern void ix_free_pages(void *addr, int nrpages);
 
 extern void ix_handle_events(void);
 extern int ix_poll(void);
+extern int ix_poll_nonblock(void);
+extern int ix_ring_init(void);
+extern int ix_ring_handle_events(void);
 extern int ix_init(struct ix_ops *ops, int batch_depth);
 
@@ -29,10 +29,12 @@
 #include <mempool.h>
 #include <stdio.h>
 #include <errno.h>
+#include <sys/time.h>
 
 #include "ixev.h"
 #include "buf.h"
 #include "ixev_timer.h"
+#include "ixev_udp.h"
 
 #define CMD_BATCH_SIZE	4096
 
@@ -46,27 +48,69 @@ static struct ixev_conn_ops ixev_global_ops;
 static struct mempool_datastore ixev_buf_datastore;
 __thread struct mempool ixev_buf_pool;
 
+/*
+ * Received segments that don't fit in the fixed recv ring of a context
+ * are queued in a chain of overflow chunks. They are moved back into the
+ * ring as the application consumes data, so the read paths only ever
+ * look at the ring.
+ */
+struct ixev_recv_ovf {
+	struct ixev_recv_ovf	*next;
+	uint16_t		head;
+	uint16_t		tail;
+	struct sg_entry		ents[IXEV_RECV_OVF_DEPTH];
+};
+
+static struct mempool_datastore ixev_recv_ovf_datastore;
+static __thread struct mempool ixev_recv_ovf_pool;
+
 static void ixev_ksys_ret(uint64_t sysnr, long ret, unsigned long cookie);
 static void ixev_tcp_sendv_ret(hid_t handle, unsigned long cookie, size_t len);
 
+/*
+ * Marks a context whose sendv was issued by a mid-iteration flush. The
+ * kernel may already have transmitted part of the SG array, so another
+ * sendv must wait for the next generation, when the sendv return has
+ * been processed. Pending data is resubmitted from ixev_tcp_sent().
+ */
+#define IXEV_SENDV_FLUSHED	((struct bsys_desc *) 1)
+
 static inline void __ixev_check_generation(struct ixev_ctx *ctx)
 {
 	if (ixev_generation != ctx->generation || tid != ctx->tid) {
 		ctx->generation = ixev_generation;
+		ctx->flush_count = ix_flush_count;
 		ctx->tid = tid;
 		ctx->recv_done_desc = NULL;
 		ctx->sendv_desc = NULL;
+	} else if (unlikely(ctx->flush_count != ix_flush_count)) {
+		/* the batch holding our descriptors was already issued */
+		ctx->flush_count = ix_flush_count;
+		ctx->recv_done_desc = NULL;
+		if (ctx->sendv_desc)
+			ctx->sendv_desc = IXEV_SENDV_FLUSHED;
 	}
 }
 
+/*
+ * Gets a descriptor for a command on @ctx. If that flushed the batch,
+ * the descriptors @ctx had cached in it are no longer valid.
+ */
+static inline struct bsys_desc *__ixev_ctx_next_desc(struct ixev_ctx *ctx)
+{
+	struct bsys_desc *d = __ixev_next_desc();
+
+	__ixev_check_generation(ctx);
+	return d;
+}
+
 static inline void
 __ixev_recv_done(struct ixev_ctx *ctx, size_t len)
 {
 	__ixev_check_generation(ctx);
 
 	if (!ctx->recv_done_desc) {
-		ctx->recv_done_desc = __bsys_arr_next(karr);
-		ixev_check_hacks(ctx);
+		ctx->recv_done_desc = __ixev_ctx_next_desc(ctx);
 		ksys_tcp_recv_done(ctx->recv_done_desc, ctx->handle, len);
 	} else {
 		ctx->recv_done_desc->argb += (uint64_t) len;
@@ -78,9 +122,11 @@ __ixev_sendv(struct ixev_ctx *ctx, struct sg_entry *ents, unsigned int nrents)
 {
 	__ixev_check_generation(ctx);
 
+	if (unlikely(ctx->sendv_desc == IXEV_SENDV_FLUSHED))
+		return;
+
 	if (!ctx->sendv_desc) {
-		ctx->sendv_desc = __bsys_arr_next(karr);
-		ixev_check_hacks(ctx);
+		ctx->sendv_desc = __ixev_ctx_next_desc(ctx);
 		ksys_tcp_sendv(ctx->sendv_desc, ctx->handle, ents, nrents);
 	} else {
 		ctx->sendv_desc->argb = (uint64_t) ents;
@@ -91,11 +137,162 @@ __ixev_sendv(struct ixev_ctx *ctx, struct sg_entry *ents, unsigned int nrents)
 static inline void
 __ixev_close(struct ixev_ctx *ctx)
 {
-	struct bsys_desc *d = __bsys_arr_next(karr);
-	ixev_check_hacks(ctx);
+	struct bsys_desc *d = __ixev_ctx_next_desc(ctx);
 	ksys_tcp_close(d, ctx->handle);
 }
 
+static __thread struct ixev_ctx *ixev_level_head;
+
+/*
+ * Sends are not handed to the kernel as they are queued. Instead the
+ * context is put on a per-thread list, and a single sendv covering all
+ * of its pending data is issued before ixev_wait() blocks again. This
+ * way the writes of a whole dispatch round leave in one batch.
+ */
+static __thread struct ixev_ctx *ixev_send_head;
+
+static size_t ixev_window_len(struct ixev_ctx *ctx, size_t len);
+static void ixev_frame_input(struct ixev_ctx *ctx);
+
+static unsigned int ixev_level_ready(struct ixev_ctx *ctx)
+{
+	unsigned int ready = 0;
+
+	if (ctx->recv_head != ctx->recv_tail)
+		ready |= IXEVIN;
+	if (!ctx->is_dead && ctx->send_count < IXEV_SEND_DEPTH &&
+	    ixev_window_len(ctx, 1))
+		ready |= IXEVOUT;
+
+	return ready & ctx->en_mask;
+}
+
+static void ixev_level_remove(struct ixev_ctx *ctx)
+{
+	if (!ctx->level_pprev)
+		return;
+
+	*ctx->level_pprev = ctx->level_next;
+	if (ctx->level_next)
+		ctx->level_next->level_pprev = ctx->level_pprev;
+	ctx->level_pprev = NULL;
+}
+
+/* queue @ctx for another dispatch if its level-triggered condition holds */
+static void ixev_level_check(struct ixev_ctx *ctx)
+{
+	if (!(ctx->en_mask & IXEVLEVEL) || ctx->level_pprev ||
+	    !ixev_level_ready(ctx))
+		return;
+
+	ctx->level_next = ixev_level_head;
+	if (ixev_level_head)
+		ixev_level_head->level_pprev = &ctx->level_next;
+	ctx->level_pprev = &ixev_level_head;
+	ixev_level_head = ctx;
+}
+
+static void ixev_dispatch(struct ixev_ctx *ctx, unsigned int reason)
+{
+	if (ctx->en_mask & IXEVONESHOT)
+		ctx->en_mask = 0;
+	if (ctx->timeout)
+		ctx->timeout_expires = ixev_timer_now + ctx->timeout;
+
+	/* with a framer, new data reaches the message handler instead */
+	if (ctx->framer && (reason & IXEVIN)) {
+		reason &= ~IXEVIN;
+		ixev_frame_input(ctx);
+	}
+
+	if (reason)
+		ctx->handler(ctx, reason);
+	ixev_level_check(ctx);
+}
+
+static void ixev_send_schedule(struct ixev_ctx *ctx)
+{
+	if (ctx->send_pprev)
+		return;
+
+	ctx->send_next = ixev_send_head;
+	if (ixev_send_head)
+		ixev_send_head->send_pprev = &ctx->send_next;
+	ctx->send_pprev = &ixev_send_head;
+	ixev_send_head = ctx;
+}
+
+static bool ixev_send_unlink(struct ixev_ctx *ctx)
+{
+	if (!ctx->send_pprev)
+		return false;
+
+	*ctx->send_pprev = ctx->send_next;
+	if (ctx->send_next)
+		ctx->send_next->send_pprev = ctx->send_pprev;
+	ctx->send_pprev = NULL;
+	return true;
+}
+
+/* issue the sendv of every context with pending data that isn't corked */
+static void ixev_send_flush(void)
+{
+	struct ixev_ctx *ctx, *next;
+
+	ctx = ixev_send_head;
+	ixev_send_head = NULL;
+
+	for (; ctx; ctx = next) {
+		next = ctx->send_next;
+		ctx->send_pprev = NULL;
+
+		if (!ctx->is_corked && !ctx->is_dead && ctx->send_count)
+			__ixev_sendv(ctx, ctx->send, ctx->send_count);
+	}
+}
+
+/* dispatch the contexts whose level-triggered condition still holds */
+static void ixev_level_run(void)
+{
+	struct ixev_ctx *ctx, *next;
+	unsigned int ready;
+
+	ctx = ixev_level_head;
+	ixev_level_head = NULL;
+
+	/* handlers may remove @next, so keep its back pointer on our stack */
+	for (; ctx; ctx = next) {
+		next = ctx->level_next;
+		if (next)
+			next->level_pprev = &next;
+		ctx->level_pprev = NULL;
+
+		ready = ixev_level_ready(ctx);
+		if (ready && (ctx->en_mask & IXEVLEVEL))
+			ixev_dispatch(ctx, ready);
+	}
+}
+
+/*
+ * Idle timeouts are rearmed lazily: dispatching an event only moves the
+ * deadline forward, and the timer is pushed back when it fires early.
+ */
+static void ixev_timeout_handler(void *arg)
+{
+	struct ixev_ctx *ctx = arg;
+
+	if (ctx->timeout_expires > ixev_timer_now) {
+		ixev_timer_add_us(&ctx->timeout_timer,
+				  ctx->timeout_expires - ixev_timer_now);
+		return;
+	}
+
+	ctx->timeout_expires = ixev_timer_now + ctx->timeout;
+	ixev_timer_add_us(&ctx->timeout_timer, ctx->timeout);
+	if (ctx->en_mask & IXEVTIMEOUT)
+		ixev_dispatch(ctx, IXEVTIMEOUT);
+}
+
 static void ixev_tcp_connected(hid_t handle, unsigned long cookie, long ret)
 {
 	struct ixev_ctx *ctx = (struct ixev_ctx *) cookie;
@@ -114,6 +311,10 @@ static void ixev_tcp_knock(hid_t handle, struct ip_tuple *id)
 
 	ctx->handle = handle;
 	ix_tcp_accept(handle, (unsigned long) ctx);
+
+	/* the context can issue commands from here on */
+	if (ixev_global_ops.accepted)
+		ixev_global_ops.accepted(ctx);
 }
 
 static void ixev_tcp_dead(hid_t handle, unsigned long cookie)
@@ -125,13 +326,97 @@ static void ixev_tcp_dead(hid_t handle, unsigned long cookie)
 
 	ctx->is_dead = true;
 	if (ctx->en_mask & IXEVHUP)
-		ctx->handler(ctx, IXEVHUP);
+		ixev_dispatch(ctx, IXEVHUP);
 	else if (ctx->en_mask & IXEVIN)
-		ctx->handler(ctx, IXEVIN | IXEVHUP);
+		ixev_dispatch(ctx, IXEVIN | IXEVHUP);
 	else
 		ctx->trig_mask |= IXEVHUP;
 
 	ctx->en_mask = 0;
+	ixev_level_remove(ctx);
+	ixev_timer_cancel(&ctx->timeout_timer);
+	ixev_send_unlink(ctx);
+}
+
+static bool ixev_recv_full(struct ixev_ctx *ctx)
+{
+	return ctx->recv_tail - ctx->recv_head + 1 >= IXEV_RECV_DEPTH;
+}
+
+/*
+ * ixev_recv_ovf_push - queue a received segment behind a full recv ring
+ *
+ * Happens when the application does not consume data for a while or the
+ * remote host sends many small segments.
+ *
+ * Returns true if successful, otherwise out of memory.
+ */
+static bool ixev_recv_ovf_push(struct ixev_ctx *ctx, void *addr, size_t len)
+{
+	struct ixev_recv_ovf *ovf = ctx->recv_ovf_tail;
+	struct sg_entry *ent;
+
+	if (!ovf || ovf->tail == IXEV_RECV_OVF_DEPTH) {
+		ovf = mempool_alloc(&ixev_recv_ovf_pool);
+		if (unlikely(!ovf))
+			return false;
+
+		ovf->next = NULL;
+		ovf->head = 0;
+		ovf->tail = 0;
+
+		if (ctx->recv_ovf_tail)
+			ctx->recv_ovf_tail->next = ovf;
+		else
+			ctx->recv_ovf_head = ovf;
+		ctx->recv_ovf_tail = ovf;
+	}
+
+	ent = &ovf->ents[ovf->tail++];
+	ent->base = addr;
+	ent->len = len;
+	return true;
+}
+
+/*
+ * ixev_recv_ovf_refill - move overflow segments into the freed recv ring
+ */
+static void ixev_recv_ovf_refill(struct ixev_ctx *ctx)
+{
+	struct ixev_recv_ovf *ovf;
+
+	while ((ovf = ctx->recv_ovf_head) && !ixev_recv_full(ctx)) {
+		ctx->recv[ctx->recv_tail & (IXEV_RECV_DEPTH - 1)] =
+			ovf->ents[ovf->head++];
+		ctx->recv_tail++;
+
+		if (ovf->head == ovf->tail) {
+			ctx->recv_ovf_head = ovf->next;
+			if (!ctx->recv_ovf_head)
+				ctx->recv_ovf_tail = NULL;
+			mempool_free(&ixev_recv_ovf_pool, ovf);
+		}
+	}
+}
+
+static void ixev_recv_ovf_release(struct ixev_ctx *ctx)
+{
+	struct ixev_recv_ovf *ovf, *next;
+
+	for (ovf = ctx->recv_ovf_head; ovf; ovf = next) {
+		next = ovf->next;
+		mempool_free(&ixev_recv_ovf_pool, ovf);
+	}
+
+	ctx->recv_ovf_head = NULL;
+	ctx->recv_ovf_tail = NULL;
+}
+
+static inline void ixev_recv_advance(struct ixev_ctx *ctx)
+{
+	ctx->recv_head++;
+	if (unlikely(ctx->recv_ovf_head))
+		ixev_recv_ovf_refill(ctx);
 }
 
 static void ixev_tcp_recv(hid_t handle, unsigned long cookie,
@@ -141,31 +426,20 @@ static void ixev_tcp_recv(hid_t handle, unsigned long cookie,
 	uint16_t pos = ((ctx->recv_tail) & (IXEV_RECV_DEPTH - 1));
 	struct sg_entry *ent;
 
-	if (unlikely(ctx->recv_tail - ctx->recv_head + 1 >= IXEV_RECV_DEPTH)) {
-		/*
-		 * FIXME: We've run out of space for received packets. This
-		 * will probably not happen unless the application is
-		 * misbehaving and does not accept new packets for long
-		 * periods of time or if a remote host sends a lot of too
-		 * small packets.
-		 *
-		 * Possible solutions:
-		 * 1.) Start copying into a buffer and accept up to the kernel
-		 * receive window size in data.
-		 * 2.) Allocate more descriptors and leave memory in mbufs, but
-		 * this could waste memory.
-		 */
-		printf("ixev: ran out of receive memory\n");
-		exit(-1);
+	if (unlikely(ctx->recv_ovf_head || ixev_recv_full(ctx))) {
+		if (unlikely(!ixev_recv_ovf_push(ctx, addr, len))) {
+			printf("ixev: ran out of receive memory\n");
+			exit(-1);
+		}
+	} else {
+		ent = &ctx->recv[pos];
+		ent->base = addr;
+		ent->len = len;
+		ctx->recv_tail++;
 	}
 
-	ent = &ctx->recv[pos];
-	ent->base = addr;
-	ent->len = len;
-	ctx->recv_tail++;
-
 	if (ctx->en_mask & IXEVIN)
-		ctx->handler(ctx, IXEVIN);
+		ixev_dispatch(ctx, IXEVIN);
 	else
 		ctx->trig_mask |= IXEVIN;
 }
@@ -188,10 +462,10 @@ static void ixev_tcp_sent(hid_t handle, unsigned long cookie, size_t len)
 
 	/* if there is pending data, make sure we try again to send it */
 	if (ctx->send_count)
-		__ixev_sendv(ctx, ctx->send, ctx->send_count);
+		ixev_send_schedule(ctx);
 
 	if (ctx->en_mask & IXEVOUT)
-		ctx->handler(ctx, IXEVOUT);
+		ixev_dispatch(ctx, IXEVOUT);
 	else
 		ctx->trig_mask |= IXEVOUT;
 }
@@ -204,6 +478,8 @@ static void ixev_timer_event(unsigned long cookie)
 }
 
 static struct ix_ops ixev_ops = {
+	.udp_recv	= ixev_udp_recv_event,
+	.udp_sent	= ixev_udp_sent_event,
 	.tcp_connected	= ixev_tcp_connected,
 	.tcp_knock	= ixev_tcp_knock,
 	.tcp_dead	= ixev_tcp_dead,
@@ -241,7 +517,7 @@ ssize_t ixev_recv(struct ixev_ctx *ctx, void *buf, size_t len)
 		if (left >= ent->len) {
 			memcpy(cbuf + pos, ent->base, ent->len);
 			pos += ent->len;
-			ctx->recv_head++;
+			ixev_recv_advance(ctx);
 		} else {
 			memcpy(cbuf + pos, ent->base, left);
 			ent->base = (char *) ent->base + left;
@@ -279,9 +555,10 @@ void *ixev_recv_zc(struct ixev_ctx *ctx, size_t len)
 	struct sg_entry *ent;
 	void *buf;
 
-	if (ctx->is_dead)
+	if (ctx->is_dead || ctx->recv_head == ctx->recv_tail)
 		return NULL;
 
+	/* otherwise the slot at the head holds a consumed segment */
 	ent = &ctx->recv[ctx->recv_head & (IXEV_RECV_DEPTH - 1)];
 	if (len > ent->len)
 		return NULL;
@@ -290,18 +567,142 @@ void *ixev_recv_zc(struct ixev_ctx *ctx, size_t len)
 	ent->base = (char *) ent->base + len;
 	ent->len -= len;
 	if (!ent->len)
-		ctx->recv_head++;
+		ixev_recv_advance(ctx);
 
 	__ixev_recv_done(ctx, len);
 	return buf;
 }
 
+static void ixev_recv_consume(struct ixev_ctx *ctx, struct sg_entry *ent,
+			      size_t len)
+{
+	ent->base = (char *) ent->base + len;
+	ent->len -= len;
+	if (!ent->len)
+		ixev_recv_advance(ctx);
+}
+
+/*
+ * Returns the length of the message at @data, including its framing, or
+ * 0 if more than @len bytes are needed to know it.
+ */
+static size_t ixev_frame_len(struct ixev_framer *f, const char *data,
+			     size_t len)
+{
+	uint64_t val = 0;
+	unsigned int i;
+	const char *end;
+
+	switch (f->type) {
+	case IXEV_FRAME_FIXED:
+		return f->param;
+
+	case IXEV_FRAME_LEN:
+		if (len < f->param)
+			return 0;
+		for (i = 0; i < f->param; i++)
+			val = (val << 8) | (uint8_t) data[i];
+		return f->param + val;
+
+	default:
+		end = memchr(data, f->param, len);
+		return end ? end - data + 1 : 0;
+	}
+}
+
+/*
+ * The message is only released to the kernel once the handler is done
+ * with it, which also holds back the receive window while it runs.
+ */
+static void ixev_frame_deliver(struct ixev_ctx *ctx, struct ixev_framer *f,
+			       char *msg, size_t len)
+{
+	size_t head = f->type == IXEV_FRAME_LEN ? f->param : 0;
+	size_t tail = f->type == IXEV_FRAME_DELIM ? 1 : 0;
+
+	f->nr_msgs++;
+	f->handler(ctx, msg + head, len - head - tail);
+
+	if (!ctx->is_closed)
+		__ixev_recv_done(ctx, len);
+}
+
+static void ixev_frame_input(struct ixev_ctx *ctx)
+{
+	struct ixev_framer *f = ctx->framer;
+	struct sg_entry *ent;
+	unsigned int nr = 0;
+	size_t len, n;
+	char *msg;
+
+	if (ctx->is_dead)
+		return;
+
+	while (ctx->recv_head != ctx->recv_tail) {
+		/* the handler may have closed, disabled or reframed us */
+		if (ctx->framer != f || ctx->is_closed ||
+		    (nr && !(ctx->en_mask & IXEVIN)))
+			return;
+
+		ent = &ctx->recv[ctx->recv_head & (IXEV_RECV_DEPTH - 1)];
+
+		/* hot path: the whole message is in one segment */
+		if (!f->len) {
+			len = ixev_frame_len(f, ent->base, ent->len);
+			if (len > f->buf_size)
+				goto fail;
+			if (len && len <= ent->len) {
+				msg = ent->base;
+				ixev_recv_consume(ctx, ent, len);
+				ixev_frame_deliver(ctx, f, msg, len);
+				nr++;
+				continue;
+			}
+		}
+
+		/* cold path: gather the message in the reassembly buffer */
+		if (f->type == IXEV_FRAME_DELIM) {
+			msg = memchr(ent->base, f->param, ent->len);
+			n = msg ? msg - (char *) ent->base + 1 : ent->len;
+		} else {
+			len = ixev_frame_len(f, f->buf, f->len);
+			n = min((len ? len : f->param) - f->len, ent->len);
+		}
+
+		if (f->len + n > f->buf_size)
+			goto fail;
+
+		memcpy(f->buf + f->len, ent->base, n);
+		f->len += n;
+		ixev_recv_consume(ctx, ent, n);
+
+		if (f->type == IXEV_FRAME_DELIM)
+			len = f->buf[f->len - 1] == (char) f->param ? f->len : 0;
+		else
+			len = ixev_frame_len(f, f->buf, f->len);
+		if (len > f->buf_size)
+			goto fail;
+
+		if (len && len == f->len) {
+			f->len = 0;
+			ixev_frame_deliver(ctx, f, f->buf, len);
+			nr++;
+		}
+	}
+
+	return;
+
+fail:
+	/* the peer sent a message that doesn't fit, so give up on it */
+	ixev_close(ctx);
+}
+
 static struct sg_entry *ixev_next_entry(struct ixev_ctx *ctx)
 {
 	struct sg_entry *ent = &ctx->send[ctx->send_count];
 
 	ctx->send_count++;
-	__ixev_sendv(ctx, ctx->send, ctx->send_count);
+	ixev_send_schedule(ctx);
 
 	return ent;
 }
@@ -356,11 +757,25 @@ ssize_t ixev_send(struct ixev_ctx *ctx, void *addr, size_t len)
 	if (!actual_len)
 		return -EAGAIN;
 
-	/* hot path: is there already a buffer? */
-	if (ctx->send_count && ctx->cur_buf) {
+	/*
+	 * hot path: is there already a buffer? Small writes are appended to
+	 * it, even once its earlier data has been accepted by the kernel.
+	 */
+	if (ctx->cur_buf && !ixev_is_buf_full(ctx->cur_buf) &&
+	    (ctx->send_count ||
+	     (ctx->ref_tail == &ctx->cur_buf->ref &&
+	      ctx->send_count < IXEV_SEND_DEPTH))) {
+		if (ctx->send_count) {
+			ent = &ctx->send[ctx->send_count - 1];
+		} else {
+			ent = ixev_next_entry(ctx);
+			ent->base = &ctx->cur_buf->payload[ctx->cur_buf->len];
+			ent->len = 0;
+		}
+
 		ret = ixev_buf_store(ctx->cur_buf, caddr, actual_len);
-		ent = &ctx->send[ctx->send_count - 1];
 		ent->len += ret;
+		ixev_send_schedule(ctx);
 
 		actual_len -= ret;
 		caddr += ret;
@@ -446,6 +861,38 @@ void ixev_add_sent_cb(struct ixev_ctx *ctx, struct ixev_ref *ref)
 	__ixev_add_sent_cb(ctx, ref);
 }
 
+/**
+ * ixev_cork - holds back the sends of a context
+ * @ctx: the context
+ *
+ * Data queued with ixev_send() and ixev_send_zc() is accumulated, but not
+ * handed to the kernel until ixev_uncork() is called. The usual limits on
+ * queued data still apply, so a corked context may return -EAGAIN. A sendv
+ * already queued in the current batch still goes out.
+ */
+void ixev_cork(struct ixev_ctx *ctx)
+{
+	ctx->is_corked = true;
+
+	/* that sendv covers the last SG entry, so don't grow it any further */
+	__ixev_check_generation(ctx);
+	if (ctx->sendv_desc && ctx->sendv_desc != IXEV_SENDV_FLUSHED)
+		ctx->cur_buf = NULL;
+}
+
+/**
+ * ixev_uncork - releases the sends held back by ixev_cork()
+ * @ctx: the context
+ *
+ * The accumulated data is sent at the end of the current dispatch round.
+ */
+void ixev_uncork(struct ixev_ctx *ctx)
+{
+	ctx->is_corked = false;
+	if (ctx->send_count)
+		ixev_send_schedule(ctx);
+}
+
 /**
  * ixev_close - closes a context
  * @ctx: the context
@@ -453,6 +900,19 @@ void ixev_add_sent_cb(struct ixev_ctx *ctx, struct ixev_ref *ref)
 void ixev_close(struct ixev_ctx *ctx)
 {
 	ctx->en_mask = 0;
+	ctx->is_closed = true;
+	ixev_level_remove(ctx);
+	ixev_timer_cancel(&ctx->timeout_timer);
+
+	/*
+	 * Data queued before the close must still go out ahead of it. A
+	 * corked context left the send list at the end of the round it was
+	 * corked in, but still holds its data.
+	 */
+	if ((ixev_send_unlink(ctx) || ctx->is_corked) && ctx->send_count &&
+	    !ctx->is_dead)
+		__ixev_sendv(ctx, ctx->send, ctx->send_count);
+
 	__ixev_close(ctx);
 }
 
@@ -471,13 +931,24 @@ void ixev_ctx_init(struct ixev_ctx *ctx)
 	ctx->recv_done_desc = NULL;
 	ctx->sendv_desc = NULL;
 	ctx->generation = 0;
+	ctx->flush_count = 0;
 	ctx->tid = tid;
 	ctx->is_dead = false;
+	ctx->is_corked = false;
+	ctx->is_closed = false;
 
 	ctx->send_total = 0;
 	ctx->sent_total = 0;
 	ctx->ref_head = NULL;
 	ctx->cur_buf = NULL;
+	ctx->recv_ovf_head = NULL;
+	ctx->recv_ovf_tail = NULL;
+
+	ctx->timeout = 0;
+	ixev_timer_init(&ctx->timeout_timer, ixev_timeout_handler, ctx);
+	ctx->level_pprev = NULL;
+	ctx->send_pprev = NULL;
+	ctx->framer = NULL;
 }
 
 static void ixev_bad_ret(struct ixev_ctx *ctx, uint64_t sysnr, long ret)
@@ -538,6 +1009,7 @@ static void ixev_handle_close_ret(struct ixev_ctx *ctx, long ret)
 		ref = ref->next;
 	}
 
+	ixev_recv_ovf_release(ctx);
 	ixev_global_ops.release(ctx);
 }
 
@@ -568,6 +1040,11 @@ static void ixev_ksys_ret(uint64_t sysnr, long ret, unsigned long cookie)
 		ixev_handle_close_ret(ctx, ret);
 		break;
 
+	case KSYS_UDP_SEND:
+	case KSYS_UDP_SENDV:
+		ixev_udp_send_ret(ret, cookie);
+		break;
+
 	case KSYS_NOP:
 		break;
 
@@ -587,12 +1064,28 @@ void ixev_wait(void)
 	 * just make system calls directly.
 	 */
 
-	ix_poll();
+	/* pick up data the application queued outside of a handler */
+	ixev_send_flush();
+
+	if (ixev_level_head) {
+		/*
+		 * Level-triggered handlers are still pending, so poll
+		 * without blocking and dispatch them again.
+		 */
+		ix_poll_nonblock();
+	} else {
+		ixev_timer_prepare_wait();
+		ix_poll();
+	}
 	ixev_generation++;
 
 	karr->len = 0;
 
+	ixev_timer_run();
 	ix_handle_events();
+	ixev_udp_dispatch();
+	ixev_level_run();
+	ixev_send_flush();
 }
 
 
@@ -607,6 +1100,105 @@ void ixev_set_handler(struct ixev_ctx *ctx, unsigned int mask,
 {
 	ctx->en_mask = mask;
 	ctx->handler = handler;
+	ixev_level_check(ctx);
+}
+
+/**
+ * ixev_set_timeout - sets the idle timeout of a context
+ * @ctx: the context
+ * @usecs: the timeout in microseconds, or 0 to disable it
+ *
+ * If no event is dispatched to the context for @usecs, the handler is
+ * called with IXEVTIMEOUT, provided that IXEVTIMEOUT is in its mask. The
+ * timeout is rearmed after it fires.
+ */
+void ixev_set_timeout(struct ixev_ctx *ctx, unsigned int usecs)
+{
+	ixev_timer_cancel(&ctx->timeout_timer);
+
+	ctx->timeout = usecs;
+	if (!usecs)
+		return;
+
+	ctx->timeout_expires = ixev_timer_now + usecs;
+	ixev_timer_add_us(&ctx->timeout_timer, usecs);
+}
+
+/**
+ * ixev_framer_init - prepares a message framer
+ * @f: the framer
+ * @type: the framing, one of IXEV_FRAME_*
+ * @param: the message size for IXEV_FRAME_FIXED, the number of length
+ *	   bytes (1, 2 or 4) for IXEV_FRAME_LEN, or the delimiter byte for
+ *	   IXEV_FRAME_DELIM
+ * @buf: a buffer to reassemble messages that span segments
+ * @buf_size: the size of @buf, which bounds messages including framing
+ * @handler: the handler called for each message
+ *
+ * Framing bytes (the length or the delimiter) are not passed to @handler.
+ *
+ * Returns zero if successful, otherwise fail.
+ */
+int ixev_framer_init(struct ixev_framer *f, unsigned int type,
+		     unsigned int param, void *buf, size_t buf_size,
+		     ixev_msg_handler_t handler)
+{
+	switch (type) {
+	case IXEV_FRAME_FIXED:
+		if (!param || param > buf_size)
+			return -EINVAL;
+		break;
+	case IXEV_FRAME_LEN:
+		if ((param != 1 && param != 2 && param != 4) ||
+		    param > buf_size)
+			return -EINVAL;
+		break;
+	case IXEV_FRAME_DELIM:
+		if (param > 0xFF || !buf_size)
+			return -EINVAL;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	f->type = type;
+	f->param = param;
+	f->handler = handler;
+	f->buf = (char *) buf;
+	f->buf_size = buf_size;
+	f->len = 0;
+	f->nr_msgs = 0;
+
+	return 0;
+}
+
+/**
+ * ixev_set_framer - delivers the received data of a context as messages
+ * @ctx: the context
+ * @f: the framer, or NULL to go back to plain IXEVIN events
+ *
+ * While IXEVIN is enabled, each complete message is passed to the handler
+ * of @f instead of the context handler, which still gets the other
+ * events. A message is handed over without copying if it arrived in one
+ * segment, and is only valid until the message handler returns. Its
+ * bytes are acknowledged to the kernel after the handler returns. With
+ * IXEVONESHOT, one message is delivered per dispatch. A peer that sends
+ * a message larger than the reassembly buffer is disconnected.
+ *
+ * Don't mix a framer with ixev_recv() or ixev_recv_zc(). Data gathered
+ * for a partial message is dropped when the framer is replaced.
+ */
+void ixev_set_framer(struct ixev_ctx *ctx, struct ixev_framer *f)
+{
+	struct ixev_framer *old = ctx->framer;
+
+	if (old && old->len) {
+		__ixev_recv_done(ctx, old->len);
+		old->len = 0;
+	}
+
+	ctx->framer = f;
+	ixev_level_check(ctx);
 }
 
 /**
@@ -628,13 +1220,24 @@ int ixev_init_thread(void)
 	if (ret)
 		return ret;
 
+	ret = mempool_create(&ixev_recv_ovf_pool, &ixev_recv_ovf_datastore);
+	if (ret) {
+		mempool_destroy(&ixev_buf_pool);
+		return ret;
+	}
+
 	ret = ix_init(&ixev_ops, CMD_BATCH_SIZE);
 	if (ret) {
+		mempool_destroy(&ixev_recv_ovf_pool);
 		mempool_destroy(&ixev_buf_pool);
 		return ret;
 	}
 
-	return 0;
+	ret = ixev_udp_init_thread();
+	if (ret)
+		return ret;
+
+	return ixev_timer_init_thread();
 }
 
 /**
@@ -654,6 +1257,16 @@ int ixev_init(struct ixev_conn_ops *ops)
 	if (ret)
 		return ret;
 
+	ret = mempool_create_datastore(&ixev_recv_ovf_datastore, 4096, sizeof(struct ixev_recv_ovf), 0, MEMPOOL_DEFAULT_CHUNKSIZE, "ixev_recv_ovf");
+	if (ret)
+		return ret;
+
+	ret = ixev_udp_create_datastore();
+	if (ret)
+		return ret;
+
+	ixev_timer_calibrate();
+
 	ixev_global_ops = *ops;
 	return 0;
 }
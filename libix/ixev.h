@@ -28,32 +28,37 @@
 #pragma once
 
 #include "ix.h"
+#include "ixev_timer.h"
 #include <stdio.h>
 
 /* FIXME: we won't need recv depth when i get a chance to fix the kernel */
 #define IXEV_RECV_DEPTH	128
+#define IXEV_RECV_OVF_DEPTH	128
 #define IXEV_SEND_DEPTH	16
 
 struct ixev_ctx;
 struct ixev_ref;
 struct ixev_buf;
-
-/*
- * FIXME: right now we only support some libevent features
- * - add level triggered support (now only edge triggered)
- * - add one fire events (now only persistent)
- * - add timeout support for events
- */
+struct ixev_recv_ovf;
 
 /* IX event types */
 #define IXEVHUP		0x1 /* the connection was closed (or failed) */
 #define IXEVIN		0x2 /* new data is available for reading */
 #define IXEVOUT		0x4 /* more space is available for writing */
+#define IXEVTIMEOUT	0x8 /* no event was dispatched within the timeout */
+
+/*
+ * IX event modes, or'ed into the mask given to ixev_set_handler().
+ * Handlers are edge-triggered and persistent by default.
+ */
+#define IXEVLEVEL	0x100 /* fire again while data or space remains */
+#define IXEVONESHOT	0x200 /* disable the handler after it fires once */
 
 struct ixev_conn_ops {
 	struct ixev_ctx *(*accept)(struct ip_tuple *id);
 	void (*release)(struct ixev_ctx *ctx);
 	void (*dialed)(struct ixev_ctx *ctx, long ret);
+	void (*accepted)(struct ixev_ctx *ctx);	/* optional */
 };
 
 /*
@@ -72,10 +77,32 @@ struct ixev_ref {
 	struct ixev_ref	*next;    /* the next ref in the sequence */
 };
 
+/* message framers, see ixev_framer_init() */
+#define IXEV_FRAME_FIXED	0 /* messages of a fixed size */
+#define IXEV_FRAME_LEN		1 /* messages behind a big-endian length */
+#define IXEV_FRAME_DELIM	2 /* messages ending with a delimiter byte */
+
+/*
+ * Use this callback to receive complete messages from a framer
+ */
+typedef void (*ixev_msg_handler_t)(struct ixev_ctx *ctx, void *msg,
+				   size_t len);
+
+struct ixev_framer {
+	unsigned int	type;		/* the IXEV_FRAME_* framing */
+	unsigned int	param;		/* the size, length bytes or delimiter */
+	ixev_msg_handler_t handler;	/* the message handler */
+	char		*buf;		/* the reassembly buffer */
+	size_t		buf_size;	/* the maximum framed message size */
+	size_t		len;		/* the bytes gathered in @buf */
+	unsigned long	nr_msgs;	/* the number of messages delivered */
+};
+
 struct ixev_ctx {
 	hid_t		handle;			/* the IX flow handle */
 	unsigned long	user_data;		/* application data */
 	uint64_t	generation;		/* generation number */
+	uint64_t	flush_count;		/* batch flushes seen this generation */
 	void 		*tid;			/* generation thread id */
 	ixev_handler_t	handler;		/* the event handler */
 	unsigned int	en_mask;		/* a mask of enabled events */
@@ -84,12 +111,25 @@ struct ixev_ctx {
 	uint16_t	recv_tail;		/* received data SG tail */
 	uint16_t	send_count;		/* the current send SG count */
 	uint16_t	is_dead: 1;		/* is the connection dead? */
+	uint16_t	is_corked: 1;		/* are sends held back? */
+	uint16_t	is_closed: 1;		/* was ixev_close() called? */
 
 	size_t		send_total;		/* the total requested bytes */
 	size_t		sent_total;		/* the total completed bytes */
 	struct ixev_ref	*ref_head;		/* list head of references */
 	struct ixev_ref *ref_tail;		/* list tail of references */
 	struct ixev_buf *cur_buf;		/* current buffer */
+	struct ixev_recv_ovf *recv_ovf_head;	/* overflow SG chunks head */
+	struct ixev_recv_ovf *recv_ovf_tail;	/* overflow SG chunks tail */
+
+	unsigned int	timeout;		/* idle timeout in us, 0 if none */
+	uint64_t	timeout_expires;	/* idle timeout deadline in us */
+	struct ixev_timer timeout_timer;	/* idle timeout timer */
+	struct ixev_ctx	*level_next;		/* pending level-triggered list */
+	struct ixev_ctx	**level_pprev;
+	struct ixev_ctx	*send_next;		/* pending sendv list */
+	struct ixev_ctx	**send_pprev;
+	struct ixev_framer *framer;		/* delivers whole messages */
 
 	struct bsys_desc *recv_done_desc;	/* the current recv_done bsys descriptor */
 	struct bsys_desc *sendv_desc;		/* the current sendv bsys descriptor */
@@ -98,18 +138,18 @@ struct ixev_ctx {
 	struct sg_entry send[IXEV_SEND_DEPTH];	/* send SG array */
 };
 
-static inline void ixev_check_hacks(struct ixev_ctx *ctx)
+/**
+ * __ixev_next_desc - get a free command descriptor
+ *
+ * If the command batch is full, it is issued to the kernel first, so a
+ * single event loop iteration can queue any number of commands.
+ */
+static inline struct bsys_desc *__ixev_next_desc(void)
 {
-	/*
-	 * Temporary hack:
-	 *
-	 * FIXME: we need to flush commands in batches to limit our
-	 * command buffer size. Then this restriction can be lifted.
-	 */
-	if (unlikely(karr->len >= karr->max_len)) {
-		printf("ixev: ran out of command space\n");
-		exit(-1);
-	}
+	if (unlikely(karr->len >= karr->max_len))
+		ix_flush();
+
+	return __bsys_arr_next(karr);
 }
 
 extern ssize_t ixev_recv(struct ixev_ctx *ctx, void *addr, size_t len);
@@ -117,6 +157,8 @@ extern void *ixev_recv_zc(struct ixev_ctx *ctx, size_t len);
 extern ssize_t ixev_send(struct ixev_ctx *ctx, void *addr, size_t len);
 extern ssize_t ixev_send_zc(struct ixev_ctx *ctx, void *addr, size_t len);
 extern void ixev_add_sent_cb(struct ixev_ctx *ctx, struct ixev_ref *ref);
+extern void ixev_cork(struct ixev_ctx *ctx);
+extern void ixev_uncork(struct ixev_ctx *ctx);
 
 extern void ixev_close(struct ixev_ctx *ctx);
 
@@ -132,8 +174,7 @@ extern void ixev_close(struct ixev_ctx *ctx);
 static inline void
 ixev_dial(struct ixev_ctx *ctx, struct ip_tuple *id)
 {
-	struct bsys_desc *d = __bsys_arr_next(karr);
-	ixev_check_hacks(ctx);
+	struct bsys_desc *d = __ixev_next_desc();
 
 	ksys_tcp_connect(d, id, (unsigned long) ctx);
 }
@@ -143,6 +184,11 @@ extern void ixev_wait(void);
 
 extern void ixev_set_handler(struct ixev_ctx *ctx, unsigned int mask,
 			     ixev_handler_t handler);
+extern void ixev_set_timeout(struct ixev_ctx *ctx, unsigned int usecs);
+extern int ixev_framer_init(struct ixev_framer *f, unsigned int type,
+			    unsigned int param, void *buf, size_t buf_size,
+			    ixev_msg_handler_t handler);
+extern void ixev_set_framer(struct ixev_ctx *ctx, struct ixev_framer *f);
 
 extern int ixev_init_thread(void);
 extern int ixev_init(struct ixev_conn_ops *ops);
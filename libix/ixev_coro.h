@@ -0,0 +1,478 @@
+/*
+ * Copyright 2013-16 Board of Trustees of Stanford University
+ * Copyright 2013-16 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * ixev_coro.h - a C++20 coroutine front end for ixev
+ *
+ * Connection handlers are written as straight-line coroutines instead of
+ * hand-built state machines:
+ *
+ *	ixev::task serve(ixev::conn &c)
+ *	{
+ *		char buf[64];
+ *
+ *		while (co_await c.recv(buf, sizeof(buf)) > 0) {
+ *			if (co_await c.send(buf, sizeof(buf)) < 0)
+ *				break;
+ *		}
+ *		c.close();
+ *	}
+ *
+ *	ixev::task listen(void)
+ *	{
+ *		while (true)
+ *			serve(co_await ixev::accept());
+ *	}
+ *
+ * Coroutine frames and connections come from per-thread mempools, so no
+ * heap allocation happens per connection or per request. A coroutine
+ * whose frame exceeds IXEV_CORO_FRAME_SIZE, or that finds the frame pool
+ * empty, does not start; if its first parameter is a conn, that
+ * connection is closed instead of being leaked.
+ */
+
+#pragma once
+
+#if __cplusplus < 202002L
+#error "ixev_coro.h requires C++20"
+#endif
+
+#include <coroutine>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <new>
+
+extern "C" {
+#include <ixev.h>
+#include <ixev_timer.h>
+#include <mempool.h>
+}
+
+#ifndef IXEV_CORO_FRAME_SIZE
+#define IXEV_CORO_FRAME_SIZE	1024
+#endif
+
+namespace ixev {
+
+class conn;
+
+namespace detail {
+
+inline struct mempool_datastore frame_datastore;
+inline thread_local struct mempool frame_pool;
+
+inline struct mempool_datastore conn_datastore;
+inline thread_local struct mempool conn_pool;
+
+/* connections accepted but not yet handed to accept() */
+struct accept_queue {
+	conn *head;
+	conn *tail;
+	std::coroutine_handle<> waiter;
+};
+
+inline thread_local struct accept_queue accepted;
+
+inline int round_up(int nr)
+{
+	return (nr + MEMPOOL_DEFAULT_CHUNKSIZE - 1) /
+	       MEMPOOL_DEFAULT_CHUNKSIZE * MEMPOOL_DEFAULT_CHUNKSIZE;
+}
+
+} /* namespace detail */
+
+/*
+ * A fire-and-forget coroutine. It runs eagerly until its first suspension
+ * point and its frame is returned to the pool when it finishes.
+ */
+class task {
+public:
+	struct promise_type {
+		task get_return_object() noexcept { return {}; }
+		static task get_return_object_on_allocation_failure() noexcept
+		{
+			return {};
+		}
+
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() noexcept {}
+		void unhandled_exception() noexcept { std::terminate(); }
+
+		static void *operator new(std::size_t size) noexcept
+		{
+			if (size > IXEV_CORO_FRAME_SIZE)
+				return nullptr;
+
+			return mempool_alloc(&detail::frame_pool);
+		}
+
+		/* a coroutine serving @c that cannot start closes it */
+		static void *operator new(std::size_t size, conn &c,
+					  auto &&...) noexcept;
+
+		static void operator delete(void *ptr) noexcept
+		{
+			mempool_free(&detail::frame_pool, ptr);
+		}
+	};
+};
+
+/*
+ * A connection. Only one recv() or send() may be outstanding at a time.
+ */
+class conn {
+public:
+	class io_op {
+	public:
+		explicit io_op(conn &c) : c_(c) {}
+
+		bool await_ready() { return c_.progress(); }
+
+		void await_suspend(std::coroutine_handle<> h)
+		{
+			c_.waiter_ = h;
+			ixev_set_handler(&c_.ctx_, c_.op_ | IXEVHUP,
+					 &conn::handler);
+		}
+
+		/* the requested length, or <0 if the connection failed */
+		ssize_t await_resume() { return c_.err_ ? c_.err_ : c_.len_; }
+
+	private:
+		conn &c_;
+	};
+
+	conn()
+	{
+		ixev_ctx_init(&ctx_);
+		ctx_.user_data = (unsigned long) this;
+	}
+
+	conn(const conn &) = delete;
+	conn &operator=(const conn &) = delete;
+
+	/**
+	 * recv - receive exactly @len bytes into @buf
+	 */
+	io_op recv(void *buf, size_t len)
+	{
+		return start(IXEVIN, buf, len);
+	}
+
+	/**
+	 * send - send @len bytes from @buf, which is copied
+	 */
+	io_op send(const void *buf, size_t len)
+	{
+		return start(IXEVOUT, const_cast<void *>(buf), len);
+	}
+
+	/**
+	 * close - close the connection
+	 *
+	 * The connection is freed once the close completes, so it must not
+	 * be touched afterwards.
+	 */
+	void close() { ixev_close(&ctx_); }
+
+	struct ixev_ctx *ctx() { return &ctx_; }
+
+	static conn *from_ctx(struct ixev_ctx *ctx)
+	{
+		return (conn *) ctx->user_data;
+	}
+
+private:
+	friend conn *accept_pop();
+	friend void accept_push(conn *c);
+
+	io_op start(unsigned int op, void *buf, size_t len)
+	{
+		op_ = op;
+		buf_ = (char *) buf;
+		len_ = len;
+		done_ = 0;
+		err_ = 0;
+		return io_op(*this);
+	}
+
+	/* returns true once the operation has completed or failed */
+	bool progress()
+	{
+		ssize_t ret;
+
+		while (done_ < len_) {
+			if (op_ == IXEVIN)
+				ret = ixev_recv(&ctx_, buf_ + done_, len_ - done_);
+			else
+				ret = ixev_send(&ctx_, buf_ + done_, len_ - done_);
+
+			if (ret == -EAGAIN)
+				return false;
+			if (ret <= 0) {
+				err_ = ret ? ret : -EIO;
+				return true;
+			}
+
+			done_ += ret;
+		}
+
+		return true;
+	}
+
+	static void handler(struct ixev_ctx *ctx, unsigned int reason)
+	{
+		conn *c = from_ctx(ctx);
+		std::coroutine_handle<> h;
+
+		if (!c->progress())
+			return;
+
+		ixev_set_handler(ctx, 0, &conn::handler);
+		h = c->waiter_;
+		c->waiter_ = nullptr;
+		h.resume();
+	}
+
+	struct ixev_ctx ctx_;
+	std::coroutine_handle<> waiter_;
+	unsigned int op_ = 0;
+	char *buf_ = nullptr;
+	size_t len_ = 0;
+	size_t done_ = 0;
+	ssize_t err_ = 0;
+	conn *next_ = nullptr;
+};
+
+inline conn *accept_pop()
+{
+	struct detail::accept_queue *a = &detail::accepted;
+	conn *c = a->head;
+
+	a->head = c->next_;
+	if (!a->head)
+		a->tail = nullptr;
+	c->next_ = nullptr;
+	return c;
+}
+
+inline void accept_push(conn *c)
+{
+	struct detail::accept_queue *a = &detail::accepted;
+	std::coroutine_handle<> h = a->waiter;
+
+	if (a->tail)
+		a->tail->next_ = c;
+	else
+		a->head = c;
+	a->tail = c;
+
+	if (h) {
+		a->waiter = nullptr;
+		h.resume();
+	}
+}
+
+/*
+ * Awaitable returned by accept(). Only one coroutine per thread may wait
+ * for connections.
+ */
+class accept_op {
+public:
+	bool await_ready() { return detail::accepted.head; }
+	void await_suspend(std::coroutine_handle<> h)
+	{
+		detail::accepted.waiter = h;
+	}
+	conn &await_resume() { return *accept_pop(); }
+};
+
+/**
+ * accept - wait for the next incoming connection on this thread
+ */
+inline accept_op accept() { return {}; }
+
+/*
+ * A one-shot timer built on ixev_timer. Only one coroutine may wait on it
+ * at a time.
+ */
+class timer {
+public:
+	class sleep_op {
+	public:
+		sleep_op(timer &t, uint64_t usecs) : t_(t), usecs_(usecs) {}
+
+		bool await_ready() { return false; }
+
+		bool await_suspend(std::coroutine_handle<> h)
+		{
+			t_.waiter_ = h;
+			if (ixev_timer_add_us(&t_.t_, usecs_)) {
+				t_.waiter_ = nullptr;
+				return false;
+			}
+
+			return true;
+		}
+
+		void await_resume() {}
+
+	private:
+		timer &t_;
+		uint64_t usecs_;
+	};
+
+	/**
+	 * init - initialize the underlying ixev_timer
+	 *
+	 * Returns true if successful.
+	 */
+	bool init() { return ixev_timer_init(&t_, &timer::handler, this); }
+
+	/**
+	 * after - suspend the calling coroutine for @usecs microseconds
+	 */
+	sleep_op after(uint64_t usecs) { return sleep_op(*this, usecs); }
+
+private:
+	static void handler(void *arg)
+	{
+		timer *t = (timer *) arg;
+		std::coroutine_handle<> h = t->waiter_;
+
+		t->waiter_ = nullptr;
+		if (h)
+			h.resume();
+	}
+
+	struct ixev_timer t_;
+	std::coroutine_handle<> waiter_;
+};
+
+inline void *task::promise_type::operator new(std::size_t size, conn &c,
+						auto &&...) noexcept
+{
+	void *frame = operator new(size);
+
+	if (!frame)
+		c.close();
+
+	return frame;
+}
+
+namespace detail {
+
+inline struct ixev_ctx *on_accept(struct ip_tuple *id)
+{
+	void *mem = mempool_alloc(&conn_pool);
+
+	if (!mem)
+		return NULL;
+
+	return (new (mem) conn)->ctx();
+}
+
+inline void on_accepted(struct ixev_ctx *ctx)
+{
+	accept_push(conn::from_ctx(ctx));
+}
+
+inline void on_release(struct ixev_ctx *ctx)
+{
+	conn *c = conn::from_ctx(ctx);
+
+	c->~conn();
+	mempool_free(&conn_pool, c);
+}
+
+inline struct ixev_conn_ops conn_ops = {
+	.accept		= on_accept,
+	.release	= on_release,
+	.dialed		= NULL,
+	.accepted	= on_accepted,
+};
+
+} /* namespace detail */
+
+/**
+ * init - global initializer
+ * @max_conns: the number of connections per thread
+ * @max_frames: the number of coroutine frames per thread
+ *
+ * Call once, instead of ixev_init().
+ *
+ * Returns zero if successful, otherwise fail.
+ */
+inline int init(int max_conns, int max_frames)
+{
+	int ret;
+
+	ret = ixev_init(&detail::conn_ops);
+	if (ret)
+		return ret;
+
+	ret = mempool_create_datastore(&detail::conn_datastore,
+				       detail::round_up(max_conns),
+				       sizeof(conn), 0,
+				       MEMPOOL_DEFAULT_CHUNKSIZE, "ixev_conn");
+	if (ret)
+		return ret;
+
+	return mempool_create_datastore(&detail::frame_datastore,
+					detail::round_up(max_frames),
+					IXEV_CORO_FRAME_SIZE, 0,
+					MEMPOOL_DEFAULT_CHUNKSIZE, "ixev_frame");
+}
+
+/**
+ * init_thread - thread-local initializer
+ *
+ * Call once per thread, instead of ixev_init_thread().
+ *
+ * Returns zero if successful, otherwise fail.
+ */
+inline int init_thread()
+{
+	int ret;
+
+	ret = ixev_init_thread();
+	if (ret)
+		return ret;
+
+	ret = mempool_create(&detail::conn_pool, &detail::conn_datastore);
+	if (ret)
+		return ret;
+
+	ret = mempool_create(&detail::frame_pool, &detail::frame_datastore);
+	if (ret) {
+		mempool_destroy(&detail::conn_pool);
+		return ret;
+	}
+
+	return 0;
+}
+
+} /* namespace ixev */
@@ -1,20 +1,375 @@
+/*
+ * Copyright 2013-16 Board of Trustees of Stanford University
+ * Copyright 2013-16 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * ixev_timer.c - user-level timers for the IX event library
+ *
+ * Timers live in a per-thread hierarchical timing wheel that is advanced
+ * from ixev_wait() using the TSC, so arming, rearming and cancelling a
+ * timer never enters the kernel. Each level has WHEEL_SIZE slots and
+ * covers WHEEL_SIZE times the range of the level below it. Timers are
+ * placed in the lowest level that can hold their deadline and cascade
+ * down as the wheel reaches their window, firing from level 0.
+ *
+ * A single kernel timer per thread is armed only when the thread is about
+ * to block in ix_poll(), so that it wakes up in time for the earliest
+ * deadline in the wheel.
+ */
+
+#include <errno.h>
+#include <ix/stddef.h>
+
 #include "ixev_timer.h"
 #include "syscall.h"
 
+#define IXEV_TIMER_TICK_US		16
+#define IXEV_TIMER_MAX_WAKEUP_US	1000000
+
+#define WHEEL_BITS	6
+#define WHEEL_SIZE	(1 << WHEEL_BITS)
+#define WHEEL_MASK	(WHEEL_SIZE - 1)
+#define WHEEL_LEVELS	5
+#define WHEEL_RANGE	(1ULL << (WHEEL_BITS * WHEEL_LEVELS))
+
+struct ixev_wheel {
+	uint64_t		tick;		/* the next tick to process */
+	unsigned long		count;		/* the number of armed timers */
+	uint64_t		occupied[WHEEL_LEVELS];
+	struct ixev_timer	*slots[WHEEL_LEVELS][WHEEL_SIZE];
+};
+
+static uint64_t ixev_cycles_per_us;
+static __thread struct ixev_wheel wheel;
+
+__thread uint64_t ixev_timer_now;
+
+static __thread struct ixev_timer wakeup;
+static __thread int wakeup_id = -1;
+static __thread bool wakeup_armed;
+static __thread uint64_t wakeup_tick;
+
+static inline uint64_t ixev_timer_clock(void)
+{
+	return rdtsc() / ixev_cycles_per_us;
+}
+
+static void wheel_insert(struct ixev_timer *t)
+{
+	uint64_t delta = min(t->expires - wheel.tick, WHEEL_RANGE - 1);
+	unsigned int level = 0, idx;
+	struct ixev_timer **slot;
+
+	if (delta >= WHEEL_SIZE)
+		level = (63 - __builtin_clzll(delta)) / WHEEL_BITS;
+
+	/* deadlines beyond the top level are reinserted when they cascade */
+	idx = ((wheel.tick + delta) >> (level * WHEEL_BITS)) & WHEEL_MASK;
+	slot = &wheel.slots[level][idx];
+
+	t->next = *slot;
+	if (*slot)
+		(*slot)->pprev = &t->next;
+	t->pprev = slot;
+	*slot = t;
+	wheel.occupied[level] |= 1ULL << idx;
+}
+
+static void wheel_cascade(unsigned int level, unsigned int idx)
+{
+	struct ixev_timer *t, *next;
+
+	t = wheel.slots[level][idx];
+	wheel.slots[level][idx] = NULL;
+	wheel.occupied[level] &= ~(1ULL << idx);
+
+	for (; t; t = next) {
+		next = t->next;
+		wheel_insert(t);
+	}
+}
+
+static void wheel_fire(unsigned int idx)
+{
+	struct ixev_timer *t, *next;
+
+	t = wheel.slots[0][idx];
+	wheel.slots[0][idx] = NULL;
+	wheel.occupied[0] &= ~(1ULL << idx);
+
+	/* handlers may cancel @next, so keep its back pointer on our stack */
+	for (; t; t = next) {
+		next = t->next;
+		if (next)
+			next->pprev = &next;
+		t->pprev = NULL;
+		wheel.count--;
+
+		t->handler(t->arg);
+	}
+}
+
+/* returns a lower bound on the earliest deadline in the wheel, in ticks */
+static uint64_t wheel_next_expiry(void)
+{
+	uint64_t best = UINT64_MAX;
+	unsigned int level;
+
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+		unsigned int shift = level * WHEEL_BITS;
+		unsigned int idx = (wheel.tick >> shift) & WHEEL_MASK;
+		uint64_t bits = wheel.occupied[level], rot, dist;
+
+		if (!bits)
+			continue;
+
+		/*
+		 * Once the wheel is past the start of a window, the current
+		 * slot of a higher level has been cascaded and only holds
+		 * timers for the next lap.
+		 */
+		if (level && (wheel.tick & ((1ULL << shift) - 1)) &&
+		    (bits & (1ULL << idx))) {
+			bits &= ~(1ULL << idx);
+			if (!bits) {
+				best = min(best, ((wheel.tick >> shift) +
+						  WHEEL_SIZE) << shift);
+				continue;
+			}
+		}
+
+		rot = (bits >> idx) | (idx ? bits << (WHEEL_SIZE - idx) : 0);
+		dist = __builtin_ctzll(rot);
+		best = min(best, ((wheel.tick >> shift) + dist) << shift);
+	}
+
+	return best;
+}
+
+/**
+ * ixev_timer_init - initializes a timer
+ * @t: the timer
+ * @h: the handler to call when the timer fires
+ * @arg: the argument passed to @h
+ *
+ * Returns nonzero if successful.
+ */
 int ixev_timer_init(struct ixev_timer *t, ixev_timer_handler_t h, void *arg)
 {
 	t->handler = h;
 	t->arg = arg;
-	t->timer_id = sys_timer_init(t);
+	t->next = NULL;
+	t->pprev = NULL;
+
+	return 1;
+}
+
+/**
+ * ixev_timer_add_us - arms a timer
+ * @t: the timer
+ * @usecs: the number of microseconds from present to fire the timer
+ *
+ * If the timer is already armed, its deadline is replaced. The timer
+ * fires from ixev_wait(), no earlier than @usecs from now.
+ *
+ * Returns 0 if successful, otherwise fail.
+ */
+int ixev_timer_add_us(struct ixev_timer *t, uint64_t usecs)
+{
+	uint64_t deadline = ixev_timer_clock() + usecs;
+
+	if (ixev_timer_pending(t))
+		ixev_timer_cancel(t);
+
+	t->expires = max(div_up(deadline, IXEV_TIMER_TICK_US), wheel.tick);
+	wheel_insert(t);
+	wheel.count++;
 
-	return t->timer_id != -1;
+	return 0;
 }
 
+/**
+ * ixev_timer_add - arms a timer
+ * @t: the timer
+ * @tv: the time from present to fire the timer
+ *
+ * See ixev_timer_add_us().
+ *
+ * Returns 0 if successful, otherwise fail.
+ */
 int ixev_timer_add(struct ixev_timer *t, struct timeval tv)
 {
-	uint64_t delay;
+	return ixev_timer_add_us(t, tv.tv_sec * 1000000 + tv.tv_usec);
+}
+
+/**
+ * ixev_timer_cancel - disarms a timer
+ * @t: the timer
+ *
+ * If the timer is already disarmed, then nothing happens.
+ */
+void ixev_timer_cancel(struct ixev_timer *t)
+{
+	struct ixev_timer **first = &wheel.slots[0][0];
+
+	if (!ixev_timer_pending(t))
+		return;
+
+	*t->pprev = t->next;
+	if (t->next)
+		t->next->pprev = t->pprev;
+
+	/* keep the occupancy bitmaps exact when a slot becomes empty */
+	if (t->pprev >= first && t->pprev < first + WHEEL_LEVELS * WHEEL_SIZE &&
+	    !*t->pprev) {
+		unsigned int pos = t->pprev - first;
+
+		wheel.occupied[pos / WHEEL_SIZE] &= ~(1ULL << (pos % WHEEL_SIZE));
+	}
+
+	t->pprev = NULL;
+	wheel.count--;
+}
+
+/**
+ * ixev_timer_run - fires the timers that have expired
+ *
+ * Updates ixev_timer_now and advances the wheel up to the present,
+ * skipping empty stretches of level 0.
+ */
+void ixev_timer_run(void)
+{
+	uint64_t target, next, bits;
+
+	ixev_timer_now = ixev_timer_clock();
+	target = ixev_timer_now / IXEV_TIMER_TICK_US;
+
+	while (wheel.count && wheel.tick <= target) {
+		unsigned int idx = wheel.tick & WHEEL_MASK;
+
+		if (!idx) {
+			unsigned int level;
+
+			for (level = 1; level < WHEEL_LEVELS; level++) {
+				unsigned int lidx = (wheel.tick >>
+					(level * WHEEL_BITS)) & WHEEL_MASK;
+
+				wheel_cascade(level, lidx);
+				if (lidx)
+					break;
+			}
+		}
+
+		/* timers armed by the handlers must land in a later slot */
+		wheel.tick++;
+		if (wheel.occupied[0] & (1ULL << idx))
+			wheel_fire(idx);
+
+		if (!(wheel.tick & WHEEL_MASK))
+			continue;
+
+		bits = wheel.occupied[0] >> (wheel.tick & WHEEL_MASK);
+		if (bits)
+			next = wheel.tick + __builtin_ctzll(bits);
+		else
+			next = (wheel.tick | WHEEL_MASK) + 1;
+		wheel.tick = min(next, target + 1);
+	}
+
+	if (!wheel.count)
+		wheel.tick = max(wheel.tick, target + 1);
+}
+
+static void ixev_timer_wakeup(void *arg)
+{
+	wakeup_armed = false;
+}
+
+/**
+ * ixev_timer_prepare_wait - arms the kernel timer before blocking
+ *
+ * Makes sure that a blocking ix_poll() returns by the earliest deadline in
+ * the wheel. The kernel timer is only rearmed when that deadline moves
+ * earlier than the pending wakeup.
+ */
+void ixev_timer_prepare_wait(void)
+{
+	uint64_t next, now, delay;
+
+	if (!wheel.count)
+		return;
+
+	next = wheel_next_expiry();
+	if (wakeup_armed && wakeup_tick <= next)
+		return;
+
+	now = ixev_timer_clock();
+	delay = next * IXEV_TIMER_TICK_US;
+	delay = delay > now ? delay - now : 1;
+	delay = min(delay, IXEV_TIMER_MAX_WAKEUP_US);
+
+	if (!sys_timer_ctl(wakeup_id, delay)) {
+		wakeup_armed = true;
+		wakeup_tick = min(next, (now + delay) / IXEV_TIMER_TICK_US);
+	}
+}
+
+/**
+ * ixev_timer_calibrate - measures the TSC frequency
+ *
+ * Call once, before any thread uses timers.
+ */
+void ixev_timer_calibrate(void)
+{
+	struct timeval start, now;
+	uint64_t tsc = rdtsc(), us;
+
+	gettimeofday(&start, NULL);
+	do {
+		gettimeofday(&now, NULL);
+		us = (now.tv_sec - start.tv_sec) * 1000000 +
+		     now.tv_usec - start.tv_usec;
+	} while (us < 10000);
+
+	ixev_cycles_per_us = (rdtsc() - tsc) / us;
+}
+
+/**
+ * ixev_timer_init_thread - thread-local initializer
+ *
+ * Allocates the kernel timer used to wake up the thread.
+ *
+ * Returns zero if successful, otherwise fail.
+ */
+int ixev_timer_init_thread(void)
+{
+	ixev_timer_init(&wakeup, ixev_timer_wakeup, NULL);
+	wakeup_id = sys_timer_init(&wakeup);
+	if (wakeup_id < 0)
+		return -ENOMEM;
 
-	delay = tv.tv_sec * 1000000 + tv.tv_usec;
+	ixev_timer_now = ixev_timer_clock();
+	wheel.tick = ixev_timer_now / IXEV_TIMER_TICK_US;
 
-	return sys_timer_ctl(t->timer_id, delay);
+	return 0;
 }
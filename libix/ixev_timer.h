@@ -1,5 +1,35 @@
+/*
+ * Copyright 2013-16 Board of Trustees of Stanford University
+ * Copyright 2013-16 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * ixev_timer.h - user-level timers for the IX event library
+ */
+
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <sys/time.h>
 
 typedef void (*ixev_timer_handler_t)(void *arg);
@@ -7,9 +37,32 @@ typedef void (*ixev_timer_handler_t)(void *arg);
 struct ixev_timer {
 	ixev_timer_handler_t handler;
 	void *arg;
-	int timer_id;
+	uint64_t expires;		/* deadline in wheel ticks */
+	struct ixev_timer *next;	/* wheel slot list */
+	struct ixev_timer **pprev;
 };
 
-int ixev_timer_init(struct ixev_timer *t, ixev_timer_handler_t h, void *arg);
+/**
+ * ixev_timer_pending - determines if a timer is armed
+ * @t: the timer
+ *
+ * Returns true if the timer is armed.
+ */
+static inline bool ixev_timer_pending(struct ixev_timer *t)
+{
+	return t->pprev != NULL;
+}
+
+extern int ixev_timer_init(struct ixev_timer *t, ixev_timer_handler_t h,
+			   void *arg);
+extern int ixev_timer_add(struct ixev_timer *t, struct timeval tv);
+extern int ixev_timer_add_us(struct ixev_timer *t, uint64_t usecs);
+extern void ixev_timer_cancel(struct ixev_timer *t);
+
+/* the time in microseconds, as of the last call to ixev_timer_run() */
+extern __thread uint64_t ixev_timer_now;
 
-int ixev_timer_add(struct ixev_timer *t, struct timeval tv);
+extern void ixev_timer_calibrate(void);
+extern int ixev_timer_init_thread(void);
+extern void ixev_timer_run(void);
+extern void ixev_timer_prepare_wait(void);
@@ -0,0 +1,320 @@
+/*
+ * Copyright 2013-16 Board of Trustees of Stanford University
+ * Copyright 2013-16 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * ixev_udp.c - UDP sockets for the IX event library
+ *
+ * IX has no notion of a UDP socket: every datagram that reaches a core is
+ * handed to the thread running on it. A struct ixev_udp claims a local
+ * port on the calling thread, so a service that runs on every core binds
+ * one socket per thread. Received datagrams are batched per socket and
+ * delivered from ixev_wait() once the events of an iteration have been
+ * processed.
+ *
+ * Every send is tracked by a request from a per-thread pool, which holds
+ * the destination tuple, the SG array and, for copying sends, the
+ * payload until the kernel reports the datagram as sent.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "ixev_udp.h"
+#include "mempool.h"
+
+#define IXEV_UDP_HASH_SIZE	64
+#define IXEV_UDP_NR_REQS	16384
+
+struct ixev_udp_req {
+	struct ip_tuple		id;
+	struct ixev_ref		*ref;		/* the completion callback */
+	struct sg_entry		ents[IXEV_UDP_MAX_SG];
+	char			payload[IXEV_UDP_MAX_LEN];
+};
+
+static struct mempool_datastore ixev_udp_req_datastore;
+static __thread struct mempool ixev_udp_req_pool;
+
+static __thread struct ixev_udp *ixev_udp_hash[IXEV_UDP_HASH_SIZE];
+static __thread struct ixev_udp *ixev_udp_pending;
+
+static inline struct ixev_udp **ixev_udp_bucket(uint16_t port)
+{
+	return &ixev_udp_hash[port & (IXEV_UDP_HASH_SIZE - 1)];
+}
+
+static struct ixev_udp *ixev_udp_lookup(uint16_t port)
+{
+	struct ixev_udp *u;
+
+	for (u = *ixev_udp_bucket(port); u; u = u->hash_next) {
+		if (u->port == port)
+			return u;
+	}
+
+	return NULL;
+}
+
+static void ixev_udp_unlink_pending(struct ixev_udp *u)
+{
+	if (!u->pending_pprev)
+		return;
+
+	*u->pending_pprev = u->pending_next;
+	if (u->pending_next)
+		u->pending_next->pending_pprev = u->pending_pprev;
+	u->pending_pprev = NULL;
+}
+
+/* hand the batched datagrams to the application, then free them */
+static void ixev_udp_deliver(struct ixev_udp *u)
+{
+	unsigned int i, nr = u->nr_msgs;
+
+	u->nr_msgs = 0;
+	u->recv(u, u->msgs, nr);
+
+	for (i = 0; i < nr; i++) {
+		if (!u->msgs[i].held)
+			ixev_udp_recv_done(u->msgs[i].addr);
+	}
+}
+
+/**
+ * ixev_udp_bind - claims a local port on the calling thread
+ * @u: the socket
+ * @port: the local port
+ * @recv: the receive callback
+ *
+ * Returns 0 if successful, otherwise fail.
+ */
+int ixev_udp_bind(struct ixev_udp *u, uint16_t port, ixev_udp_recv_t recv)
+{
+	struct ixev_udp **bucket = ixev_udp_bucket(port);
+
+	if (ixev_udp_lookup(port))
+		return -EADDRINUSE;
+
+	u->port = port;
+	u->recv = recv;
+	u->pending_pprev = NULL;
+	u->nr_msgs = 0;
+
+	u->hash_next = *bucket;
+	*bucket = u;
+
+	return 0;
+}
+
+/**
+ * ixev_udp_unbind - releases the local port of a socket
+ * @u: the socket
+ *
+ * Datagrams received but not yet delivered are dropped. Sends already
+ * queued still complete. When called from the receive callback of @u,
+ * @u must stay allocated until the callback returns.
+ */
+void ixev_udp_unbind(struct ixev_udp *u)
+{
+	struct ixev_udp **pos = ixev_udp_bucket(u->port);
+	unsigned int i;
+
+	for (; *pos; pos = &(*pos)->hash_next) {
+		if (*pos == u) {
+			*pos = u->hash_next;
+			break;
+		}
+	}
+
+	ixev_udp_unlink_pending(u);
+	for (i = 0; i < u->nr_msgs; i++)
+		ixev_udp_recv_done(u->msgs[i].addr);
+	u->nr_msgs = 0;
+}
+
+static struct ixev_udp_req *
+ixev_udp_req_alloc(struct ixev_udp *u, uint32_t ip, uint16_t port,
+		   struct ixev_ref *ref)
+{
+	struct ixev_udp_req *req = mempool_alloc(&ixev_udp_req_pool);
+
+	if (unlikely(!req))
+		return NULL;
+
+	req->id.src_ip = 0;
+	req->id.dst_ip = ip;
+	req->id.src_port = u->port;
+	req->id.dst_port = port;
+	req->ref = ref;
+
+	return req;
+}
+
+static void ixev_udp_req_done(struct ixev_udp_req *req)
+{
+	struct ixev_ref *ref = req->ref;
+
+	mempool_free(&ixev_udp_req_pool, req);
+	if (ref)
+		ref->cb(ref);
+}
+
+/**
+ * ixev_udp_sendto - sends a datagram using copying
+ * @u: the socket
+ * @addr: the address of the payload
+ * @len: the length of the payload, at most IXEV_UDP_MAX_LEN
+ * @ip: the destination address
+ * @port: the destination port
+ *
+ * Returns the number of bytes sent, or <0 if there was an error.
+ */
+ssize_t ixev_udp_sendto(struct ixev_udp *u, void *addr, size_t len,
+			uint32_t ip, uint16_t port)
+{
+	struct ixev_udp_req *req;
+
+	if (unlikely(len > IXEV_UDP_MAX_LEN))
+		return -EINVAL;
+
+	req = ixev_udp_req_alloc(u, ip, port, NULL);
+	if (unlikely(!req))
+		return -EAGAIN;
+
+	memcpy(req->payload, addr, len);
+	ksys_udp_send(__ixev_next_desc(), req->payload, len, &req->id,
+		      (unsigned long) req);
+
+	return len;
+}
+
+/**
+ * ixev_udp_sendv - sends a datagram using zero-copy
+ * @u: the socket
+ * @ents: the SG entries of the payload
+ * @nrents: the number of SG entries, at most IXEV_UDP_MAX_SG
+ * @ip: the destination address
+ * @port: the destination port
+ * @ref: a callback for when the datagram is sent, or NULL
+ *
+ * The SG array itself may be reused right away, but the memory it points
+ * to must stay untouched until @ref is called. A datagram that can't be
+ * sent is dropped, as the network could have, and @ref is still called.
+ *
+ * Returns 0 if successful, otherwise fail.
+ */
+int ixev_udp_sendv(struct ixev_udp *u, struct sg_entry *ents,
+		   unsigned int nrents, uint32_t ip, uint16_t port,
+		   struct ixev_ref *ref)
+{
+	struct ixev_udp_req *req;
+
+	if (unlikely(!nrents || nrents > IXEV_UDP_MAX_SG))
+		return -EINVAL;
+
+	req = ixev_udp_req_alloc(u, ip, port, ref);
+	if (unlikely(!req))
+		return -EAGAIN;
+
+	memcpy(req->ents, ents, nrents * sizeof(struct sg_entry));
+	ksys_udp_sendv(__ixev_next_desc(), req->ents, nrents, &req->id,
+		       (unsigned long) req);
+
+	return 0;
+}
+
+void ixev_udp_recv_event(void *addr, size_t len, struct ip_tuple *id)
+{
+	struct ixev_udp *u = ixev_udp_lookup(id->dst_port);
+	struct ixev_udp_msg *msg;
+
+	if (unlikely(!u)) {
+		ixev_udp_recv_done(addr);
+		return;
+	}
+
+	if (u->nr_msgs == IXEV_UDP_RECV_BATCH)
+		ixev_udp_deliver(u);
+
+	if (!u->pending_pprev) {
+		u->pending_next = ixev_udp_pending;
+		if (ixev_udp_pending)
+			ixev_udp_pending->pending_pprev = &u->pending_next;
+		u->pending_pprev = &ixev_udp_pending;
+		ixev_udp_pending = u;
+	}
+
+	msg = &u->msgs[u->nr_msgs++];
+	msg->addr = addr;
+	msg->len = len;
+	msg->id = id;
+	msg->held = false;
+}
+
+void ixev_udp_sent_event(unsigned long cookie)
+{
+	ixev_udp_req_done((struct ixev_udp_req *) cookie);
+}
+
+void ixev_udp_send_ret(long ret, unsigned long cookie)
+{
+	if (ret < 0 && cookie)
+		ixev_udp_req_done((struct ixev_udp_req *) cookie);
+}
+
+/**
+ * ixev_udp_dispatch - delivers the datagrams batched during an iteration
+ */
+void ixev_udp_dispatch(void)
+{
+	struct ixev_udp *u, *next;
+
+	u = ixev_udp_pending;
+	ixev_udp_pending = NULL;
+
+	/* callbacks may unbind @next, so keep its back pointer on our stack */
+	for (; u; u = next) {
+		next = u->pending_next;
+		if (next)
+			next->pending_pprev = &next;
+		u->pending_pprev = NULL;
+
+		if (u->nr_msgs)
+			ixev_udp_deliver(u);
+	}
+}
+
+int ixev_udp_create_datastore(void)
+{
+	return mempool_create_datastore(&ixev_udp_req_datastore,
+					IXEV_UDP_NR_REQS,
+					sizeof(struct ixev_udp_req), 0,
+					MEMPOOL_DEFAULT_CHUNKSIZE,
+					"ixev_udp_req");
+}
+
+int ixev_udp_init_thread(void)
+{
+	return mempool_create(&ixev_udp_req_pool, &ixev_udp_req_datastore);
+}
@@ -0,0 +1,103 @@
+/*
+ * Copyright 2013-16 Board of Trustees of Stanford University
+ * Copyright 2013-16 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * ixev_udp.h - UDP sockets for the IX event library
+ */
+
+#pragma once
+
+#include "ixev.h"
+
+/* the number of datagrams handed to a receive callback at once */
+#define IXEV_UDP_RECV_BATCH	32
+/* the maximum number of SG entries in a datagram */
+#define IXEV_UDP_MAX_SG		8
+/* the maximum payload of a datagram */
+#define IXEV_UDP_MAX_LEN	1472
+
+struct ixev_udp;
+
+struct ixev_udp_msg {
+	void		*addr;		/* the payload */
+	size_t		len;		/* the length of the payload */
+	struct ip_tuple	*id;		/* the source and destination */
+	bool		held;		/* released by the application? */
+};
+
+/*
+ * Called with the datagrams received for a socket since the last call.
+ * Their buffers are returned to the kernel when the callback returns,
+ * unless ixev_udp_hold() was called on them.
+ */
+typedef void (*ixev_udp_recv_t)(struct ixev_udp *u,
+				struct ixev_udp_msg *msgs, unsigned int nr);
+
+struct ixev_udp {
+	uint16_t		port;		/* the local port */
+	unsigned long		user_data;	/* application data */
+	ixev_udp_recv_t		recv;		/* the receive callback */
+	struct ixev_udp		*hash_next;	/* port lookup chain */
+	struct ixev_udp		*pending_next;	/* sockets with datagrams */
+	struct ixev_udp		**pending_pprev;
+	unsigned int		nr_msgs;	/* the batched datagram count */
+	struct ixev_udp_msg	msgs[IXEV_UDP_RECV_BATCH];
+};
+
+/**
+ * ixev_udp_hold - keeps a received datagram after the callback returns
+ * @msg: the datagram
+ *
+ * The buffer must later be released with ixev_udp_recv_done().
+ */
+static inline void ixev_udp_hold(struct ixev_udp_msg *msg)
+{
+	msg->held = true;
+}
+
+/**
+ * ixev_udp_recv_done - releases a datagram kept with ixev_udp_hold()
+ * @addr: the payload address of the datagram
+ */
+static inline void ixev_udp_recv_done(void *addr)
+{
+	ksys_udp_recv_done(__ixev_next_desc(), addr);
+}
+
+extern int ixev_udp_bind(struct ixev_udp *u, uint16_t port,
+			 ixev_udp_recv_t recv);
+extern void ixev_udp_unbind(struct ixev_udp *u);
+extern ssize_t ixev_udp_sendto(struct ixev_udp *u, void *addr, size_t len,
+			       uint32_t ip, uint16_t port);
+extern int ixev_udp_sendv(struct ixev_udp *u, struct sg_entry *ents,
+			  unsigned int nrents, uint32_t ip, uint16_t port,
+			  struct ixev_ref *ref);
+
+/* used by the event library */
+extern int ixev_udp_create_datastore(void);
+extern int ixev_udp_init_thread(void);
+extern void ixev_udp_recv_event(void *addr, size_t len, struct ip_tuple *id);
+extern void ixev_udp_sent_event(unsigned long cookie);
+extern void ixev_udp_send_ret(long ret, unsigned long cookie);
+extern void ixev_udp_dispatch(void);
@@ -32,33 +32,60 @@
 
 static __thread bsysfn_t usys_tbl[USYS_NR];
 static __thread struct bsys_arr *uarr;
+static __thread unsigned long uarr_pos;
 
 __thread struct bsys_arr *karr;
+__thread uint64_t ix_flush_count;
+__thread struct bsys_rings *ix_rings;
 
-/**
- * ix_poll - flush pending commands and check for new commands
- *
- * Returns the number of new commands received.
- */
-int ix_poll(void)
+static int __ix_poll(unsigned int flags)
 {
 	int ret;
 
-	ret = sys_bpoll(karr->descs, karr->len);
+	ret = sys_bpoll(karr->descs, karr->len, flags);
 	if (ret) {
 		printf("libix: encountered a fatal memory fault\n");
 		exit(-1);
 	}
 
+	uarr_pos = 0;
 	return uarr->len;
 }
 
-void ix_handle_events(void)
+/**
+ * ix_poll - flush pending commands and check for new commands
+ *
+ * Blocks until there is at least one new command.
+ *
+ * Returns the number of new commands received.
+ */
+int ix_poll(void)
 {
-	int i;
+	return __ix_poll(0);
+}
 
-	for (i = 0; i < uarr->len; i++) {
-		struct bsys_desc d = uarr->descs[i];
+/**
+ * ix_poll_nonblock - like ix_poll(), but without blocking
+ *
+ * Does one pass of I/O processing and returns, even without new commands.
+ *
+ * Returns the number of new commands received.
+ */
+int ix_poll_nonblock(void)
+{
+	return __ix_poll(BPOLL_NONBLOCK);
+}
+
+/**
+ * ix_handle_events - dispatch the events not handled yet
+ *
+ * Events returned by ix_flush() after the last ix_poll() are appended to
+ * the same array, so calling this again only handles the new ones.
+ */
+void ix_handle_events(void)
+{
+	for (; uarr_pos < uarr->len; uarr_pos++) {
+		struct bsys_desc d = uarr->descs[uarr_pos];
 		usys_tbl[d.sysnr](d.arga, d.argb, d.argc, d.argd);
 	}
 }
@@ -77,6 +104,47 @@ void ix_flush(void)
 	}
 
 	karr->len = 0;
+	ix_flush_count++;
+}
+
+/**
+ * ix_ring_init - switch this thread to the shared-memory rings
+ *
+ * Events already returned by ix_poll() must have been handled. From now
+ * on events are delivered through the completion ring only.
+ *
+ * Returns 0 if successful, otherwise fail.
+ */
+int ix_ring_init(void)
+{
+	ix_rings = sys_ring_setup();
+	if (!ix_rings)
+		return -ENOMEM;
+
+	return 0;
+}
+
+/**
+ * ix_ring_handle_events - handle the events posted to the completion ring
+ *
+ * Returns the number of events handled.
+ */
+int ix_ring_handle_events(void)
+{
+	const struct bsys_cring *cq = ix_rings->cq;
+	uint32_t head = ix_rings->cq_head, tail = cq->tail;
+	int nr = tail - head;
+
+	rmb();
+
+	for (; head != tail; head++) {
+		struct bsys_desc d = cq->descs[head & BSYS_RING_MASK];
+		usys_tbl[d.sysnr](d.arga, d.argb, d.argc, d.argd);
+	}
+
+	ix_rings->cq_head = head;
+
+	return nr;
 }
 
 static void
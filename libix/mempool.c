@@ -39,6 +39,27 @@ static struct mempool_datastore *mempool_all_datastores;
 #define log_err(fmt, ...) printf(fmt, ##__VA_ARGS__)
 #define panic(fmt, ...) do {printf(fmt, ##__VA_ARGS__); exit(-1); } while (0)
 
+/*
+ * Moves the elements freed by other threads back to the local free list.
+ * The whole stack is taken with a single exchange, so there is no ABA
+ * problem with concurrent pushes.
+ */
+static bool mempool_reclaim_remote(struct mempool *m)
+{
+	struct mempool_hdr *h, *next;
+
+	if (!m->remote_head)
+		return false;
+
+	h = __sync_lock_test_and_set(&m->remote_head, NULL);
+	for (; h; h = next) {
+		next = h->next;
+		mempool_free(m, h);
+	}
+
+	return true;
+}
+
 /**
  * mempool_alloc_2  -- second stage allocator; may spinlock
  * @m: mempool
@@ -51,6 +72,9 @@ void *mempool_alloc_2(struct mempool *m)
 	assert(m->magic == MEMPOOL_MAGIC);
 	assert(m->head == NULL);
 
+	if (mempool_reclaim_remote(m) && m->head)
+		return mempool_alloc(m);
+
 	if (m->private_chunk) {
 		h = m->private_chunk;
 		m->head = h->next;
@@ -98,6 +122,7 @@ void mempool_free_2(struct mempool *m, void *ptr)
 	}
 	m->private_chunk = m->head;
 	m->head = elem;
+	m->num_free = 1;
 }
 
 
@@ -259,3 +284,112 @@ void mempool_destroy(struct mempool *m)
 {
 	/* TODO: implement me */
 }
+
+static struct mempool_datastore mempool_class_datastores[MEMPOOL_NR_CLASSES];
+static __thread struct mempool mempool_classes[MEMPOOL_NR_CLASSES];
+
+/* prepended to size-class elements; keeps user data 16-byte aligned */
+struct mempool_class_hdr {
+	struct mempool		*pool;
+	unsigned long		pad;
+};
+
+static const char *mempool_class_names[MEMPOOL_NR_CLASSES] = {
+	"class_32", "class_64", "class_128", "class_256",
+	"class_512", "class_1024", "class_2048", "class_4096",
+};
+
+/**
+ * mempool_create_class_datastores - initializes the size-class datastores
+ * @nr_elems: the minimum number of elements in each class
+ *
+ * Call once.
+ *
+ * Returns 0 if successful, otherwise fail.
+ */
+int mempool_create_class_datastores(int nr_elems)
+{
+	int i, ret;
+
+	nr_elems = align_up(nr_elems, MEMPOOL_DEFAULT_CHUNKSIZE);
+
+	for (i = 0; i < MEMPOOL_NR_CLASSES; i++) {
+		size_t len = (MEMPOOL_CLASS_MIN << i) +
+			     sizeof(struct mempool_class_hdr);
+
+		ret = mempool_create_datastore(&mempool_class_datastores[i],
+					       nr_elems, len, 0,
+					       MEMPOOL_DEFAULT_CHUNKSIZE,
+					       mempool_class_names[i]);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/**
+ * mempool_create_classes - initializes the size-class pools of a thread
+ *
+ * Call once per thread.
+ *
+ * Returns 0 if successful, otherwise fail.
+ */
+int mempool_create_classes(void)
+{
+	int i, ret;
+
+	for (i = 0; i < MEMPOOL_NR_CLASSES; i++) {
+		ret = mempool_create(&mempool_classes[i],
+				     &mempool_class_datastores[i]);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/**
+ * mempool_class_alloc - allocates memory from the size-class pools
+ * @len: the number of bytes, at most MEMPOOL_CLASS_MAX
+ *
+ * Returns a pointer to 16-byte aligned memory, or NULL if unsuccessful.
+ */
+void *mempool_class_alloc(size_t len)
+{
+	struct mempool_class_hdr *h;
+	struct mempool *m;
+	int class = 0;
+
+	if (unlikely(len > MEMPOOL_CLASS_MAX))
+		return NULL;
+
+	if (len > MEMPOOL_CLASS_MIN)
+		class = 64 - __builtin_clzl(len - 1) - MEMPOOL_CLASS_MIN_SHIFT;
+
+	m = &mempool_classes[class];
+	h = mempool_alloc(m);
+	if (unlikely(!h))
+		return NULL;
+
+	h->pool = m;
+	return h + 1;
+}
+
+/**
+ * mempool_class_free - frees memory back to the size-class pools
+ * @ptr: memory returned by mempool_class_alloc()
+ *
+ * May be called from any thread. Memory allocated by another thread is
+ * handed back to that thread with mempool_free_remote().
+ */
+void mempool_class_free(void *ptr)
+{
+	struct mempool_class_hdr *h = (struct mempool_class_hdr *) ptr - 1;
+	struct mempool *m = h->pool;
+
+	if (m >= mempool_classes && m < mempool_classes + MEMPOOL_NR_CLASSES)
+		mempool_free(m, h);
+	else
+		mempool_free_remote(m, h);
+}
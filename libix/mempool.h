@@ -29,6 +29,7 @@
 
 #include <ix/stddef.h>
 #include <ix/mem.h>
+#include <asm/cpu.h>
 #include <assert.h>
 
 #ifdef __KERNEL__
@@ -75,6 +76,9 @@ struct mempool {
 	int                     chunk_size;
 	int                     num_alloc;
 	int                     num_free;
+
+	/* elements freed by other threads, reclaimed by the owner */
+	struct mempool_hdr	*volatile remote_head __aligned(CACHE_LINE_SIZE);
 };
 #define MEMPOOL_MAGIC   0x12911776
 
@@ -120,6 +124,44 @@ static inline void mempool_free(struct mempool *m, void *ptr)
 		mempool_free_2(m, ptr);
 }
 
+/**
+ * mempool_free_remote - frees an element from a thread that doesn't own @m
+ * @m: the memory pool the element was allocated from
+ * @ptr: the element
+ *
+ * The element is pushed on a lock-free stack that the owner of @m
+ * reclaims in bulk the next time its local free list runs dry. The
+ * owning thread must still be alive.
+ */
+static inline void mempool_free_remote(struct mempool *m, void *ptr)
+{
+	struct mempool_hdr *elem = (struct mempool_hdr *) ptr;
+	struct mempool_hdr *head;
+
+	do {
+		head = m->remote_head;
+		elem->next = head;
+	} while (!__sync_bool_compare_and_swap(&m->remote_head, head, elem));
+}
+
 extern int mempool_create_datastore(struct mempool_datastore *m, int nr_elems, size_t elem_len, int nostraddle, int chunk_size, const char *prettyname);
 extern int mempool_create(struct mempool *m, struct mempool_datastore *mds);
 extern void mempool_destroy(struct mempool *m);
+
+/*
+ * Size-class pools: power-of-two classes from MEMPOOL_CLASS_MIN to
+ * MEMPOOL_CLASS_MAX bytes, with one datastore per class shared by all
+ * threads. Elements remember their owning pool, so they can be freed
+ * from any thread without passing the pool or the size.
+ */
+#define MEMPOOL_CLASS_MIN_SHIFT	5
+#define MEMPOOL_CLASS_MAX_SHIFT	12
+#define MEMPOOL_CLASS_MIN	(1 << MEMPOOL_CLASS_MIN_SHIFT)
+#define MEMPOOL_CLASS_MAX	(1 << MEMPOOL_CLASS_MAX_SHIFT)
+#define MEMPOOL_NR_CLASSES	\
+	(MEMPOOL_CLASS_MAX_SHIFT - MEMPOOL_CLASS_MIN_SHIFT + 1)
+
+extern int mempool_create_class_datastores(int nr_elems);
+extern int mempool_create_classes(void);
+extern void *mempool_class_alloc(size_t len);
+extern void mempool_class_free(void *ptr);
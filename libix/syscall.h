@@ -32,9 +32,10 @@
 #include <ix/vm.h>
 #include "syscall_raw.h"
 
-static inline int sys_bpoll(struct bsys_desc *d, unsigned int nr)
+static inline int sys_bpoll(struct bsys_desc *d, unsigned int nr,
+			    unsigned int flags)
 {
-	return (int) SYSCALL(SYS_BPOLL, d, nr);
+	return (int) SYSCALL(SYS_BPOLL, d, nr, flags);
 }
 
 static inline int sys_bcall(struct bsys_desc *d, unsigned int nr)
@@ -76,3 +77,8 @@ static inline int sys_timer_ctl(int timer_id, uint64_t delay)
 {
 	return (int) SYSCALL(SYS_TIMER_CTL, timer_id, delay);
 }
+
+static inline struct bsys_rings *sys_ring_setup(void)
+{
+	return (struct bsys_rings *) SYSCALL(SYS_RING_SETUP);
+}
@@ -0,0 +1,438 @@
+/*
+ * Copyright 2013-16 Board of Trustees of Stanford University
+ * Copyright 2013-16 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * ix_mock.c - the kernel side of the userspace stand-in for IX
+ *
+ * Commands are checked against the state of their connection, so a
+ * descriptor that libix rewrote after it was issued, or a command for
+ * the wrong handle, shows up in ix_mock_errors. Sendv returns are
+ * reported, and the data acknowledged, at the next bpoll, unless the
+ * connection holds its acknowledgements back for ix_mock_ack().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "ix_mock.h"
+
+#define MOCK_UARR_LEN	(1 << 20)
+#define MOCK_MAX_CONNS	(1 << 20)
+
+ix_mock_sendv_t ix_mock_sendv;
+ix_mock_udp_send_t ix_mock_udp_send;
+ix_mock_udp_recv_done_t ix_mock_udp_recv_done;
+unsigned long ix_mock_nr_cmds;
+unsigned long ix_mock_errors;
+unsigned long ix_mock_nr_timer_ctl;
+unsigned long ix_mock_timer_delay;
+
+static struct bsys_arr *uarr;
+static struct ix_mock_conn *conns;
+static unsigned int nr_conns;
+
+/* events for the next bpoll */
+static struct bsys_desc *events;
+static unsigned long nr_events, max_events;
+
+/* connections with sendv returns to report */
+static struct ix_mock_conn **dirty;
+static unsigned int nr_dirty;
+
+static int nr_timers;
+
+#define mock_error(fmt, ...)						\
+do {									\
+	if (ix_mock_errors++ < 20)					\
+		printf("ix_mock: " fmt "\n", ##__VA_ARGS__);		\
+} while (0)
+
+/* the BSYS_DESC_*ARG() macros evaluate their descriptor more than once */
+static struct bsys_desc *mock_event(void)
+{
+	if (nr_events == max_events) {
+		max_events = max_events ? max_events * 2 : 4096;
+		events = realloc(events, max_events * sizeof(*events));
+		if (!events) {
+			printf("ix_mock: out of memory\n");
+			exit(1);
+		}
+	}
+
+	return &events[nr_events++];
+}
+
+/**
+ * ix_mock_conn - finds the kernel side of a connection
+ * @handle: the handle
+ *
+ * Returns the connection, or NULL if the handle is invalid.
+ */
+struct ix_mock_conn *ix_mock_conn(hid_t handle)
+{
+	if (!handle || handle > nr_conns)
+		return NULL;
+
+	return &conns[handle - 1];
+}
+
+/**
+ * ix_mock_knock - opens a connection, announced at the next bpoll
+ *
+ * Returns the kernel side of the connection.
+ */
+struct ix_mock_conn *ix_mock_knock(void)
+{
+	static struct ip_tuple id;
+	struct ix_mock_conn *c;
+	struct bsys_desc *d;
+
+	if (!conns) {
+		conns = calloc(MOCK_MAX_CONNS, sizeof(*conns));
+		dirty = calloc(MOCK_MAX_CONNS, sizeof(*dirty));
+	}
+	if (!conns || !dirty || nr_conns == MOCK_MAX_CONNS) {
+		printf("ix_mock: too many connections\n");
+		exit(1);
+	}
+
+	c = &conns[nr_conns++];
+	c->handle = nr_conns;
+	d = mock_event();
+	BSYS_DESC_2ARG(d, USYS_TCP_KNOCK, c->handle, &id);
+
+	return c;
+}
+
+/**
+ * ix_mock_recv - delivers data at the next bpoll
+ * @c: the connection
+ * @addr: the data, which must stay valid until it is released
+ * @len: the length of the data
+ */
+void ix_mock_recv(struct ix_mock_conn *c, void *addr, size_t len)
+{
+	struct bsys_desc *d = mock_event();
+
+	/* the cookie is filled in at delivery, the accept may be queued */
+	BSYS_DESC_4ARG(d, USYS_TCP_RECV, c->handle, 0, addr, len);
+	c->recvd += len;
+}
+
+/**
+ * ix_mock_ack - acknowledges the data sent so far at the next bpoll
+ * @c: the connection
+ */
+void ix_mock_ack(struct ix_mock_conn *c)
+{
+	struct bsys_desc *d;
+
+	if (c->closed || c->sent == c->acked)
+		return;
+
+	d = mock_event();
+	BSYS_DESC_3ARG(d, USYS_TCP_SENT, c->handle, 0, c->sent - c->acked);
+	c->acked = c->sent;
+}
+
+/**
+ * ix_mock_udp_recv - delivers a UDP datagram at the next bpoll
+ * @addr: the payload, which must stay valid until it is released
+ * @len: the length of the payload
+ * @id: the source and destination, valid as long as @addr
+ */
+void ix_mock_udp_recv(void *addr, size_t len, struct ip_tuple *id)
+{
+	struct bsys_desc *d = mock_event();
+
+	BSYS_DESC_3ARG(d, USYS_UDP_RECV, addr, len, id);
+}
+
+/**
+ * ix_mock_udp_sent - reports a UDP datagram as sent at the next bpoll
+ * @cookie: the cookie of the send
+ */
+void ix_mock_udp_sent(unsigned long cookie)
+{
+	struct bsys_desc *d = mock_event();
+
+	BSYS_DESC_1ARG(d, USYS_UDP_SENT, cookie);
+}
+
+static void mock_udp_send(struct bsys_desc *d)
+{
+	struct ix_mock_dgram dg;
+	struct sg_entry ent;
+	struct bsys_desc *ev;
+	long ret = 0;
+
+	if (d->sysnr == KSYS_UDP_SEND) {
+		ent.base = (void *) d->arga;
+		ent.len = d->argb;
+		dg.ents = &ent;
+		dg.nrents = 1;
+	} else {
+		dg.ents = (struct sg_entry *) d->arga;
+		dg.nrents = d->argb;
+	}
+	dg.id = (struct ip_tuple *) d->argc;
+	dg.cookie = d->argd;
+
+	if (!dg.nrents || dg.nrents > MAX_SG_ENTRIES)
+		ret = -RET_INVAL;
+	else if (ix_mock_udp_send)
+		ret = ix_mock_udp_send(&dg);
+	else
+		ix_mock_udp_sent(dg.cookie);
+
+	if (ret) {
+		ev = mock_event();
+		BSYS_DESC_3ARG(ev, USYS_KSYS_RET, d->sysnr, ret, dg.cookie);
+	}
+}
+
+static size_t mock_sendv_all(struct ix_mock_conn *c, struct sg_entry *ents,
+			     unsigned int nrents)
+{
+	size_t len = 0;
+	unsigned int i;
+
+	for (i = 0; i < nrents; i++)
+		len += ents[i].len;
+
+	return len;
+}
+
+static void mock_sendv(struct ix_mock_conn *c, struct sg_entry *ents,
+		       unsigned int nrents)
+{
+	size_t len;
+
+	if (!nrents || nrents > MAX_SG_ENTRIES) {
+		mock_error("sendv on %lu with %u entries", c->handle, nrents);
+		return;
+	}
+
+	len = (ix_mock_sendv ? ix_mock_sendv : mock_sendv_all)(c, ents,
+							       nrents);
+	if (!len)
+		return;
+
+	c->sent += len;
+	c->xmit += len;
+	if (!c->dirty) {
+		c->dirty = true;
+		dirty[nr_dirty++] = c;
+	}
+}
+
+static void mock_dispatch_one(struct bsys_desc *d)
+{
+	struct ix_mock_conn *c = NULL;
+	struct bsys_desc *ev;
+
+	ix_mock_nr_cmds++;
+
+	switch (d->sysnr) {
+	case KSYS_TCP_ACCEPT:
+	case KSYS_TCP_REJECT:
+	case KSYS_TCP_SEND:
+	case KSYS_TCP_SENDV:
+	case KSYS_TCP_RECV_DONE:
+	case KSYS_TCP_CLOSE:
+		c = ix_mock_conn(d->arga);
+		if (!c || c->closed) {
+			mock_error("command %lu on invalid handle %lu",
+				   d->sysnr, d->arga);
+			return;
+		}
+		if (!c->accepted && d->sysnr != KSYS_TCP_ACCEPT &&
+		    d->sysnr != KSYS_TCP_REJECT) {
+			mock_error("command %lu on unaccepted handle %lu",
+				   d->sysnr, d->arga);
+			return;
+		}
+		break;
+	case KSYS_UDP_SEND:
+	case KSYS_UDP_SENDV:
+		mock_udp_send(d);
+		return;
+	case KSYS_UDP_RECV_DONE:
+		if (ix_mock_udp_recv_done)
+			ix_mock_udp_recv_done((void *) d->arga);
+		return;
+	case KSYS_NOP:
+		return;
+	default:
+		mock_error("unexpected command %lu", d->sysnr);
+		return;
+	}
+
+	switch (d->sysnr) {
+	case KSYS_TCP_ACCEPT:
+		if (c->accepted)
+			mock_error("handle %lu accepted twice", c->handle);
+		c->accepted = true;
+		c->cookie = d->argb;
+		break;
+	case KSYS_TCP_REJECT:
+		c->closed = true;
+		break;
+	case KSYS_TCP_SENDV:
+		mock_sendv(c, (struct sg_entry *) d->argb, d->argc);
+		break;
+	case KSYS_TCP_RECV_DONE:
+		if (d->argb > c->recvd - c->recv_done) {
+			mock_error("recv_done of %lu bytes on %lu, %lu outstanding",
+				   d->argb, c->handle, c->recvd - c->recv_done);
+			return;
+		}
+		c->recv_done += d->argb;
+		break;
+	case KSYS_TCP_CLOSE:
+		c->closed = true;
+		ev = mock_event();
+		BSYS_DESC_3ARG(ev, USYS_KSYS_RET, KSYS_TCP_CLOSE, 0, c->cookie);
+		break;
+	default:
+		mock_error("unsupported command %lu", d->sysnr);
+	}
+}
+
+static void mock_dispatch(struct bsys_desc *d, unsigned int nr)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr; i++)
+		mock_dispatch_one(&d[i]);
+}
+
+static struct bsys_arr *mock_baddr(void)
+{
+	if (!uarr) {
+		uarr = malloc(sizeof(struct bsys_arr) +
+			      MOCK_UARR_LEN * sizeof(struct bsys_desc));
+		if (!uarr)
+			return NULL;
+		uarr->len = 0;
+		uarr->max_len = MOCK_UARR_LEN;
+	}
+
+	return uarr;
+}
+
+/* the previous events are consumed, so hand out the new ones */
+static void mock_bpoll(struct bsys_desc *d, unsigned int nr)
+{
+	struct ix_mock_conn *c;
+	struct bsys_desc *ev;
+	unsigned long i;
+
+	mock_dispatch(d, nr);
+
+	uarr->len = 0;
+	for (i = 0; i < nr_dirty; i++) {
+		c = dirty[i];
+		c->dirty = false;
+		if (c->closed)
+			continue;
+
+		ev = &uarr->descs[uarr->len++];
+		BSYS_DESC_3ARG(ev, USYS_TCP_SENDV_RET, c->handle, c->cookie,
+			       c->xmit);
+		c->xmit = 0;
+		if (c->hold_acks || c->sent == c->acked)
+			continue;
+
+		ev = &uarr->descs[uarr->len++];
+		BSYS_DESC_3ARG(ev, USYS_TCP_SENT, c->handle, c->cookie,
+			       c->sent - c->acked);
+		c->acked = c->sent;
+	}
+	nr_dirty = 0;
+
+	if (uarr->len + nr_events > uarr->max_len) {
+		printf("ix_mock: too many events\n");
+		exit(1);
+	}
+	for (i = 0; i < nr_events; i++) {
+		ev = &uarr->descs[uarr->len++];
+		*ev = events[i];
+		if (ev->sysnr == USYS_TCP_RECV || ev->sysnr == USYS_TCP_SENT)
+			ev->argb = ix_mock_conn(ev->arga)->cookie;
+	}
+	nr_events = 0;
+}
+
+static int mock_mmap(void *addr, int nr, int size, int perm)
+{
+	void *ret;
+
+	ret = mmap(addr, (size_t) nr * size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE |
+		   MAP_NORESERVE, -1, 0);
+	if (ret != addr) {
+		if (ret != MAP_FAILED)
+			munmap(ret, (size_t) nr * size);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+long ix_mock_syscall(long sysnr, long a, long b, long c, long d, long e,
+		     long f)
+{
+	switch (sysnr) {
+	case SYS_BPOLL:
+		mock_bpoll((struct bsys_desc *) a, b);
+		return 0;
+	case SYS_BCALL:
+		mock_dispatch((struct bsys_desc *) a, b);
+		return 0;
+	case SYS_BADDR:
+		return (long) mock_baddr();
+	case SYS_MMAP:
+		return mock_mmap((void *) a, b, c, d);
+	case SYS_MUNMAP:
+		return munmap((void *) a, (size_t) b * c);
+	case SYS_SPAWNMODE:
+		return 0;
+	case SYS_NRCPUS:
+		return 1;
+	case SYS_TIMER_INIT:
+		return nr_timers++;
+	case SYS_TIMER_CTL:
+		ix_mock_nr_timer_ctl++;
+		ix_mock_timer_delay = b;
+		return 0;
+	case SYS_RING_SETUP:
+		return 0;
+	default:
+		return -ENOSYS;
+	}
+}
@@ -0,0 +1,107 @@
+/*
+ * Copyright 2013-16 Board of Trustees of Stanford University
+ * Copyright 2013-16 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * ix_mock.h - a userspace stand-in for the IX system call interface
+ *
+ * The libix sources of the tests are built with -include ix_mock.h, which
+ * routes every SYSCALL() to ix_mock_syscall() instead of trapping into
+ * the dataplane. ix_mock.c plays the kernel side: it checks and executes
+ * the batched commands, and hands the events queued by the test to the
+ * next bpoll. Only one thread may use the batched calls at a time.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <ix/syscall.h>
+#include "../libix/syscall_raw.h"
+
+#undef SYSCALL
+#define __IX_MOCK_SYSCALL(sysnr, a, b, c, d, e, f, ...)			\
+	ix_mock_syscall(sysnr, (long) (a), (long) (b), (long) (c),	\
+			(long) (d), (long) (e), (long) (f))
+#define SYSCALL(...) __IX_MOCK_SYSCALL(__VA_ARGS__, 0, 0, 0, 0, 0, 0)
+
+extern long ix_mock_syscall(long sysnr, long a, long b, long c, long d,
+			    long e, long f);
+
+/* the kernel side of a TCP connection */
+struct ix_mock_conn {
+	hid_t		handle;
+	unsigned long	cookie;		/* set by KSYS_TCP_ACCEPT */
+	bool		accepted;
+	bool		closed;
+	bool		dirty;		/* sendv returns to report */
+	bool		hold_acks;	/* acknowledge only in ix_mock_ack() */
+	size_t		recvd;		/* bytes delivered with USYS_TCP_RECV */
+	size_t		recv_done;	/* bytes given back with KSYS_TCP_RECV_DONE */
+	size_t		sent;		/* bytes taken by KSYS_TCP_SENDV */
+	size_t		xmit;		/* bytes taken since the last bpoll */
+	size_t		acked;		/* bytes reported with USYS_TCP_SENT */
+};
+
+/*
+ * Called for each KSYS_TCP_SENDV; returns how many bytes the kernel
+ * takes. The default takes everything.
+ */
+typedef size_t (*ix_mock_sendv_t)(struct ix_mock_conn *c,
+				  struct sg_entry *ents, unsigned int nrents);
+
+extern ix_mock_sendv_t ix_mock_sendv;
+
+/* a UDP datagram handed to the kernel */
+struct ix_mock_dgram {
+	struct ip_tuple	*id;
+	struct sg_entry	*ents;		/* the payload */
+	unsigned int	nrents;
+	unsigned long	cookie;
+};
+
+/*
+ * Called for each KSYS_UDP_SEND and KSYS_UDP_SENDV; returns 0 if the
+ * datagram is sent, which is reported with ix_mock_udp_sent(), or a
+ * -RET_* code to fail it. The default sends everything and reports it
+ * at the next bpoll.
+ */
+typedef long (*ix_mock_udp_send_t)(struct ix_mock_dgram *dg);
+
+/* called for each KSYS_UDP_RECV_DONE */
+typedef void (*ix_mock_udp_recv_done_t)(void *addr);
+
+extern ix_mock_udp_send_t ix_mock_udp_send;
+extern ix_mock_udp_recv_done_t ix_mock_udp_recv_done;
+extern unsigned long ix_mock_nr_cmds;	/* commands dispatched */
+extern unsigned long ix_mock_errors;	/* invalid commands seen */
+extern unsigned long ix_mock_nr_timer_ctl; /* kernel timers armed */
+extern unsigned long ix_mock_timer_delay; /* the last delay armed, in us */
+
+extern struct ix_mock_conn *ix_mock_knock(void);
+extern void ix_mock_recv(struct ix_mock_conn *c, void *addr, size_t len);
+extern void ix_mock_ack(struct ix_mock_conn *c);
+extern struct ix_mock_conn *ix_mock_conn(hid_t handle);
+extern void ix_mock_udp_recv(void *addr, size_t len, struct ip_tuple *id);
+extern void ix_mock_udp_sent(unsigned long cookie);
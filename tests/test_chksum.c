@@ -0,0 +1,191 @@
+/*
+ * Copyright 2013-16 Board of Trustees of Stanford University
+ * Copyright 2013-16 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * test_chksum.c - checks the vector checksum kernels against a reference
+ *
+ * Every kernel the CPU supports is run on odd lengths, misaligned
+ * buffers and lengths around CHKSUM_VEC_MIN_LEN, and must agree with a
+ * plain RFC 1071 sum of 16-bit words.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+
+#include "../dp/core/chksum.c"
+
+#define MAX_LEN		4200
+#define MAX_OFF		64
+
+struct kernel {
+	const char *name;
+	uint16_t (*partial)(const void *buf, int len);
+	uint16_t (*copy_partial)(void *dst, const void *src, int len);
+};
+
+static const struct kernel kernels[] = {
+	{"generic", chksum_partial_generic, chksum_copy_partial_generic},
+	{"sse4.2", chksum_partial_sse42, chksum_copy_partial_sse42},
+	{"avx2", chksum_partial_avx2, chksum_copy_partial_avx2},
+};
+
+static unsigned char src_buf[MAX_LEN + MAX_OFF];
+static unsigned char dst_buf[MAX_LEN + MAX_OFF];
+static int failures;
+
+void logk(int level, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+}
+
+static uint16_t ref_partial(const unsigned char *p, int len)
+{
+	uint64_t sum = 0;
+	uint16_t w;
+
+	for (; len >= 2; p += 2, len -= 2) {
+		memcpy(&w, p, 2);
+		sum += w;
+	}
+	if (len)
+		sum += *p;
+
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return sum;
+}
+
+/* 0x0000 and 0xffff both encode zero in one's complement */
+static bool same_sum(uint16_t a, uint16_t b)
+{
+	return a == b || ((a == 0 || a == 0xffff) && (b == 0 || b == 0xffff));
+}
+
+static void check(const struct kernel *k, int off, int len)
+{
+	const unsigned char *src = src_buf + off;
+	unsigned char *dst = dst_buf + (off * 7 + 3) % MAX_OFF;
+	uint16_t ref = ref_partial(src, len);
+	uint16_t got;
+
+	got = k->partial(src, len);
+	if (!same_sum(got, ref)) {
+		printf("FAIL %s partial off %d len %d: %04x != %04x\n",
+		       k->name, off, len, got, ref);
+		failures++;
+	}
+
+	memset(dst_buf, 0x5a, sizeof(dst_buf));
+	got = k->copy_partial(dst, src, len);
+	if (!same_sum(got, ref)) {
+		printf("FAIL %s copy_partial off %d len %d: %04x != %04x\n",
+		       k->name, off, len, got, ref);
+		failures++;
+	}
+	if (memcmp(dst, src, len) || (dst + len < dst_buf + sizeof(dst_buf) &&
+				      dst[len] != 0x5a)) {
+		printf("FAIL %s copy_partial off %d len %d: bad copy\n",
+		       k->name, off, len);
+		failures++;
+	}
+
+	got = ~chksum_internet((const char *) src, len);
+	if (!same_sum(got, ref)) {
+		printf("FAIL %s chksum_internet off %d len %d: %04x != %04x\n",
+		       k->name, off, len, got, ref);
+		failures++;
+	}
+}
+
+static void fill(unsigned int seed, int pattern)
+{
+	int i;
+
+	srand(seed);
+	for (i = 0; i < sizeof(src_buf); i++) {
+		switch (pattern) {
+		case 0:
+			src_buf[i] = rand();
+			break;
+		case 1:
+			/* all ones stresses the carries */
+			src_buf[i] = 0xff;
+			break;
+		default:
+			src_buf[i] = 0;
+		}
+	}
+}
+
+int main(void)
+{
+	static const int offs[] = {0, 1, 2, 3, 5, 7, 8, 15, 16, 31, 33};
+	bool supported[] = {
+		true,
+		__builtin_cpu_supports("sse4.2"),
+		__builtin_cpu_supports("avx2"),
+	};
+	const struct kernel *k;
+	int i, j, len, pattern;
+
+	for (i = 0; i < ARRAY_SIZE(kernels); i++) {
+		k = &kernels[i];
+		if (!supported[i]) {
+			printf("skipping %s kernels (unsupported CPU)\n",
+			       k->name);
+			continue;
+		}
+
+		/* exercise chksum_internet() with this kernel selected */
+		chksum_partial = k->partial;
+		chksum_copy_partial = k->copy_partial;
+
+		for (pattern = 0; pattern < 3; pattern++) {
+			fill(i * 3 + pattern + 1, pattern);
+			for (j = 0; j < ARRAY_SIZE(offs); j++) {
+				/* every length through a few vector blocks */
+				for (len = 0; len <= 300; len++)
+					check(k, offs[j], len);
+				/* odd and even lengths up to a jumbo frame */
+				for (len = 301; len <= MAX_LEN; len += 97)
+					check(k, offs[j], len);
+			}
+		}
+
+		printf("%s kernels: ok\n", k->name);
+	}
+
+	if (failures) {
+		printf("test_chksum: %d failures\n", failures);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,239 @@
+/*
+ * Copyright 2013-16 Board of Trustees of Stanford University
+ * Copyright 2013-16 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+
+/*
+ * test_eth_batch.c - checks the adaptive RX batch limit
+ *
+ * eth_rx_adapt_batch() is fed synthetic sequences of queuing delays and
+ * queue sizes. The limit must double while packets wait on it, step down
+ * once the delay is well below target, hold in between, and never leave
+ * [ETH_RX_MIN_BATCH, eth_rx_max_batch], even when the maximum is lowered
+ * under it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+
+/* ethqueue.c pulls in headers that are for the dataplane only */
+#define __KERNEL__ 1
+
+#include <ix/cpu.h>
+
+/* a single CPU whose percpu variables are plain globals */
+#undef DEFINE_PERCPU
+#define DEFINE_PERCPU(type, name) __typeof__(type) name
+#undef percpu_get
+#define percpu_get(var) (var)
+
+#include "../dp/core/ethqueue.c"
+
+#define TARGET_DELAY	100
+
+static int failures;
+
+#define CHECK(cond, fmt, ...)						\
+do {									\
+	if (!(cond)) {							\
+		printf("FAIL %s:%d: " fmt "\n", __FILE__, __LINE__,	\
+		       ##__VA_ARGS__);					\
+		if (++failures > 20)					\
+			exit(1);					\
+	}								\
+} while (0)
+
+/* only eth_rx_adapt_batch() runs, so the rest is never called */
+DEFINE_PERCPU(unsigned int, cpu_nr);
+DEFINE_PERCPU(unsigned long, idle_cycles);
+volatile struct cp_shmem *cp_shmem;
+double energy_unit;
+int cycles_per_us;
+
+void eth_input(struct eth_rx_queue *rx_queue, struct mbuf *pkt)
+{
+	abort();
+}
+
+void tcp_gro_flush(void)
+{
+	abort();
+}
+
+void tcp_ack_flush(void)
+{
+	abort();
+}
+
+void logk(int level, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+}
+
+static unsigned int adapt(double delay, double queue_size)
+{
+	eth_rx_adapt_batch(delay, queue_size);
+	return eth_rx_batch;
+}
+
+static void test_grow(void)
+{
+	unsigned int expected;
+
+	eth_rx_max_batch = 64;
+	eth_rx_batch = ETH_RX_MIN_BATCH;
+
+	/* doubles while the delay is high and the queue outgrows the limit */
+	for (expected = ETH_RX_MIN_BATCH * 2; expected <= 64; expected *= 2)
+		CHECK(adapt(TARGET_DELAY * 2, 1000) == expected,
+		      "grew to %u, expected %u", eth_rx_batch, expected);
+
+	/* and stops at the maximum */
+	CHECK(adapt(TARGET_DELAY * 2, 1000) == 64,
+	      "grew past the maximum to %u", eth_rx_batch);
+
+	/* a maximum that isn't a power of two is reached, not overshot */
+	eth_rx_max_batch = 50;
+	eth_rx_batch = 32;
+	CHECK(adapt(TARGET_DELAY * 2, 1000) == 50,
+	      "grew to %u instead of the maximum", eth_rx_batch);
+
+	/* a high delay the limit doesn't cause must not grow it */
+	eth_rx_max_batch = 64;
+	eth_rx_batch = 16;
+	CHECK(adapt(TARGET_DELAY * 2, 16) == 16,
+	      "grew to %u with a queue no longer than the limit",
+	      eth_rx_batch);
+	CHECK(adapt(TARGET_DELAY, 1000) == 16,
+	      "grew to %u with the delay on target", eth_rx_batch);
+}
+
+static void test_shrink(void)
+{
+	unsigned int expected;
+
+	eth_rx_max_batch = 64;
+	eth_rx_batch = 64;
+
+	/* steps down while the delay is under half the target */
+	for (expected = 64 - ETH_RX_BATCH_STEP; expected >= ETH_RX_MIN_BATCH;
+	     expected -= ETH_RX_BATCH_STEP)
+		CHECK(adapt(TARGET_DELAY / 2 - 1, 0) == expected,
+		      "shrank to %u, expected %u", eth_rx_batch, expected);
+
+	/* and stops at the minimum */
+	CHECK(adapt(0, 0) == ETH_RX_MIN_BATCH,
+	      "shrank below the minimum to %u", eth_rx_batch);
+
+	/* a limit less than a step above the minimum lands on it */
+	eth_rx_batch = ETH_RX_MIN_BATCH + ETH_RX_BATCH_STEP - 1;
+	CHECK(adapt(0, 0) == ETH_RX_MIN_BATCH,
+	      "shrank to %u instead of the minimum", eth_rx_batch);
+
+	/* between half the target and the target, the limit holds */
+	eth_rx_batch = 32;
+	CHECK(adapt(TARGET_DELAY / 2, 0) == 32,
+	      "changed to %u at half the target", eth_rx_batch);
+	CHECK(adapt(TARGET_DELAY, 1000) == 32,
+	      "changed to %u on target", eth_rx_batch);
+}
+
+static void test_lower_max(void)
+{
+	/* a maximum lowered under the limit clamps it on any update */
+	eth_rx_max_batch = 64;
+	eth_rx_batch = 64;
+	eth_rx_max_batch = 16;
+	CHECK(adapt(TARGET_DELAY, 0) == 16,
+	      "held at %u above the maximum", eth_rx_batch);
+
+	eth_rx_max_batch = 64;
+	eth_rx_batch = 64;
+	eth_rx_max_batch = 16;
+	CHECK(adapt(0, 0) == 16,
+	      "stepped down to %u above the maximum", eth_rx_batch);
+}
+
+static void test_random(void)
+{
+	unsigned int prev, batch, expected;
+	double delay, queue_size;
+	int i;
+
+	eth_rx_max_batch = 64;
+	eth_rx_batch = eth_rx_max_batch;
+
+	for (i = 0; i < 100000; i++) {
+		/* sometimes move the maximum, as a reconfiguration would */
+		if (rand() % 1000 == 0)
+			eth_rx_max_batch = ETH_RX_MIN_BATCH +
+					   rand() % 256;
+
+		delay = rand() % (TARGET_DELAY * 3);
+		queue_size = rand() % 300;
+		prev = eth_rx_batch;
+		batch = adapt(delay, queue_size);
+
+		if (delay > TARGET_DELAY && queue_size > prev)
+			expected = prev * 2;
+		else if (delay * 2 < TARGET_DELAY)
+			expected = prev < ETH_RX_MIN_BATCH + ETH_RX_BATCH_STEP ?
+				   ETH_RX_MIN_BATCH : prev - ETH_RX_BATCH_STEP;
+		else
+			expected = prev;
+		if (expected > eth_rx_max_batch)
+			expected = eth_rx_max_batch;
+
+		CHECK(batch == expected,
+		      "step %d: %u -> %u for delay %.0f queue %.0f, "
+		      "expected %u", i, prev, batch, delay, queue_size,
+		      expected);
+		CHECK(batch >= ETH_RX_MIN_BATCH && batch <= eth_rx_max_batch,
+		      "step %d: %u outside [%u, %u]", i, batch,
+		      ETH_RX_MIN_BATCH, eth_rx_max_batch);
+	}
+}
+
+int main(void)
+{
+	srand(1);
+	eth_rx_target_delay = TARGET_DELAY;
+
+	test_grow();
+	test_shrink();
+	test_lower_max();
+	test_random();
+
+	if (failures) {
+		printf("test_eth_batch: %d failures\n", failures);
+		return 1;
+	}
+
+	printf("test_eth_batch: ok\n");
+	return 0;
+}
@@ -0,0 +1,275 @@
+/*
+ * Copyright 2013-16 Board of Trustees of Stanford University
+ * Copyright 2013-16 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * test_ixev_batch.c - stresses ixev with far more commands per iteration
+ * than fit in one batch
+ *
+ * Thousands of connections receive many small segments per event loop
+ * iteration and echo them back, partly from their handlers and partly
+ * between iterations, so several hundred thousand commands are queued
+ * per iteration and the batch is flushed many times mid-iteration. The
+ * recv_done and sendv descriptors that ixev coalesces must stay correct
+ * across those flushes: every byte must be released exactly once and
+ * the echoed stream must reach the kernel complete and in order.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ix_mock.h"
+#include <ixev.h>
+
+#define NR_CONNS	20000
+#define NR_ROUNDS	10	/* segments per connection and iteration */
+#define NR_ITERS	10
+#define MAX_SEG		64
+#define MIN_CMDS	200000	/* commands per iteration to reach */
+
+struct conn {
+	struct ixev_ctx ctx;
+	struct ix_mock_conn *kc;
+	size_t consumed;	/* bytes read by the application */
+	size_t echoed;		/* bytes accepted by ixev_send() */
+	int released;
+};
+
+static struct conn *conns;
+static int nr_accepted;
+static int failures;
+
+/* byte @pos of connection @h's stream is (@h + @pos) & 0xff both ways */
+static unsigned char pattern[512];
+
+#define CHECK(cond, fmt, ...)						\
+do {									\
+	if (!(cond)) {							\
+		printf("FAIL %s:%d: " fmt "\n", __FILE__, __LINE__,	\
+		       ##__VA_ARGS__);					\
+		if (++failures > 20)					\
+			exit(1);					\
+	}								\
+} while (0)
+
+static inline unsigned char *stream(hid_t h, size_t pos)
+{
+	return &pattern[(h + pos) & 0xff];
+}
+
+static int stream_ok(const void *buf, hid_t h, size_t pos, size_t len)
+{
+	const unsigned char *p = buf;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (p[i] != ((h + pos + i) & 0xff))
+			return 0;
+	}
+
+	return 1;
+}
+
+static void echo(struct conn *c)
+{
+	size_t len;
+	ssize_t ret;
+
+	while (c->consumed > c->echoed) {
+		len = c->consumed - c->echoed;
+		if (len > MAX_SEG)
+			len = MAX_SEG;
+
+		ret = ixev_send(&c->ctx, stream(c->ctx.handle, c->echoed), len);
+		if (ret <= 0)
+			break;
+		c->echoed += ret;
+	}
+}
+
+static void handler(struct ixev_ctx *ctx, unsigned int reason)
+{
+	struct conn *c = container_of(ctx, struct conn, ctx);
+	char buf[MAX_SEG];
+	ssize_t ret;
+
+	if (reason & IXEVIN) {
+		while ((ret = ixev_recv(ctx, buf, 1 + rand() % MAX_SEG)) > 0) {
+			CHECK(stream_ok(buf, ctx->handle, c->consumed, ret),
+			      "handle %lu received corrupt data", ctx->handle);
+			c->consumed += ret;
+		}
+	}
+
+	/* leave half of the echoes to the main loop */
+	if (rand() & 1)
+		echo(c);
+}
+
+/* the kernel takes all or part of a sendv and checks what it takes */
+static size_t sendv(struct ix_mock_conn *kc, struct sg_entry *ents,
+		    unsigned int nrents)
+{
+	size_t len = 0, take, pos = kc->sent;
+	unsigned int i;
+
+	for (i = 0; i < nrents; i++)
+		len += ents[i].len;
+	if (!len)
+		return 0;
+
+	take = rand() % 4 ? len : 1 + rand() % len;
+	len = take;
+
+	for (i = 0; i < nrents && take; i++) {
+		size_t n = ents[i].len < take ? ents[i].len : take;
+
+		CHECK(stream_ok(ents[i].base, kc->handle, pos, n),
+		      "handle %lu sent corrupt data at %lu", kc->handle, pos);
+		pos += n;
+		take -= n;
+	}
+
+	return len;
+}
+
+static struct ixev_ctx *accept_conn(struct ip_tuple *id)
+{
+	struct conn *c = &conns[nr_accepted++];
+
+	ixev_ctx_init(&c->ctx);
+	return &c->ctx;
+}
+
+static void accepted(struct ixev_ctx *ctx)
+{
+	struct conn *c = container_of(ctx, struct conn, ctx);
+
+	c->kc = ix_mock_conn(ctx->handle);
+	ixev_set_handler(ctx, IXEVIN | IXEVOUT, handler);
+}
+
+static void release(struct ixev_ctx *ctx)
+{
+	struct conn *c = container_of(ctx, struct conn, ctx);
+
+	CHECK(!c->released, "handle %lu released twice", ctx->handle);
+	c->released = 1;
+}
+
+static struct ixev_conn_ops conn_ops = {
+	.accept		= accept_conn,
+	.release	= release,
+	.accepted	= accepted,
+};
+
+static void deliver(struct conn *c)
+{
+	size_t len = 1 + rand() % MAX_SEG;
+
+	ix_mock_recv(c->kc, stream(c->kc->handle, c->kc->recvd), len);
+}
+
+static int drained(void)
+{
+	int i;
+
+	for (i = 0; i < NR_CONNS; i++) {
+		struct conn *c = &conns[i];
+
+		if (c->kc->recvd != c->consumed || c->echoed != c->consumed ||
+		    c->kc->sent != c->echoed)
+			return 0;
+	}
+
+	return 1;
+}
+
+int main(void)
+{
+	unsigned long cmds, max_cmds = 0;
+	int i, iter, round;
+
+	for (i = 0; i < sizeof(pattern); i++)
+		pattern[i] = i;
+
+	conns = calloc(NR_CONNS, sizeof(*conns));
+	if (!conns || ixev_init(&conn_ops) || ixev_init_thread()) {
+		printf("test_ixev_batch: init failed\n");
+		return 1;
+	}
+	ix_mock_sendv = sendv;
+
+	for (i = 0; i < NR_CONNS; i++)
+		ix_mock_knock();
+	ixev_wait();
+	CHECK(nr_accepted == NR_CONNS, "accepted %d connections", nr_accepted);
+
+	for (iter = 0; iter < NR_ITERS; iter++) {
+		for (round = 0; round < NR_ROUNDS; round++) {
+			for (i = 0; i < NR_CONNS; i++)
+				deliver(&conns[i]);
+		}
+
+		cmds = ix_mock_nr_cmds;
+		ixev_wait();
+		for (i = 0; i < NR_CONNS; i++)
+			echo(&conns[i]);
+		ixev_wait();
+		cmds = ix_mock_nr_cmds - cmds;
+		if (cmds > max_cmds)
+			max_cmds = cmds;
+	}
+
+	for (i = 0; i < 100 && !drained(); i++) {
+		for (int j = 0; j < NR_CONNS; j++)
+			echo(&conns[j]);
+		ixev_wait();
+	}
+	CHECK(drained(), "data still in flight after draining");
+
+	for (i = 0; i < NR_CONNS; i++) {
+		struct conn *c = &conns[i];
+
+		CHECK(c->kc->recv_done == c->kc->recvd,
+		      "handle %lu released %lu of %lu bytes", c->kc->handle,
+		      c->kc->recv_done, c->kc->recvd);
+		ixev_close(&c->ctx);
+	}
+	ixev_wait();
+	ixev_wait();
+
+	for (i = 0; i < NR_CONNS; i++)
+		CHECK(conns[i].released, "handle %lu not released",
+		      conns[i].kc->handle);
+	CHECK(!ix_mock_errors, "%lu invalid commands", ix_mock_errors);
+	CHECK(max_cmds >= MIN_CMDS, "only %lu commands per iteration",
+	      max_cmds);
+
+	if (failures)
+		return 1;
+
+	printf("test_ixev_batch: up to %lu commands per iteration, ok\n",
+	       max_cmds);
+	return 0;
+}
@@ -0,0 +1,336 @@
+/*
+ * Copyright 2013-16 Board of Trustees of Stanford University
+ * Copyright 2013-16 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+
+/*
+ * test_ixev_cork.c - checks send corking and small-write coalescing
+ *
+ * Connections answer requests with bursts of small writes, from their
+ * handlers and from the main loop, while some of them are corked for a
+ * few rounds and the kernel holds back its acknowledgements at random.
+ * Each connection must get at most one sendv per batch, never while
+ * corked, and the data must reach the kernel complete and in order, with
+ * writes to the same buffer merged into one SG entry. Small writes made
+ * after the kernel took the earlier data must be appended to the buffer
+ * it is still holding. Closing a corked connection must send its data
+ * ahead of the close.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "ix_mock.h"
+#include <ixev.h>
+
+#define NR_CONNS	1000
+#define NR_ITERS	500
+#define MAX_WRITES	20	/* writes per burst */
+#define MAX_WRITE	300
+#define MAX_CORK	4	/* rounds a connection stays corked */
+
+struct conn {
+	struct ixev_ctx ctx;
+	struct ix_mock_conn *kc;
+	size_t written;		/* bytes accepted by ixev_send() */
+	bool corked;
+	size_t cork_pos;	/* bytes written before the cork */
+	unsigned long uncork_at;	/* the round to uncork in */
+	unsigned long sendv_round;	/* the last round with a sendv */
+	char *sent_end;		/* the end of the data the kernel took */
+	int released;
+};
+
+static struct conn *conns;
+static int nr_accepted;
+static unsigned long round_nr;
+static bool full_takes;
+static unsigned long nr_writes, nr_sendvs, nr_ents, nr_appends;
+static int failures;
+
+/* byte @pos of connection @h's stream is (@h + @pos) & 0xff */
+static unsigned char pattern[256 + MAX_WRITE];
+
+#define CHECK(cond, fmt, ...)						\
+do {									\
+	if (!(cond)) {							\
+		printf("FAIL %s:%d: " fmt "\n", __FILE__, __LINE__,	\
+		       ##__VA_ARGS__);					\
+		if (++failures > 20)					\
+			exit(1);					\
+	}								\
+} while (0)
+
+static inline unsigned char *stream(hid_t h, size_t pos)
+{
+	return &pattern[(h + pos) & 0xff];
+}
+
+static int stream_ok(const void *buf, hid_t h, size_t pos, size_t len)
+{
+	const unsigned char *p = buf;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (p[i] != ((h + pos + i) & 0xff))
+			return 0;
+	}
+
+	return 1;
+}
+
+static void respond(struct conn *c)
+{
+	int i, n = 1 + rand() % MAX_WRITES;
+	ssize_t ret;
+
+	for (i = 0; i < n; i++) {
+		ret = ixev_send(&c->ctx, stream(c->ctx.handle, c->written),
+				1 + rand() % MAX_WRITE);
+		if (ret == -EAGAIN)
+			break;
+		CHECK(ret > 0, "handle %lu: ixev_send returned %ld",
+		      c->ctx.handle, (long) ret);
+		if (ret <= 0)
+			break;
+		c->written += ret;
+		nr_writes++;
+	}
+}
+
+static void handler(struct ixev_ctx *ctx, unsigned int reason)
+{
+	struct conn *c = container_of(ctx, struct conn, ctx);
+	char buf[64];
+
+	if (reason & IXEVIN) {
+		while (ixev_recv(ctx, buf, sizeof(buf)) > 0)
+			;
+		respond(c);
+	}
+}
+
+/* the kernel checks each sendv, and takes all or part of it */
+static size_t sendv(struct ix_mock_conn *kc, struct sg_entry *ents,
+		    unsigned int nrents)
+{
+	struct conn *c = container_of((struct ixev_ctx *) kc->cookie,
+				      struct conn, ctx);
+	size_t len = 0, take, pos = kc->sent;
+	unsigned int i;
+
+	CHECK(c->sendv_round != round_nr,
+	      "handle %lu: two sendvs in one batch", kc->handle);
+	c->sendv_round = round_nr;
+	nr_sendvs++;
+	nr_ents += nrents;
+
+	if ((char *) ents[0].base == c->sent_end)
+		nr_appends++;
+
+	for (i = 0; i < nrents; i++) {
+		len += ents[i].len;
+		CHECK(!i || (char *) ents[i - 1].base + ents[i - 1].len !=
+			    (char *) ents[i].base,
+		      "handle %lu: SG entries %u and %u are contiguous",
+		      kc->handle, i - 1, i);
+	}
+
+	/* a sendv queued before the cork still goes, but nothing newer */
+	CHECK(!c->corked || pos + len <= c->cork_pos,
+	      "handle %lu: sendv of %lu bytes written while corked",
+	      kc->handle, pos + len - c->cork_pos);
+
+	take = full_takes || rand() % 8 ? len : 1 + rand() % len;
+	len = take;
+
+	for (i = 0; i < nrents && take; i++) {
+		size_t n = ents[i].len < take ? ents[i].len : take;
+
+		CHECK(stream_ok(ents[i].base, kc->handle, pos, n),
+		      "handle %lu sent corrupt data at %lu", kc->handle, pos);
+		c->sent_end = (char *) ents[i].base + n;
+		pos += n;
+		take -= n;
+	}
+
+	return len;
+}
+
+static struct ixev_ctx *accept_conn(struct ip_tuple *id)
+{
+	struct conn *c = &conns[nr_accepted++];
+
+	ixev_ctx_init(&c->ctx);
+	return &c->ctx;
+}
+
+static void accepted(struct ixev_ctx *ctx)
+{
+	struct conn *c = container_of(ctx, struct conn, ctx);
+
+	c->kc = ix_mock_conn(ctx->handle);
+	ixev_set_handler(ctx, IXEVIN, handler);
+}
+
+static void release(struct ixev_ctx *ctx)
+{
+	struct conn *c = container_of(ctx, struct conn, ctx);
+
+	CHECK(!c->released, "handle %lu released twice", ctx->handle);
+	c->released = 1;
+}
+
+static struct ixev_conn_ops conn_ops = {
+	.accept		= accept_conn,
+	.release	= release,
+	.accepted	= accepted,
+};
+
+static void cork(struct conn *c, unsigned long rounds)
+{
+	ixev_cork(&c->ctx);
+	c->corked = true;
+	c->cork_pos = c->written;
+	c->uncork_at = round_nr + rounds;
+}
+
+static void wait_round(void)
+{
+	round_nr++;
+	ixev_wait();
+}
+
+static void test_random(void)
+{
+	struct conn *c;
+	int i, iter;
+
+	for (iter = 0; iter < NR_ITERS; iter++) {
+		for (i = 0; i < NR_CONNS; i++) {
+			c = &conns[i];
+
+			if (c->corked && round_nr + 1 >= c->uncork_at) {
+				ixev_uncork(&c->ctx);
+				c->corked = false;
+			} else if (!c->corked && rand() % 16 == 0) {
+				cork(c, 1 + rand() % MAX_CORK);
+			}
+
+			c->kc->hold_acks = rand() % 4;
+			if (rand() % 4 == 0)
+				ix_mock_ack(c->kc);
+
+			if (rand() % 2)
+				ix_mock_recv(c->kc, "request", 7);
+			if (rand() % 8 == 0)
+				respond(c);
+		}
+
+		wait_round();
+	}
+}
+
+static void test_close(void)
+{
+	struct conn *c;
+	int i, j;
+
+	/* let everything out, so the closes can't lose data to the window */
+	full_takes = true;
+	for (i = 0; i < NR_CONNS; i++) {
+		c = &conns[i];
+		if (c->corked) {
+			ixev_uncork(&c->ctx);
+			c->corked = false;
+		}
+		c->kc->hold_acks = false;
+	}
+	for (j = 0; j < 4; j++) {
+		for (i = 0; i < NR_CONNS; i++)
+			ix_mock_ack(conns[i].kc);
+		wait_round();
+	}
+
+	/* cork half of the connections across a round, with data queued */
+	for (i = 0; i < NR_CONNS; i++) {
+		c = &conns[i];
+		CHECK(c->kc->sent == c->written,
+		      "handle %lu: %lu of %lu bytes sent before closing",
+		      c->kc->handle, c->kc->sent, c->written);
+		if (i & 1)
+			cork(c, 2);
+		respond(c);
+	}
+	wait_round();
+
+	for (i = 0; i < NR_CONNS; i++) {
+		c = &conns[i];
+		c->corked = false;
+		ixev_close(&c->ctx);
+	}
+	wait_round();
+	wait_round();
+
+	for (i = 0; i < NR_CONNS; i++) {
+		c = &conns[i];
+		CHECK(c->kc->sent == c->written,
+		      "handle %lu: %lu of %lu bytes sent by the close",
+		      c->kc->handle, c->kc->sent, c->written);
+		CHECK(c->released, "handle %lu not released", c->kc->handle);
+	}
+}
+
+int main(void)
+{
+	int i;
+
+	for (i = 0; i < sizeof(pattern); i++)
+		pattern[i] = i;
+
+	conns = calloc(NR_CONNS, sizeof(*conns));
+	if (!conns || ixev_init(&conn_ops) || ixev_init_thread()) {
+		printf("test_ixev_cork: init failed\n");
+		return 1;
+	}
+	ix_mock_sendv = sendv;
+
+	for (i = 0; i < NR_CONNS; i++)
+		ix_mock_knock();
+	wait_round();
+	CHECK(nr_accepted == NR_CONNS, "accepted %d connections", nr_accepted);
+
+	test_random();
+	test_close();
+
+	CHECK(!ix_mock_errors, "%lu invalid commands", ix_mock_errors);
+	CHECK(nr_appends, "small writes were never appended to a sent buffer");
+
+	if (failures)
+		return 1;
+
+	printf("test_ixev_cork: %lu writes in %lu sendvs of %lu entries, "
+	       "%lu appended, ok\n", nr_writes, nr_sendvs, nr_ents, nr_appends);
+	return 0;
+}
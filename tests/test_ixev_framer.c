@@ -0,0 +1,435 @@
+/*
+ * Copyright 2013-16 Board of Trustees of Stanford University
+ * Copyright 2013-16 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+
+/*
+ * test_ixev_framer.c - checks message framing across short reads
+ *
+ * Connections with every kind of framer receive a stream of messages cut
+ * into random segments, from single bytes that split a length prefix to
+ * segments holding several messages. Each segment lands in its own
+ * buffer, so a message that spans segments can't be read in place. Every
+ * message must reach the handler once, whole and in order, in place when
+ * it arrived in one segment and reassembled otherwise, and its bytes
+ * must only be acknowledged once it was delivered. A message larger than
+ * the reassembly buffer must close the connection after the messages
+ * before it, and so must a handler that closes mid-stream.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "ix_mock.h"
+#include <ixev.h>
+
+#define NR_CONNS	500
+#define NR_BAD		20		/* conns ending with an oversized message */
+#define STREAM_LEN	(32 * 1024)
+#define BUF_LEN		512		/* the reassembly buffer */
+#define FIXED_LEN	37
+#define MAX_SEGS	3		/* segments per connection and round */
+#define MAX_SEG		300
+#define POISON		0
+
+struct msg {
+	size_t off;		/* the payload offset in the stream */
+	size_t len;
+};
+
+struct conn {
+	struct ixev_ctx ctx;
+	struct ixev_framer framer;
+	char buf[BUF_LEN];
+	struct ix_mock_conn *kc;
+
+	char *stream;		/* what the peer sends */
+	size_t stream_len;
+	size_t pos;		/* bytes delivered */
+	char *arena;		/* the segments, with a gap after each */
+	size_t arena_len;
+
+	struct msg *msgs;
+	unsigned int nr_msgs;
+	unsigned int next_msg;	/* the next message to deliver */
+	size_t framed_done;	/* stream bytes of the delivered messages */
+	int close_at;		/* the message to close at, or -1 */
+	bool oversized;		/* the stream ends with a message too large */
+	bool closed;
+	int released;
+};
+
+static struct conn *conns;
+static int nr_accepted;
+static unsigned long nr_msgs, nr_in_place, nr_reassembled;
+static int failures;
+
+#define CHECK(cond, fmt, ...)						\
+do {									\
+	if (!(cond)) {							\
+		printf("FAIL %s:%d: " fmt "\n", __FILE__, __LINE__,	\
+		       ##__VA_ARGS__);					\
+		if (++failures > 20)					\
+			exit(1);					\
+	}								\
+} while (0)
+
+static inline char payload_byte(unsigned int msg, size_t pos)
+{
+	return 'a' + (msg * 7 + pos) % 26;
+}
+
+static unsigned int framer_type(int i)
+{
+	static const unsigned int types[] = {
+		IXEV_FRAME_FIXED, IXEV_FRAME_LEN, IXEV_FRAME_LEN,
+		IXEV_FRAME_LEN, IXEV_FRAME_DELIM,
+	};
+
+	return types[i % 5];
+}
+
+static unsigned int framer_param(int i)
+{
+	static const unsigned int params[] = {FIXED_LEN, 1, 2, 4, '\n'};
+
+	return params[i % 5];
+}
+
+/* appends a message, returns false once the stream is full */
+static bool add_msg(struct conn *c, size_t len)
+{
+	struct ixev_framer *f = &c->framer;
+	size_t head = f->type == IXEV_FRAME_LEN ? f->param : 0;
+	size_t tail = f->type == IXEV_FRAME_DELIM ? 1 : 0;
+	char *p = c->stream + c->stream_len;
+	unsigned int i;
+
+	if (c->stream_len + head + len + tail > STREAM_LEN)
+		return false;
+
+	for (i = 0; i < head; i++)
+		p[i] = len >> ((head - 1 - i) * 8);
+	for (i = 0; i < len; i++)
+		p[head + i] = payload_byte(c->nr_msgs, i);
+	if (tail)
+		p[head + len] = f->param;
+
+	c->msgs[c->nr_msgs].off = c->stream_len + head;
+	c->msgs[c->nr_msgs].len = len;
+	c->nr_msgs++;
+	c->stream_len += head + len + tail;
+	return true;
+}
+
+static size_t random_len(struct conn *c)
+{
+	struct ixev_framer *f = &c->framer;
+	size_t max;
+
+	switch (f->type) {
+	case IXEV_FRAME_FIXED:
+		return f->param;
+	case IXEV_FRAME_LEN:
+		max = f->param == 1 ? 255 : BUF_LEN - f->param;
+		break;
+	default:
+		max = BUF_LEN - 1;
+	}
+
+	/* mostly small messages, so that many share a segment */
+	if (rand() % 4)
+		return rand() % 32;
+	return rand() % (max + 1);
+}
+
+static void make_stream(struct conn *c)
+{
+	struct ixev_framer *f = &c->framer;
+	size_t n;
+	char *p;
+
+	while (add_msg(c, random_len(c)))
+		;
+
+	if (!c->oversized)
+		return;
+
+	/* replace the tail with a message that can't fit */
+	c->nr_msgs = c->nr_msgs / 2;
+	c->stream_len = c->msgs[c->nr_msgs].off -
+			(f->type == IXEV_FRAME_LEN ? f->param : 0);
+	p = c->stream + c->stream_len;
+	if (f->type == IXEV_FRAME_LEN) {
+		p[0] = BUF_LEN >> 8;
+		p[1] = BUF_LEN & 0xff;
+		/* the header alone must be enough to give up */
+		n = rand() % (BUF_LEN + 1);
+		memset(p + 2, 'x', n);
+		c->stream_len += 2 + n;
+	} else {
+		memset(p, 'x', BUF_LEN + 1);
+		c->stream_len += BUF_LEN + 1;
+	}
+}
+
+static void msg_handler(struct ixev_ctx *ctx, void *data, size_t len)
+{
+	struct conn *c = container_of(ctx, struct conn, ctx);
+	struct ixev_framer *f = &c->framer;
+	size_t head = f->type == IXEV_FRAME_LEN ? f->param : 0;
+	struct msg *m = &c->msgs[c->next_msg];
+	char *p = data;
+	size_t i;
+
+	CHECK(!c->closed, "handle %lu got a message after closing",
+	      ctx->handle);
+	CHECK(c->next_msg < c->nr_msgs, "handle %lu got an extra message",
+	      ctx->handle);
+	if (c->closed || c->next_msg >= c->nr_msgs)
+		return;
+
+	CHECK(len == m->len, "handle %lu message %u is %lu bytes, not %lu",
+	      ctx->handle, c->next_msg, len, m->len);
+	for (i = 0; i < len && i < m->len; i++) {
+		if (p[i] != payload_byte(c->next_msg, i)) {
+			CHECK(0, "handle %lu message %u is corrupt at %lu",
+			      ctx->handle, c->next_msg, i);
+			break;
+		}
+	}
+
+	if (p == f->buf + head) {
+		nr_reassembled++;
+	} else {
+		CHECK(p >= c->arena && p + len <= c->arena + c->arena_len,
+		      "handle %lu message %u is outside of the segments",
+		      ctx->handle, c->next_msg);
+		nr_in_place++;
+	}
+
+	c->framed_done = (c->next_msg + 1 < c->nr_msgs ?
+			  c->msgs[c->next_msg + 1].off -
+			  (f->type == IXEV_FRAME_LEN ? f->param : 0) :
+			  c->stream_len);
+	c->next_msg++;
+	nr_msgs++;
+
+	if (c->close_at == c->next_msg) {
+		ixev_close(ctx);
+		c->closed = true;
+	}
+}
+
+static void handler(struct ixev_ctx *ctx, unsigned int reason)
+{
+	CHECK(!(reason & IXEVIN), "IXEVIN bypassed the framer");
+}
+
+static struct ixev_ctx *accept_conn(struct ip_tuple *id)
+{
+	struct conn *c = &conns[nr_accepted++];
+
+	ixev_ctx_init(&c->ctx);
+	return &c->ctx;
+}
+
+static void accepted(struct ixev_ctx *ctx)
+{
+	struct conn *c = container_of(ctx, struct conn, ctx);
+
+	c->kc = ix_mock_conn(ctx->handle);
+	ixev_set_handler(ctx, IXEVIN | IXEVHUP, handler);
+	ixev_set_framer(ctx, &c->framer);
+}
+
+static void release(struct ixev_ctx *ctx)
+{
+	struct conn *c = container_of(ctx, struct conn, ctx);
+
+	CHECK(!c->released, "handle %lu released twice", ctx->handle);
+	c->released = 1;
+}
+
+static struct ixev_conn_ops conn_ops = {
+	.accept		= accept_conn,
+	.release	= release,
+	.accepted	= accepted,
+};
+
+/* sends the next segment in a buffer of its own */
+static void deliver(struct conn *c)
+{
+	size_t len, left = c->stream_len - c->pos;
+	char *seg = c->arena + c->arena_len;
+
+	if (rand() % 4 == 0)
+		len = 1 + rand() % 4;
+	else
+		len = 1 + rand() % MAX_SEG;
+	if (len > left)
+		len = left;
+
+	memcpy(seg, c->stream + c->pos, len);
+	seg[len] = POISON;
+	c->arena_len += len + 1;
+	c->pos += len;
+
+	ix_mock_recv(c->kc, seg, len);
+}
+
+static void test_init(void)
+{
+	struct ixev_framer f;
+	char buf[8];
+
+	CHECK(ixev_framer_init(&f, IXEV_FRAME_FIXED, 0, buf, sizeof(buf),
+			       msg_handler) == -EINVAL, "accepted size 0");
+	CHECK(ixev_framer_init(&f, IXEV_FRAME_FIXED, 9, buf, sizeof(buf),
+			       msg_handler) == -EINVAL,
+	      "accepted a size larger than the buffer");
+	CHECK(ixev_framer_init(&f, IXEV_FRAME_LEN, 3, buf, sizeof(buf),
+			       msg_handler) == -EINVAL,
+	      "accepted a 3 byte length");
+	CHECK(ixev_framer_init(&f, IXEV_FRAME_DELIM, 256, buf, sizeof(buf),
+			       msg_handler) == -EINVAL,
+	      "accepted a delimiter that isn't a byte");
+	CHECK(ixev_framer_init(&f, 3, 1, buf, sizeof(buf), msg_handler) ==
+	      -EINVAL, "accepted an unknown framing");
+}
+
+static bool busy(void)
+{
+	int i;
+
+	for (i = 0; i < NR_CONNS; i++) {
+		if (!conns[i].kc->closed && conns[i].pos < conns[i].stream_len)
+			return true;
+	}
+
+	return false;
+}
+
+int main(void)
+{
+	struct conn *c;
+	int i, j, n;
+
+	conns = calloc(NR_CONNS, sizeof(*conns));
+	if (!conns || ixev_init(&conn_ops) || ixev_init_thread()) {
+		printf("test_ixev_framer: init failed\n");
+		return 1;
+	}
+
+	test_init();
+
+	for (i = 0; i < NR_CONNS; i++) {
+		c = &conns[i];
+		c->stream = malloc(STREAM_LEN);
+		c->arena = malloc(STREAM_LEN * 3);
+		c->msgs = calloc(STREAM_LEN, sizeof(*c->msgs));
+		if (!c->stream || !c->arena || !c->msgs) {
+			printf("test_ixev_framer: out of memory\n");
+			return 1;
+		}
+		CHECK(!ixev_framer_init(&c->framer, framer_type(i),
+					framer_param(i), c->buf, BUF_LEN,
+					msg_handler), "framer_init failed");
+
+		/* oversized messages on 2-byte length and delimiter framers */
+		c->oversized = i < NR_BAD * 5 && (i % 5 == 2 || i % 5 == 4);
+		make_stream(c);
+		c->close_at = !c->oversized && rand() % 16 == 0 ?
+			      1 + rand() % c->nr_msgs : -1;
+		ix_mock_knock();
+	}
+	ixev_wait();
+	CHECK(nr_accepted == NR_CONNS, "accepted %d connections", nr_accepted);
+
+	while (busy()) {
+		for (i = 0; i < NR_CONNS; i++) {
+			c = &conns[i];
+			if (c->kc->closed)
+				continue;
+			n = rand() % (MAX_SEGS + 1);
+			for (j = 0; j < n && c->pos < c->stream_len; j++)
+				deliver(c);
+		}
+		ixev_wait();
+
+		for (i = 0; i < NR_CONNS; i++) {
+			c = &conns[i];
+			CHECK(c->kc->recv_done <= c->framed_done,
+			      "handle %lu acknowledged %lu bytes, %lu delivered",
+			      c->kc->handle, c->kc->recv_done, c->framed_done);
+		}
+	}
+	ixev_wait();
+	ixev_wait();
+
+	for (i = 0; i < NR_CONNS; i++) {
+		c = &conns[i];
+		if (c->close_at >= 0) {
+			CHECK(c->next_msg == c->close_at,
+			      "handle %lu got %u messages, closed after %d",
+			      c->kc->handle, c->next_msg, c->close_at);
+		} else {
+			CHECK(c->next_msg == c->nr_msgs,
+			      "handle %lu got %u of %u messages", c->kc->handle,
+			      c->next_msg, c->nr_msgs);
+		}
+
+		if (c->oversized || c->close_at >= 0) {
+			CHECK(c->kc->closed, "handle %lu is still open",
+			      c->kc->handle);
+			CHECK(c->released, "handle %lu not released",
+			      c->kc->handle);
+		} else {
+			CHECK(!c->kc->closed, "handle %lu was closed",
+			      c->kc->handle);
+			CHECK(c->kc->recv_done == c->stream_len,
+			      "handle %lu acknowledged %lu of %lu bytes",
+			      c->kc->handle, c->kc->recv_done, c->stream_len);
+			ixev_close(&c->ctx);
+		}
+	}
+	ixev_wait();
+	ixev_wait();
+
+	for (i = 0; i < NR_CONNS; i++)
+		CHECK(conns[i].released, "handle %lu not released",
+		      conns[i].kc->handle);
+	CHECK(!ix_mock_errors, "%lu invalid commands", ix_mock_errors);
+	CHECK(nr_in_place && nr_reassembled,
+	      "%lu messages in place, %lu reassembled", nr_in_place,
+	      nr_reassembled);
+
+	if (failures)
+		return 1;
+
+	printf("test_ixev_framer: %lu messages, %lu in place, "
+	       "%lu reassembled, ok\n", nr_msgs, nr_in_place, nr_reassembled);
+	return 0;
+}
@@ -0,0 +1,362 @@
+/*
+ * Copyright 2013-16 Board of Trustees of Stanford University
+ * Copyright 2013-16 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * test_ixev_recv_ovf.c - fuzzes the receive ring and its overflow chain
+ *
+ * Connections receive segments of random sizes, mostly tiny ones, while
+ * their consumers go to sleep for random numbers of iterations, either
+ * with the handler disabled or with a handler that ignores the data.
+ * Half of them are level-triggered, so leftover data is dispatched again
+ * without new segments arriving.
+ * More than IXEV_RECV_DEPTH segments pile up, so they spill into chains
+ * of overflow chunks that are refilled into the ring as the consumer
+ * catches up with reads of random sizes, with and without copying. Some
+ * connections are closed with data still queued, which must return the
+ * chunks to the pool. Every byte must arrive once and in order, and
+ * exactly what was consumed must be released to the kernel.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ix_mock.h"
+#include <ixev.h>
+
+#define NR_SLOTS	64
+#define NR_ITERS	5000
+#define MAX_SLEEP	30	/* iterations a consumer may sleep */
+#define MAX_SEG		1460
+
+struct conn {
+	struct ixev_ctx ctx;
+	struct ix_mock_conn *kc;
+	size_t consumed;
+	unsigned int mask;	/* IXEVIN, and maybe IXEVLEVEL */
+	int sleep;		/* iterations left before reading again */
+	int disabled;		/* sleeping with the handler disabled */
+	int released;
+};
+
+static struct conn *slots[NR_SLOTS];
+static int pending[NR_SLOTS];	/* slots waiting for their accept */
+static int pending_head, pending_tail;
+
+static struct conn **all;
+static int nr_all, max_all;
+static int nr_closed, nr_ovf, nr_ovf_chain;
+static int failures;
+
+/* segments point into this at offset (handle + pos) & 0xff */
+static unsigned char pattern[256 + MAX_SEG];
+
+#define CHECK(cond, fmt, ...)						\
+do {									\
+	if (!(cond)) {							\
+		printf("FAIL %s:%d: " fmt "\n", __FILE__, __LINE__,	\
+		       ##__VA_ARGS__);					\
+		if (++failures > 20)					\
+			exit(1);					\
+	}								\
+} while (0)
+
+static int stream_ok(const void *buf, hid_t h, size_t pos, size_t len)
+{
+	const unsigned char *p = buf;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (p[i] != ((h + pos + i) & 0xff))
+			return 0;
+	}
+
+	return 1;
+}
+
+static void consume(struct conn *c, const void *buf, size_t len)
+{
+	CHECK(stream_ok(buf, c->ctx.handle, c->consumed, len),
+	      "handle %lu received corrupt data at %lu", c->ctx.handle,
+	      c->consumed);
+	c->consumed += len;
+}
+
+static void handler(struct ixev_ctx *ctx, unsigned int reason)
+{
+	struct conn *c = container_of(ctx, struct conn, ctx);
+	size_t budget, len;
+	char buf[4096];
+	ssize_t ret;
+	void *zc;
+
+	if (c->sleep)
+		return;
+
+	/* read a random amount, the rest is dispatched again */
+	budget = rand() % 4 ? 1 + rand() % 8192 : (size_t) -1;
+	while (budget) {
+		len = 1 + rand() % (rand() % 2 ? 16 : sizeof(buf));
+		if (len > budget)
+			len = budget;
+
+		if (rand() % 4 == 0) {
+			zc = ixev_recv_zc(ctx, len);
+			if (zc) {
+				consume(c, zc, len);
+				budget -= len;
+				continue;
+			}
+		}
+
+		ret = ixev_recv(ctx, buf, len);
+		if (ret <= 0)
+			break;
+		CHECK(ret <= len, "read %ld bytes for %lu", ret, len);
+		consume(c, buf, ret);
+		budget -= ret;
+	}
+}
+
+static struct ixev_ctx *accept_conn(struct ip_tuple *id)
+{
+	struct conn *c = calloc(1, sizeof(*c));
+
+	if (!c || pending_head == pending_tail)
+		return NULL;
+
+	if (nr_all == max_all) {
+		max_all = max_all ? max_all * 2 : 1024;
+		all = realloc(all, max_all * sizeof(*all));
+		if (!all)
+			return NULL;
+	}
+	all[nr_all++] = c;
+
+	slots[pending[pending_head++ % NR_SLOTS]] = c;
+	ixev_ctx_init(&c->ctx);
+	return &c->ctx;
+}
+
+static void accepted(struct ixev_ctx *ctx)
+{
+	struct conn *c = container_of(ctx, struct conn, ctx);
+
+	c->kc = ix_mock_conn(ctx->handle);
+	c->mask = IXEVIN | (rand() % 2 ? IXEVLEVEL : 0);
+	ixev_set_handler(ctx, c->mask, handler);
+}
+
+static void release(struct ixev_ctx *ctx)
+{
+	struct conn *c = container_of(ctx, struct conn, ctx);
+
+	CHECK(!c->released, "handle %lu released twice", ctx->handle);
+	c->released = 1;
+}
+
+static struct ixev_conn_ops conn_ops = {
+	.accept		= accept_conn,
+	.release	= release,
+	.accepted	= accepted,
+};
+
+static void knock(int slot)
+{
+	slots[slot] = NULL;
+	pending[pending_tail++ % NR_SLOTS] = slot;
+	ix_mock_knock();
+}
+
+static size_t seg_len(void)
+{
+	switch (rand() % 16) {
+	case 0:
+		return 1 + rand() % MAX_SEG;
+	case 1 ... 4:
+		return 5 + rand() % 60;
+	default:
+		return 1 + rand() % 4;
+	}
+}
+
+static void deliver(struct conn *c)
+{
+	int i, nr = rand() % 2 ? rand() % 4 : rand() % 48;
+	size_t len;
+
+	/*
+	 * Flood the connections about to be closed, so that a leak of their
+	 * overflow chunks soon exhausts the pool.
+	 */
+	if (c->sleep < 0)
+		nr += 64;
+
+	for (i = 0; i < nr; i++) {
+		len = c->sleep < 0 ? 1 : seg_len();
+		ix_mock_recv(c->kc, &pattern[(c->kc->handle + c->kc->recvd) &
+					     0xff], len);
+	}
+}
+
+/* puts consumers to sleep, wakes them up, and churns connections */
+static void schedule(int slot)
+{
+	struct conn *c = slots[slot];
+
+	if (c->sleep) {
+		if (--c->sleep)
+			return;
+		if (c->disabled) {
+			c->disabled = 0;
+			ixev_set_handler(&c->ctx, c->mask, handler);
+		}
+		return;
+	}
+
+	if (rand() % 8)
+		return;
+
+	c->sleep = 1 + rand() % MAX_SLEEP;
+	if (rand() % 2) {
+		c->disabled = 1;
+		ixev_set_handler(&c->ctx, 0, handler);
+	}
+
+	/* close some sleepers later, with their data still queued */
+	if (rand() % 16 == 0)
+		c->sleep = -1;
+}
+
+static void close_conn(int slot)
+{
+	ixev_close(&slots[slot]->ctx);
+	nr_closed++;
+	knock(slot);
+}
+
+static int drained(void)
+{
+	int i;
+
+	for (i = 0; i < NR_SLOTS; i++) {
+		if (slots[i] && slots[i]->kc->recvd != slots[i]->consumed)
+			return 0;
+	}
+
+	return 1;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int seed = argc > 1 ? atoi(argv[1]) : 1;
+	struct conn *c;
+	int i, iter;
+
+	srand(seed);
+	for (i = 0; i < sizeof(pattern); i++)
+		pattern[i] = i;
+
+	if (ixev_init(&conn_ops) || ixev_init_thread()) {
+		printf("test_ixev_recv_ovf: init failed\n");
+		return 1;
+	}
+
+	for (i = 0; i < NR_SLOTS; i++)
+		knock(i);
+
+	for (iter = 0; iter < NR_ITERS; iter++) {
+		ixev_wait();
+
+		for (i = 0; i < NR_SLOTS; i++) {
+			c = slots[i];
+			if (!c)
+				continue;
+
+			if (c->sleep < 0 && c->sleep-- < -MAX_SLEEP) {
+				close_conn(i);
+				continue;
+			}
+			if (c->sleep >= 0)
+				schedule(i);
+			deliver(c);
+
+			if (c->ctx.recv_ovf_head) {
+				nr_ovf++;
+				if (c->ctx.recv_ovf_head != c->ctx.recv_ovf_tail)
+					nr_ovf_chain++;
+			}
+		}
+	}
+
+	/* wake everyone up and let them catch up */
+	for (i = 0; i < NR_SLOTS; i++) {
+		c = slots[i];
+		if (!c)
+			continue;
+		c->sleep = 0;
+		if (c->disabled) {
+			c->disabled = 0;
+			ixev_set_handler(&c->ctx, c->mask, handler);
+		}
+	}
+	for (i = 0; i < 100000 && !drained(); i++) {
+		ixev_wait();
+
+		/* edge-triggered consumers are not told about old data */
+		for (int j = 0; j < NR_SLOTS; j++) {
+			c = slots[j];
+			if (c && !(c->mask & IXEVLEVEL))
+				handler(&c->ctx, IXEVIN);
+		}
+	}
+	CHECK(drained(), "data still queued after draining");
+
+	for (i = 0; i < NR_SLOTS; i++) {
+		if (slots[i])
+			ixev_close(&slots[i]->ctx);
+	}
+	ixev_wait();
+	ixev_wait();
+
+	for (i = 0; i < nr_all; i++) {
+		c = all[i];
+		CHECK(c->released, "handle %lu not released", c->ctx.handle);
+		CHECK(c->kc->recv_done == c->consumed,
+		      "handle %lu released %lu bytes, consumed %lu",
+		      c->ctx.handle, c->kc->recv_done, c->consumed);
+	}
+	CHECK(!ix_mock_errors, "%lu invalid commands", ix_mock_errors);
+	CHECK(nr_ovf_chain > 0, "the overflow chain was never used");
+	CHECK(nr_closed > 0, "no connection closed with queued data");
+
+	if (failures) {
+		printf("test_ixev_recv_ovf: failed with seed %u\n", seed);
+		return 1;
+	}
+
+	printf("test_ixev_recv_ovf: %d connections, %d closed, "
+	       "%d overflows, %d chains, ok\n", nr_all, nr_closed, nr_ovf,
+	       nr_ovf_chain);
+	return 0;
+}
@@ -0,0 +1,320 @@
+/*
+ * Copyright 2013-16 Board of Trustees of Stanford University
+ * Copyright 2013-16 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+
+/*
+ * test_ixev_timer.c - checks the ixev timer wheel with a mocked clock
+ *
+ * Timers spread over every level of the wheel are armed, cancelled and
+ * rearmed, from the test and from the handlers of other timers, while
+ * the clock advances in random steps. Each armed timer must fire exactly
+ * once, in deadline order, never early and on the first ixev_timer_run()
+ * that reaches its tick. Cancelled timers must never fire, and the kernel
+ * timer armed before blocking must never sleep past a pending deadline.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ix_mock.h"
+#include <asm/cpu.h>
+
+static uint64_t mock_now_us;
+
+#define rdtsc() (mock_now_us)
+
+#include "../libix/ixev_timer.c"
+
+#define TICK		IXEV_TIMER_TICK_US
+#define NR_TIMERS	2000
+#define NR_STEPS	200000
+
+struct test_timer {
+	struct ixev_timer t;
+	uint64_t deadline;	/* the requested deadline, in us */
+	bool armed;
+};
+
+static struct test_timer timers[NR_TIMERS];
+static uint64_t last_run_us;
+static uint64_t last_fired_tick;
+static long nr_fired, nr_cancelled, nr_rearmed;
+static bool quiet;	/* handlers leave the other timers alone */
+static int failures;
+
+/* the kernel timer, as armed by ixev_timer_prepare_wait() */
+static unsigned long seen_timer_ctl;
+static uint64_t wakeup_us;
+static bool wakeup_pending;
+
+#define CHECK(cond, fmt, ...)						\
+do {									\
+	if (!(cond)) {							\
+		printf("FAIL %s:%d: " fmt "\n", __FILE__, __LINE__,	\
+		       ##__VA_ARGS__);					\
+		if (++failures > 20)					\
+			exit(1);					\
+	}								\
+} while (0)
+
+static uint64_t deadline_tick(struct test_timer *tt)
+{
+	return div_up(tt->deadline, TICK);
+}
+
+static uint64_t random_delay(void)
+{
+	/* cover every level but the last, which a test can't wait out */
+	switch (rand() % 8) {
+	case 0:
+		return 1 + rand() % TICK;
+	case 1:
+	case 2:
+		return 1 + rand() % (TICK * WHEEL_SIZE);
+	case 3:
+	case 4:
+		return 1 + rand() % (TICK * WHEEL_SIZE * WHEEL_SIZE);
+	case 5:
+		return 1 + rand() % (TICK * WHEEL_SIZE * WHEEL_SIZE *
+				     WHEEL_SIZE);
+	default:
+		return 1 + (((uint64_t) rand() << 16) ^ rand()) %
+		       ((uint64_t) TICK * WHEEL_SIZE * WHEEL_SIZE *
+			WHEEL_SIZE * WHEEL_SIZE);
+	}
+}
+
+static void arm(struct test_timer *tt, uint64_t delay)
+{
+	tt->deadline = mock_now_us + delay;
+	tt->armed = true;
+	CHECK(!ixev_timer_add_us(&tt->t, delay), "ixev_timer_add_us failed");
+	CHECK(ixev_timer_pending(&tt->t), "armed timer not pending");
+}
+
+static void cancel(struct test_timer *tt)
+{
+	ixev_timer_cancel(&tt->t);
+	tt->armed = false;
+	CHECK(!ixev_timer_pending(&tt->t), "cancelled timer still pending");
+	nr_cancelled++;
+}
+
+static void handler(void *arg)
+{
+	struct test_timer *tt = arg, *other;
+	uint64_t tick = deadline_tick(tt);
+
+	CHECK(tt->armed, "timer %ld fired while disarmed",
+	      (long) (tt - timers));
+	CHECK(!ixev_timer_pending(&tt->t), "timer %ld pending in its handler",
+	      (long) (tt - timers));
+	CHECK(mock_now_us >= tt->deadline, "timer %ld fired %lu us early",
+	      (long) (tt - timers), tt->deadline - mock_now_us);
+	/* an earlier ixev_timer_run() already reached the tick */
+	CHECK(last_run_us < tick * TICK, "timer %ld fired %lu us late",
+	      (long) (tt - timers), last_run_us - tt->deadline);
+	CHECK(tick >= last_fired_tick,
+	      "timer %ld for tick %lu fired after tick %lu",
+	      (long) (tt - timers), tick, last_fired_tick);
+
+	tt->armed = false;
+	last_fired_tick = tick;
+	nr_fired++;
+
+	if (quiet)
+		return;
+
+	/* handlers may cancel and arm timers, including themselves */
+	switch (rand() % 8) {
+	case 0:
+		other = &timers[rand() % NR_TIMERS];
+		if (other->armed)
+			cancel(other);
+		break;
+	case 1:
+		arm(tt, random_delay());
+		nr_rearmed++;
+		break;
+	case 2:
+		other = &timers[rand() % NR_TIMERS];
+		arm(other, 1 + rand() % (TICK * 4));
+		nr_rearmed++;
+		break;
+	}
+}
+
+static uint64_t next_deadline_tick(void)
+{
+	uint64_t next = UINT64_MAX;
+	int i;
+
+	for (i = 0; i < NR_TIMERS; i++)
+		if (timers[i].armed && deadline_tick(&timers[i]) < next)
+			next = deadline_tick(&timers[i]);
+
+	return next;
+}
+
+static void run(void)
+{
+	uint64_t next;
+
+	/* the kernel timer expires while the thread is blocked */
+	if (wakeup_pending && mock_now_us >= wakeup_us) {
+		wakeup_pending = false;
+		ixev_timer_wakeup(NULL);
+	}
+
+	ixev_timer_run();
+	last_run_us = mock_now_us;
+	CHECK(ixev_timer_now == mock_now_us, "ixev_timer_now is %lu, not %lu",
+	      ixev_timer_now, mock_now_us);
+
+	ixev_timer_prepare_wait();
+	if (ix_mock_nr_timer_ctl != seen_timer_ctl) {
+		seen_timer_ctl = ix_mock_nr_timer_ctl;
+		CHECK(ix_mock_timer_delay > 0 &&
+		      ix_mock_timer_delay <= IXEV_TIMER_MAX_WAKEUP_US,
+		      "kernel timer armed for %lu us", ix_mock_timer_delay);
+		wakeup_us = mock_now_us + ix_mock_timer_delay;
+		wakeup_pending = true;
+	}
+
+	next = next_deadline_tick();
+	if (next == UINT64_MAX)
+		return;
+	CHECK(wakeup_pending, "blocking with no wakeup for tick %lu", next);
+	CHECK(wakeup_us <= next * TICK,
+	      "wakeup at %lu us sleeps past a timer due at %lu us",
+	      wakeup_us, next * TICK);
+}
+
+static void test_order(void)
+{
+	int order[NR_TIMERS];
+	int i, j, tmp;
+
+	for (i = 0; i < NR_TIMERS; i++)
+		order[i] = i;
+	for (i = NR_TIMERS - 1; i > 0; i--) {
+		j = rand() % (i + 1);
+		tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+
+	/* distinct deadlines on every level, armed out of order */
+	for (i = 0; i < NR_TIMERS; i++)
+		arm(&timers[order[i]], 1 + (uint64_t) order[i] * order[i] *
+					   order[i] / 2);
+
+	/* a single run has to cascade and fire them all, in order */
+	quiet = true;
+	mock_now_us += (uint64_t) NR_TIMERS * NR_TIMERS * NR_TIMERS / 2 + 1;
+	run();
+	quiet = false;
+
+	for (i = 0; i < NR_TIMERS; i++)
+		CHECK(!timers[i].armed, "timer %d never fired", i);
+	CHECK(!wheel.count, "%lu timers left in the wheel", wheel.count);
+}
+
+static void test_random(void)
+{
+	struct test_timer *tt;
+	int i, step;
+
+	for (i = 0; i < NR_TIMERS; i++)
+		arm(&timers[i], random_delay());
+
+	for (step = 0; step < NR_STEPS; step++) {
+		/* mostly short steps, sometimes jump over whole levels */
+		switch (rand() % 100) {
+		case 0:
+			mock_now_us += rand() % (TICK * WHEEL_SIZE *
+						 WHEEL_SIZE * WHEEL_SIZE);
+			break;
+		case 1:
+		case 2:
+			mock_now_us += rand() % (TICK * WHEEL_SIZE * 2);
+			break;
+		default:
+			mock_now_us += rand() % (TICK * 3);
+		}
+		run();
+
+		tt = &timers[rand() % NR_TIMERS];
+		if (!tt->armed) {
+			arm(tt, random_delay());
+		} else if (rand() % 3 == 0) {
+			cancel(tt);
+		} else if (rand() % 2 == 0) {
+			arm(tt, random_delay());
+			nr_rearmed++;
+		}
+	}
+
+	/* cancel half of what's left, then wait out the rest */
+	for (i = 0; i < NR_TIMERS; i += 2)
+		if (timers[i].armed)
+			cancel(&timers[i]);
+	while (wheel.count) {
+		mock_now_us += TICK * WHEEL_SIZE * WHEEL_SIZE;
+		run();
+	}
+
+	for (i = 0; i < NR_TIMERS; i++) {
+		CHECK(!timers[i].armed, "timer %d never fired", i);
+		CHECK(!ixev_timer_pending(&timers[i].t),
+		      "timer %d still pending", i);
+	}
+}
+
+int main(void)
+{
+	int i;
+
+	srand(1);
+	mock_now_us = 1000003;
+	ixev_cycles_per_us = 1;
+	if (ixev_timer_init_thread()) {
+		printf("ixev_timer_init_thread failed\n");
+		return 1;
+	}
+	for (i = 0; i < NR_TIMERS; i++)
+		ixev_timer_init(&timers[i].t, handler, &timers[i]);
+
+	test_order();
+	test_random();
+
+	if (failures) {
+		printf("test_ixev_timer: %d failures\n", failures);
+		return 1;
+	}
+
+	printf("test_ixev_timer: %ld fired, %ld cancelled, %ld rearmed, ok\n",
+	       nr_fired, nr_cancelled, nr_rearmed);
+	return 0;
+}
@@ -0,0 +1,591 @@
+/*
+ * Copyright 2013-16 Board of Trustees of Stanford University
+ * Copyright 2013-16 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+
+/*
+ * test_ixev_udp.c - checks UDP batching and buffer lifetimes in ixev
+ *
+ * Datagrams are delivered to a set of sockets, and to ports nobody
+ * bound, while the receive callbacks hold some of them back, send
+ * datagrams of their own and unbind sockets with datagrams still
+ * batched. Every received buffer must be delivered in order to its
+ * socket, or released if it can't be, and returned to the kernel exactly
+ * once. Sends are issued by copying and zero-copy; the kernel checks each
+ * one, fails some and reports the rest sent in random order. A zero-copy
+ * send must call its completion exactly once, and only once the kernel
+ * is done with it, and the payload of a copying send must stay intact
+ * until then. No send request may leak.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "ix_mock.h"
+#include <ixev.h>
+#include <ixev_udp.h>
+
+#define NR_SOCKS	64
+#define NR_PORTS	(NR_SOCKS + 8)	/* some ports are never bound */
+#define BASE_PORT	5000
+#define NR_ROUNDS	2000
+#define MAX_RECVS	200		/* datagrams delivered per round */
+#define NR_SLOTS	16384		/* kernel receive buffers */
+#define MAX_SENDS	(NR_ROUNDS * MAX_RECVS)
+#define NR_ZC_BUFS	4096
+#define MAX_INFLIGHT	65536		/* more than there are send requests */
+#define PILE_ROUNDS	50		/* rounds without completions */
+#define PILE_SENDS	500		/* sends per round while piling up */
+#define PEER_IP		0x0a000002
+
+/* a kernel receive buffer */
+struct slot {
+	struct ip_tuple id;
+	unsigned long sock_seq;	/* the order of delivery to its socket */
+	size_t len;
+	bool busy;		/* handed to ixev and not released yet */
+	char data[64];
+};
+
+struct sock {
+	struct ixev_udp u;
+	bool bound;
+	unsigned long delivered;	/* datagrams queued to the socket */
+	unsigned long received;		/* datagrams seen by the callback */
+	bool may_skip;		/* unbound since the last datagram */
+};
+
+/* a datagram sent by the test */
+struct tx {
+	struct ixev_ref ref;
+	uint16_t src_port;
+	uint16_t dst_port;
+	size_t len;
+	char *zc_buf;		/* NULL for a copying send */
+	bool dispatched;	/* seen by the kernel */
+	bool done;		/* sent or failed by the kernel */
+	bool released;		/* the completion was called */
+};
+
+/* a datagram the kernel has yet to report sent */
+struct inflight {
+	struct tx *tx;
+	unsigned long cookie;
+	unsigned int nrents;
+	struct sg_entry ents[IXEV_UDP_MAX_SG];
+};
+
+static struct slot *slots;
+static unsigned int *free_slots, nr_free_slots;
+static void **held;
+static unsigned int nr_held;
+
+static struct sock socks[NR_SOCKS];
+
+static struct tx *txs;
+static unsigned int nr_txs, next_dispatch;
+static char (*zc_bufs)[IXEV_UDP_MAX_LEN];
+static unsigned int *free_zc, nr_free_zc;
+static struct inflight *inflight;
+static unsigned int nr_inflight;
+static bool complete_now;	/* report sends right away */
+
+static unsigned long nr_recvs, nr_batches, nr_full, nr_failed, nr_eagain;
+static int failures;
+
+#define CHECK(cond, fmt, ...)						\
+do {									\
+	if (!(cond)) {							\
+		printf("FAIL %s:%d: " fmt "\n", __FILE__, __LINE__,	\
+		       ##__VA_ARGS__);					\
+		if (++failures > 20)					\
+			exit(1);					\
+	}								\
+} while (0)
+
+/* byte @pos of a payload with tag @tag is (@tag + @pos) & 0xff */
+static void fill(void *buf, unsigned long tag, size_t len)
+{
+	unsigned char *p = buf;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		p[i] = tag + i;
+}
+
+static int payload_ok(const void *buf, unsigned long tag, size_t pos,
+		      size_t len)
+{
+	const unsigned char *p = buf;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (p[i] != ((tag + pos + i) & 0xff))
+			return 0;
+	}
+
+	return 1;
+}
+
+static struct sock *sock_of(struct ixev_udp *u)
+{
+	return container_of(u, struct sock, u);
+}
+
+static struct slot *slot_of(void *addr)
+{
+	return container_of((char (*)[64]) addr, struct slot, data);
+}
+
+/*
+ * Sending
+ */
+
+static void zc_release(struct ixev_ref *ref)
+{
+	struct tx *tx = container_of(ref, struct tx, ref);
+
+	CHECK(tx->done, "datagram %ld released before it was sent",
+	      (long) (tx - txs));
+	CHECK(!tx->released, "datagram %ld released twice", (long) (tx - txs));
+	tx->released = true;
+
+	/* the kernel must be done with the buffer, so scribble over it */
+	memset(tx->zc_buf, 0xee, IXEV_UDP_MAX_LEN);
+	free_zc[nr_free_zc++] = (tx->zc_buf - zc_bufs[0]) / IXEV_UDP_MAX_LEN;
+}
+
+static void send_one(struct sock *s)
+{
+	struct sg_entry ents[IXEV_UDP_MAX_SG];
+	char buf[IXEV_UDP_MAX_LEN];
+	struct tx *tx = &txs[nr_txs];
+	unsigned int i, nrents;
+	size_t pos, n;
+	ssize_t ret;
+
+	if (!s->bound || nr_txs == MAX_SENDS)
+		return;
+
+	tx->src_port = s->u.port;
+	tx->dst_port = 1 + rand() % 60000;
+	tx->len = 1 + rand() % IXEV_UDP_MAX_LEN;
+
+	if (rand() % 2 || !nr_free_zc) {
+		tx->zc_buf = NULL;
+		fill(buf, nr_txs, tx->len);
+		ret = ixev_udp_sendto(&s->u, buf, tx->len, PEER_IP,
+				      tx->dst_port);
+		/* the payload was copied */
+		memset(buf, 0xee, tx->len);
+		if (ret == -EAGAIN) {
+			nr_eagain++;
+			return;
+		}
+		CHECK(ret == tx->len, "sendto returned %ld", (long) ret);
+	} else {
+		tx->zc_buf = zc_bufs[free_zc[--nr_free_zc]];
+		fill(tx->zc_buf, nr_txs, tx->len);
+		tx->ref.cb = zc_release;
+
+		nrents = 1 + rand() % IXEV_UDP_MAX_SG;
+		for (i = 0, pos = 0; i < nrents && pos < tx->len; i++) {
+			n = i == nrents - 1 ? tx->len - pos :
+			    rand() % (tx->len - pos + 1);
+			ents[i].base = tx->zc_buf + pos;
+			ents[i].len = n;
+			pos += n;
+		}
+		ret = ixev_udp_sendv(&s->u, ents, i, PEER_IP, tx->dst_port,
+				     &tx->ref);
+		/* the SG array may be reused right away */
+		memset(ents, 0xee, sizeof(ents));
+		if (ret == -EAGAIN) {
+			free_zc[nr_free_zc++] = (tx->zc_buf - zc_bufs[0]) /
+						IXEV_UDP_MAX_LEN;
+			nr_eagain++;
+			return;
+		}
+		CHECK(!ret, "sendv returned %ld", (long) ret);
+	}
+
+	nr_txs++;
+}
+
+static int dgram_ok(struct tx *tx, struct sg_entry *ents, unsigned int nrents)
+{
+	size_t pos = 0;
+	unsigned int i;
+
+	for (i = 0; i < nrents; i++) {
+		if (!payload_ok(ents[i].base, tx - txs, pos, ents[i].len))
+			return 0;
+		pos += ents[i].len;
+	}
+
+	return pos == tx->len;
+}
+
+/* the kernel takes the datagrams in the order they were sent */
+static long udp_send(struct ix_mock_dgram *dg)
+{
+	struct tx *tx = &txs[next_dispatch];
+	struct inflight *f;
+
+	CHECK(next_dispatch < nr_txs, "unexpected datagram");
+	if (next_dispatch >= nr_txs)
+		return -RET_INVAL;
+	next_dispatch++;
+
+	CHECK(!tx->dispatched, "datagram %ld sent twice", (long) (tx - txs));
+	tx->dispatched = true;
+	CHECK(dg->nrents <= IXEV_UDP_MAX_SG, "%u SG entries", dg->nrents);
+	CHECK(dg->id->dst_ip == PEER_IP && dg->id->dst_port == tx->dst_port &&
+	      dg->id->src_port == tx->src_port,
+	      "datagram %ld has the wrong address", (long) (tx - txs));
+	CHECK(dgram_ok(tx, dg->ents, dg->nrents),
+	      "datagram %ld has a corrupt payload", (long) (tx - txs));
+
+	if (rand() % 16 == 0) {
+		tx->done = true;
+		nr_failed++;
+		return -RET_NOBUFS;
+	}
+
+	if (complete_now) {
+		tx->done = true;
+		ix_mock_udp_sent(dg->cookie);
+		return 0;
+	}
+
+	CHECK(nr_inflight < MAX_INFLIGHT, "too many datagrams in flight");
+	if (nr_inflight == MAX_INFLIGHT)
+		exit(1);
+	f = &inflight[nr_inflight++];
+	f->tx = tx;
+	f->cookie = dg->cookie;
+	f->nrents = dg->nrents;
+	memcpy(f->ents, dg->ents, dg->nrents * sizeof(*dg->ents));
+	return 0;
+}
+
+/* report some of the datagrams in flight as sent, in any order */
+static void complete(unsigned int nr)
+{
+	struct inflight *f;
+	unsigned int i;
+
+	while (nr-- && nr_inflight) {
+		i = rand() % nr_inflight;
+		f = &inflight[i];
+
+		CHECK(dgram_ok(f->tx, f->ents, f->nrents),
+		      "datagram %ld changed in flight", (long) (f->tx - txs));
+		f->tx->done = true;
+		ix_mock_udp_sent(f->cookie);
+
+		*f = inflight[--nr_inflight];
+	}
+}
+
+/*
+ * Receiving
+ */
+
+static void udp_recv_done(void *addr)
+{
+	struct slot *sl = slot_of(addr);
+
+	CHECK(sl >= slots && sl < slots + NR_SLOTS && addr == sl->data,
+	      "released unknown buffer %p", addr);
+	CHECK(sl->busy, "buffer %ld released twice", (long) (sl - slots));
+	sl->busy = false;
+	free_slots[nr_free_slots++] = sl - slots;
+}
+
+static void recv_cb(struct ixev_udp *u, struct ixev_udp_msg *msgs,
+		    unsigned int nr)
+{
+	struct sock *s = sock_of(u), *other;
+	struct slot *sl;
+	unsigned int i;
+
+	CHECK(s->bound, "callback of an unbound socket");
+	CHECK(nr && nr <= IXEV_UDP_RECV_BATCH, "batch of %u datagrams", nr);
+	nr_batches++;
+	if (nr == IXEV_UDP_RECV_BATCH)
+		nr_full++;
+
+	for (i = 0; i < nr; i++) {
+		sl = slot_of(msgs[i].addr);
+		nr_recvs++;
+
+		CHECK(sl->busy, "buffer %ld delivered after its release",
+		      (long) (sl - slots));
+		CHECK(msgs[i].len == sl->len && msgs[i].id == &sl->id,
+		      "buffer %ld delivered with the wrong length or tuple",
+		      (long) (sl - slots));
+		CHECK(sl->id.dst_port == u->port,
+		      "datagram for port %u delivered to %u",
+		      sl->id.dst_port, u->port);
+		/* only an unbind drops datagrams */
+		CHECK(sl->sock_seq == s->received ||
+		      (sl->sock_seq > s->received && s->may_skip),
+		      "port %u got datagram %lu, expected %lu", u->port,
+		      sl->sock_seq, s->received);
+		s->may_skip = false;
+		CHECK(payload_ok(sl->data, sl->sock_seq, 0, sl->len),
+		      "port %u got a corrupt payload", u->port);
+		s->received = sl->sock_seq + 1;
+
+		if (rand() % 8 == 0) {
+			ixev_udp_hold(&msgs[i]);
+			held[nr_held++] = msgs[i].addr;
+		}
+		if (rand() % 4 == 0)
+			send_one(s);
+	}
+
+	/* drop a socket, maybe this one, with datagrams still batched */
+	if (rand() % 64 == 0) {
+		other = &socks[rand() % NR_SOCKS];
+		if (other->bound) {
+			ixev_udp_unbind(&other->u);
+			other->bound = false;
+			other->may_skip = true;
+		}
+	}
+}
+
+static void sock_bind(struct sock *s)
+{
+	CHECK(!ixev_udp_bind(&s->u, BASE_PORT + (s - socks), recv_cb),
+	      "bind failed");
+	s->bound = true;
+}
+
+static void deliver(unsigned int port)
+{
+	struct sock *s = NULL;
+	struct slot *sl;
+
+	if (!nr_free_slots)
+		return;
+
+	sl = &slots[free_slots[--nr_free_slots]];
+	CHECK(!sl->busy, "buffer %ld reused while busy", (long) (sl - slots));
+	sl->busy = true;
+
+	if (port < BASE_PORT + NR_SOCKS)
+		s = &socks[port - BASE_PORT];
+
+	sl->id.src_ip = PEER_IP;
+	sl->id.dst_ip = 0;
+	sl->id.src_port = 1 + rand() % 60000;
+	sl->id.dst_port = port;
+	sl->sock_seq = s ? s->delivered++ : 0;
+	sl->len = 1 + rand() % sizeof(sl->data);
+	fill(sl->data, sl->sock_seq, sl->len);
+
+	ix_mock_udp_recv(sl->data, sl->len, &sl->id);
+}
+
+/*
+ * The main loop
+ */
+
+static struct ixev_ctx *accept_conn(struct ip_tuple *id)
+{
+	return NULL;
+}
+
+static void release(struct ixev_ctx *ctx)
+{
+}
+
+static struct ixev_conn_ops conn_ops = {
+	.accept		= accept_conn,
+	.release	= release,
+};
+
+/* returns how many copying sends fit before the request pool runs out */
+static int count_reqs(void)
+{
+	char buf[1] = {0};
+	int nr = 0;
+
+	complete_now = true;
+	ix_mock_udp_send = NULL;
+	while (ixev_udp_sendto(&socks[0].u, buf, 1, PEER_IP, 1) == 1)
+		nr++;
+	ixev_wait();
+	ixev_wait();
+	ix_mock_udp_send = udp_send;
+	complete_now = false;
+
+	return nr;
+}
+
+static void test_invalid(void)
+{
+	struct sg_entry ents[IXEV_UDP_MAX_SG + 1] = {{zc_bufs[0], 1}};
+	struct ixev_ref ref = {zc_release};
+	char buf[IXEV_UDP_MAX_LEN + 1] = {0};
+
+	CHECK(ixev_udp_bind(&socks[1].u, socks[0].u.port, recv_cb) ==
+	      -EADDRINUSE, "bound a port twice");
+	CHECK(ixev_udp_sendto(&socks[0].u, buf, sizeof(buf), PEER_IP, 1) ==
+	      -EINVAL, "sent an oversized datagram");
+	CHECK(ixev_udp_sendv(&socks[0].u, ents, 0, PEER_IP, 1, &ref) ==
+	      -EINVAL, "sent a datagram without SG entries");
+	CHECK(ixev_udp_sendv(&socks[0].u, ents, IXEV_UDP_MAX_SG + 1, PEER_IP,
+			     1, &ref) == -EINVAL,
+	      "sent a datagram with too many SG entries");
+}
+
+static void test_random(void)
+{
+	unsigned int i, n;
+	int round;
+
+	for (round = 0; round < NR_ROUNDS; round++) {
+		n = rand() % MAX_RECVS;
+		for (i = 0; i < n; i++)
+			deliver(BASE_PORT + rand() % NR_PORTS);
+
+		/* a burst to one port fills batches before the dispatch */
+		if (round % 16 == 0) {
+			n = BASE_PORT + rand() % NR_SOCKS;
+			for (i = 0; i < IXEV_UDP_RECV_BATCH * 3; i++)
+				deliver(n);
+		}
+
+		for (i = 0; i < NR_SOCKS; i++) {
+			if (!socks[i].bound && rand() % 8 == 0)
+				sock_bind(&socks[i]);
+			if (rand() % 8 == 0)
+				send_one(&socks[i]);
+		}
+
+		/* release held buffers out of order */
+		for (n = rand() % (nr_held + 1); n; n--) {
+			i = rand() % nr_held;
+			ixev_udp_recv_done(held[i]);
+			held[i] = held[--nr_held];
+		}
+
+		/* now and then, pile up sends until the requests run out */
+		if (round % (NR_ROUNDS / 4) < NR_ROUNDS / 4 - PILE_ROUNDS) {
+			complete(rand() % (nr_inflight + 1));
+		} else {
+			for (i = 0; i < PILE_SENDS; i++)
+				send_one(&socks[rand() % NR_SOCKS]);
+		}
+
+		/* the callbacks send in the next batch, the rest in this one */
+		n = nr_txs;
+		ixev_wait();
+		CHECK(next_dispatch >= n, "%u of %u datagrams reached the kernel",
+		      next_dispatch, n);
+	}
+}
+
+static void drain(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < 4; i++) {
+		while (nr_held)
+			ixev_udp_recv_done(held[--nr_held]);
+		complete(nr_inflight);
+		ixev_wait();
+	}
+
+	for (i = 0; i < NR_SOCKS; i++) {
+		if (socks[i].bound) {
+			ixev_udp_unbind(&socks[i].u);
+			socks[i].bound = false;
+		}
+	}
+	ixev_wait();
+
+	for (i = 0; i < nr_txs; i++) {
+		CHECK(txs[i].done, "datagram %u never sent", i);
+		CHECK(!txs[i].zc_buf || txs[i].released,
+		      "datagram %u never released", i);
+	}
+	for (i = 0; i < NR_SLOTS; i++)
+		CHECK(!slots[i].busy, "buffer %u never released", i);
+}
+
+int main(void)
+{
+	int i, nr_reqs;
+
+	slots = calloc(NR_SLOTS, sizeof(*slots));
+	free_slots = calloc(NR_SLOTS, sizeof(*free_slots));
+	held = calloc(NR_SLOTS, sizeof(*held));
+	txs = calloc(MAX_SENDS, sizeof(*txs));
+	inflight = calloc(MAX_INFLIGHT, sizeof(*inflight));
+	zc_bufs = calloc(NR_ZC_BUFS, sizeof(*zc_bufs));
+	free_zc = calloc(NR_ZC_BUFS, sizeof(*free_zc));
+	if (!slots || !free_slots || !held || !txs || !inflight ||
+	    !zc_bufs || !free_zc || ixev_init(&conn_ops) ||
+	    ixev_init_thread()) {
+		printf("test_ixev_udp: init failed\n");
+		return 1;
+	}
+
+	for (i = 0; i < NR_SLOTS; i++)
+		free_slots[nr_free_slots++] = i;
+	for (i = 0; i < NR_ZC_BUFS; i++)
+		free_zc[nr_free_zc++] = i;
+	ix_mock_udp_send = udp_send;
+	ix_mock_udp_recv_done = udp_recv_done;
+
+	for (i = 0; i < NR_SOCKS; i++)
+		sock_bind(&socks[i]);
+
+	test_invalid();
+	nr_reqs = count_reqs();
+	test_random();
+	drain();
+
+	/* every request went back to the pool */
+	for (i = 0; i < NR_SOCKS; i++)
+		sock_bind(&socks[i]);
+	CHECK(count_reqs() == nr_reqs, "send requests leaked");
+	CHECK(nr_eagain, "the send requests never ran out");
+	CHECK(nr_full, "no batch was ever full");
+	CHECK(!ix_mock_errors, "%lu invalid commands", ix_mock_errors);
+
+	if (failures)
+		return 1;
+
+	printf("test_ixev_udp: %lu received in %lu batches (%lu full), "
+	       "%u sent, %lu failed, %lu deferred, ok\n", nr_recvs,
+	       nr_batches, nr_full, nr_txs, nr_failed, nr_eagain);
+	return 0;
+}
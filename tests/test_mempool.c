@@ -0,0 +1,373 @@
+/*
+ * Copyright 2013-16 Board of Trustees of Stanford University
+ * Copyright 2013-16 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * test_mempool.c - frees libIX mempool elements from other threads
+ *
+ * The first part has one owner allocate from a small pool while several
+ * threads free the elements back with mempool_free_remote(), so the
+ * owner keeps reclaiming the remote stack while it is being pushed to.
+ * The second part has threads allocate from the size-class pools and
+ * pass the memory around, so it is freed locally or remotely at random.
+ *
+ * Live elements are tagged and checked when they are freed, which
+ * catches an element handed out twice. Once all threads are done, every
+ * element must be allocatable again, which catches lost ones.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ix_mock.h"
+#include <mempool.h>
+
+#define NR_FREERS	3
+#define REMOTE_ELEMS	4096
+#define REMOTE_LEN	512	/* REMOTE_ELEMS fill one 2MB page */
+#define REMOTE_ALLOCS	2000000
+#define RING_SIZE	1024
+
+#define NR_WORKERS	4
+#define CLASS_ELEMS	2048
+#define CLASS_ALLOCS	200000
+
+static int failures;
+
+#define CHECK(cond, fmt, ...)						\
+do {									\
+	if (!(cond)) {							\
+		printf("FAIL %s:%d: " fmt "\n", __FILE__, __LINE__,	\
+		       ##__VA_ARGS__);					\
+		if (__sync_add_and_fetch(&failures, 1) > 20)		\
+			exit(1);					\
+	}								\
+} while (0)
+
+/*
+ * Part 1: mempool_free_remote()
+ */
+
+static struct mempool_datastore remote_ds;
+static struct mempool remote_pool;
+static unsigned char remote_live[REMOTE_ELEMS * 2];
+
+/* single producer, single consumer; the owner hands out elements */
+struct ring {
+	void		*volatile elems[RING_SIZE];
+	volatile unsigned long head, tail;
+};
+
+static struct ring rings[NR_FREERS];
+static volatile int remote_done;
+
+struct remote_elem {
+	struct mempool_hdr	hdr;	/* overwritten by the free */
+	unsigned long		seq;
+};
+
+static unsigned long remote_index(void *p)
+{
+	uintptr_t off = (uintptr_t) p - (uintptr_t) remote_ds.buf;
+
+	CHECK(off % remote_ds.elem_len == 0 &&
+	      off / remote_ds.elem_len < remote_ds.nr_elems,
+	      "bad element %p", p);
+	return off / remote_ds.elem_len;
+}
+
+static void *freer(void *arg)
+{
+	struct ring *r = arg;
+	struct remote_elem *e;
+	unsigned long seq = r - rings;
+
+	for (;;) {
+		if (r->head == r->tail) {
+			if (remote_done)
+				break;
+			sched_yield();
+			continue;
+		}
+
+		e = r->elems[r->head % RING_SIZE];
+		__sync_synchronize();
+		r->head++;
+
+		CHECK(e->seq == seq, "element %p has seq %lu, not %lu", e,
+		      e->seq, seq);
+		seq += NR_FREERS;
+		CHECK(__sync_bool_compare_and_swap(
+			&remote_live[remote_index(e)], 1, 0),
+		      "element %p freed but not live", e);
+		mempool_free_remote(&remote_pool, e);
+	}
+
+	return NULL;
+}
+
+static void test_free_remote(void)
+{
+	pthread_t threads[NR_FREERS];
+	unsigned long seq, stalls = 0, nr;
+	struct remote_elem *e;
+	struct ring *r;
+	int i;
+
+	mempool_create_datastore(&remote_ds, REMOTE_ELEMS, REMOTE_LEN, 0,
+				 MEMPOOL_DEFAULT_CHUNKSIZE, "remote");
+	mempool_create(&remote_pool, &remote_ds);
+	if (remote_ds.nr_elems > sizeof(remote_live)) {
+		printf("test_mempool: the pool is too large\n");
+		exit(1);
+	}
+
+	for (i = 0; i < NR_FREERS; i++)
+		pthread_create(&threads[i], NULL, freer, &rings[i]);
+
+	for (seq = 0; seq < REMOTE_ALLOCS; seq++) {
+		while (!(e = mempool_alloc(&remote_pool))) {
+			stalls++;
+			sched_yield();
+		}
+
+		CHECK(__sync_bool_compare_and_swap(
+			&remote_live[remote_index(e)], 0, 1),
+		      "element %p allocated twice", e);
+		e->seq = seq;
+
+		r = &rings[seq % NR_FREERS];
+		while (r->tail - r->head == RING_SIZE)
+			sched_yield();
+		r->elems[r->tail % RING_SIZE] = e;
+		__sync_synchronize();
+		r->tail++;
+	}
+
+	remote_done = 1;
+	for (i = 0; i < NR_FREERS; i++)
+		pthread_join(threads[i], NULL);
+
+	for (nr = 0; (e = mempool_alloc(&remote_pool)); nr++) {
+		CHECK(__sync_bool_compare_and_swap(
+			&remote_live[remote_index(e)], 0, 1),
+		      "element %p allocated twice", e);
+	}
+	CHECK(nr == remote_ds.nr_elems, "%lu of %u elements left", nr,
+	      remote_ds.nr_elems);
+
+	if (!failures)
+		printf("test_mempool: %d remote frees, %lu stalls, ok\n",
+		       REMOTE_ALLOCS, stalls);
+}
+
+/*
+ * Part 2: the size-class pools
+ */
+
+struct msg {
+	unsigned char	*p;
+	size_t		len;
+	unsigned char	fill;
+};
+
+struct inbox {
+	pthread_mutex_t	lock;
+	struct msg	*msgs;
+	int		nr, max;
+};
+
+static struct inbox inboxes[NR_WORKERS];
+static volatile long outstanding;
+static volatile int nr_producing = NR_WORKERS;
+static pthread_barrier_t barrier;
+static long capacity[MEMPOOL_NR_CLASSES];
+static long reclaimed[MEMPOOL_NR_CLASSES];
+
+static void msg_free(struct msg *m)
+{
+	size_t i;
+
+	for (i = 0; i < m->len; i++) {
+		if (m->p[i] != m->fill) {
+			CHECK(0, "%lu bytes at %p overwritten while live",
+			      m->len, m->p);
+			break;
+		}
+	}
+
+	mempool_class_free(m->p);
+}
+
+static void inbox_push(struct inbox *in, struct msg *m)
+{
+	pthread_mutex_lock(&in->lock);
+	if (in->nr == in->max) {
+		in->max = in->max ? in->max * 2 : 1024;
+		in->msgs = realloc(in->msgs, in->max * sizeof(*in->msgs));
+		if (!in->msgs) {
+			printf("test_mempool: out of memory\n");
+			exit(1);
+		}
+	}
+	in->msgs[in->nr++] = *m;
+	pthread_mutex_unlock(&in->lock);
+}
+
+static void inbox_drain(struct inbox *in)
+{
+	struct msg m;
+
+	for (;;) {
+		pthread_mutex_lock(&in->lock);
+		if (!in->nr) {
+			pthread_mutex_unlock(&in->lock);
+			return;
+		}
+		m = in->msgs[--in->nr];
+		pthread_mutex_unlock(&in->lock);
+
+		msg_free(&m);
+		__sync_sub_and_fetch(&outstanding, 1);
+	}
+}
+
+/* allocates everything left in the size-class pools of this thread */
+static void class_alloc_all(long *count)
+{
+	long nr;
+	int i;
+
+	for (i = 0; i < MEMPOOL_NR_CLASSES; i++) {
+		for (nr = 0; mempool_class_alloc(MEMPOOL_CLASS_MIN << i); nr++)
+			;
+		__sync_add_and_fetch(&count[i], nr);
+	}
+}
+
+static void *worker(void *arg)
+{
+	long id = (long) arg;
+	unsigned int seed = id;
+	struct msg m;
+	int i;
+
+	if (id)
+		mempool_create_classes();
+
+	for (i = 0; i < CLASS_ALLOCS; i++) {
+		inbox_drain(&inboxes[id]);
+
+		m.len = 1 + rand_r(&seed) % MEMPOOL_CLASS_MAX;
+		m.p = mempool_class_alloc(m.len);
+		if (!m.p) {
+			sched_yield();
+			continue;
+		}
+
+		CHECK(((uintptr_t) m.p & 15) == 0, "%p is misaligned", m.p);
+		m.fill = rand_r(&seed);
+		memset(m.p, m.fill, m.len);
+
+		if (rand_r(&seed) % 4 == 0) {
+			msg_free(&m);
+		} else {
+			__sync_add_and_fetch(&outstanding, 1);
+			inbox_push(&inboxes[rand_r(&seed) % NR_WORKERS], &m);
+		}
+	}
+
+	/* the owners must stay alive until all remote frees are done */
+	__sync_sub_and_fetch(&nr_producing, 1);
+	while (nr_producing || outstanding) {
+		inbox_drain(&inboxes[id]);
+		sched_yield();
+	}
+	pthread_barrier_wait(&barrier);
+
+	class_alloc_all(reclaimed);
+	return NULL;
+}
+
+static void test_classes(void)
+{
+	pthread_t threads[NR_WORKERS];
+	void **p, *list;
+	long nr;
+	int i;
+
+	if (mempool_create_class_datastores(CLASS_ELEMS) ||
+	    mempool_create_classes()) {
+		printf("test_mempool: cannot create the size classes\n");
+		exit(1);
+	}
+
+	/* measure the capacity of each class, chaining the elements */
+	for (i = 0; i < MEMPOOL_NR_CLASSES; i++) {
+		list = NULL;
+		for (nr = 0; (p = mempool_class_alloc(MEMPOOL_CLASS_MIN << i));
+		     nr++) {
+			*p = list;
+			list = p;
+		}
+		CHECK(nr >= CLASS_ELEMS, "class %d holds %ld elements", i, nr);
+		capacity[i] = nr;
+
+		for (p = list; p; p = list) {
+			list = *p;
+			mempool_class_free(p);
+		}
+	}
+	CHECK(!mempool_class_alloc(MEMPOOL_CLASS_MAX + 1),
+	      "allocated more than MEMPOOL_CLASS_MAX");
+
+	for (i = 0; i < NR_WORKERS; i++)
+		pthread_mutex_init(&inboxes[i].lock, NULL);
+	pthread_barrier_init(&barrier, NULL, NR_WORKERS);
+
+	for (i = 1; i < NR_WORKERS; i++)
+		pthread_create(&threads[i], NULL, worker, (void *) (long) i);
+	worker(0);
+	for (i = 1; i < NR_WORKERS; i++)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; i < MEMPOOL_NR_CLASSES; i++)
+		CHECK(reclaimed[i] == capacity[i],
+		      "class %d: %ld of %ld elements left", i, reclaimed[i],
+		      capacity[i]);
+
+	if (!failures)
+		printf("test_mempool: %d threads on the size classes, ok\n",
+		       NR_WORKERS);
+}
+
+int main(void)
+{
+	test_free_remote();
+	test_classes();
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,276 @@
+/*
+ * Copyright 2013-16 Board of Trustees of Stanford University
+ * Copyright 2013-16 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+
+/*
+ * test_syncookie.c - checks SYN cookie generation and validation
+ *
+ * Cookies made for random 4-tuples, sequence numbers and SYN options at
+ * random times, across counter wrap-arounds, must be accepted with their
+ * MSS and window scale until they are COOKIE_MAX_AGE periods old and be
+ * rejected from then on, or when returned for another connection. The
+ * MSS must be rounded down to the table, and every window scale must
+ * survive the round trip.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* tcp_syncookie.c pulls in headers that are for the dataplane only */
+#define __KERNEL__ 1
+
+#include "../dp/net/tcp_syncookie.c"
+
+#define NR_COOKIES	200000
+
+struct syn {
+	ip_addr_t local_ip;
+	ip_addr_t remote_ip;
+	u16_t local_port;
+	u16_t remote_port;
+	u32_t isn;
+	u16_t mss;		/* offered, then encoded */
+	u8_t wscale;
+	u32_t cookie;
+};
+
+static uint64_t mock_now_us;
+static unsigned int mock_pcb_usage;
+static int failures;
+
+#define CHECK(cond, fmt, ...)						\
+do {									\
+	if (!(cond)) {							\
+		printf("FAIL %s:%d: " fmt "\n", __FILE__, __LINE__,	\
+		       ##__VA_ARGS__);					\
+		if (++failures > 20)					\
+			exit(1);					\
+	}								\
+} while (0)
+
+uint64_t timer_now(void)
+{
+	return mock_now_us;
+}
+
+unsigned int memp_tcp_pcb_usage(void)
+{
+	return mock_pcb_usage;
+}
+
+static uint32_t rand32(void)
+{
+	return ((uint32_t) rand() << 16) ^ rand();
+}
+
+static uint64_t rand64(void)
+{
+	return ((uint64_t) rand32() << 32) ^ rand32();
+}
+
+static void random_syn(struct syn *s)
+{
+	s->local_ip.addr = rand32();
+	s->remote_ip.addr = rand32();
+	s->local_port = rand();
+	s->remote_port = rand();
+	s->isn = rand32();
+	s->mss = rand() % 10000;
+	s->wscale = rand() % 16 == 15 ? TCP_SYNCOOKIE_NO_WSCALE : rand() % 15;
+}
+
+static void make(struct syn *s)
+{
+	s->cookie = tcp_syncookie_make(ip_2_ipX(&s->local_ip),
+				       ip_2_ipX(&s->remote_ip), s->local_port,
+				       s->remote_port, s->isn, &s->mss,
+				       s->wscale);
+}
+
+static int check(struct syn *s, u16_t *mss, u8_t *wscale)
+{
+	return tcp_syncookie_check(ip_2_ipX(&s->local_ip),
+				   ip_2_ipX(&s->remote_ip), s->local_port,
+				   s->remote_port, s->isn, s->cookie, mss,
+				   wscale);
+}
+
+static void test_encoding(void)
+{
+	static const struct {
+		u16_t offered;
+		u16_t encoded;
+	} mss[] = {
+		{0, 536}, {535, 536}, {536, 536}, {1299, 536}, {1300, 1300},
+		{1439, 1300}, {1440, 1440}, {1459, 1440}, {1460, 1460},
+		{9000, 1460}, {65535, 1460},
+	};
+	struct syn s;
+	u16_t got_mss;
+	u8_t got_wscale;
+	int i, w;
+
+	/* every MSS boundary with every window scale, and without one */
+	for (i = 0; i < ARRAY_SIZE(mss); i++) {
+		for (w = 0; w <= 15; w++) {
+			random_syn(&s);
+			s.mss = mss[i].offered;
+			s.wscale = w == 15 ? TCP_SYNCOOKIE_NO_WSCALE : w;
+			make(&s);
+			CHECK(s.mss == mss[i].encoded,
+			      "MSS %u encoded as %u, not %u", mss[i].offered,
+			      s.mss, mss[i].encoded);
+
+			got_mss = 0;
+			got_wscale = 0;
+			CHECK(!check(&s, &got_mss, &got_wscale),
+			      "cookie for MSS %u, wscale %d rejected",
+			      mss[i].offered, s.wscale);
+			CHECK(got_mss == s.mss, "MSS %u came back as %u",
+			      s.mss, got_mss);
+			CHECK(got_wscale == s.wscale,
+			      "wscale %u came back as %u", s.wscale,
+			      got_wscale);
+		}
+	}
+}
+
+static void test_age(void)
+{
+	uint64_t made, period, age;
+	struct syn s;
+	u16_t mss;
+	u8_t wscale;
+	int i, ret;
+
+	for (i = 0; i < NR_COOKIES; i++) {
+		/* cover wrap-arounds of the counter in the cookie */
+		mock_now_us = rand64() % ((uint64_t) COOKIE_PERIOD_US << 12);
+		made = mock_now_us / COOKIE_PERIOD_US;
+		random_syn(&s);
+		make(&s);
+
+		/* up to the wrap-around that makes cookies valid again */
+		age = rand() % 4 ? rand() % COOKIE_MAX_AGE :
+		      rand() % (1 << (32 - COOKIE_BITS));
+		mock_now_us = (made + age) * COOKIE_PERIOD_US +
+			      rand64() % COOKIE_PERIOD_US;
+		period = mock_now_us / COOKIE_PERIOD_US - made;
+
+		ret = check(&s, &mss, &wscale);
+		if (period < COOKIE_MAX_AGE) {
+			CHECK(!ret, "cookie rejected after %lu periods",
+			      period);
+			CHECK(!ret || (mss == s.mss && wscale == s.wscale),
+			      "cookie changed MSS %u to %u, wscale %u to %u",
+			      s.mss, mss, s.wscale, wscale);
+		} else {
+			CHECK(ret == -EINVAL,
+			      "cookie accepted after %lu periods", period);
+		}
+	}
+}
+
+static void test_other_conn(void)
+{
+	struct syn s, o;
+	u16_t mss;
+	u8_t wscale;
+	int i;
+
+	/* a cookie is only good for the connection it was made for */
+	for (i = 0; i < NR_COOKIES; i++) {
+		mock_now_us = rand64() % ((uint64_t) COOKIE_PERIOD_US << 12);
+		random_syn(&s);
+		make(&s);
+
+		o = s;
+		switch (rand() % 4) {
+		case 0:
+			o.local_ip.addr ^= 1 << (rand() % 32);
+			break;
+		case 1:
+			o.remote_ip.addr ^= 1 << (rand() % 32);
+			break;
+		case 2:
+			o.local_port ^= 1 << (rand() % 16);
+			break;
+		default:
+			o.remote_port ^= 1 << (rand() % 16);
+		}
+
+		CHECK(check(&o, &mss, &wscale) == -EINVAL,
+		      "cookie accepted for another connection");
+	}
+}
+
+static void test_needed(void)
+{
+	struct tcp_pcb_listen lpcb;
+
+	memset(&lpcb, 0, sizeof(lpcb));
+
+	tcp_syn_cookie_threshold = 0;
+	mock_pcb_usage = 100;
+	CHECK(!tcp_syncookie_needed(&lpcb), "cookies sent while disabled");
+
+	tcp_syn_cookie_threshold = 90;
+	mock_pcb_usage = 89;
+	CHECK(!tcp_syncookie_needed(&lpcb), "cookies sent below threshold");
+	mock_pcb_usage = 90;
+	CHECK(tcp_syncookie_needed(&lpcb), "no cookies at the threshold");
+}
+
+int main(void)
+{
+	int i;
+
+	srand(1);
+
+	CHECK(!tcp_syncookie_init(), "tcp_syncookie_init failed");
+	for (i = 0; i < ARRAY_SIZE(syncookie_secret); i++)
+		if (syncookie_secret[i])
+			break;
+	CHECK(i < ARRAY_SIZE(syncookie_secret), "the secret is zero");
+
+	/* the rest must not depend on the secret drawn */
+	for (i = 0; i < ARRAY_SIZE(syncookie_secret); i++)
+		syncookie_secret[i] = rand64();
+
+	test_encoding();
+	test_age();
+	test_other_conn();
+	test_needed();
+
+	if (failures) {
+		printf("test_syncookie: %d failures\n", failures);
+		return 1;
+	}
+
+	printf("test_syncookie: ok\n");
+	return 0;
+}
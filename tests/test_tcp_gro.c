@@ -0,0 +1,518 @@
+/*
+ * Copyright 2013-16 Board of Trustees of Stanford University
+ * Copyright 2013-16 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+
+/*
+ * test_tcp_gro.c - checks the merge and flush rules of TCP receive
+ * coalescing
+ *
+ * Random segment streams of a dozen connections in two flow groups go
+ * through tcp_gro_input() in RX batches: in-order data mixed with gaps,
+ * retransmissions, new ACKs, option, TOS and ECN flag changes, control
+ * segments and malformed headers. For every segment, the merge rules
+ * decide whether it must join the connection's held chain, flush it,
+ * or be passed on by itself. The stack must see the segments of each
+ * connection in arrival order, in chains with the window and PSH of
+ * their last segment, and no other connection may be flushed except to
+ * make room for a new flow.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* tcp_gro.c pulls in headers that are for the dataplane only */
+#define __KERNEL__ 1
+
+#include <ix/cpu.h>
+
+/* a single CPU whose percpu variables are plain globals */
+#undef DEFINE_PERCPU
+#define DEFINE_PERCPU(type, name) __typeof__(type) name
+#undef percpu_get
+#define percpu_get(var) (var)
+
+/* like the rest of the dataplane, tcp_gro.c points into packed headers */
+#pragma GCC diagnostic ignored "-Waddress-of-packed-member"
+
+#include "../dp/net/tcp_gro.c"
+
+#define NR_FGS		2
+#define NR_CONNS	12		/* each tuple is in both flow groups */
+#define NR_SEGS		400000
+#define MAX_BATCH	64
+#define MAX_QUEUE	(MAX_BATCH + 1)
+#define OPTS_LEN	12		/* NOP, NOP, timestamps */
+
+struct conn;
+
+struct seg {
+	struct mbuf mbuf;
+	struct conn *conn;
+	struct ip_hdr *iphdr;
+	struct tcp_hdr *tcphdr;
+	char *data;
+	int tcplen;		/* the TCP header and data */
+	int len;		/* the data */
+	u16_t wnd;		/* as sent */
+	bool psh;
+	bool plain;		/* ACK or ACK+PSH with data */
+	bool garbage;		/* too short for a TCP header */
+	bool dropped;
+};
+
+struct conn {
+	struct eth_fg *fg;
+	u32_t local_ip;
+	u32_t remote_ip;
+	u16_t local_port;
+	u16_t remote_port;
+	u32_t seq;
+	u32_t ack;
+	u8_t tos;
+	bool opts;
+	u32_t tsval;
+	u16_t ecn_flags;	/* ECE and CWR */
+	bool jumbo;
+
+	/* segments that arrived and were not passed on yet */
+	struct seg *queue[MAX_QUEUE];
+	int nr_queued;
+	int nr_delivered;	/* by the current tcp_gro_input() call */
+};
+
+static struct eth_fg fgs_mock[NR_FGS];
+static struct conn conns[NR_CONNS];
+static bool fail_pbuf;
+static long nr_segs_in, nr_chains, nr_merged, nr_max_segs, nr_max_len;
+static long nr_evicted, nr_dropped, nr_bypassed;
+static int failures;
+
+DEFINE_PERCPU(unsigned int, cpu_id);
+DEFINE_PERCPU(struct mempool, mbuf_mempool);
+
+#define CHECK(cond, fmt, ...)						\
+do {									\
+	if (!(cond)) {							\
+		printf("FAIL %s:%d: " fmt "\n", __FILE__, __LINE__,	\
+		       ##__VA_ARGS__);					\
+		if (++failures > 20)					\
+			exit(1);					\
+	}								\
+} while (0)
+
+struct pbuf *pbuf_alloc(pbuf_layer layer, u16_t length, pbuf_type type)
+{
+	struct pbuf *p;
+
+	if (fail_pbuf)
+		return NULL;
+
+	p = calloc(1, sizeof(*p));
+	p->tot_len = p->len = length;
+	p->type = type;
+	p->ref = 1;
+	return p;
+}
+
+void pbuf_cat(struct pbuf *h, struct pbuf *t)
+{
+	struct pbuf *p;
+
+	for (p = h; p->next; p = p->next)
+		p->tot_len += t->tot_len;
+	p->tot_len += t->tot_len;
+	p->next = t;
+}
+
+/* the mbuf pool is empty, so every mbuf_free() ends up here */
+void mempool_free_2(struct mempool *m, void *ptr)
+{
+	struct seg *s = container_of(ptr, struct seg, mbuf);
+
+	CHECK(m == &mbuf_mempool, "freed to the wrong pool");
+	s->dropped = true;
+}
+
+static struct seg *pop(struct conn *c, struct seg *s, int n)
+{
+	struct seg *front = c->nr_queued ? c->queue[0] : NULL;
+
+	CHECK(front == s, "conn %ld got a segment out of order",
+	      (long) (c - conns));
+	if (front != s || n > c->nr_queued)
+		exit(1);
+
+	c->nr_queued -= n;
+	memmove(c->queue, c->queue + n, c->nr_queued * sizeof(c->queue[0]));
+	c->nr_delivered += n;
+	return s;
+}
+
+static u16_t tcp_ece_cwr(struct tcp_hdr *hdr)
+{
+	return hdr->_hdrlen_rsvd_flags & PP_HTONS(TCP_ECE | TCP_CWR);
+}
+
+void tcp_input(struct eth_fg *cur_fg, struct pbuf *p, ip_addr_t *src,
+	       ip_addr_t *dest)
+{
+	struct seg *head = container_of(p->mbuf, struct seg, mbuf);
+	struct conn *c = head->conn;
+	struct seg *s = head, *last;
+	struct pbuf *q, *next;
+	int n = 0, tot = 0;
+
+	CHECK(cur_fg == c->fg, "delivered to the wrong flow group");
+	CHECK(src == (ip_addr_t *) &head->iphdr->src &&
+	      dest == (ip_addr_t *) &head->iphdr->dest,
+	      "delivered with the wrong addresses");
+
+	/* the chain must be the front of the connection's queue */
+	for (q = p; q; q = q->next, n++) {
+		CHECK(n < c->nr_queued && q->mbuf == &c->queue[n]->mbuf,
+		      "conn %ld chain has a foreign segment",
+		      (long) (c - conns));
+		if (n >= c->nr_queued || q->mbuf != &c->queue[n]->mbuf)
+			exit(1);
+		s = c->queue[n];
+		if (!n) {
+			CHECK(q->payload == s->tcphdr && q->len == s->tcplen,
+			      "the head pbuf is not the TCP segment");
+		} else {
+			CHECK(q->payload == s->data && q->len == s->len,
+			      "pbuf %d is not the segment data", n);
+			CHECK(s->plain, "merged a segment that isn't plain");
+		}
+		tot += q->len;
+	}
+	last = s;
+
+	CHECK(p->tot_len == tot, "chain tot_len %u, not %d", p->tot_len, tot);
+	CHECK(!!(p->flags & PBUF_FLAG_GRO) == (n > 1),
+	      "GRO flag on a chain of %d", n);
+	CHECK(!!(p->flags & PBUF_FLAG_CE) ==
+	      (IPH_ECN(head->iphdr) == IPH_ECN_CE), "CE flag is wrong");
+	CHECK(!!(TCPH_FLAGS(head->tcphdr) & TCP_PSH) == last->psh,
+	      "the chain doesn't have the PSH of its last segment");
+	CHECK(head->tcphdr->wnd == last->wnd,
+	      "the chain doesn't have the window of its last segment");
+
+	pop(c, head, n);
+	nr_chains++;
+	if (n > 1)
+		nr_merged++;
+	if (n == TCP_GRO_MAX_SEGS)
+		nr_max_segs++;
+
+	for (q = p; q; q = next) {
+		next = q->next;
+		free(container_of(q->mbuf, struct seg, mbuf));
+		free(q);
+	}
+}
+
+void tcp_input_tmp(struct eth_fg *cur_fg, struct mbuf *pkt,
+		   struct ip_hdr *iphdr, void *tcphdr)
+{
+	struct seg *s = container_of(pkt, struct seg, mbuf);
+
+	CHECK(cur_fg == s->conn->fg, "delivered to the wrong flow group");
+	CHECK(iphdr == s->iphdr && tcphdr == s->tcphdr,
+	      "delivered with the wrong headers");
+
+	/* tcp_input() drops these, so their order doesn't matter */
+	if (s->garbage) {
+		s->conn->nr_delivered++;
+		free(s);
+		return;
+	}
+
+	pop(s->conn, s, 1);
+	nr_bypassed++;
+	free(s);
+}
+
+static struct seg *build(struct conn *c)
+{
+	int hdrlen = sizeof(struct tcp_hdr) + (c->opts ? OPTS_LEN : 0);
+	int r = rand() % 200, len = 0, hl = hdrlen / 4;
+	u16_t flags = TCP_ACK;
+	struct seg *s;
+	char *opts;
+
+	if (r < 10) {
+		/* control segments, some carrying data */
+		static const u16_t ctl[] = {
+			TCP_SYN, TCP_SYN | TCP_ACK, TCP_FIN | TCP_ACK,
+			TCP_RST, TCP_RST | TCP_ACK, TCP_URG | TCP_ACK,
+			TCP_ACK, TCP_ACK, TCP_ACK, TCP_ACK,
+		};
+
+		flags = ctl[r];
+		len = rand() % 2 ? 1 + rand() % 100 : 0;
+	} else {
+		len = 1 + rand() % (c->jumbo ? 9000 : 1460);
+		if (rand() % 20 == 0)
+			flags |= TCP_PSH;
+	}
+
+	/* a header length shorter than the header */
+	if (rand() % 200 == 0)
+		hl = 4;
+
+	s = calloc(1, sizeof(*s) + sizeof(struct ip_hdr) + hdrlen + len);
+	s->conn = c;
+	s->iphdr = (struct ip_hdr *) (s + 1);
+	s->tcphdr = (struct tcp_hdr *) (s->iphdr + 1);
+	s->data = (char *) s->tcphdr + hdrlen;
+	s->tcplen = hdrlen + len;
+	s->len = len;
+	s->wnd = rand();
+	s->psh = flags & TCP_PSH;
+	s->plain = len && hl >= 5 && !(flags & ~(TCP_ACK | TCP_PSH));
+
+	IPH_VHL_SET(s->iphdr, 4, 5);
+	IPH_TOS_SET(s->iphdr, c->tos);
+	IPH_LEN_SET(s->iphdr, htons(sizeof(struct ip_hdr) + s->tcplen));
+	s->iphdr->src.addr = c->remote_ip;
+	s->iphdr->dest.addr = c->local_ip;
+
+	s->tcphdr->src = htons(c->remote_port);
+	s->tcphdr->dest = htons(c->local_port);
+	s->tcphdr->seqno = htonl(c->seq);
+	s->tcphdr->ackno = htonl(c->ack);
+	TCPH_HDRLEN_FLAGS_SET(s->tcphdr, hl, flags | c->ecn_flags);
+	s->tcphdr->wnd = s->wnd;
+
+	if (c->opts) {
+		opts = (char *) (s->tcphdr + 1);
+		opts[0] = opts[1] = 1;
+		opts[2] = 8;
+		opts[3] = 10;
+		memcpy(opts + 4, &c->tsval, 4);
+		memset(opts + 8, 0, 4);
+	}
+
+	/* an IP length too short for a TCP header */
+	if (rand() % 200 == 0) {
+		IPH_LEN_SET(s->iphdr, htons(sizeof(struct ip_hdr) + 10));
+		s->garbage = true;
+		s->plain = false;
+	}
+
+	c->seq += len;
+	return s;
+}
+
+/* changes the connection like a sender or the network would */
+static void perturb(struct conn *c)
+{
+	if (rand() % 100 == 0)
+		c->seq += 1 + rand() % 1000;
+	if (rand() % 100 == 0)
+		c->seq -= rand() % 3000;
+	if (rand() % 20 == 0)
+		c->ack += rand() % 3000;
+	if (rand() % 20 == 0)
+		c->tsval++;
+	if (rand() % 100 == 0)
+		c->tos ^= 1;		/* ECT(0) <-> CE */
+	if (rand() % 100 == 0)
+		c->opts = !c->opts;
+	if (rand() % 100 == 0)
+		c->ecn_flags ^= rand() % 2 ? TCP_ECE : TCP_CWR;
+}
+
+/* whether @s may join the chain of the segments in @c's queue */
+static bool can_merge(struct conn *c, struct seg *s)
+{
+	struct seg *head = c->queue[0], *last = c->queue[c->nr_queued - 1];
+	int i, tot = head->tcplen;
+
+	for (i = 1; i < c->nr_queued; i++)
+		tot += c->queue[i]->len;
+
+	return s->plain &&
+	       c->nr_queued < TCP_GRO_MAX_SEGS &&
+	       tot + s->len <= 0xffff &&
+	       ntohl(s->tcphdr->seqno) == ntohl(last->tcphdr->seqno) + last->len &&
+	       s->tcphdr->ackno == head->tcphdr->ackno &&
+	       IPH_TOS(s->iphdr) == IPH_TOS(head->iphdr) &&
+	       s->tcplen - s->len == head->tcplen - head->len &&
+	       tcp_ece_cwr(s->tcphdr) == tcp_ece_cwr(head->tcphdr) &&
+	       !memcmp(s->tcphdr + 1, head->tcphdr + 1,
+		       s->tcplen - s->len - sizeof(struct tcp_hdr));
+}
+
+static int nr_held_flows(void)
+{
+	int i, n = 0;
+
+	for (i = 0; i < NR_CONNS; i++)
+		n += conns[i].nr_queued > 0;
+
+	return n;
+}
+
+/* feeds one segment and checks what it did to every held chain */
+static void input(struct conn *c)
+{
+	struct seg *s = build(c);
+	int held = c->nr_queued, others = nr_held_flows() - !!held;
+	bool merge = held && can_merge(c, s);
+	int i, nr_others = 0;
+
+	for (i = 0; i < NR_CONNS; i++)
+		conns[i].nr_delivered = 0;
+
+	if (!s->garbage)
+		c->queue[c->nr_queued++] = s;
+
+	fail_pbuf = rand() % 100 == 0;
+	tcp_gro_input(c->fg, &s->mbuf, s->iphdr, s->tcphdr);
+	fail_pbuf = false;
+	nr_segs_in++;
+
+	if (s->dropped) {
+		CHECK(c->nr_queued && c->queue[c->nr_queued - 1] == s,
+		      "a segment was dropped after being passed on");
+		c->nr_queued--;
+		free(s);
+		nr_dropped++;
+	}
+
+	for (i = 0; i < NR_CONNS; i++)
+		if (&conns[i] != c && conns[i].nr_delivered)
+			nr_others++;
+
+	if (s->garbage) {
+		CHECK(c->nr_delivered == 1 && c->nr_queued == held,
+		      "a garbage segment flushed its connection");
+	} else if (s->dropped) {
+		/* the chain can't be extended, but must not be lost */
+		CHECK(c->nr_delivered == (merge ? 0 : held),
+		      "%d segments passed on around a drop",
+		      c->nr_delivered);
+	} else if (!s->plain) {
+		CHECK(c->nr_delivered == held + 1,
+		      "%d of %d segments passed on before a control segment",
+		      c->nr_delivered, held + 1);
+	} else if (merge) {
+		CHECK(c->nr_delivered == (s->psh ? held + 1 : 0),
+		      "a chain of %d took a segment, %d passed on", held + 1,
+		      c->nr_delivered);
+		if (held + 1 == TCP_GRO_MAX_SEGS)
+			nr_max_len++;
+	} else {
+		CHECK(c->nr_delivered == held + s->psh,
+		      "a chain of %d couldn't take a segment, %d passed on",
+		      held, c->nr_delivered);
+	}
+
+	/*
+	 * Only a new flow may push another one out, once the table is full,
+	 * even if its segment is then dropped.
+	 */
+	if (s->plain && !merge && !s->psh &&
+	    others == TCP_GRO_MAX_FLOWS) {
+		CHECK(nr_others == 1, "%d flows evicted", nr_others);
+		nr_evicted++;
+	} else {
+		CHECK(!nr_others, "%d other flows passed on", nr_others);
+	}
+	CHECK(nr_held_flows() <= TCP_GRO_MAX_FLOWS, "%d flows held",
+	      nr_held_flows());
+}
+
+static void test_random(void)
+{
+	struct conn *c = &conns[0];
+	int n, i;
+
+	while (nr_segs_in < NR_SEGS) {
+		n = 1 + rand() % MAX_BATCH;
+		for (i = 0; i < n; i++) {
+			/* mostly runs of the same connection */
+			if (rand() % 8 == 0)
+				c = &conns[rand() % NR_CONNS];
+			perturb(c);
+			input(c);
+		}
+
+		/* the end of the RX batch passes everything on */
+		tcp_gro_flush();
+		for (i = 0; i < NR_CONNS; i++)
+			CHECK(!conns[i].nr_queued,
+			      "conn %d has %d segments after the flush", i,
+			      conns[i].nr_queued);
+	}
+}
+
+int main(void)
+{
+	struct conn *c;
+	int i;
+
+	srand(1);
+
+	for (i = 0; i < NR_FGS; i++) {
+		fgs_mock[i].fg_id = i;
+		fgs_mock[i].cur_cpu = percpu_get(cpu_id);
+	}
+
+	for (i = 0; i < NR_CONNS; i++) {
+		c = &conns[i];
+		c->fg = &fgs_mock[i % NR_FGS];
+		c->local_ip = htonl(0xc0a80001);
+		c->remote_ip = htonl(0x0a000001 + i / NR_FGS % 2);
+		c->local_port = 80;
+		c->remote_port = 1024 + i / NR_FGS / 2;
+		c->seq = rand();
+		c->ack = rand();
+		c->tos = IPH_ECN_ECT0;
+		c->jumbo = i % 3 == 0;
+	}
+
+	test_random();
+
+	CHECK(nr_merged && nr_max_segs && nr_max_len && nr_evicted &&
+	      nr_dropped && nr_bypassed,
+	      "%ld merged, %ld at %d segs, %ld at the length limit, "
+	      "%ld evicted, %ld dropped, %ld passed by", nr_merged,
+	      nr_max_segs, TCP_GRO_MAX_SEGS, nr_max_len, nr_evicted,
+	      nr_dropped, nr_bypassed);
+
+	if (failures) {
+		printf("test_tcp_gro: %d failures\n", failures);
+		return 1;
+	}
+
+	printf("test_tcp_gro: %ld segments in %ld chains, %ld merged, "
+	       "%ld evicted, ok\n", nr_segs_in, nr_chains, nr_merged,
+	       nr_evicted);
+	return 0;
+}
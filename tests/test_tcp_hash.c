@@ -0,0 +1,407 @@
+/*
+ * Copyright 2013-16 Board of Trustees of Stanford University
+ * Copyright 2013-16 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+
+/*
+ * test_tcp_hash.c - checks the connection table of a flow group
+ *
+ * Connections are inserted, looked up and removed at random against a
+ * model while the table grows from its minimum size. Some connections
+ * hash by their remote port alone to a handful of buckets with just two
+ * distinct tags, which forces tag collisions between tuples that differ
+ * in a single field, and long overflow probes. After every batch of
+ * operations, each connection must be found exactly when it's inserted,
+ * and every bucket's overflow counter must match the entries that
+ * probed past it, in both tables while a resize is in progress. When
+ * the table can't grow, inserts must fail only once it is 7/8 full.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* tcp_hash.c pulls in headers that are for the dataplane only */
+#define __KERNEL__ 1
+
+#include <ix/stddef.h>
+#include <lwip/tcp.h>
+#include <lwip/tcp_impl.h>
+
+/* hash some connections badly on purpose */
+static u32_t mock_conn_hash(ipX_addr_t *local_ip, ipX_addr_t *remote_ip,
+			    uint16_t local_port, uint16_t remote_port);
+#define tcp_conn_hash mock_conn_hash
+
+#include "../dp/net/tcp_hash.c"
+
+#define NR_CONNS	20000
+#define NR_ROUNDS	3
+#define BATCH		1000
+#define CLUSTER_MASK	0x0003001f	/* 32 home buckets, tags 1 and 3 */
+
+struct conn {
+	struct tcp_pcb pcb;
+	bool inserted;
+};
+
+static struct conn *conns;
+static struct eth_fg fg;
+static bool fail_pages;
+static long nr_pages, nr_inserted, nr_refused, nr_migrating;
+static long nr_tag_hits, nr_probes;
+static uint32_t max_buckets;
+static int failures;
+
+#define CHECK(cond, fmt, ...)						\
+do {									\
+	if (!(cond)) {							\
+		printf("FAIL %s:%d: " fmt "\n", __FILE__, __LINE__,	\
+		       ##__VA_ARGS__);					\
+		if (++failures > 20)					\
+			exit(1);					\
+	}								\
+} while (0)
+
+static u32_t mock_conn_hash(ipX_addr_t *local_ip, ipX_addr_t *remote_ip,
+			    uint16_t local_port, uint16_t remote_port)
+{
+	u32_t hash;
+
+#undef tcp_conn_hash
+	hash = tcp_conn_hash(local_ip, remote_ip, local_port, remote_port);
+#define tcp_conn_hash mock_conn_hash
+
+	/* by the remote port alone, so that whole families share a tag */
+	if (remote_port % 16)
+		return hash;
+	return (remote_port * 0x9e3779b1) & CLUSTER_MASK;
+}
+
+void logk(int level, const char *fmt, ...)
+{
+	va_list ap;
+
+	/* the failure to grow is expected while it is injected */
+	if (fail_pages)
+		return;
+
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+}
+
+void *mem_alloc_pages(int nr, int size, struct bitmask *mask,
+		      int numa_policy)
+{
+	if (fail_pages)
+		return MAP_FAILED;
+
+	nr_pages += nr;
+	return calloc(nr, size);
+}
+
+void mem_free_pages(void *addr, int nr, int size)
+{
+	nr_pages -= nr;
+	free(addr);
+}
+
+static struct tcp_pcb *lookup(struct tcp_pcb *pcb)
+{
+	return tcp_active_lookup(&fg, tcp_pcb_hash(pcb),
+				 ip_2_ipX(&pcb->local_ip),
+				 ip_2_ipX(&pcb->remote_ip), pcb->local_port,
+				 pcb->remote_port);
+}
+
+/*
+ * Checks the slots of every bucket and recomputes the overflow counters
+ * from where each entry sits relative to its home bucket.
+ */
+static long check_buckets(struct tcp_active_bucket *buckets, uint32_t mask,
+			  const char *name)
+{
+	uint16_t *overflow = calloc(mask + 1, sizeof(*overflow));
+	struct tcp_active_bucket *b;
+	struct tcp_pcb *pcb;
+	struct conn *c;
+	long nr = 0;
+	uint32_t i, j;
+	int slot;
+
+	for (i = 0; i <= mask; i++) {
+		b = &buckets[i];
+		for (slot = 0; slot < TCP_ACTIVE_TBL_SLOTS; slot++) {
+			pcb = b->pcbs[slot];
+			if (!pcb) {
+				CHECK(!b->tags[slot], "%s bucket %u slot %d "
+				      "has a tag but no pcb", name, i, slot);
+				continue;
+			}
+
+			c = container_of(pcb, struct conn, pcb);
+			CHECK(c->inserted, "%s bucket %u holds a removed "
+			      "connection", name, i);
+			CHECK(b->tags[slot] == tcp_active_tag(tcp_pcb_hash(pcb)),
+			      "%s bucket %u slot %d has the wrong tag", name,
+			      i, slot);
+			for (j = tcp_pcb_hash(pcb) & mask; j != i;
+			     j = (j + 1) & mask)
+				overflow[j]++;
+			nr++;
+		}
+	}
+
+	for (i = 0; i <= mask; i++)
+		CHECK(buckets[i].overflow == overflow[i],
+		      "%s bucket %u overflow is %u, not %u", name, i,
+		      buckets[i].overflow, overflow[i]);
+
+	free(overflow);
+	return nr;
+}
+
+static void check_all(void)
+{
+	struct tcp_active_tbl *tbl = &fg.active_tbl;
+	struct tcp_pcb *pcb;
+	long nr;
+	int i;
+
+	for (i = 0; i < NR_CONNS; i++) {
+		pcb = lookup(&conns[i].pcb);
+		if (conns[i].inserted)
+			CHECK(pcb == &conns[i].pcb,
+			      "conn %d not found (found %p)", i, pcb);
+		else
+			CHECK(!pcb, "removed conn %d found", i);
+		CHECK(conns[i].pcb.hashed == conns[i].inserted,
+		      "conn %d hashed is %d", i, conns[i].pcb.hashed);
+	}
+
+	if (tbl->mask + 1 > max_buckets)
+		max_buckets = tbl->mask + 1;
+
+	nr = check_buckets(tbl->buckets, tbl->mask, "new");
+	if (tbl->old_buckets) {
+		nr += check_buckets(tbl->old_buckets, tbl->old_mask, "old");
+		nr_migrating++;
+	}
+	CHECK(nr == nr_inserted && tbl->count == nr_inserted,
+	      "%ld entries in the buckets, %u counted, %ld inserted", nr,
+	      tbl->count, nr_inserted);
+}
+
+static void insert(struct conn *c)
+{
+	struct tcp_active_tbl *tbl = &fg.active_tbl;
+	uint32_t nr_slots;
+	int ret;
+
+	ret = tcp_active_insert(&fg, &c->pcb, tcp_pcb_hash(&c->pcb));
+
+	/* the size that counts is the one after trying to grow */
+	nr_slots = (tbl->mask + 1) * TCP_ACTIVE_TBL_SLOTS;
+	if (ret) {
+		CHECK(ret == -ENOMEM, "insert returned %d", ret);
+		CHECK(fail_pages && nr_inserted >= nr_slots * 7 / 8,
+		      "insert refused with %ld of %u slots used",
+		      nr_inserted, nr_slots);
+		nr_refused++;
+		return;
+	}
+
+	CHECK(nr_inserted < nr_slots, "inserted into a full table");
+	c->inserted = true;
+	nr_inserted++;
+}
+
+static void remove_conn(struct conn *c)
+{
+	tcp_active_remove(&fg, &c->pcb);
+	c->inserted = false;
+	nr_inserted--;
+}
+
+/* operations on random connections, mostly inserts if @fill */
+static void run_batch(bool fill)
+{
+	struct tcp_pcb *pcb;
+	struct conn *c;
+	int i;
+
+	for (i = 0; i < BATCH; i++) {
+		c = &conns[rand() % NR_CONNS];
+		switch (rand() % 4) {
+		case 0:
+			/* a lookup in the middle of a resize */
+			pcb = lookup(&c->pcb);
+			CHECK(pcb == (c->inserted ? &c->pcb : NULL),
+			      "lookup of conn %ld found %p",
+			      (long) (c - conns), pcb);
+			break;
+		case 1:
+			if (c->inserted)
+				remove_conn(c);
+			else if (fill)
+				insert(c);
+			break;
+		default:
+			if (!c->inserted && fill)
+				insert(c);
+			else if (c->inserted && !fill)
+				remove_conn(c);
+		}
+	}
+}
+
+/* counts tag hits on other connections, which only the tuple rejects */
+static void count_collisions(void)
+{
+	struct tcp_active_tbl *tbl = &fg.active_tbl;
+	struct tcp_active_bucket *b;
+	struct tcp_pcb *pcb;
+	unsigned int hits;
+	uint32_t i, hash;
+	int n, slot;
+
+	for (n = 0; n < NR_CONNS; n++) {
+		if (!conns[n].inserted)
+			continue;
+		pcb = &conns[n].pcb;
+		hash = tcp_pcb_hash(pcb);
+		i = hash;
+		do {
+			b = &tbl->buckets[i++ & tbl->mask];
+			hits = tcp_active_match_tags(b, tcp_active_tag(hash));
+			while (hits) {
+				slot = __builtin_ctz(hits) / 2;
+				hits &= ~(3 << (slot * 2));
+				if (b->pcbs[slot] != pcb)
+					nr_tag_hits++;
+			}
+			nr_probes++;
+		} while (b->overflow);
+	}
+}
+
+/* a table that can't grow fills up to 7/8 and then refuses */
+static void test_no_grow(void)
+{
+	uint32_t nr_slots = TCP_ACTIVE_TBL_MIN_BUCKETS * TCP_ACTIVE_TBL_SLOTS;
+	int i;
+
+	fail_pages = true;
+	for (i = 0; i < NR_CONNS; i++)
+		insert(&conns[i]);
+	check_all();
+	fail_pages = false;
+
+	CHECK(nr_inserted == nr_slots * 7 / 8,
+	      "%ld connections inserted, not %u", nr_inserted,
+	      nr_slots * 7 / 8);
+	CHECK(nr_refused == NR_CONNS - nr_inserted,
+	      "%ld inserts refused", nr_refused);
+
+	for (i = 0; i < NR_CONNS; i++)
+		if (conns[i].inserted)
+			remove_conn(&conns[i]);
+	check_all();
+}
+
+static void test_random(void)
+{
+	int round, i;
+
+	for (round = 0; round < NR_ROUNDS; round++) {
+		while (nr_inserted < NR_CONNS * 3 / 4) {
+			run_batch(true);
+			check_all();
+		}
+		count_collisions();
+		while (nr_inserted > NR_CONNS / 8) {
+			run_batch(false);
+			check_all();
+		}
+	}
+
+	for (i = 0; i < NR_CONNS; i++)
+		if (conns[i].inserted)
+			remove_conn(&conns[i]);
+	check_all();
+}
+
+int main(void)
+{
+	struct tcp_pcb *pcb;
+	int i;
+
+	srand(1);
+
+	conns = calloc(NR_CONNS, sizeof(*conns));
+	if (!conns) {
+		printf("test_tcp_hash: out of memory\n");
+		return 1;
+	}
+
+	/*
+	 * Families of four tuples, three of which differ from the first in
+	 * a single field. Tuples whose remote ports are 16 apart differ in
+	 * just that.
+	 */
+	for (i = 0; i < NR_CONNS; i++) {
+		pcb = &conns[i].pcb;
+		pcb->local_ip.addr = htonl(0xc0a80001 + (i % 4 == 1));
+		pcb->remote_ip.addr = htonl(0x0a000000 + (i / 4 / 4096 << 16) +
+					    (i % 4 == 2 ? 0x100 : 0));
+		pcb->local_port = i % 4 == 3 ? 443 : 80;
+		pcb->remote_port = 1024 + i / 4 % 4096;
+	}
+
+	CHECK(!tcp_active_tbl_init(&fg.active_tbl), "tcp_active_tbl_init failed");
+	CHECK(fg.active_tbl.mask + 1 == TCP_ACTIVE_TBL_MIN_BUCKETS,
+	      "the table starts with %u buckets", fg.active_tbl.mask + 1);
+
+	test_no_grow();
+	test_random();
+
+	CHECK(nr_migrating, "never checked in the middle of a resize");
+	CHECK(nr_tag_hits > nr_probes / 2, "only %ld tag hits in %ld probes",
+	      nr_tag_hits, nr_probes);
+
+	tcp_active_tbl_free(&fg.active_tbl);
+	CHECK(!nr_pages, "%ld pages leaked", nr_pages);
+
+	if (failures) {
+		printf("test_tcp_hash: %d failures\n", failures);
+		return 1;
+	}
+
+	printf("test_tcp_hash: %u buckets, %ld tag collisions in %ld probes, "
+	       "%ld refused, ok\n", max_buckets, nr_tag_hits,
+	       nr_probes, nr_refused);
+	return 0;
+}
@@ -0,0 +1,431 @@
+/*
+ * Copyright 2013-16 Board of Trustees of Stanford University
+ * Copyright 2013-16 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+
+/*
+ * test_tcp_tw.c - checks the expiry of compact TIME-WAIT entries
+ *
+ * Thousands of connections enter TIME-WAIT in bursts while a mocked
+ * clock drives the real timer wheel. Each entry must be found with the
+ * state of its pcb until 2MSL after it entered or was last restarted,
+ * and be gone and freed within a timer bucket of that. The table must
+ * grow under the load, keep every entry reachable when a resize fails,
+ * and skip TIME-WAIT cleanly when no entry can be allocated.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* tcp_tw.c pulls in headers that are for the dataplane only */
+#define __KERNEL__ 1
+
+#include <ix/cpu.h>
+#include <asm/cpu.h>
+
+static uint64_t mock_now_us;
+
+/* a single CPU whose percpu variables are plain globals */
+#undef DEFINE_PERCPU
+#define DEFINE_PERCPU(type, name) __typeof__(type) name
+#undef percpu_get
+#define percpu_get(var) (var)
+#define rdtsc() (mock_now_us)
+#define rdtscp(aux) (mock_now_us)
+
+#include "../dp/core/timer.c"
+#include "../dp/net/tcp_tw.c"
+
+#define NR_CONNS	8000
+#define MAX_ENTER	50		/* connections entering per step */
+#define MAX_STEP_US	(400 * ONE_MS)
+
+enum {
+	CONN_OPEN,
+	CONN_TW,		/* has a TIME-WAIT entry */
+	CONN_GONE,
+};
+
+struct conn {
+	int state;
+	ip_addr_t local_ip;
+	ip_addr_t remote_ip;
+	u16_t local_port;
+	u16_t remote_port;
+	u32_t snd_nxt;
+	u32_t rcv_nxt;
+	tcpwnd_size_t rcv_wnd;
+	u8_t tos;
+	u8_t ttl;
+	u8_t rcv_scale;
+	uint64_t expires;	/* 2MSL after entering or the last restart */
+};
+
+static struct conn conns[NR_CONNS];
+static struct eth_fg fg;
+static bool fail_tw, fail_pages;
+static long nr_tw, nr_tw_freed, nr_pcbs_freed, nr_pages;
+static long nr_no_entry, nr_failed_grows, nr_restarts, nr_expired;
+static uint32_t max_buckets;
+static int failures;
+
+struct eth_fg *fgs[ETH_MAX_TOTAL_FG + NCPU];
+DEFINE_PERCPU(unsigned int, cpu_id);
+DEFINE_PERCPU(struct mempool, tcp_pcb_mempool);
+DEFINE_PERCPU(struct mempool, tcp_tw_mempool);
+
+#define CHECK(cond, fmt, ...)						\
+do {									\
+	if (!(cond)) {							\
+		printf("FAIL %s:%d: " fmt "\n", __FILE__, __LINE__,	\
+		       ##__VA_ARGS__);					\
+		if (++failures > 20)					\
+			exit(1);					\
+	}								\
+} while (0)
+
+void logk(int level, const char *fmt, ...)
+{
+	va_list ap;
+
+	/* the warnings are expected, the failures that cause them injected */
+	if (level == LOG_WARN)
+		return;
+
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+}
+
+/* the pools are empty, so every allocation and free ends up here */
+void *mempool_alloc_2(struct mempool *m)
+{
+	void *p;
+
+	CHECK(m == &tcp_tw_mempool, "allocated from the wrong pool");
+	if (fail_tw)
+		return NULL;
+
+	p = malloc(sizeof(struct tcp_tw));
+	memset(p, 0xa5, sizeof(struct tcp_tw));
+	nr_tw++;
+	return p;
+}
+
+void mempool_free_2(struct mempool *m, void *ptr)
+{
+	if (m == &tcp_tw_mempool)
+		nr_tw_freed++;
+	else if (m == &tcp_pcb_mempool)
+		nr_pcbs_freed++;
+	else
+		CHECK(0, "freed to the wrong pool");
+	free(ptr);
+}
+
+void *mem_alloc_pages(int nr, int size, struct bitmask *mask,
+		      int numa_policy)
+{
+	if (fail_pages)
+		return MAP_FAILED;
+
+	nr_pages += nr;
+	return calloc(nr, size);
+}
+
+void mem_free_pages(void *addr, int nr, int size)
+{
+	nr_pages -= nr;
+	free(addr);
+}
+
+void tcp_pcb_purge(struct tcp_pcb *pcb)
+{
+}
+
+void tcp_ack_unqueue(struct tcp_pcb *pcb)
+{
+	CHECK(0, "the pcb is not in an ACK batch");
+}
+
+void tcp_active_remove(struct eth_fg *cur_fg, struct tcp_pcb *pcb)
+{
+	CHECK(0, "the pcb is not hashed");
+}
+
+static u32_t conn_hash(struct conn *c)
+{
+	return tcp_conn_hash(ip_2_ipX(&c->local_ip), ip_2_ipX(&c->remote_ip),
+			     c->local_port, c->remote_port);
+}
+
+static struct tcp_tw *conn_lookup(struct conn *c)
+{
+	return tcp_tw_lookup(&fg, conn_hash(c), ip_2_ipX(&c->local_ip),
+			     ip_2_ipX(&c->remote_ip), c->local_port,
+			     c->remote_port);
+}
+
+/*
+ * Looks up a 4-tuple that differs from @c in one field, but in the bucket
+ * of @c, so that only the comparison of that field tells them apart.
+ */
+static void check_other(struct conn *c)
+{
+	ip_addr_t ip;
+	u32_t hash = conn_hash(c);
+
+	ip.addr = c->local_ip.addr ^ htonl(1);
+	CHECK(!tcp_tw_lookup(&fg, hash, ip_2_ipX(&ip), ip_2_ipX(&c->remote_ip),
+			     c->local_port, c->remote_port),
+	      "found another local address");
+	ip.addr = c->remote_ip.addr ^ htonl(1 << 8);
+	CHECK(!tcp_tw_lookup(&fg, hash, ip_2_ipX(&c->local_ip), ip_2_ipX(&ip),
+			     c->local_port, c->remote_port),
+	      "found another remote address");
+	CHECK(!tcp_tw_lookup(&fg, hash, ip_2_ipX(&c->local_ip),
+			     ip_2_ipX(&c->remote_ip), c->local_port + 1,
+			     c->remote_port), "found another local port");
+	CHECK(!tcp_tw_lookup(&fg, hash, ip_2_ipX(&c->local_ip),
+			     ip_2_ipX(&c->remote_ip), c->local_port,
+			     c->remote_port ^ 0x8000),
+	      "found another remote port");
+}
+
+static void check_entry(struct conn *c, struct tcp_tw *tw)
+{
+	int i = c - conns;
+
+	CHECK(tw->snd_nxt == c->snd_nxt && tw->rcv_nxt == c->rcv_nxt,
+	      "conn %d has the wrong sequence numbers", i);
+	CHECK(tw->rcv_wnd == c->rcv_wnd && tw->rcv_scale == c->rcv_scale,
+	      "conn %d has the wrong window", i);
+	CHECK(tw->tos == c->tos && tw->ttl == c->ttl,
+	      "conn %d has the wrong IP header fields", i);
+}
+
+static void enter(struct conn *c)
+{
+	struct tcp_pcb *pcb = calloc(1, sizeof(*pcb));
+	struct tcp_tw *tw;
+	long freed = nr_pcbs_freed;
+	uint32_t count = fg.tw_tbl.count;
+
+	c->snd_nxt = rand();
+	c->rcv_nxt = rand();
+	c->rcv_wnd = rand();
+	c->rcv_scale = rand() % 15;
+	c->tos = rand();
+	c->ttl = rand();
+
+	pcb->state = TIME_WAIT;
+	ip_addr_copy(pcb->local_ip, c->local_ip);
+	ip_addr_copy(pcb->remote_ip, c->remote_ip);
+	pcb->local_port = c->local_port;
+	pcb->remote_port = c->remote_port;
+	pcb->snd_nxt = c->snd_nxt;
+	pcb->rcv_nxt = c->rcv_nxt;
+	pcb->rcv_ann_wnd = c->rcv_wnd;
+	pcb->rcv_scale = c->rcv_scale;
+	pcb->tos = c->tos;
+	pcb->ttl = c->ttl;
+	hlist_add_head(&fg.tw_pcbs, &pcb->link);
+
+	/* fail the first grows, so that the chains get longer for a while */
+	fail_tw = rand() % 50 == 0;
+	fail_pages = !fail_tw && count >= (fg.tw_tbl.mask + 1) * 2 &&
+		     nr_failed_grows < 100;
+	if (fail_pages)
+		nr_failed_grows++;
+	tcp_tw_enter(&fg, pcb);
+	fail_tw = fail_pages = false;
+
+	CHECK(nr_pcbs_freed == freed + 1, "the pcb was not freed");
+	CHECK(hlist_empty(&fg.tw_pcbs), "the pcb is still on tw_pcbs");
+
+	tw = conn_lookup(c);
+	if (tw) {
+		check_entry(c, tw);
+		c->state = CONN_TW;
+		c->expires = mock_now_us + TCP_TW_TIMEOUT_US;
+	} else {
+		CHECK(nr_tw_freed + fg.tw_tbl.count == nr_tw,
+		      "no entry for conn %ld, yet one was allocated",
+		      (long) (c - conns));
+		c->state = CONN_GONE;
+		nr_no_entry++;
+	}
+
+	if (fg.tw_tbl.mask + 1 > max_buckets)
+		max_buckets = fg.tw_tbl.mask + 1;
+}
+
+static void check_expiry(void)
+{
+	struct tcp_tw *tw;
+	struct conn *c;
+	long live = 0;
+	int i;
+
+	for (i = 0; i < NR_CONNS; i++) {
+		c = &conns[i];
+		if (c->state != CONN_TW)
+			continue;
+
+		tw = conn_lookup(c);
+		if (mock_now_us < c->expires) {
+			CHECK(tw, "conn %d expired %lu us early", i,
+			      c->expires - mock_now_us);
+		} else if (mock_now_us >= c->expires + MIN_DELAY_US) {
+			CHECK(!tw, "conn %d expired %lu us ago", i,
+			      mock_now_us - c->expires);
+		}
+
+		if (!tw) {
+			c->state = CONN_GONE;
+			nr_expired++;
+			continue;
+		}
+
+		check_entry(c, tw);
+		live++;
+
+		/* a retransmitted FIN restarts the 2MSL timeout */
+		if (rand() % 2000 == 0) {
+			tcp_tw_restart(&fg, tw);
+			c->expires = mock_now_us + TCP_TW_TIMEOUT_US;
+			nr_restarts++;
+		}
+
+		check_other(c);
+	}
+
+	CHECK(fg.tw_tbl.count == live, "%u entries counted, %ld live",
+	      fg.tw_tbl.count, live);
+	CHECK(nr_tw - nr_tw_freed == live, "%ld entries allocated, %ld live",
+	      nr_tw - nr_tw_freed, live);
+}
+
+/* returns how far the next deadline is, or 0 if there is none */
+static uint64_t next_deadline(void)
+{
+	uint64_t next = UINT64_MAX;
+	int i;
+
+	for (i = 0; i < NR_CONNS; i++) {
+		if (conns[i].state == CONN_TW && conns[i].expires > mock_now_us &&
+		    conns[i].expires < next)
+			next = conns[i].expires;
+	}
+
+	return next == UINT64_MAX ? 0 : next - mock_now_us;
+}
+
+static uint64_t random_step(void)
+{
+	uint64_t next = next_deadline();
+
+	/* land right before or a bucket after a close deadline now and then */
+	switch (next && next < MAX_STEP_US ? rand() % 8 : 7) {
+	case 0:
+		return 0;
+	case 1:
+		return next - 1;
+	case 2:
+		return next + MIN_DELAY_US;
+	default:
+		return rand() % MAX_STEP_US;
+	}
+}
+
+static bool busy(void)
+{
+	int i;
+
+	for (i = 0; i < NR_CONNS; i++)
+		if (conns[i].state != CONN_GONE)
+			return true;
+
+	return false;
+}
+
+int main(void)
+{
+	struct conn *c;
+	int i, n, next = 0;
+
+	srand(1);
+	cycles_per_us = 1;
+	mock_now_us = 12345678;
+	timer_init_cpu();
+
+	/* the flow group is served by this CPU */
+	fg.fg_id = 0;
+	fg.cur_cpu = percpu_get(cpu_id);
+	fgs[0] = &fg;
+	CHECK(!tcp_tw_tbl_init(&fg.tw_tbl), "tcp_tw_tbl_init failed");
+	CHECK(fg.tw_tbl.mask + 1 == TCP_TW_TBL_MIN_BUCKETS,
+	      "the table starts with %u buckets", fg.tw_tbl.mask + 1);
+
+	for (i = 0; i < NR_CONNS; i++) {
+		c = &conns[i];
+		c->local_ip.addr = htonl(0xc0a80001);
+		c->remote_ip.addr = htonl(0x0a000000 | (i % 97));
+		c->local_port = i % 2 ? 80 : 443;
+		c->remote_port = 1024 + i;
+	}
+
+	while (busy()) {
+		n = rand() % (MAX_ENTER + 1);
+		for (i = 0; i < n && next < NR_CONNS; i++)
+			enter(&conns[next++]);
+
+		mock_now_us += random_step();
+		timer_run();
+		check_expiry();
+	}
+
+	CHECK(!fg.tw_tbl.count, "%u entries left", fg.tw_tbl.count);
+	CHECK(nr_pcbs_freed == NR_CONNS, "%ld of %d pcbs freed",
+	      nr_pcbs_freed, NR_CONNS);
+	CHECK(max_buckets >= NR_CONNS / 4, "the table only grew to %u buckets",
+	      max_buckets);
+	CHECK(nr_no_entry && nr_failed_grows && nr_restarts,
+	      "%ld conns without entry, %ld failed grows, %ld restarts",
+	      nr_no_entry, nr_failed_grows, nr_restarts);
+
+	tcp_tw_tbl_free(&fg.tw_tbl);
+	CHECK(!nr_pages, "%ld pages leaked", nr_pages);
+
+	if (failures) {
+		printf("test_tcp_tw: %d failures\n", failures);
+		return 1;
+	}
+
+	printf("test_tcp_tw: %ld expired, %ld restarts, %u buckets, ok\n",
+	       nr_expired, nr_restarts, max_buckets);
+	return 0;
+}
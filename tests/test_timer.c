@@ -0,0 +1,273 @@
+/*
+ * Copyright 2013-16 Board of Trustees of Stanford University
+ * Copyright 2013-16 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * test_timer.c - checks the hierarchical timer wheel with a mocked clock
+ *
+ * Timers spread over all three wheels are armed, moved and deleted while
+ * the clock advances in random steps, across wheel wrap-arounds. Each
+ * timer must fire exactly once, never early and within a bucket of its
+ * deadline, and timer_deadline() must never sleep past a pending timer.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+
+#include <ix/cpu.h>
+#include <asm/cpu.h>
+
+static uint64_t mock_now_us;
+
+/* a single CPU whose percpu variables are plain globals */
+#undef DEFINE_PERCPU
+#define DEFINE_PERCPU(type, name) __typeof__(type) name
+#undef percpu_get
+#define percpu_get(var) (var)
+#define rdtsc() (mock_now_us)
+#define rdtscp(aux) (mock_now_us)
+
+#include "../dp/core/timer.c"
+
+#define NR_TIMERS	2000
+#define NR_STEPS	200000
+
+struct test_timer {
+	struct timer t;
+	uint64_t expires;	/* the requested deadline */
+	int fired;
+};
+
+static struct test_timer timers[NR_TIMERS];
+static uint64_t last_run_us;
+static long nr_fired;
+static int failures;
+
+/* the timers have no flow group, so these are never dereferenced */
+struct eth_fg *fgs[ETH_MAX_TOTAL_FG + NCPU];
+DEFINE_PERCPU(unsigned int, cpu_id);
+
+void logk(int level, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+}
+
+#define CHECK(cond, fmt, ...)						\
+do {									\
+	if (!(cond)) {							\
+		printf("FAIL %s:%d: " fmt "\n", __FILE__, __LINE__,	\
+		       ##__VA_ARGS__);					\
+		if (++failures > 20)					\
+			exit(1);					\
+	}								\
+} while (0)
+
+static void handler(struct timer *t, struct eth_fg *cur_fg)
+{
+	struct test_timer *tt = container_of(t, struct test_timer, t);
+
+	CHECK(!tt->fired, "timer %ld fired twice", (long) (tt - timers));
+	CHECK(mock_now_us >= tt->expires,
+	      "timer %ld fired %lu us early", (long) (tt - timers),
+	      tt->expires - mock_now_us);
+	/* deadlines are rounded up to the next bucket, but no further */
+	CHECK(last_run_us < tt->expires + MIN_DELAY_US,
+	      "timer %ld fired %lu us late", (long) (tt - timers),
+	      last_run_us - tt->expires);
+
+	tt->fired = 1;
+	nr_fired++;
+}
+
+static uint64_t random_delay(void)
+{
+	/* cover every wheel, including the longest possible delay */
+	switch (rand() % 8) {
+	case 0:
+		return 1 + rand() % MIN_DELAY_US;
+	case 1:
+		return MAX_DELAY_US - 1 - rand() % 1000;
+	case 2:
+	case 3:
+		return 1 + rand() % (MIN_DELAY_US * WHEEL_SIZE);
+	case 4:
+	case 5:
+		return 1 + rand() % (MIN_DELAY_US * WHEEL_SIZE * WHEEL_SIZE);
+	default:
+		return 1 + (((uint64_t) rand() << 16) ^ rand()) %
+		       (MAX_DELAY_US - 1);
+	}
+}
+
+static void arm(struct test_timer *tt)
+{
+	uint64_t delay = random_delay();
+
+	tt->expires = mock_now_us + delay;
+	tt->fired = 0;
+	CHECK(!timer_mod(&tt->t, NULL, delay), "timer_add failed");
+}
+
+static uint64_t next_expiry(void)
+{
+	uint64_t next = UINT64_MAX;
+	int i;
+
+	for (i = 0; i < NR_TIMERS; i++)
+		if (timer_pending(&timers[i].t) && timers[i].expires < next)
+			next = timers[i].expires;
+
+	return next;
+}
+
+static void run(void)
+{
+	uint64_t next, deadline;
+
+	timer_run();
+	last_run_us = mock_now_us;
+
+	next = next_expiry();
+	deadline = timer_deadline(MAX_DELAY_US);
+	if (next == UINT64_MAX)
+		CHECK(deadline == MAX_DELAY_US,
+		      "empty wheel has a deadline of %lu us", deadline);
+	else
+		CHECK(mock_now_us + deadline <= next + 2 * MIN_DELAY_US,
+		      "deadline %lu us oversleeps a timer due in %ld us",
+		      deadline, (long) (next - mock_now_us));
+}
+
+static void test_empty(void)
+{
+	int i;
+
+	/* an empty wheel must stay empty across every kind of jump */
+	for (i = 0; i < 1000; i++) {
+		mock_now_us += rand() % (MIN_DELAY_US * WHEEL_SIZE * 4);
+		run();
+	}
+	mock_now_us += MAX_DELAY_US * 3;
+	run();
+}
+
+static void test_random(void)
+{
+	struct test_timer *tt;
+	int i, step;
+
+	for (i = 0; i < NR_TIMERS; i++) {
+		timer_init_entry(&timers[i].t, handler);
+		arm(&timers[i]);
+	}
+
+	for (step = 0; step < NR_STEPS; step++) {
+		/* mostly short steps, sometimes jump over whole wheels */
+		switch (rand() % 100) {
+		case 0:
+			mock_now_us += rand() % (MIN_DELAY_US * WHEEL_SIZE *
+						 WHEEL_SIZE);
+			break;
+		case 1:
+		case 2:
+			mock_now_us += rand() % (MIN_DELAY_US * WHEEL_SIZE * 2);
+			break;
+		default:
+			mock_now_us += rand() % (MIN_DELAY_US * 4);
+		}
+		run();
+
+		tt = &timers[rand() % NR_TIMERS];
+		switch (rand() % 4) {
+		case 0:
+			/* deleting leaves a stale occupancy bit behind */
+			timer_del(&tt->t);
+			tt->fired = 1;
+			break;
+		default:
+			if (!timer_pending(&tt->t))
+				arm(tt);
+		}
+	}
+
+	/* drain the wheel, cascading from the highest wheel */
+	while (next_expiry() != UINT64_MAX) {
+		mock_now_us += MIN_DELAY_US * WHEEL_SIZE * WHEEL_SIZE;
+		run();
+	}
+
+	for (i = 0; i < NR_TIMERS; i++)
+		CHECK(timers[i].fired, "timer %d never fired", i);
+
+	run();
+}
+
+static void test_bitmap(void)
+{
+	DEFINE_BITMAP(bits, 300);
+	int i, n, pos, want;
+
+	for (n = 0; n < 2000; n++) {
+		bitmap_init(bits, 300, 0);
+		for (i = rand() % 8; i > 0; i--)
+			bitmap_set(bits, rand() % 300);
+
+		pos = rand() % 310;
+		for (want = pos; want < 300 && !bitmap_test(bits, want); want++)
+			;
+		if (want > 300)
+			want = 300;
+		CHECK(bitmap_find_next_set(bits, 300, pos) == want,
+		      "bitmap_find_next_set(%d) != %d", pos, want);
+	}
+}
+
+int main(void)
+{
+	srand(1);
+	cycles_per_us = 1;
+
+	/* start just before the highest wheel wraps around */
+	mock_now_us = ((uint64_t) 1 << 40) - MAX_DELAY_US / 2 - 12345;
+	timer_init_cpu();
+	last_run_us = mock_now_us;
+
+	test_bitmap();
+	test_empty();
+	test_random();
+	test_empty();
+
+	if (failures) {
+		printf("test_timer: %d failures\n", failures);
+		return 1;
+	}
+
+	printf("test_timer: %ld timers fired, ok\n", nr_fired);
+	return 0;
+}
@@ -73,6 +73,18 @@ static void __attribute__((unused)) show_counter(const char *name, int value)
 	printf("%s count %d\n", name, value);
 }
 
+/* every xmit_batch sample is one TX tail register write */
+static void show_doorbells_per_packet(struct ix_stats_percpu *acc)
+{
+	int i;
+	long doorbells = 0;
+
+	for (i = 0; i < sizeof(acc->xmit_batch.bucket) / sizeof(acc->xmit_batch.bucket[0]); i++)
+		doorbells += acc->xmit_batch.bucket[i];
+
+	printf("doorbells_per_packet %.3f\n", acc->xmit_batch.sum ? 1.0 * doorbells / acc->xmit_batch.sum : 0);
+}
+
 static void show_stats(struct ix_stats *stats)
 {
 	int i;
@@ -101,6 +113,8 @@ STATS
 #define COUNTER(name) show_counter(#name, acc.name);
 STATS
 #undef HISTOGRAM
+
+	show_doorbells_per_packet(&acc);
 }
 
 int main(int argc, char **argv)